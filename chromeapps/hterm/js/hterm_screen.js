@@ -249,6 +249,7 @@ hterm.Screen.prototype.invalidateCursorPosition = function() {
 hterm.Screen.prototype.clearCursorRow = function() {
   this.cursorRowNode_.innerHTML = '';
   this.cursorRowNode_.removeAttribute('line-overflow');
+  this.cursorRowNode_.style.backgroundImage = '';
   this.cursorOffset_ = 0;
   this.cursorPosition.column = 0;
   this.cursorPosition.overflow = false;
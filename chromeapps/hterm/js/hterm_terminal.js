@@ -1338,6 +1338,89 @@ hterm.Terminal.prototype.formFeed = function() {
   }
 };
 
+/**
+ * Display an image at the cursor position.
+ *
+ * The image is drawn as the background of the rows it covers, so it scrolls
+ * with them and clearing a row removes its part of the image.  The cursor
+ * moves to column zero of the row below the image.
+ *
+ * Display size is given the way iTerm2 does it: 'N' character cells, 'Npx',
+ * 'N%' of the terminal size or 'auto' for the image size.  Images wider than
+ * the terminal are scaled down.
+ *
+ * @param {string} cssImage CSS image value, such as url(...).
+ * @param {integer} width Image width in pixels, 0 if not known.
+ * @param {integer} height Image height in pixels, 0 if not known.
+ * @param {string} opt_displayWidth Display width, 'auto' by default.
+ * @param {string} opt_displayHeight Display height, 'auto' by default.
+ * @param {boolean} opt_preserveAspectRatio False to stretch the image to
+ *     both display width and height.  Defaults to true.
+ * @return {boolean} False if display size is not known, nothing is shown.
+ */
+hterm.Terminal.prototype.displayImage = function(
+    cssImage, width, height, opt_displayWidth, opt_displayHeight,
+    opt_preserveAspectRatio) {
+  var charSize = this.scrollPort_.characterSize;
+  var screenWidth = this.screenSize.width * charSize.width;
+  var screenHeight = this.screenSize.height * charSize.height;
+
+  function getDisplaySize(value, cellSize, screenSize) {
+    var size = parseFloat(value);
+    if (isNaN(size))
+      return 0;
+    if (/px$/.test(value))
+      return size;
+    if (/%$/.test(value))
+      return size * screenSize / 100;
+    return size * cellSize;
+  }
+
+  var displayWidth = getDisplaySize(opt_displayWidth, charSize.width,
+                                    screenWidth);
+  var displayHeight = getDisplaySize(opt_displayHeight, charSize.height,
+                                     screenHeight);
+  var preserveAspectRatio = opt_preserveAspectRatio !== false;
+  if (preserveAspectRatio && width && height) {
+    if (displayWidth && displayHeight) {
+      var scale = Math.min(displayWidth / width, displayHeight / height);
+      displayWidth = width * scale;
+      displayHeight = height * scale;
+    } else if (displayWidth) {
+      displayHeight = height * displayWidth / width;
+    } else if (displayHeight) {
+      displayWidth = width * displayHeight / height;
+    }
+  }
+  displayWidth = displayWidth || width;
+  displayHeight = displayHeight || height;
+  if (!displayWidth || !displayHeight)
+    return false;
+
+  if (displayWidth > screenWidth) {
+    if (preserveAspectRatio)
+      displayHeight *= screenWidth / displayWidth;
+    displayWidth = screenWidth;
+  }
+  var left = Math.min(this.screen_.cursorPosition.column * charSize.width,
+                      screenWidth - displayWidth);
+
+  var rowCount = Math.ceil(displayHeight / charSize.height);
+  var size = displayWidth + 'px ' + displayHeight + 'px';
+  for (var i = 0; i < rowCount; i++) {
+    var style = this.screen_.rowsArray[this.screen_.cursorPosition.row].style;
+    style.backgroundImage = cssImage;
+    style.backgroundRepeat = 'no-repeat';
+    style.backgroundSize = size;
+    style.backgroundPosition =
+        left + 'px ' + (-i * charSize.height) + 'px';
+    this.newLine();
+  }
+
+  this.scheduleSyncCursorPosition_();
+  return true;
+};
+
 /**
  * Move the cursor up one row, possibly inserting a blank line.
  *
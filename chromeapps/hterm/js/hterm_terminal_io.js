@@ -160,6 +160,22 @@ hterm.Terminal.IO.prototype.writelnUTF8 = function(string) {
   this.terminal_.interpret(string + '\r\n');
 };
 
+/**
+ * Display an image at the cursor position.
+ *
+ * See hterm.Terminal.prototype.displayImage for the arguments.
+ */
+hterm.Terminal.IO.prototype.displayImage = function(
+    cssImage, width, height, opt_displayWidth, opt_displayHeight,
+    opt_preserveAspectRatio) {
+  if (this.terminal_.io != this)
+    throw 'Attempt to print from inactive IO object.';
+
+  return this.terminal_.displayImage(cssImage, width, height,
+                                     opt_displayWidth, opt_displayHeight,
+                                     opt_preserveAspectRatio);
+};
+
 /**
  * Write a UTF-16 JavaScript string to the terminal.
  *
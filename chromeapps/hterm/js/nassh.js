@@ -40,6 +40,51 @@ nassh.loadManifest = function(onSuccess, opt_onError) {
   xhr.send();
 };
 
+/**
+ * Plugin builds by name, ssh_client/build.sh packages each one in its own
+ * directory.
+ */
+nassh.pluginURLs = {
+  // glibc, loaded through runnable-ld.so with its shared libraries.
+  'dynamic': '../plugin/nacl/ssh_client.nmf',
+  // glibc linked statically, x86 only.
+  'static': '../plugin/static/ssh_client.nmf',
+  // newlib, the ssh_client_nl_* nexes.
+  'newlib': '../plugin/pnacl/ssh_client.nmf',
+  'arm_23': '../plugin/arm_23/ssh_client.nmf'
+};
+
+/**
+ * Load the static build instead of newlib on x86.
+ *
+ * ssh_client/build.sh --prefer-static turns this on in the package it
+ * makes. Only do that once html/nassh_plugin_bench.html shows the static
+ * build starting faster, nassh doesn't probe the package at runtime.
+ */
+nassh.preferStaticPlugin = false;
+
+/**
+ * Get the plugin build for this browser.
+ *
+ * @return {string} Name from nassh.pluginURLs.
+ */
+nassh.getPluginName = function() {
+  var ary = navigator.userAgent.match(/Chrome\/(\d\d)\./);
+  var chromeVersion = parseInt(ary[1]);
+  var isARM = (/arm/i).test(navigator.platform);
+
+  if (chromeVersion < 23) {
+    // TODO(rginda): Remove the old school intel-only nacl plugin once we drain
+    // the Chrome OS M21 users.
+    return 'dynamic';
+  }
+  if (isARM) {
+    // TODO(rginda): Remove (ARM && Chrome 23) plugin once Chrome 23 is history.
+    return chromeVersion == 23 ? 'arm_23' : 'newlib';
+  }
+  return nassh.preferStaticPlugin ? 'static' : 'newlib';
+};
+
 /**
  * Request the persistent HTML5 filesystem for this extension.
  *
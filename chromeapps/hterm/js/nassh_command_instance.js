@@ -53,6 +53,15 @@ nassh.CommandInstance = function(argv) {
   this.stdoutAcknowledgeCount_ = 0;
   this.stderrAcknowledgeCount_ = 0;
 
+  // Image announced by writeImage, its data comes in the next message.
+  this.pendingImage_ = null;
+
+  // Inline image counters logged with plugin stats.
+  this.imageStats_ = {count: 0, bytes: 0, uiMs: 0};
+
+  // Local echo prediction of a mosh session.
+  this.echoPredictor_ = null;
+
   // Prevent us from reporting an exit twice.
   this.exited_ = false;
 };
@@ -116,6 +125,10 @@ nassh.CommandInstance.prototype.run = function() {
     this.fileSystem_ = fileSystem;
     this.sshDirectoryEntry_ = sshDirectoryEntry;
 
+    // ZMODEM downloads are saved here by the plugin.
+    lib.fs.getOrCreateDirectory(fileSystem.root, '/zmodem', function() {},
+                                lib.fs.err('Error creating /zmodem'));
+
     var argstr = this.argv_.argString;
 
     // This item is set before we redirect away to login to a relay server.
@@ -160,6 +173,7 @@ nassh.CommandInstance.prototype.reconnect = function(argstr) {
 
   this.stdoutAcknowledgeCount_ = 0;
   this.stderrAcknowledgeCount_ = 0;
+  this.echoPredictor_ = null;
 
   this.connectToArgString(argstr);
 };
@@ -282,6 +296,13 @@ nassh.CommandInstance.prototype.connectToProfile = function(
           port: prefs.get('port'),
           relayHost: prefs.get('relay-host'),
           relayOptions: prefs.get('relay-options'),
+          proxy: prefs.get('proxy'),
+          triggers: prefs.get('triggers'),
+          hostProfile: prefs.get('host-profile'),
+          fastAuth: prefs.get('fast-auth'),
+          mosh: prefs.get('mosh'),
+          moshServer: prefs.get('mosh-server'),
+          moshPredict: prefs.get('mosh-predict'),
           identity: prefs.get('identity'),
           argstr: prefs.get('argstr'),
           terminalProfile: prefs.get('terminal-profile')
@@ -320,6 +341,30 @@ nassh.CommandInstance.prototype.connectToDestination = function(destination) {
   });
 };
 
+/**
+ * Parse a proxy string for the plugin.
+ *
+ * @param {string} proxy A string of the form
+ *     (http|socks5)://[user:password@]host:port.
+ * @return {Object} Proxy attributes for startSession or null if the string
+ *     can't be parsed.
+ */
+nassh.CommandInstance.parseProxy_ = function(proxy) {
+  var ary = proxy.match(new RegExp('^(http|socks5)://' +
+                                   '(?:([^:@]*)(?::([^@]*))?@)?' +
+                                   '(\\[[^\\]]+\\]|[^:@]+):(\\d+)$'));
+  if (!ary)
+    return null;
+
+  return {
+      type: ary[1],
+      username: ary[2] ? decodeURIComponent(ary[2]) : '',
+      password: ary[3] ? decodeURIComponent(ary[3]) : '',
+      host: ary[4].replace(/^\[(.*)\]$/, '$1'),
+      port: parseInt(ary[5])
+  };
+};
+
 /**
  * Initiate a connection to a remote host.
  *
@@ -367,13 +412,22 @@ nassh.CommandInstance.prototype.connectTo = function(params) {
   argv.terminalWidth = this.io.terminal_.screenSize.width;
   argv.terminalHeight = this.io.terminal_.screenSize.height;
   argv.useJsSocket = !!this.relay_;
+  if (params.proxy && !this.relay_) {
+    argv.proxy = nassh.CommandInstance.parseProxy_(params.proxy);
+    if (!argv.proxy)
+      console.log('Ignoring invalid proxy: ' + params.proxy);
+  }
+  if (params.hostProfile === false)
+    argv.useHostProfile = false;
+  if (params.fastAuth)
+    argv.fastAuth = true;
   argv.environment = this.environment_;
   argv.writeWindow = 8 * 1024;
 
   argv.arguments = ['-C'];  // enable compression
 
   // Disable IP address check for connection through proxy.
-  if (argv.useJsSocket)
+  if (argv.useJsSocket || argv.proxy)
     argv.arguments.push("-o CheckHostIP=no");
 
   var commandArgs;
@@ -393,13 +447,32 @@ nassh.CommandInstance.prototype.connectTo = function(params) {
     argv.arguments.push('-p' + params.port);
 
   argv.arguments.push(params.username + '@' + params.hostname);
-  if (commandArgs)
-    argv.arguments.push(commandArgs);
+
+  // The plugin talks to mosh-server over UDP, which a relay or proxy can't
+  // carry.
+  if (params.mosh && !argv.useJsSocket && !argv.proxy) {
+    argv.mosh = {
+      host: params.hostname,
+      server: params.moshServer || 'mosh-server',
+      command: commandArgs || ''
+    };
+    if (params.moshPredict != 'never') {
+      this.echoPredictor_ = new nassh.EchoPredictor(
+          this.io.terminal_, params.moshPredict || 'adaptive');
+    }
+  } else {
+    if (params.mosh)
+      console.log('Ignoring mosh, it needs a direct connection.');
+    if (commandArgs)
+      argv.arguments.push(commandArgs);
+  }
 
   var self = this;
   this.initPlugin_(function() {
       window.onbeforeunload = self.onBeforeUnload_.bind(self);
       self.sendToPlugin_('startSession', [argv]);
+      if (params.triggers && params.triggers.length)
+        self.setTriggers(params.triggers);
     });
 
   document.querySelector('#terminal').focus();
@@ -421,7 +494,12 @@ nassh.CommandInstance.prototype.dispatchMessage_ = function(
 
 nassh.CommandInstance.prototype.initPlugin_ = function(onComplete) {
   var self = this;
+  var loadStart = Date.now();
   function onPluginLoaded() {
+    // Time to fetch, validate and start the module, compare the builds with
+    // html/nassh_plugin_bench.html.
+    console.log('nassh: ' + pluginURL + ' loaded in ' +
+                (Date.now() - loadStart) + 'ms');
     self.io.println(hterm.msg('PLUGIN_LOADING_COMPLETE'));
     onComplete();
   };
@@ -435,22 +513,7 @@ nassh.CommandInstance.prototype.initPlugin_ = function(onComplete) {
        'width: 0;' +
        'height: 0;');
 
-  var ary = navigator.userAgent.match(/Chrome\/(\d\d)\./);
-  var chromeVersion = parseInt(ary[1]);
-  var isARM = (/arm/i).test(navigator.platform);
-
-  var pluginURL;
-  if (chromeVersion < 23) {
-    // TODO(rginda): Remove the old school intel-only nacl plugin once we drain
-    // the Chrome OS M21 users.
-    pluginURL = '../plugin/nacl/ssh_client.nmf';
-  } else if (isARM && chromeVersion == 23) {
-    // TODO(rginda): Remove (ARM && Chrome 23) plugin once Chrome 23 is history.
-    pluginURL = '../plugin/arm_23/ssh_client.nmf';
-  } else {
-    pluginURL = '../plugin/pnacl/ssh_client.nmf';
-  }
-
+  var pluginURL = nassh.pluginURLs[nassh.getPluginName()];
   this.plugin_.setAttribute('src', pluginURL);
   this.plugin_.setAttribute('type', 'application/x-nacl');
   this.plugin_.addEventListener('load', onPluginLoaded);
@@ -481,6 +544,8 @@ nassh.CommandInstance.prototype.sendToPlugin_ = function(name, args) {
  * @param {string} string The string to send.
  */
 nassh.CommandInstance.prototype.sendString_ = function(string) {
+  if (this.echoPredictor_)
+    this.echoPredictor_.onInput(string);
   this.sendToPlugin_('onRead', [0, btoa(string)]);
 };
 
@@ -491,9 +556,56 @@ nassh.CommandInstance.prototype.sendString_ = function(string) {
  * @param {string|integer} terminal height.
  */
 nassh.CommandInstance.prototype.onTerminalResize_ = function(width, height) {
+  if (this.echoPredictor_)
+    this.echoPredictor_.reset();
   this.sendToPlugin_('onResize', [Number(width), Number(height)]);
 };
 
+/**
+ * Queue files for the next ZMODEM upload, they are sent when rz is run on
+ * the remote host. Received files are saved in /zmodem/.
+ *
+ * @param {Array.<string>} paths Paths of the files in the HTML5 filesystem.
+ */
+nassh.CommandInstance.prototype.zmodemSend = function(paths) {
+  this.sendToPlugin_('zmodemSend', paths);
+};
+
+/**
+ * Look for patterns in the terminal output, onTrigger is called for every
+ * match.
+ *
+ * Patterns are matched in the plugin before the output gets here.  They are
+ * regular expressions with literals, '.', classes, \d \w \s, groups,
+ * '|', '*', '+' and '?', but no anchors.  Escape sequences in the output
+ * are skipped.
+ *
+ * @param {Array} patterns Pattern strings, replacing the previous ones.
+ */
+nassh.CommandInstance.prototype.setTriggers = function(patterns) {
+  this.sendToPlugin_('setTriggers', patterns);
+};
+
+/**
+ * Called when a pattern given to setTriggers matches.
+ *
+ * Override this to act on the match.
+ *
+ * @param {integer} index Index of the pattern.
+ * @param {integer} offset Stdout offset right after the match.  It's shown
+ *     once stdout acknowledge count reaches it.
+ */
+nassh.CommandInstance.prototype.onTrigger = function(index, offset) {
+  console.log('trigger ' + index + ' matched at ' + offset);
+};
+
+/**
+ * Ask the plugin for its wakeup counters, they are logged when they arrive.
+ */
+nassh.CommandInstance.prototype.requestStats = function() {
+  this.sendToPlugin_('getStats', []);
+};
+
 /**
  * Exit the nassh command.
  */
@@ -540,11 +652,57 @@ nassh.CommandInstance.prototype.onBeforeUnload_ = function(e) {
  * plugin message into something dispatchMessage_ can digest.
  */
 nassh.CommandInstance.prototype.onPluginMessage_ = function(e) {
+  if (e.data instanceof ArrayBuffer) {
+    this.onPluginImageData_(e.data);
+    return;
+  }
+
   var msg = JSON.parse(e.data);
   msg.argv = msg.arguments;
   this.dispatchMessage_('plugin', this.onPlugin_, msg);
 };
 
+/**
+ * Called with the pixels or file of the image announced by writeImage.
+ *
+ * Time spent here is what the image costs the UI thread, hterm never sees
+ * the escape sequence.
+ */
+nassh.CommandInstance.prototype.onPluginImageData_ = function(buffer) {
+  var image = this.pendingImage_;
+  this.pendingImage_ = null;
+  if (!image) {
+    console.warn('Unexpected binary message from plugin');
+    return;
+  }
+
+  var start = performance.now();
+  var cssImage;
+  if (image.format == 'rgba') {
+    // CSS canvas is drawn right away and needs no image encoding.
+    var name = 'nassh-image-' + this.imageStats_.count;
+    var context = document.getCSSCanvasContext('2d', name, image.width,
+                                               image.height);
+    var imageData = context.createImageData(image.width, image.height);
+    imageData.data.set(new Uint8Array(buffer));
+    context.putImageData(imageData, 0, 0);
+    cssImage = '-webkit-canvas(' + name + ')';
+  } else {
+    // Browser decodes the file off the UI thread.
+    cssImage = 'url(' + URL.createObjectURL(new Blob([buffer])) + ')';
+  }
+
+  if (!this.io.displayImage(cssImage, image.width, image.height,
+                            image.displayWidth, image.displayHeight,
+                            image.preserveAspectRatio)) {
+    console.warn('Inline image of unknown size is not shown');
+  }
+
+  this.imageStats_.count++;
+  this.imageStats_.bytes += buffer.byteLength;
+  this.imageStats_.uiMs += performance.now() - start;
+};
+
 /**
  * Connect dialog message handlers.
  */
@@ -573,6 +731,46 @@ nassh.CommandInstance.prototype.onPlugin_.printLog = function(str) {
   console.log('plugin log: ' + str);
 };
 
+/**
+ * Plugin reports wakeup counters requested by requestStats().
+ */
+nassh.CommandInstance.prototype.onPlugin_.stats = function(stats) {
+  var minutes = stats.uptimeMs / 60000;
+  console.log('plugin stats: ' + JSON.stringify(stats));
+  console.log('inline images: ' + this.imageStats_.count + ', ' +
+              this.imageStats_.bytes + ' bytes, ' +
+              this.imageStats_.uiMs.toFixed(1) + 'ms on UI thread');
+  console.log('handshake: ' + stats.handshakeRoundTrips + ' round trips, ' +
+              stats.handshakeMs + 'ms, host profile ' +
+              (stats.hostProfileUsed ? 'used' : 'not used') + ', ' +
+              stats.authRoundTripsSaved + ' saved by fast auth');
+  if (stats.bufferBytesAppended) {
+    var moved = stats.bufferBytesMoved / stats.bufferBytesAppended;
+    console.log('ssh buffers: ' + moved.toFixed(3) +
+                ' bytes moved per byte appended');
+  }
+  if (stats.modExpCalls) {
+    console.log('RSA/DH: ' + stats.modExpCalls + ' exponentiations, ' +
+                stats.modExpMs + 'ms');
+  }
+  console.log('plugin wakeups per minute: timer ' +
+              (stats.timerWakeups / minutes).toFixed(1) + ', io ' +
+              (stats.ioWakeups / minutes).toFixed(1) + ', spurious ' +
+              (stats.spuriousWakeups / minutes).toFixed(1) +
+              ', avoided ' +
+              (stats.unchangedNotifications / minutes).toFixed(1));
+};
+
+/**
+ * Plugin found trigger patterns in stdout.
+ *
+ * @param {Array} matches Pattern index and offset pairs, flattened.
+ */
+nassh.CommandInstance.prototype.onPlugin_.triggerMatches = function(matches) {
+  for (var i = 0; i + 1 < matches.length; i += 2)
+    this.onTrigger(matches[i], matches[i + 1]);
+};
+
 /**
  * Plugin has exited.
  */
@@ -582,6 +780,16 @@ nassh.CommandInstance.prototype.onPlugin_.exit = function(code) {
   this.exit(code);
 };
 
+/**
+ * Terminal output of a mosh session up to |outputOffset| shows the echo of
+ * the input before |inputOffset|.
+ */
+nassh.CommandInstance.prototype.onPlugin_.echoAck = function(
+    outputOffset, inputOffset, rttMs) {
+  if (this.echoPredictor_)
+    this.echoPredictor_.onEchoAck(outputOffset, inputOffset, rttMs);
+};
+
 /**
  * Plugin wants to open a file.
  *
@@ -644,7 +852,11 @@ nassh.CommandInstance.prototype.onPlugin_.write = function(fd, data) {
     var ackCount = (fd == 1 ?
                     this.stdoutAcknowledgeCount_ += string.length :
                     this.stderrAcknowledgeCount_ += string.length);
+    if (this.echoPredictor_)
+      this.echoPredictor_.beforeOutput();
     this.io.writeUTF8(string);
+    if (this.echoPredictor_)
+      this.echoPredictor_.afterOutput(this.stdoutAcknowledgeCount_);
 
     setTimeout(function() {
         self.sendToPlugin_('onWriteAcknowledge', [fd, ackCount]);
@@ -663,6 +875,32 @@ nassh.CommandInstance.prototype.onPlugin_.write = function(fd, data) {
     }, 100);
 };
 
+/**
+ * Plugin cut an inline image out of stdout, it's displayed when its data
+ * arrives.
+ *
+ * @param {integer} fd Always 1.
+ * @param {string} format 'rgba' for decoded sixel pixels, 'encoded' for an
+ *     image file.
+ * @param {integer} width Image width in pixels, 0 if not known.
+ * @param {integer} height Image height in pixels, 0 if not known.
+ * @param {string} displayWidth Display width requested by OSC 1337.
+ * @param {string} displayHeight Display height requested by OSC 1337.
+ * @param {boolean} preserveAspectRatio Requested by OSC 1337.
+ */
+nassh.CommandInstance.prototype.onPlugin_.writeImage = function(
+    fd, format, width, height, displayWidth, displayHeight,
+    preserveAspectRatio) {
+  this.pendingImage_ = {
+    format: format,
+    width: width,
+    height: height,
+    displayWidth: displayWidth,
+    displayHeight: displayHeight,
+    preserveAspectRatio: preserveAspectRatio
+  };
+};
+
 /**
  * Plugin wants to read from a fd.
  */
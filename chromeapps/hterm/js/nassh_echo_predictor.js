@@ -0,0 +1,255 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+'use strict';
+
+/**
+ * Local echo prediction for mosh sessions.
+ *
+ * Printable keys are drawn underlined after the cursor before the host
+ * echoes them. The plugin tells which terminal output shows the echo of
+ * the input up to some offset, see onEchoAck. Drawn predictions are taken
+ * back before any output is written, the echoed ones are checked against
+ * the screen and the rest is drawn again at the new cursor position.
+ *
+ * Like in mosh, predictions are tentative after Enter, any other key that
+ * isn't printable or a wrong prediction. They are only drawn once one of
+ * them turns out right, so a password typed with echo off is not shown.
+ * Nothing is predicted after a key that isn't printable until its echo
+ * comes, the cursor may go anywhere.
+ *
+ * @param {hterm.Terminal} terminal The terminal to draw in.
+ * @param {string} mode 'adaptive' to draw predictions only when the round
+ *     trip is slow, 'always' to draw them anyway.
+ */
+nassh.EchoPredictor = function(terminal, mode) {
+  this.terminal_ = terminal;
+  this.mode_ = mode;
+  this.slow_ = (mode == 'always');
+
+  // Bytes sent to the plugin and bytes of stdout it wrote, the plugin
+  // counts both the same way.
+  this.inputOffset_ = 0;
+  this.outputOffset_ = 0;
+
+  // Echo acknowledgements waiting for their output.
+  this.pendingAcks_ = [];
+  // Input before this offset shows on the screen, -1 until the session
+  // acknowledges echo at all.
+  this.echoedOffset_ = -1;
+  // Offset of the last key that isn't predicted.
+  this.unpredictedOffset_ = -1;
+
+  // Keys not echoed yet. Once placed, they have a row and column unless
+  // there was no room for them on the line.
+  this.predictions_ = [];
+  this.epoch_ = 1;
+  this.confirmedEpoch_ = 0;
+
+  // Row and cursor as they were before the predictions were drawn.
+  this.saved_ = null;
+};
+
+/**
+ * Round trip times in ms the adaptive mode starts and stops drawing
+ * predictions at, the same as mosh.
+ */
+nassh.EchoPredictor.SLOW_RTT_MS = 30;
+nassh.EchoPredictor.FAST_RTT_MS = 20;
+
+/**
+ * Called with the keys before they are sent to the plugin.
+ *
+ * @param {string} string The keys, UTF-8 encoded.
+ */
+nassh.EchoPredictor.prototype.onInput = function(string) {
+  // Keys typed before the session acknowledges echo go to ssh prompts.
+  for (var i = 0; i < string.length; i++) {
+    var code = string.charCodeAt(i);
+    if (code < 0x20 || code >= 0x7f) {
+      this.unpredictedOffset_ = this.inputOffset_;
+      this.epoch_++;
+    } else if (this.echoedOffset_ >= 0) {
+      this.predictions_.push({offset: this.inputOffset_,
+                              ch: string.charAt(i),
+                              epoch: this.epoch_,
+                              placed: false,
+                              row: null,
+                              column: 0});
+    }
+    this.inputOffset_++;
+  }
+
+  if (this.echoedOffset_ >= 0)
+    this.refresh_();
+};
+
+/**
+ * Called before terminal output is written.
+ */
+nassh.EchoPredictor.prototype.beforeOutput = function() {
+  this.undraw_();
+};
+
+/**
+ * Called after terminal output is written.
+ *
+ * @param {integer} outputOffset Bytes of stdout written so far.
+ */
+nassh.EchoPredictor.prototype.afterOutput = function(outputOffset) {
+  this.outputOffset_ = outputOffset;
+  this.applyAcks_();
+  this.refresh_();
+};
+
+/**
+ * Plugin output up to |outputOffset| shows the echo of the input before
+ * |inputOffset|.
+ *
+ * @param {integer} outputOffset Offset in stdout.
+ * @param {integer} inputOffset Offset in the input sent to the plugin.
+ * @param {integer} rttMs Smoothed round trip time to the host.
+ */
+nassh.EchoPredictor.prototype.onEchoAck = function(
+    outputOffset, inputOffset, rttMs) {
+  if (this.mode_ == 'adaptive') {
+    if (rttMs > nassh.EchoPredictor.SLOW_RTT_MS)
+      this.slow_ = true;
+    else if (rttMs < nassh.EchoPredictor.FAST_RTT_MS)
+      this.slow_ = false;
+  }
+
+  this.pendingAcks_.push({output: outputOffset, input: inputOffset});
+  this.applyAcks_();
+  this.refresh_();
+};
+
+/**
+ * Take back all predictions, the screen is about to change in some other
+ * way.
+ */
+nassh.EchoPredictor.prototype.reset = function() {
+  this.undraw_();
+  this.predictions_.length = 0;
+  this.epoch_++;
+};
+
+nassh.EchoPredictor.prototype.applyAcks_ = function() {
+  while (this.pendingAcks_.length &&
+         this.pendingAcks_[0].output <= this.outputOffset_) {
+    this.echoedOffset_ = Math.max(this.echoedOffset_,
+                                  this.pendingAcks_.shift().input);
+  }
+};
+
+/**
+ * Check the echoed predictions and draw the others.
+ */
+nassh.EchoPredictor.prototype.refresh_ = function() {
+  this.undraw_();
+
+  var wrong = false;
+  while (this.predictions_.length &&
+         this.predictions_[0].offset < this.echoedOffset_) {
+    var prediction = this.predictions_.shift();
+    if (!prediction.row)
+      continue;
+    var ch = prediction.row.textContent.charAt(prediction.column) || ' ';
+    if (ch == prediction.ch) {
+      this.confirmedEpoch_ = Math.max(this.confirmedEpoch_, prediction.epoch);
+    } else {
+      wrong = true;
+    }
+  }
+  if (wrong)
+    this.reset();
+
+  if (this.unpredictedOffset_ < this.echoedOffset_)
+    this.place_();
+  if (this.slow_)
+    this.draw_();
+};
+
+/**
+ * Give new predictions the cells after the last placed one or after the
+ * cursor. Placed predictions stay where they are, the host echo goes there
+ * even if other output moves the cursor meanwhile.
+ */
+nassh.EchoPredictor.prototype.place_ = function() {
+  var terminal = this.terminal_;
+  var width = terminal.screenSize.width;
+  var cursor = terminal.saveCursor();
+  var row = terminal.screen_.rowsArray[cursor.row];
+  var column = cursor.overflow ? width : cursor.column;
+
+  for (var i = 0; i < this.predictions_.length; i++) {
+    var prediction = this.predictions_[i];
+    if (prediction.placed) {
+      row = prediction.row;
+      column = row ? prediction.column + 1 : width;
+      continue;
+    }
+
+    // The last column is left out, hterm would wrap the line after it.
+    prediction.placed = true;
+    if (column < width - 1) {
+      prediction.row = row;
+      prediction.column = column++;
+    }
+  }
+};
+
+/**
+ * Draw the confirmed predictions next to each other from the first one,
+ * the cursor goes after them.
+ */
+nassh.EchoPredictor.prototype.draw_ = function() {
+  var first = this.predictions_[0];
+  var text = '';
+  for (var i = 0; i < this.predictions_.length; i++) {
+    var prediction = this.predictions_[i];
+    if (!prediction.row || prediction.row != first.row ||
+        prediction.column != first.column + i ||
+        prediction.epoch > this.confirmedEpoch_) {
+      break;
+    }
+    text += prediction.ch;
+  }
+
+  var terminal = this.terminal_;
+  var rowIndex = text ? terminal.screen_.rowsArray.indexOf(first.row) : -1;
+  if (rowIndex < 0)
+    return;
+
+  var attrs = terminal.getTextAttributes();
+  this.saved_ = {row: first.row,
+                 contents: first.row.cloneNode(true),
+                 cursor: terminal.saveCursor()};
+
+  var predictedAttrs = attrs.clone();
+  predictedAttrs.underline = true;
+  terminal.setAbsoluteCursorPosition(rowIndex, first.column);
+  terminal.setTextAttributes(predictedAttrs);
+  terminal.print(text);
+  terminal.setTextAttributes(attrs);
+};
+
+nassh.EchoPredictor.prototype.undraw_ = function() {
+  if (!this.saved_)
+    return;
+
+  var row = this.saved_.row;
+  var contents = this.saved_.contents;
+  while (row.firstChild)
+    row.removeChild(row.firstChild);
+  while (contents.firstChild)
+    row.appendChild(contents.firstChild);
+
+  // The screen still points into the removed nodes.
+  var terminal = this.terminal_;
+  terminal.screen_.invalidateCursorPosition();
+  terminal.restoreCursor(this.saved_.cursor);
+  terminal.scheduleSyncCursorPosition_();
+  this.saved_ = null;
+};
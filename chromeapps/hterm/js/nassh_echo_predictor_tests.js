@@ -0,0 +1,197 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+'use strict';
+
+/**
+ * @fileoverview nassh.EchoPredictor unit tests.
+ */
+
+nassh.EchoPredictor.Tests = new lib.TestManager.Suite(
+    'nassh.EchoPredictor.Tests');
+
+nassh.EchoPredictor.Tests.prototype.setup = function(cx) {
+  this.setDefaults(cx,
+      { visibleColumnCount: 80,
+        visibleRowCount: 24,
+      });
+};
+
+/**
+ * Create a new hterm.Terminal and a predictor that always draws for it.
+ *
+ * Called before each test case in this suite.
+ */
+nassh.EchoPredictor.Tests.prototype.preamble = function(result, cx) {
+  var document = cx.window.document;
+
+  document.body.innerHTML = '';
+
+  var div = this.div = document.createElement('div');
+  div.style.position = 'absolute';
+  div.style.height = '100%';
+  div.style.width = '100%';
+
+  document.body.appendChild(div);
+
+  cx.window.terminal = this.terminal = new hterm.Terminal();
+
+  this.terminal.decorate(div);
+  this.terminal.setHeight(this.visibleRowCount);
+  this.terminal.setWidth(this.visibleColumnCount);
+
+  this.predictor = new nassh.EchoPredictor(this.terminal, 'always');
+  this.output = 0;
+};
+
+/**
+ * Wait for the terminal initialization like hterm.Terminal.Tests, then
+ * start the session with a prompt and the first echo acknowledgement.
+ */
+nassh.EchoPredictor.Tests.addTest = function(name, callback) {
+  function testProxy(result, cx) {
+    var self = this;
+    setTimeout(function() {
+        self.terminal.setCursorPosition(0, 0);
+        self.write('$ ');
+        self.predictor.onEchoAck(self.output, 0, 100);
+        callback.apply(self, [result, cx]);
+      }, 0);
+
+    result.requestTime(200);
+  }
+
+  lib.TestManager.Suite.addTest.apply(this, [name, testProxy]);
+};
+
+/**
+ * Write host output the way nassh.CommandInstance does.
+ */
+nassh.EchoPredictor.Tests.prototype.write = function(str) {
+  this.predictor.beforeOutput();
+  this.terminal.interpret(str);
+  this.output += str.length;
+  this.predictor.afterOutput(this.output);
+};
+
+nassh.EchoPredictor.Tests.prototype.getRowText = function(row) {
+  return this.terminal.getRowText(this.terminal.getRowCount() -
+                                  this.visibleRowCount + row);
+};
+
+/**
+ * Predictions are drawn once one of them turns out right and are gone when
+ * the echo comes.
+ */
+nassh.EchoPredictor.Tests.addTest('confirm', function(result, cx) {
+    this.predictor.onInput('l');
+    result.assertEQ(this.getRowText(0), '$ ');
+
+    this.write('l');
+    this.predictor.onEchoAck(this.output, 1, 100);
+    this.predictor.onInput('s');
+    result.assertEQ(this.getRowText(0), '$ ls');
+    result.assertEQ(this.terminal.getCursorColumn(), 4);
+
+    this.write('s');
+    result.assertEQ(this.getRowText(0), '$ ls');
+    this.predictor.onEchoAck(this.output, 2, 100);
+    result.assertEQ(this.getRowText(0), '$ ls');
+    result.assertEQ(this.terminal.getCursorColumn(), 4);
+
+    result.pass();
+  });
+
+/**
+ * The row is the same as before once the predictions are taken back.
+ */
+nassh.EchoPredictor.Tests.addTest('restore', function(result, cx) {
+    this.write('\x1b[1mbold\x1b[m text\x1b[5G');
+    var before = this.terminal.getRowNode(
+        this.terminal.getRowCount() - this.visibleRowCount).innerHTML;
+
+    this.predictor.confirmedEpoch_ = this.predictor.epoch_;
+    this.predictor.onInput('xyz');
+    result.assertEQ(this.getRowText(0), '$ boxyztext');
+
+    this.predictor.beforeOutput();
+    var row = this.terminal.getRowNode(
+        this.terminal.getRowCount() - this.visibleRowCount);
+    result.assertEQ(row.innerHTML, before);
+    result.assertEQ(this.terminal.getCursorColumn(), 4);
+
+    result.pass();
+  });
+
+/**
+ * A wrong prediction takes back the others and makes them tentative.
+ */
+nassh.EchoPredictor.Tests.addTest('wrong', function(result, cx) {
+    this.predictor.onInput('a');
+    this.write('a');
+    this.predictor.onEchoAck(this.output, 1, 100);
+
+    // Echo is off, the host acknowledges the key without it.
+    this.predictor.onInput('pw');
+    result.assertEQ(this.getRowText(0), '$ apw');
+    this.predictor.onEchoAck(this.output, 2, 100);
+    result.assertEQ(this.getRowText(0), '$ a');
+
+    this.predictor.onInput('d');
+    result.assertEQ(this.getRowText(0), '$ a');
+
+    result.pass();
+  });
+
+/**
+ * Acknowledgement waits for the output it refers to.
+ */
+nassh.EchoPredictor.Tests.addTest('ack-before-output', function(result, cx) {
+    this.predictor.onInput('a');
+    this.predictor.onEchoAck(this.output + 1, 1, 100);
+    this.write('a');
+    this.predictor.onInput('b');
+    result.assertEQ(this.getRowText(0), '$ ab');
+
+    result.pass();
+  });
+
+/**
+ * Nothing is drawn after Enter until it's echoed and a prediction after it
+ * turns out right.
+ */
+nassh.EchoPredictor.Tests.addTest('enter', function(result, cx) {
+    this.predictor.confirmedEpoch_ = this.predictor.epoch_;
+    this.predictor.onInput('\r');
+    this.predictor.onInput('x');
+    result.assertEQ(this.getRowText(0), '$ ');
+
+    this.write('\r\n$ ');
+    this.predictor.onEchoAck(this.output, 1, 100);
+    result.assertEQ(this.getRowText(1), '$ ');
+
+    this.write('x');
+    this.predictor.onEchoAck(this.output, 2, 100);
+    this.predictor.onInput('y');
+    result.assertEQ(this.getRowText(1), '$ xy');
+
+    result.pass();
+  });
+
+/**
+ * Adaptive mode only draws predictions while the round trip is slow.
+ */
+nassh.EchoPredictor.Tests.addTest('adaptive', function(result, cx) {
+    this.predictor = new nassh.EchoPredictor(this.terminal, 'adaptive');
+    this.predictor.afterOutput(this.output);
+    this.predictor.onEchoAck(this.output, 0, 5);
+    this.predictor.confirmedEpoch_ = this.predictor.epoch_;
+    this.predictor.onInput('a');
+    result.assertEQ(this.getRowText(0), '$ ');
+
+    this.predictor.onEchoAck(this.output, 0, 50);
+    result.assertEQ(this.getRowText(0), '$ a');
+
+    result.pass();
+  });
@@ -0,0 +1,194 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+'use strict';
+
+lib.rtdep('lib.f');
+
+/**
+ * Startup benchmark for the plugin builds in nassh.pluginURLs.
+ *
+ * Every packaged build is loaded a number of times in a fresh embed. Load
+ * is the time from inserting the embed to its load event, it covers
+ * fetching and validating the nexes and, for the dynamic glibc build,
+ * runnable-ld.so loading the shared libraries. Init is the time from the
+ * plugin instance creation to the end of its OpenSSL warm-up, as reported
+ * by getStats. The first run of each build is shown on its own because it
+ * may have to fill caches the others hit.
+ *
+ * Open html/nassh_plugin_bench.html, optionally with ?runs=N&builds=a,b.
+ *
+ * @param {Element} output The element the results are appended to.
+ * @param {number} runs How many times each build is loaded.
+ */
+nassh.PluginBench = function(output, runs) {
+  this.output_ = output;
+  this.runs_ = runs;
+};
+
+/**
+ * Wait between polls for the end of the plugin warm-up.
+ */
+nassh.PluginBench.POLL_MS = 10;
+
+/**
+ * Benchmark the builds one after another.
+ *
+ * @param {Array} names Names from nassh.pluginURLs.
+ * @param {function()} onComplete The function to invoke when all are done.
+ */
+nassh.PluginBench.prototype.run = function(names, onComplete) {
+  this.print_(lib.f.lpad('build', 8) + lib.f.lpad('runs', 6) +
+              lib.f.lpad('load 1st', 10) + lib.f.lpad('load med', 10) +
+              lib.f.lpad('init 1st', 10) + lib.f.lpad('init med', 10));
+
+  var self = this;
+  function next(i) {
+    if (i == names.length) {
+      onComplete();
+      return;
+    }
+    self.runBuild_(names[i], next.bind(null, i + 1));
+  }
+  next(0);
+};
+
+/**
+ * Load one build this.runs_ times and print its line.
+ */
+nassh.PluginBench.prototype.runBuild_ = function(name, onComplete) {
+  var self = this;
+  var loads = [];
+  var inits = [];
+
+  function printResult(error) {
+    var line = lib.f.lpad(name, 8);
+    if (error) {
+      line += '  ' + error;
+    } else {
+      line += lib.f.lpad(String(loads.length), 6) +
+          lib.f.lpad(loads[0].toFixed(0), 10) +
+          lib.f.lpad(self.median_(loads.slice(1)), 10) +
+          lib.f.lpad(inits[0].toFixed(0), 10) +
+          lib.f.lpad(self.median_(inits.slice(1)), 10);
+    }
+    self.print_(line);
+    onComplete();
+  }
+
+  function onRun(error, loadMs, initMs) {
+    if (error) {
+      printResult(error);
+      return;
+    }
+    loads.push(loadMs);
+    inits.push(initMs);
+    if (loads.length < self.runs_) {
+      self.runOnce_(name, onRun);
+    } else {
+      printResult(null);
+    }
+  }
+
+  var xhr = new XMLHttpRequest();
+  xhr.open('GET', nassh.pluginURLs[name]);
+  xhr.onloadend = function() {
+    if (xhr.status == 200) {
+      self.runOnce_(name, onRun);
+    } else {
+      printResult('not packaged');
+    }
+  };
+  xhr.send();
+};
+
+/**
+ * Load the build in a new embed and remove it once warm-up is done.
+ *
+ * @param {string} name The build to load.
+ * @param {function(string, number, number)} onComplete The function to
+ *     invoke with an error message or null, load and init time in ms.
+ */
+nassh.PluginBench.prototype.runOnce_ = function(name, onComplete) {
+  var plugin = window.document.createElement('embed');
+  plugin.style.cssText =
+      ('position: absolute;' +
+       'top: -99px' +
+       'width: 0;' +
+       'height: 0;');
+
+  var loadStart;
+  var loadMs;
+  var done = false;
+
+  function finish(error, initMs) {
+    if (done)
+      return;
+    done = true;
+    plugin.parentNode.removeChild(plugin);
+    onComplete(error, loadMs, initMs);
+  }
+
+  function requestStats() {
+    plugin.postMessage(JSON.stringify({name: 'getStats', arguments: []}));
+  }
+
+  plugin.setAttribute('src', nassh.pluginURLs[name]);
+  plugin.setAttribute('type', 'application/x-nacl');
+  plugin.addEventListener('load', function() {
+    loadMs = Date.now() - loadStart;
+    requestStats();
+  });
+  plugin.addEventListener('message', function(e) {
+    if (e.data instanceof ArrayBuffer)
+      return;
+    var msg = JSON.parse(e.data);
+    if (msg.name != 'stats')
+      return;
+    var stats = msg.arguments[0];
+    if (stats.warmUpMs < 0) {
+      setTimeout(requestStats, nassh.PluginBench.POLL_MS);
+    } else {
+      finish(null, stats.warmUpMs);
+    }
+  });
+  plugin.addEventListener('error', function() {
+    finish('failed to load');
+  });
+  plugin.addEventListener('crash', function() {
+    finish('crashed');
+  });
+
+  loadStart = Date.now();
+  document.body.appendChild(plugin);
+};
+
+/**
+ * Get the median of a list of times as a string, '-' if it's empty.
+ */
+nassh.PluginBench.prototype.median_ = function(values) {
+  if (!values.length)
+    return '-';
+  values = values.slice().sort(function(a, b) { return a - b });
+  return values[Math.floor(values.length / 2)].toFixed(0);
+};
+
+nassh.PluginBench.prototype.print_ = function(line) {
+  console.log(line);
+  this.output_.textContent += line + '\n';
+};
+
+window.onload = function() {
+  lib.ensureRuntimeDependencies();
+
+  var params = lib.f.parseQuery(document.location.search);
+  var runs = Math.max(1, parseInt(params['runs'] || '5', 10) || 1);
+  var names = params['builds'] ? params['builds'].split(',') :
+      Object.keys(nassh.pluginURLs);
+
+  var bench = new nassh.PluginBench(document.querySelector('#results'), runs);
+  bench.run(names, function() {
+    console.log('nassh plugin bench: done');
+  });
+};
@@ -76,6 +76,52 @@ nassh.ProfilePreferenceManager = function(storage, id) {
      */
     ['relay-options', ''],
 
+    /**
+     * Proxy to tunnel the connection through when there is no relay, in
+     * the form http://[user:password@]host:port or
+     * socks5://[user:password@]host:port.
+     */
+    ['proxy', ''],
+
+    /**
+     * Regular expressions looked for in the terminal output by the plugin,
+     * see nassh.CommandInstance.prototype.setTriggers.
+     */
+    ['triggers', []],
+
+    /**
+     * Whether the plugin should remember the address of this host and try
+     * it first on the next connection. Turning it off is mostly useful to
+     * compare handshake times.
+     */
+    ['host-profile', true],
+
+    /**
+     * Whether authentication may skip the queries the host profile knows
+     * answers to: the "none" probe and asking if the key that worked last
+     * time is acceptable. Each of them costs a round trip.
+     */
+    ['fast-auth', false],
+
+    /**
+     * Whether ssh should only start mosh-server and the session should go
+     * over UDP with mosh protocol. It keeps working over lossy links and
+     * across network changes, but needs a direct connection to the host.
+     */
+    ['mosh', false],
+
+    /**
+     * The mosh-server command to run on the host.
+     */
+    ['mosh-server', 'mosh-server'],
+
+    /**
+     * When to show local echo of the keys typed in a mosh session before the
+     * host echoes them: 'adaptive' when the round trip is slow, 'always' or
+     * 'never'. Predicted characters are underlined.
+     */
+    ['mosh-predict', 'adaptive'],
+
     /**
      * The private key file to use as the identity for this extension.
      *
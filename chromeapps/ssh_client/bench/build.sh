@@ -0,0 +1,86 @@
+#!/bin/bash
+# Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+# Use of this source code is governed by a BSD-style license that can be
+# found in the LICENSE file.
+
+# build.sh
+#
+# usage: bench/build.sh [--asm]
+#
+# download and build OpenSSL and the patched openssh for Linux, then
+# output/ssh_bench. OpenSSL is built without assembly like for NaCl unless
+# --asm is given. NACL_SDK_ROOT must point to an SDK for the Pepper headers.
+
+set -x
+
+readonly OPENSSL=openssl-1.0.1c
+readonly OPENSSL_MIRROR=http://www.openssl.org/source
+readonly OPENSSH=openssh-5.9p1
+readonly OPENSSH_MIRROR=http://ftp5.usa.openbsd.org/pub/OpenBSD/OpenSSH/portable
+
+ASM=0
+
+for i in $@; do
+  case $i in
+    "--asm")
+      ASM=1
+      ;;
+
+    *)
+      echo "usage: $0 [--asm]"
+      exit 1
+      ;;
+  esac
+done
+
+if [[ ($NACL_SDK_ROOT == "") || !(-d $NACL_SDK_ROOT) ]]; then
+  echo "NACL_SDK_ROOT is not set, run build.sh first"
+  exit 1
+fi
+
+cd "$(dirname "$0")/.."
+readonly ROOT=$PWD
+readonly PREFIX=$ROOT/output/bench
+mkdir -p $PREFIX/lib $PREFIX/include
+
+pushd $PREFIX
+if [[ !(-f lib/libcrypto.a) ]]; then
+  if [[ !(-f $OPENSSL.tar.gz) ]]; then
+    wget $OPENSSL_MIRROR/$OPENSSL.tar.gz -O $OPENSSL.tar.gz || exit 1
+  fi
+  rm -rf $OPENSSL/
+  tar xzf $OPENSSL.tar.gz || exit 1
+  if [[ $ASM == 1 ]]; then
+    OPENSSL_FLAGS=
+  else
+    OPENSSL_FLAGS=no-asm
+  fi
+  pushd $OPENSSL
+  ./config --prefix=$PREFIX --openssldir=$PREFIX/ssl no-shared \
+      $OPENSSL_FLAGS || exit 1
+  make && make install_sw || exit 1
+  popd
+fi
+
+if [[ !(-f lib/libopenssh.a) ]]; then
+  if [[ !(-f $OPENSSH.tar.gz) ]]; then
+    wget $OPENSSH_MIRROR/$OPENSSH.tar.gz -O $OPENSSH.tar.gz || exit 1
+  fi
+  rm -rf $OPENSSH/
+  tar xzf $OPENSSH.tar.gz || exit 1
+  pushd $OPENSSH
+  patch -p0 -i $ROOT/$OPENSSH.patch || exit 1
+  ./configure --with-ssl-dir=$PREFIX CFLAGS="-O2" || exit 1
+
+  # will fail on link stage due to missing reference to main - it is expected
+  make ssh || echo "Ignore error."
+  ar rcs ../lib/libopenssh.a \
+      ssh.o readconf.o clientloop.o sshtty.o sshconnect.o sshconnect1.o \
+      sshconnect2.o mux.o roaming_common.o roaming_client.o || exit 1
+  cp -f libssh.a ../lib/ || exit 1
+  cp -f openbsd-compat/libopenbsd-compat.a ../lib/ || exit 1
+  popd
+fi
+popd
+
+make -j bench || exit 1
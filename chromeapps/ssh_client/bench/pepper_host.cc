@@ -0,0 +1,1267 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pepper_host.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "irt/irt.h"
+#include "ppapi/c/pp_errors.h"
+#include "ppapi/c/ppb_file_io.h"
+#include "ppapi/cpp/completion_callback.h"
+#include "ppapi/cpp/core.h"
+#include "ppapi/cpp/file_io.h"
+#include "ppapi/cpp/file_ref.h"
+#include "ppapi/cpp/file_system.h"
+#include "ppapi/cpp/instance_handle.h"
+#include "ppapi/cpp/module.h"
+#include "ppapi/cpp/private/host_resolver_private.h"
+#include "ppapi/cpp/private/net_address_private.h"
+#include "ppapi/cpp/private/tcp_server_socket_private.h"
+#include "ppapi/cpp/private/tcp_socket_private.h"
+#include "ppapi/cpp/private/udp_socket_private.h"
+#include "ppapi/cpp/resource.h"
+#include "ppapi/cpp/var.h"
+
+#include "pthread_helpers.h"
+
+namespace {
+
+int64_t GetTimeUsec() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+int32_t ErrnoToPepper(int error) {
+  switch (error) {
+    case ENOENT:
+      return PP_ERROR_FILENOTFOUND;
+    case EEXIST:
+      return PP_ERROR_FILEEXISTS;
+    case EACCES:
+    case EPERM:
+      return PP_ERROR_NOACCESS;
+    case ENOSPC:
+      return PP_ERROR_NOSPACE;
+    default:
+      return PP_ERROR_FAILED;
+  }
+}
+
+// Object behind a PP_Resource, deleted with the last reference.
+class HostResource {
+ public:
+  HostResource() : ref_(1) {}
+  virtual ~HostResource() {}
+
+  // Set if the main loop polls fd() for events().
+  virtual int fd() { return -1; }
+  virtual short events() { return 0; }
+  virtual void OnReady(short revents) {}
+
+ private:
+  friend class MainLoop;
+  int ref_;
+};
+
+struct Task {
+  PP_CompletionCallback callback;
+  int32_t result;
+};
+
+class MainLoop {
+ public:
+  explicit MainLoop(const char* root)
+      : root_(root), next_resource_(1), thread_(pthread_self()),
+        wake_fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), quit_(false) {}
+
+  const std::string& root() const { return root_; }
+  bool IsMainThread() { return pthread_equal(pthread_self(), thread_); }
+
+  PP_Resource AddResource(HostResource* resource) {
+    Mutex::Lock lock(mutex_);
+    PP_Resource id = next_resource_++;
+    resources_[id] = resource;
+    return id;
+  }
+
+  template<class T> T* GetResource(PP_Resource id) {
+    Mutex::Lock lock(mutex_);
+    ResourceMap::iterator it = resources_.find(id);
+    return it != resources_.end() ? dynamic_cast<T*>(it->second) : NULL;
+  }
+
+  void AddRef(PP_Resource id) {
+    Mutex::Lock lock(mutex_);
+    ResourceMap::iterator it = resources_.find(id);
+    if (it != resources_.end())
+      it->second->ref_++;
+  }
+
+  void Release(PP_Resource id) {
+    HostResource* deleted = NULL;
+    {
+      Mutex::Lock lock(mutex_);
+      ResourceMap::iterator it = resources_.find(id);
+      if (it != resources_.end() && --it->second->ref_ == 0) {
+        deleted = it->second;
+        resources_.erase(it);
+      }
+    }
+    delete deleted;
+  }
+
+  // Callbacks never run before the call that started the operation returns,
+  // so completions are always posted.
+  void PostTask(int32_t delay_ms, const PP_CompletionCallback& callback,
+                int32_t result) {
+    Task task = { callback, result };
+    {
+      Mutex::Lock lock(mutex_);
+      tasks_.insert(std::make_pair(GetTimeUsec() + delay_ms * 1000LL, task));
+    }
+    if (!IsMainThread()) {
+      uint64_t one = 1;
+      RawIo::Write(wake_fd_, &one, sizeof(one));
+    }
+  }
+
+  void Run() {
+    std::vector<Task> due;
+    std::vector<pollfd> fds;
+    std::vector<PP_Resource> ids;
+    for (;;) {
+      int timeout = -1;
+      due.clear();
+      fds.clear();
+      ids.clear();
+      pollfd wake = { wake_fd_, POLLIN, 0 };
+      fds.push_back(wake);
+      {
+        Mutex::Lock lock(mutex_);
+        if (quit_)
+          break;
+        int64_t now = GetTimeUsec();
+        while (!tasks_.empty() && tasks_.begin()->first <= now) {
+          due.push_back(tasks_.begin()->second);
+          tasks_.erase(tasks_.begin());
+        }
+        if (!due.empty())
+          timeout = 0;
+        else if (!tasks_.empty())
+          timeout = int((tasks_.begin()->first - now + 999) / 1000);
+
+        for (ResourceMap::iterator it = resources_.begin();
+             it != resources_.end(); ++it) {
+          short events = it->second->events();
+          if (events) {
+            pollfd pfd = { it->second->fd(), events, 0 };
+            fds.push_back(pfd);
+            ids.push_back(it->first);
+          }
+        }
+      }
+
+      for (size_t i = 0; i < due.size(); i++)
+        PP_RunCompletionCallback(&due[i].callback, due[i].result);
+      if (!due.empty())
+        continue;
+
+      if (poll(&fds[0], fds.size(), timeout) <= 0)
+        continue;
+      if (fds[0].revents) {
+        uint64_t count;
+        RawIo::Read(wake_fd_, &count, sizeof(count));
+      }
+      // Operations only post their callbacks, so no resource goes away
+      // while the results are dispatched.
+      for (size_t i = 1; i < fds.size(); i++) {
+        if (fds[i].revents) {
+          HostResource* resource = GetResource<HostResource>(ids[i - 1]);
+          if (resource)
+            resource->OnReady(fds[i].revents);
+        }
+      }
+    }
+  }
+
+  void Quit() {
+    {
+      Mutex::Lock lock(mutex_);
+      quit_ = true;
+    }
+    uint64_t one = 1;
+    RawIo::Write(wake_fd_, &one, sizeof(one));
+  }
+
+ private:
+  typedef std::map<PP_Resource, HostResource*> ResourceMap;
+  typedef std::multimap<int64_t, Task> TaskMap;
+
+  Mutex mutex_;
+  std::string root_;
+  ResourceMap resources_;
+  PP_Resource next_resource_;
+  TaskMap tasks_;
+  pthread_t thread_;
+  int wake_fd_;
+  bool quit_;
+};
+
+MainLoop* g_loop = NULL;
+
+// See PepperHost::SetUdpLoss(), the state is used on the main thread only.
+int g_udp_loss_percent = 0;
+uint32_t g_udp_loss_state = 1;
+
+// Same sequence of drops on every run.
+bool DropDatagram() {
+  if (!g_udp_loss_percent)
+    return false;
+  g_udp_loss_state = g_udp_loss_state * 1103515245 + 12345;
+  return (g_udp_loss_state >> 16) % 100 < uint32_t(g_udp_loss_percent);
+}
+
+void PostResult(const pp::CompletionCallback& cc, int32_t result) {
+  g_loop->PostTask(0, cc.pp_completion_callback(), result);
+}
+
+// One pending operation of a socket.
+class PendingOp {
+ public:
+  PendingOp() : callback_(PP_BlockUntilComplete()), buf_(NULL), size_(0) {}
+
+  bool is_pending() const { return callback_.func != NULL; }
+
+  void Start(const pp::CompletionCallback& cc, char* buf, int32_t size) {
+    callback_ = cc.pp_completion_callback();
+    buf_ = buf;
+    size_ = size;
+  }
+
+  void Complete(int32_t result) {
+    if (is_pending()) {
+      g_loop->PostTask(0, callback_, result);
+      callback_ = PP_BlockUntilComplete();
+    }
+  }
+
+  char* buf() const { return buf_; }
+  int32_t size() const { return size_; }
+
+ private:
+  PP_CompletionCallback callback_;
+  char* buf_;
+  int32_t size_;
+};
+
+bool ToSockaddr(const PP_NetAddress_Private& addr, sockaddr_storage* ss,
+                socklen_t* len) {
+  if (addr.size < sizeof(sa_family_t) || addr.size > sizeof(*ss))
+    return false;
+  memset(ss, 0, sizeof(*ss));
+  memcpy(ss, addr.data, addr.size);
+  *len = addr.size;
+  return true;
+}
+
+void FromSockaddr(const void* sa, socklen_t len, PP_NetAddress_Private* out) {
+  memset(out, 0, sizeof(*out));
+  out->size = std::min<size_t>(len, sizeof(out->data));
+  memcpy(out->data, sa, out->size);
+}
+
+class HostTcpSocket : public HostResource {
+ public:
+  explicit HostTcpSocket(int fd) : fd_(fd), connecting_(false) {}
+  virtual ~HostTcpSocket() { Disconnect(); }
+
+  virtual int fd() { return fd_; }
+
+  virtual short events() {
+    if (fd_ < 0)
+      return 0;
+    short events = 0;
+    if (connect_.is_pending() || write_.is_pending())
+      events |= POLLOUT;
+    if (read_.is_pending())
+      events |= POLLIN;
+    return events;
+  }
+
+  virtual void OnReady(short revents) {
+    if (connect_.is_pending()) {
+      int error = 0;
+      socklen_t len = sizeof(error);
+      RawIo::GetSockOpt(fd_, SOL_SOCKET, SO_ERROR, &error, &len);
+      connecting_ = false;
+      if (error) {
+        RawIo::Close(fd_);
+        fd_ = -1;
+      }
+      connect_.Complete(error ? PP_ERROR_FAILED : PP_OK);
+      return;
+    }
+    if (read_.is_pending() && (revents & (POLLIN | POLLHUP | POLLERR))) {
+      ssize_t n = RawIo::Read(fd_, read_.buf(), read_.size());
+      if (n >= 0 || errno != EAGAIN)
+        read_.Complete(n >= 0 ? n : PP_ERROR_FAILED);
+    }
+    if (write_.is_pending() && (revents & (POLLOUT | POLLHUP | POLLERR))) {
+      ssize_t n = syscall(SYS_sendto, fd_, write_.buf(), write_.size(),
+                          MSG_NOSIGNAL, NULL, 0);
+      if (n >= 0 || errno != EAGAIN)
+        write_.Complete(n >= 0 ? n : PP_ERROR_FAILED);
+    }
+  }
+
+  int32_t Connect(const char* host, uint16_t port,
+                  const pp::CompletionCallback& cc) {
+    if (fd_ >= 0 || connecting_)
+      return PP_ERROR_FAILED;
+    if (!strcmp(host, "localhost"))
+      host = "127.0.0.1";
+    sockaddr_storage ss;
+    memset(&ss, 0, sizeof(ss));
+    socklen_t len;
+    sockaddr_in* sin = reinterpret_cast<sockaddr_in*>(&ss);
+    sockaddr_in6* sin6 = reinterpret_cast<sockaddr_in6*>(&ss);
+    if (inet_pton(AF_INET, host, &sin->sin_addr) == 1) {
+      sin->sin_family = AF_INET;
+      sin->sin_port = htons(port);
+      len = sizeof(*sin);
+    } else if (inet_pton(AF_INET6, host, &sin6->sin6_addr) == 1) {
+      sin6->sin6_family = AF_INET6;
+      sin6->sin6_port = htons(port);
+      len = sizeof(*sin6);
+    } else {
+      return PP_ERROR_FAILED;
+    }
+    return ConnectTo(reinterpret_cast<sockaddr*>(&ss), len, cc);
+  }
+
+  int32_t ConnectTo(const sockaddr* addr, socklen_t len,
+                    const pp::CompletionCallback& cc) {
+    int fd = RawIo::Socket(addr->sa_family, SOCK_STREAM, 0);
+    if (fd < 0)
+      return PP_ERROR_FAILED;
+    int one = 1;
+    RawIo::SetSockOpt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    RawIo::SetNonBlocking(fd);
+    if (RawIo::Connect(fd, addr, len) && errno != EINPROGRESS) {
+      RawIo::Close(fd);
+      return PP_ERROR_FAILED;
+    }
+    fd_ = fd;
+    connecting_ = true;
+    connect_.Start(cc, NULL, 0);
+    return PP_OK_COMPLETIONPENDING;
+  }
+
+  int32_t Read(char* buf, int32_t size, const pp::CompletionCallback& cc) {
+    if (fd_ < 0 || connecting_)
+      return PP_ERROR_FAILED;
+    if (read_.is_pending())
+      return PP_ERROR_INPROGRESS;
+    read_.Start(cc, buf, size);
+    return PP_OK_COMPLETIONPENDING;
+  }
+
+  int32_t Write(const char* buf, int32_t size,
+                const pp::CompletionCallback& cc) {
+    if (fd_ < 0 || connecting_)
+      return PP_ERROR_FAILED;
+    if (write_.is_pending())
+      return PP_ERROR_INPROGRESS;
+    write_.Start(cc, const_cast<char*>(buf), size);
+    return PP_OK_COMPLETIONPENDING;
+  }
+
+  void Disconnect() {
+    connect_.Complete(PP_ERROR_ABORTED);
+    read_.Complete(PP_ERROR_ABORTED);
+    write_.Complete(PP_ERROR_ABORTED);
+    connecting_ = false;
+    if (fd_ >= 0) {
+      RawIo::Close(fd_);
+      fd_ = -1;
+    }
+  }
+
+ private:
+  int fd_;
+  bool connecting_;
+  PendingOp connect_;
+  PendingOp read_;
+  PendingOp write_;
+};
+
+class HostTcpServerSocket : public HostResource {
+ public:
+  HostTcpServerSocket() : fd_(-1), accepted_(NULL) {}
+  virtual ~HostTcpServerSocket() { StopListening(); }
+
+  virtual int fd() { return fd_; }
+  virtual short events() {
+    return fd_ >= 0 && accept_.is_pending() ? POLLIN : 0;
+  }
+
+  virtual void OnReady(short revents) {
+    int fd = RawIo::Accept(fd_);
+    if (fd < 0) {
+      if (errno != EAGAIN)
+        accept_.Complete(PP_ERROR_FAILED);
+      return;
+    }
+    int one = 1;
+    RawIo::SetSockOpt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    RawIo::SetNonBlocking(fd);
+    *accepted_ = g_loop->AddResource(new HostTcpSocket(fd));
+    accept_.Complete(PP_OK);
+  }
+
+  int32_t Listen(const PP_NetAddress_Private* addr, int32_t backlog,
+                 const pp::CompletionCallback& cc) {
+    sockaddr_storage ss;
+    socklen_t len;
+    if (fd_ >= 0 || !ToSockaddr(*addr, &ss, &len))
+      return PP_ERROR_FAILED;
+    int fd = RawIo::Socket(ss.ss_family, SOCK_STREAM, 0);
+    if (fd < 0)
+      return PP_ERROR_FAILED;
+    int one = 1;
+    RawIo::SetSockOpt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    RawIo::SetNonBlocking(fd);
+    int32_t result = PP_OK;
+    if (RawIo::Bind(fd, reinterpret_cast<sockaddr*>(&ss), len) ||
+        RawIo::Listen(fd, backlog)) {
+      result = PP_ERROR_FAILED;
+      RawIo::Close(fd);
+    } else {
+      fd_ = fd;
+    }
+    PostResult(cc, result);
+    return PP_OK_COMPLETIONPENDING;
+  }
+
+  int32_t Accept(PP_Resource* socket, const pp::CompletionCallback& cc) {
+    if (fd_ < 0)
+      return PP_ERROR_FAILED;
+    if (accept_.is_pending())
+      return PP_ERROR_INPROGRESS;
+    accepted_ = socket;
+    accept_.Start(cc, NULL, 0);
+    return PP_OK_COMPLETIONPENDING;
+  }
+
+  void StopListening() {
+    accept_.Complete(PP_ERROR_ABORTED);
+    if (fd_ >= 0) {
+      RawIo::Close(fd_);
+      fd_ = -1;
+    }
+  }
+
+ private:
+  int fd_;
+  PP_Resource* accepted_;
+  PendingOp accept_;
+};
+
+class HostUdpSocket : public HostResource {
+ public:
+  HostUdpSocket() : fd_(-1), from_len_(0), to_len_(0) {}
+  virtual ~HostUdpSocket() { Close(); }
+
+  virtual int fd() { return fd_; }
+
+  virtual short events() {
+    if (fd_ < 0)
+      return 0;
+    short events = 0;
+    if (send_.is_pending())
+      events |= POLLOUT;
+    if (recv_.is_pending())
+      events |= POLLIN;
+    return events;
+  }
+
+  virtual void OnReady(short revents) {
+    if (recv_.is_pending() && (revents & (POLLIN | POLLERR))) {
+      socklen_t len = sizeof(from_);
+      ssize_t n = syscall(SYS_recvfrom, fd_, recv_.buf(), recv_.size(), 0,
+                          &from_, &len);
+      // A dropped datagram leaves the receive pending for the next one.
+      if (n >= 0 && !DropDatagram()) {
+        from_len_ = len;
+        recv_.Complete(n);
+      } else if (n < 0 && errno != EAGAIN) {
+        recv_.Complete(PP_ERROR_FAILED);
+      }
+    }
+    if (send_.is_pending() && (revents & (POLLOUT | POLLERR))) {
+      ssize_t n = send_.size();
+      if (!DropDatagram()) {
+        n = syscall(SYS_sendto, fd_, send_.buf(), send_.size(), 0, &to_,
+                    to_len_);
+      }
+      if (n >= 0 || errno != EAGAIN)
+        send_.Complete(n >= 0 ? n : PP_ERROR_FAILED);
+    }
+  }
+
+  int32_t Bind(const PP_NetAddress_Private* addr,
+               const pp::CompletionCallback& cc) {
+    sockaddr_storage ss;
+    socklen_t len;
+    if (fd_ >= 0 || !ToSockaddr(*addr, &ss, &len))
+      return PP_ERROR_FAILED;
+    int fd = RawIo::Socket(ss.ss_family, SOCK_DGRAM, 0);
+    if (fd < 0)
+      return PP_ERROR_FAILED;
+    RawIo::SetNonBlocking(fd);
+    int32_t result = PP_OK;
+    if (RawIo::Bind(fd, reinterpret_cast<sockaddr*>(&ss), len)) {
+      result = PP_ERROR_FAILED;
+      RawIo::Close(fd);
+    } else {
+      fd_ = fd;
+    }
+    PostResult(cc, result);
+    return PP_OK_COMPLETIONPENDING;
+  }
+
+  bool GetBoundAddress(PP_NetAddress_Private* addr) {
+    sockaddr_storage ss;
+    socklen_t len = sizeof(ss);
+    if (fd_ < 0 ||
+        RawIo::GetSockName(fd_, reinterpret_cast<sockaddr*>(&ss), &len)) {
+      return false;
+    }
+    FromSockaddr(&ss, len, addr);
+    return true;
+  }
+
+  int32_t RecvFrom(char* buf, int32_t size,
+                   const pp::CompletionCallback& cc) {
+    if (fd_ < 0)
+      return PP_ERROR_FAILED;
+    if (recv_.is_pending())
+      return PP_ERROR_INPROGRESS;
+    recv_.Start(cc, buf, size);
+    return PP_OK_COMPLETIONPENDING;
+  }
+
+  bool GetRecvFromAddress(PP_NetAddress_Private* addr) {
+    if (!from_len_)
+      return false;
+    FromSockaddr(&from_, from_len_, addr);
+    return true;
+  }
+
+  int32_t SendTo(const char* buf, int32_t size,
+                 const PP_NetAddress_Private* addr,
+                 const pp::CompletionCallback& cc) {
+    if (fd_ < 0)
+      return PP_ERROR_FAILED;
+    if (send_.is_pending())
+      return PP_ERROR_INPROGRESS;
+    if (!ToSockaddr(*addr, &to_, &to_len_))
+      return PP_ERROR_FAILED;
+    send_.Start(cc, const_cast<char*>(buf), size);
+    return PP_OK_COMPLETIONPENDING;
+  }
+
+  void Close() {
+    recv_.Complete(PP_ERROR_ABORTED);
+    send_.Complete(PP_ERROR_ABORTED);
+    if (fd_ >= 0) {
+      RawIo::Close(fd_);
+      fd_ = -1;
+    }
+  }
+
+ private:
+  int fd_;
+  sockaddr_storage from_;
+  socklen_t from_len_;
+  sockaddr_storage to_;
+  socklen_t to_len_;
+  PendingOp recv_;
+  PendingOp send_;
+};
+
+class HostFileSystem : public HostResource {
+};
+
+class HostFileRef : public HostResource {
+ public:
+  explicit HostFileRef(const std::string& path) : path_(path) {}
+  const std::string& path() const { return path_; }
+
+ private:
+  std::string path_;
+};
+
+class HostFileIo : public HostResource {
+ public:
+  HostFileIo() : fd_(-1) {}
+  virtual ~HostFileIo() {
+    if (fd_ >= 0)
+      RawIo::Close(fd_);
+  }
+
+  // Not polled, regular files are always ready.
+  int file() const { return fd_; }
+  void set_file(int fd) { fd_ = fd; }
+
+ private:
+  int fd_;
+};
+
+// mkdir -p, |path| is absolute.
+int32_t MakeDirectories(const std::string& path) {
+  for (size_t i = 1; i <= path.size(); i++) {
+    if (i == path.size() || path[i] == '/') {
+      std::string dir = path.substr(0, i);
+      if (syscall(SYS_mkdirat, AT_FDCWD, dir.c_str(), 0700) &&
+          errno != EEXIST) {
+        return ErrnoToPepper(errno);
+      }
+    }
+  }
+  return PP_OK;
+}
+
+int GetRandomBytes(void* buf, size_t count, size_t* nread) {
+  size_t done = 0;
+  while (done < count) {
+    ssize_t n = syscall(SYS_getrandom, static_cast<char*>(buf) + done,
+                        count - done, 0);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return errno;
+    }
+    done += n;
+  }
+  *nread = done;
+  return 0;
+}
+
+class HostModule : public pp::Module {
+ public:
+  virtual pp::Instance* CreateInstance(PP_Instance instance) { return NULL; }
+};
+
+}  // namespace
+
+void PepperHost::Init(const char* root) {
+  g_loop = new MainLoop(root);
+  MakeDirectories(root);
+  (new HostModule())->InternalInit(1, NULL);
+}
+
+void PepperHost::Run() {
+  g_loop->Run();
+}
+
+void PepperHost::Quit() {
+  g_loop->Quit();
+}
+
+void PepperHost::SetUdpLoss(int percent) {
+  g_udp_loss_percent = percent;
+}
+
+int RawIo::Socket(int domain, int type, int protocol) {
+  return syscall(SYS_socket, domain, type | SOCK_CLOEXEC, protocol);
+}
+
+int RawIo::Connect(int fd, const sockaddr* addr, socklen_t addrlen) {
+  return syscall(SYS_connect, fd, addr, addrlen);
+}
+
+int RawIo::Bind(int fd, const sockaddr* addr, socklen_t addrlen) {
+  return syscall(SYS_bind, fd, addr, addrlen);
+}
+
+int RawIo::Listen(int fd, int backlog) {
+  return syscall(SYS_listen, fd, backlog);
+}
+
+int RawIo::Accept(int fd) {
+  return syscall(SYS_accept4, fd, NULL, NULL, SOCK_CLOEXEC);
+}
+
+int RawIo::GetSockName(int fd, sockaddr* addr, socklen_t* addrlen) {
+  return syscall(SYS_getsockname, fd, addr, addrlen);
+}
+
+int RawIo::GetSockOpt(int fd, int level, int optname, void* optval,
+                      socklen_t* optlen) {
+  return syscall(SYS_getsockopt, fd, level, optname, optval, optlen);
+}
+
+int RawIo::SetSockOpt(int fd, int level, int optname, const void* optval,
+                      socklen_t optlen) {
+  return syscall(SYS_setsockopt, fd, level, optname, optval, optlen);
+}
+
+int RawIo::SetNonBlocking(int fd) {
+  long flags = syscall(SYS_fcntl, fd, F_GETFL);
+  if (flags < 0)
+    return -1;
+  return syscall(SYS_fcntl, fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+ssize_t RawIo::Read(int fd, void* buf, size_t count) {
+  return syscall(SYS_read, fd, buf, count);
+}
+
+ssize_t RawIo::Write(int fd, const void* buf, size_t count) {
+  return syscall(SYS_write, fd, buf, count);
+}
+
+int RawIo::Close(int fd) {
+  return syscall(SYS_close, fd);
+}
+
+int RawIo::BindLoopback(int backlog, uint16_t* port) {
+  int fd = Socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  int one = 1;
+  SetSockOpt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  sockaddr_in sin;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(sin);
+  if (Bind(fd, reinterpret_cast<sockaddr*>(&sin), len) ||
+      (backlog > 0 && Listen(fd, backlog)) ||
+      GetSockName(fd, reinterpret_cast<sockaddr*>(&sin), &len)) {
+    Close(fd);
+    return -1;
+  }
+  *port = ntohs(sin.sin_port);
+  return fd;
+}
+
+int RawIo::ConnectLoopback(uint16_t port) {
+  int fd = Socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  int one = 1;
+  SetSockOpt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  sockaddr_in sin;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sin.sin_port = htons(port);
+  if (Connect(fd, reinterpret_cast<sockaddr*>(&sin), sizeof(sin))) {
+    Close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+extern "C" size_t nacl_interface_query(const char* interface_ident,
+                                       void* table, size_t tablesize) {
+  if (!strcmp(interface_ident, NACL_IRT_RANDOM_v0_1) &&
+      tablesize >= sizeof(nacl_irt_random)) {
+    static_cast<nacl_irt_random*>(table)->get_random_bytes = GetRandomBytes;
+    return sizeof(nacl_irt_random);
+  }
+  return 0;
+}
+
+namespace pp {
+
+static Module* g_module = NULL;
+
+Module::Module() : pp_module_(0), get_browser_interface_(NULL), core_(NULL) {
+}
+
+Module::~Module() {
+  delete core_;
+  g_module = NULL;
+}
+
+Module* Module::Get() {
+  return g_module;
+}
+
+bool Module::InternalInit(PP_Module mod,
+                          PPB_GetInterface get_browser_interface) {
+  pp_module_ = mod;
+  get_browser_interface_ = get_browser_interface;
+  core_ = new Core(NULL);
+  g_module = this;
+  return Init();
+}
+
+bool Module::Init() {
+  return true;
+}
+
+void Core::AddRefResource(PP_Resource resource) {
+  g_loop->AddRef(resource);
+}
+
+void Core::ReleaseResource(PP_Resource resource) {
+  g_loop->Release(resource);
+}
+
+void Core::CallOnMainThread(int32_t delay_in_milliseconds,
+                            const CompletionCallback& callback,
+                            int32_t result) {
+  g_loop->PostTask(delay_in_milliseconds, callback.pp_completion_callback(),
+                   result);
+}
+
+bool Core::IsMainThread() {
+  return g_loop->IsMainThread();
+}
+
+// The benchmark has no instance.
+InstanceHandle::InstanceHandle(Instance* instance) : pp_instance_(0) {
+}
+
+Resource::Resource() : pp_resource_(0) {
+}
+
+Resource::Resource(const Resource& other) : pp_resource_(other.pp_resource_) {
+  if (!is_null())
+    g_loop->AddRef(pp_resource_);
+}
+
+Resource::~Resource() {
+  if (!is_null())
+    g_loop->Release(pp_resource_);
+}
+
+Resource& Resource::operator=(const Resource& other) {
+  if (!other.is_null())
+    g_loop->AddRef(other.pp_resource_);
+  if (!is_null())
+    g_loop->Release(pp_resource_);
+  pp_resource_ = other.pp_resource_;
+  return *this;
+}
+
+PP_Resource Resource::detach() {
+  PP_Resource resource = pp_resource_;
+  pp_resource_ = 0;
+  return resource;
+}
+
+Resource::Resource(PP_Resource resource) : pp_resource_(resource) {
+  if (!is_null())
+    g_loop->AddRef(pp_resource_);
+}
+
+Resource::Resource(PassRef, PP_Resource resource) : pp_resource_(resource) {
+}
+
+void Resource::PassRefFromConstructor(PP_Resource resource) {
+  pp_resource_ = resource;
+}
+
+Var::Var() {
+  var_ = PP_MakeUndefined();
+  is_managed_ = true;
+}
+
+Var::Var(const Var& other) {
+  var_ = other.var_;
+  is_managed_ = true;
+}
+
+Var::~Var() {
+}
+
+Var& Var::operator=(const Var& other) {
+  var_ = other.var_;
+  return *this;
+}
+
+std::string Var::AsString() const {
+  return std::string();
+}
+
+TCPSocketPrivate::TCPSocketPrivate(const InstanceHandle& instance) {
+  PassRefFromConstructor(g_loop->AddResource(new HostTcpSocket(-1)));
+}
+
+TCPSocketPrivate::TCPSocketPrivate(PassRef, PP_Resource resource)
+    : Resource(PASS_REF, resource) {
+}
+
+bool TCPSocketPrivate::IsAvailable() {
+  return true;
+}
+
+int32_t TCPSocketPrivate::Connect(const char* host, uint16_t port,
+                                  const CompletionCallback& callback) {
+  return g_loop->GetResource<HostTcpSocket>(pp_resource())->Connect(
+      host, port, callback);
+}
+
+int32_t TCPSocketPrivate::Read(char* buffer, int32_t bytes_to_read,
+                               const CompletionCallback& callback) {
+  return g_loop->GetResource<HostTcpSocket>(pp_resource())->Read(
+      buffer, bytes_to_read, callback);
+}
+
+int32_t TCPSocketPrivate::Write(const char* buffer, int32_t bytes_to_write,
+                                const CompletionCallback& callback) {
+  return g_loop->GetResource<HostTcpSocket>(pp_resource())->Write(
+      buffer, bytes_to_write, callback);
+}
+
+TCPServerSocketPrivate::TCPServerSocketPrivate(
+    const InstanceHandle& instance) {
+  PassRefFromConstructor(g_loop->AddResource(new HostTcpServerSocket()));
+}
+
+bool TCPServerSocketPrivate::IsAvailable() {
+  return true;
+}
+
+int32_t TCPServerSocketPrivate::Listen(const PP_NetAddress_Private* addr,
+                                       int32_t backlog,
+                                       const CompletionCallback& callback) {
+  return g_loop->GetResource<HostTcpServerSocket>(pp_resource())->Listen(
+      addr, backlog, callback);
+}
+
+int32_t TCPServerSocketPrivate::Accept(PP_Resource* socket,
+                                       const CompletionCallback& callback) {
+  return g_loop->GetResource<HostTcpServerSocket>(pp_resource())->Accept(
+      socket, callback);
+}
+
+void TCPServerSocketPrivate::StopListening() {
+  g_loop->GetResource<HostTcpServerSocket>(pp_resource())->StopListening();
+}
+
+UDPSocketPrivate::UDPSocketPrivate(const InstanceHandle& instance) {
+  PassRefFromConstructor(g_loop->AddResource(new HostUdpSocket()));
+}
+
+bool UDPSocketPrivate::IsAvailable() {
+  return true;
+}
+
+int32_t UDPSocketPrivate::Bind(const PP_NetAddress_Private* addr,
+                               const CompletionCallback& callback) {
+  return g_loop->GetResource<HostUdpSocket>(pp_resource())->Bind(
+      addr, callback);
+}
+
+bool UDPSocketPrivate::GetBoundAddress(PP_NetAddress_Private* addr) {
+  return g_loop->GetResource<HostUdpSocket>(pp_resource())->GetBoundAddress(
+      addr);
+}
+
+int32_t UDPSocketPrivate::RecvFrom(char* buffer, int32_t num_bytes,
+                                   const CompletionCallback& callback) {
+  return g_loop->GetResource<HostUdpSocket>(pp_resource())->RecvFrom(
+      buffer, num_bytes, callback);
+}
+
+bool UDPSocketPrivate::GetRecvFromAddress(PP_NetAddress_Private* addr) {
+  return g_loop->GetResource<HostUdpSocket>(pp_resource())->
+      GetRecvFromAddress(addr);
+}
+
+int32_t UDPSocketPrivate::SendTo(const char* buffer, int32_t num_bytes,
+                                 const PP_NetAddress_Private* addr,
+                                 const CompletionCallback& callback) {
+  return g_loop->GetResource<HostUdpSocket>(pp_resource())->SendTo(
+      buffer, num_bytes, addr, callback);
+}
+
+void UDPSocketPrivate::Close() {
+  g_loop->GetResource<HostUdpSocket>(pp_resource())->Close();
+}
+
+HostResolverPrivate::HostResolverPrivate(const InstanceHandle& instance) {
+}
+
+bool HostResolverPrivate::IsAvailable() {
+  return false;
+}
+
+int32_t HostResolverPrivate::Resolve(const std::string& host, uint16_t port,
+                                     const PP_HostResolver_Private_Hint& hint,
+                                     const CompletionCallback& callback) {
+  return PP_ERROR_NOINTERFACE;
+}
+
+Var HostResolverPrivate::GetCanonicalName() {
+  return Var();
+}
+
+uint32_t HostResolverPrivate::GetSize() {
+  return 0;
+}
+
+bool HostResolverPrivate::GetNetAddress(uint32_t index,
+                                        PP_NetAddress_Private* address) {
+  return false;
+}
+
+bool NetAddressPrivate::IsAvailable() {
+  return true;
+}
+
+bool NetAddressPrivate::AreEqual(const PP_NetAddress_Private& addr1,
+                                 const PP_NetAddress_Private& addr2) {
+  return addr1.size == addr2.size &&
+      !memcmp(addr1.data, addr2.data, addr1.size);
+}
+
+bool NetAddressPrivate::AreHostsEqual(const PP_NetAddress_Private& addr1,
+                                      const PP_NetAddress_Private& addr2) {
+  char host1[16], host2[16];
+  return GetFamily(addr1) == GetFamily(addr2) &&
+      GetAddress(addr1, host1, sizeof(host1)) &&
+      GetAddress(addr2, host2, sizeof(host2)) &&
+      !memcmp(host1, host2, GetFamily(addr1) == PP_NETADDRESSFAMILY_IPV4 ?
+              4 : 16);
+}
+
+std::string NetAddressPrivate::Describe(const PP_NetAddress_Private& addr,
+                                        bool include_port) {
+  char host[INET6_ADDRSTRLEN];
+  char buf[INET6_ADDRSTRLEN + 16];
+  PP_NetAddressFamily_Private family = GetFamily(addr);
+  if (family == PP_NETADDRESSFAMILY_UNSPECIFIED)
+    return std::string();
+  bool ipv6 = family == PP_NETADDRESSFAMILY_IPV6;
+  uint8_t address[16];
+  GetAddress(addr, address, sizeof(address));
+  inet_ntop(ipv6 ? AF_INET6 : AF_INET, address, host, sizeof(host));
+  if (!include_port)
+    return host;
+  snprintf(buf, sizeof(buf), ipv6 ? "[%s]:%d" : "%s:%d", host,
+           GetPort(addr));
+  return buf;
+}
+
+bool NetAddressPrivate::ReplacePort(const PP_NetAddress_Private& addr_in,
+                                    uint16_t port,
+                                    PP_NetAddress_Private* addr_out) {
+  sockaddr_storage ss;
+  socklen_t len;
+  if (!ToSockaddr(addr_in, &ss, &len))
+    return false;
+  if (ss.ss_family == AF_INET)
+    reinterpret_cast<sockaddr_in*>(&ss)->sin_port = htons(port);
+  else if (ss.ss_family == AF_INET6)
+    reinterpret_cast<sockaddr_in6*>(&ss)->sin6_port = htons(port);
+  else
+    return false;
+  FromSockaddr(&ss, len, addr_out);
+  return true;
+}
+
+bool NetAddressPrivate::GetAnyAddress(bool is_ipv6,
+                                      PP_NetAddress_Private* addr) {
+  uint8_t any[16] = { 0 };
+  return is_ipv6 ? CreateFromIPv6Address(any, 0, 0, addr) :
+      CreateFromIPv4Address(any, 0, addr);
+}
+
+PP_NetAddressFamily_Private NetAddressPrivate::GetFamily(
+    const PP_NetAddress_Private& addr) {
+  sockaddr_storage ss;
+  socklen_t len;
+  if (ToSockaddr(addr, &ss, &len)) {
+    if (ss.ss_family == AF_INET)
+      return PP_NETADDRESSFAMILY_IPV4;
+    if (ss.ss_family == AF_INET6)
+      return PP_NETADDRESSFAMILY_IPV6;
+  }
+  return PP_NETADDRESSFAMILY_UNSPECIFIED;
+}
+
+uint16_t NetAddressPrivate::GetPort(const PP_NetAddress_Private& addr) {
+  sockaddr_storage ss;
+  socklen_t len;
+  if (!ToSockaddr(addr, &ss, &len))
+    return 0;
+  if (ss.ss_family == AF_INET)
+    return ntohs(reinterpret_cast<sockaddr_in*>(&ss)->sin_port);
+  if (ss.ss_family == AF_INET6)
+    return ntohs(reinterpret_cast<sockaddr_in6*>(&ss)->sin6_port);
+  return 0;
+}
+
+bool NetAddressPrivate::GetAddress(const PP_NetAddress_Private& addr,
+                                   void* address, uint16_t address_size) {
+  sockaddr_storage ss;
+  socklen_t len;
+  if (!ToSockaddr(addr, &ss, &len))
+    return false;
+  if (ss.ss_family == AF_INET && address_size >= 4) {
+    memcpy(address, &reinterpret_cast<sockaddr_in*>(&ss)->sin_addr, 4);
+    return true;
+  }
+  if (ss.ss_family == AF_INET6 && address_size >= 16) {
+    memcpy(address, &reinterpret_cast<sockaddr_in6*>(&ss)->sin6_addr, 16);
+    return true;
+  }
+  return false;
+}
+
+uint32_t NetAddressPrivate::GetScopeID(const PP_NetAddress_Private& addr) {
+  sockaddr_storage ss;
+  socklen_t len;
+  if (!ToSockaddr(addr, &ss, &len) || ss.ss_family != AF_INET6)
+    return 0;
+  return reinterpret_cast<sockaddr_in6*>(&ss)->sin6_scope_id;
+}
+
+bool NetAddressPrivate::CreateFromIPv4Address(
+    const uint8_t ip[4], uint16_t port, PP_NetAddress_Private* addr_out) {
+  sockaddr_in sin;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(port);
+  memcpy(&sin.sin_addr, ip, 4);
+  FromSockaddr(&sin, sizeof(sin), addr_out);
+  return true;
+}
+
+bool NetAddressPrivate::CreateFromIPv6Address(
+    const uint8_t ip[16], uint32_t scope_id, uint16_t port,
+    PP_NetAddress_Private* addr_out) {
+  sockaddr_in6 sin6;
+  memset(&sin6, 0, sizeof(sin6));
+  sin6.sin6_family = AF_INET6;
+  sin6.sin6_port = htons(port);
+  sin6.sin6_scope_id = scope_id;
+  memcpy(&sin6.sin6_addr, ip, 16);
+  FromSockaddr(&sin6, sizeof(sin6), addr_out);
+  return true;
+}
+
+FileSystem::FileSystem() {
+}
+
+FileSystem::FileSystem(const InstanceHandle& instance,
+                       PP_FileSystemType type) {
+  PassRefFromConstructor(g_loop->AddResource(new HostFileSystem()));
+}
+
+int32_t FileSystem::Open(int64_t expected_size, const CompletionCallback& cc) {
+  PostResult(cc, PP_OK);
+  return PP_OK_COMPLETIONPENDING;
+}
+
+FileRef::FileRef(const FileSystem& file_system, const char* path) {
+  PassRefFromConstructor(g_loop->AddResource(
+      new HostFileRef(g_loop->root() + path)));
+}
+
+int32_t FileRef::MakeDirectoryIncludingAncestors(const CompletionCallback& cc) {
+  HostFileRef* ref = g_loop->GetResource<HostFileRef>(pp_resource());
+  PostResult(cc, MakeDirectories(ref->path()));
+  return PP_OK_COMPLETIONPENDING;
+}
+
+FileIO::FileIO(const InstanceHandle& instance) {
+  PassRefFromConstructor(g_loop->AddResource(new HostFileIo()));
+}
+
+int32_t FileIO::Open(const FileRef& file_ref, int32_t open_flags,
+                     const CompletionCallback& cc) {
+  HostFileIo* io = g_loop->GetResource<HostFileIo>(pp_resource());
+  HostFileRef* ref = g_loop->GetResource<HostFileRef>(file_ref.pp_resource());
+  int flags = O_CLOEXEC;
+  if ((open_flags & PP_FILEOPENFLAG_READ) &&
+      (open_flags & PP_FILEOPENFLAG_WRITE)) {
+    flags |= O_RDWR;
+  } else if (open_flags & PP_FILEOPENFLAG_WRITE) {
+    flags |= O_WRONLY;
+  }
+  if (open_flags & PP_FILEOPENFLAG_CREATE)
+    flags |= O_CREAT;
+  if (open_flags & PP_FILEOPENFLAG_TRUNCATE)
+    flags |= O_TRUNC;
+  if (open_flags & PP_FILEOPENFLAG_EXCLUSIVE)
+    flags |= O_EXCL;
+  int fd = syscall(SYS_openat, AT_FDCWD, ref->path().c_str(), flags, 0600);
+  if (fd >= 0)
+    io->set_file(fd);
+  PostResult(cc, fd >= 0 ? PP_OK : ErrnoToPepper(errno));
+  return PP_OK_COMPLETIONPENDING;
+}
+
+int32_t FileIO::Query(PP_FileInfo* result_buf, const CompletionCallback& cc) {
+  HostFileIo* io = g_loop->GetResource<HostFileIo>(pp_resource());
+  struct stat st;
+  int32_t result = PP_OK;
+  if (syscall(SYS_fstat, io->file(), &st)) {
+    result = ErrnoToPepper(errno);
+  } else {
+    result_buf->size = st.st_size;
+    result_buf->type = S_ISDIR(st.st_mode) ? PP_FILETYPE_DIRECTORY :
+        PP_FILETYPE_REGULAR;
+    result_buf->system_type = PP_FILESYSTEMTYPE_LOCALPERSISTENT;
+    result_buf->creation_time = st.st_ctime;
+    result_buf->last_access_time = st.st_atime;
+    result_buf->last_modified_time =
+        st.st_mtim.tv_sec + st.st_mtim.tv_nsec / 1e9;
+  }
+  PostResult(cc, result);
+  return PP_OK_COMPLETIONPENDING;
+}
+
+int32_t FileIO::Read(int64_t offset, char* buffer, int32_t bytes_to_read,
+                     const CompletionCallback& cc) {
+  HostFileIo* io = g_loop->GetResource<HostFileIo>(pp_resource());
+  ssize_t n = syscall(SYS_pread64, io->file(), buffer, bytes_to_read, offset);
+  PostResult(cc, n >= 0 ? n : ErrnoToPepper(errno));
+  return PP_OK_COMPLETIONPENDING;
+}
+
+int32_t FileIO::Write(int64_t offset, const char* buffer,
+                      int32_t bytes_to_write, const CompletionCallback& cc) {
+  HostFileIo* io = g_loop->GetResource<HostFileIo>(pp_resource());
+  ssize_t n = syscall(SYS_pwrite64, io->file(), buffer, bytes_to_write,
+                      offset);
+  PostResult(cc, n >= 0 ? n : ErrnoToPepper(errno));
+  return PP_OK_COMPLETIONPENDING;
+}
+
+int32_t FileIO::SetLength(int64_t length, const CompletionCallback& cc) {
+  HostFileIo* io = g_loop->GetResource<HostFileIo>(pp_resource());
+  int result = syscall(SYS_ftruncate, io->file(), length);
+  PostResult(cc, result == 0 ? PP_OK : ErrnoToPepper(errno));
+  return PP_OK_COMPLETIONPENDING;
+}
+
+}  // namespace pp
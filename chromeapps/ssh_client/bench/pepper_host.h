@@ -0,0 +1,60 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef PEPPER_HOST_H
+#define PEPPER_HOST_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+// Linux stand-ins for the Pepper C++ classes the plugin uses, so ssh_main,
+// syscalls.cc and FileSystem can run in a plain process (see ssh_bench.cc).
+// The thread that calls Run() plays the Pepper main thread: it runs
+// CallOnMainThread() tasks and completes socket and file operations, whose
+// callbacks are always asynchronous like in the browser.
+//
+// Sockets connect to numeric addresses and localhost only, getaddrinfo()
+// in this process is the one from syscalls.cc. Pepper files live under the
+// root directory given to Init(). The host resolver reports itself
+// unavailable.
+class PepperHost {
+ public:
+  // Create the module, the calling thread becomes the main thread.
+  static void Init(const char* root);
+  // Run tasks and I/O until Quit() is called from any thread.
+  static void Run();
+  static void Quit();
+  // Drop |percent| of the UDP datagrams sent and received, both ways alike.
+  // Called before Run().
+  static void SetUdpLoss(int percent);
+};
+
+// Linux calls made with syscall(). syscalls.cc replaces the libc ones in
+// this process, so the stand-ins and the benchmark's own sockets use these.
+// They return -1 and set errno on failure like libc.
+class RawIo {
+ public:
+  static int Socket(int domain, int type, int protocol);
+  static int Connect(int fd, const sockaddr* addr, socklen_t addrlen);
+  static int Bind(int fd, const sockaddr* addr, socklen_t addrlen);
+  static int Listen(int fd, int backlog);
+  static int Accept(int fd);
+  static int GetSockName(int fd, sockaddr* addr, socklen_t* addrlen);
+  static int GetSockOpt(int fd, int level, int optname, void* optval,
+                        socklen_t* optlen);
+  static int SetSockOpt(int fd, int level, int optname, const void* optval,
+                        socklen_t optlen);
+  static int SetNonBlocking(int fd);
+  static ssize_t Read(int fd, void* buf, size_t count);
+  static ssize_t Write(int fd, const void* buf, size_t count);
+  static int Close(int fd);
+
+  // Loopback TCP socket bound to an ephemeral port, returns the fd and
+  // stores the port. Listens if |backlog| is positive.
+  static int BindLoopback(int backlog, uint16_t* port);
+  static int ConnectLoopback(uint16_t port);
+};
+
+#endif  // PEPPER_HOST_H
@@ -0,0 +1,1279 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Runs ssh_main with the plugin's FileSystem and syscalls.cc on Linux
+// against a local sshd, see pepper_host.h for what replaces Pepper and the
+// JS side. The key is read from <home>/.ssh/id_rsa like ~/.ssh/id_rsa in
+// the plugin, so it must be unencrypted and in sshd's authorized_keys.
+//
+// Each scenario runs once per cipher, MAC and compression setting:
+//   bulk      terminal output of "head -c N /dev/zero" through a pty
+//   echo      keys sent one at a time and echoed by the remote pty
+//   upload    stdin to "head -c N > /dev/null", like scp to the host
+//   download  "head -c N /dev/zero" without a pty, like scp from the host
+//   forward   N connections to a -R forwarded port, each reading bytes
+//             served by a local socket through ssh
+//   idle      "sleep N" with a keepalive every second, select() wakeups
+//             per minute are printed on the next line, only run when given
+//             with -s
+//   mosh      keys sent one at a time to a shell in a mosh session started
+//             by ssh like the plugin does, mosh-server must be installed on
+//             the host. Latency is the time until the echo of the key is
+//             acknowledged, when a predicted key would be confirmed. -L
+//             drops some of the UDP datagrams both ways. Only run when
+//             given with -s
+//   hostfile  known_hosts lookups of one host among N hashed entries, like
+//             ssh does when it connects, without a connection. The first
+//             lookup and one after an entry is appended are printed on the
+//             next line. Runs once before the other scenarios, only when
+//             given with -s
+//   proxy     connections through stand-in HTTP and SOCKS5 proxies on
+//             loopback with replies split over several reads, wrong
+//             credentials and replies cut short, checked like tests.
+//             Latency is the time connect() takes. Runs once before the
+//             other scenarios, only when given with -s
+// Throughput counts the payload from the first to the last byte. CPU is
+// given per payload byte, per key for echo, per lookup for hostfile or per
+// select() call for idle, for the ssh thread and the Pepper main thread and
+// includes the handshake.
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+#include <resolv.h>
+
+#include "file_system.h"
+#include "known_hosts_index.h"
+#include "mont_exp.h"
+#include "mosh_client.h"
+#include "pepper_host.h"
+#include "ppapi/cpp/completion_callback.h"
+#include "ppapi/cpp/module.h"
+#include "ppapi/utility/completion_callback_factory.h"
+#include "pthread_helpers.h"
+
+extern "C" int ssh_main(int ac, const char **av);
+extern "C" void ssh_reset_globals();
+
+namespace {
+
+const size_t kWriteWindow = 64 * 1024;
+const size_t kChunkSize = 256 * 1024;
+const int64_t kConnectTimeoutUsec = 10 * 1000 * 1000;
+
+int64_t GetTimeUsec() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+uint64_t GetCpuNsec(clockid_t clock) {
+  timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void Sleep(int64_t usec) {
+  timespec ts = { time_t(usec / 1000000), long(usec % 1000000 * 1000) };
+  nanosleep(&ts, NULL);
+}
+
+std::vector<std::string> Split(const std::string& list) {
+  std::vector<std::string> items;
+  size_t start = 0;
+  while (start <= list.size()) {
+    size_t end = list.find(',', start);
+    if (end == std::string::npos)
+      end = list.size();
+    if (end > start)
+      items.push_back(list.substr(start, end - start));
+    start = end + 1;
+  }
+  return items;
+}
+
+std::string ToString(uint64_t value) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%llu", (unsigned long long)value);
+  return buf;
+}
+
+// Stands in for the JS side of the plugin: stdout is counted and
+// acknowledged right away, stdin is what the scenario types.
+class BenchOutput : public OutputInterface {
+ public:
+  BenchOutput() : factory_(this), typed_(0), echoed_(0) {
+    memset(streams_, 0, sizeof(streams_));
+    memset(written_, 0, sizeof(written_));
+    StartSession();
+  }
+
+  // Clears the counters of the previous session.
+  void StartSession() {
+    Mutex::Lock lock(mutex_);
+    input_.clear();
+    stdout_bytes_ = 0;
+    first_output_usec_ = 0;
+    last_output_usec_ = 0;
+    exited_ = false;
+    exit_code_ = 0;
+    ssh_cpu_nsec_ = 0;
+  }
+
+  // Sends |keys| to stdin from the main thread, like the terminal does.
+  void Type(const std::string& keys) {
+    {
+      Mutex::Lock lock(mutex_);
+      input_ += keys;
+    }
+    pp::Module::Get()->core()->CallOnMainThread(
+        0, factory_.NewCallback(&BenchOutput::Feed));
+  }
+
+  // True while typed input hasn't been read by ssh.
+  bool IsInputPending() {
+    {
+      Mutex::Lock lock(mutex_);
+      if (!input_.empty())
+        return true;
+    }
+    FileSystem* sys = FileSystem::GetFileSystem();
+    Mutex::Lock lock(sys->mutex());
+    FileStream* stream = dynamic_cast<FileStream*>(streams_[0]);
+    return stream && stream->is_read_ready();
+  }
+
+  // Waits until |bytes| were written to stdout or ssh exited, returns the
+  // time of the last write.
+  int64_t WaitForOutput(uint64_t bytes) {
+    Mutex::Lock lock(mutex_);
+    while (stdout_bytes_ < bytes && !exited_)
+      cond_.wait(mutex_);
+    return last_output_usec_;
+  }
+
+  // Waits until the echo of all input so far is acknowledged or the
+  // session ended, returns false then.
+  bool WaitForEchoAck() {
+    Mutex::Lock lock(mutex_);
+    while ((echoed_ < typed_ || !input_.empty()) && !exited_)
+      cond_.wait(mutex_);
+    return echoed_ >= typed_ && input_.empty();
+  }
+
+  void WaitForExit() {
+    Mutex::Lock lock(mutex_);
+    while (!exited_)
+      cond_.wait(mutex_);
+  }
+
+  uint64_t stdout_bytes() {
+    Mutex::Lock lock(mutex_);
+    return stdout_bytes_;
+  }
+  int64_t first_output_usec() {
+    Mutex::Lock lock(mutex_);
+    return first_output_usec_;
+  }
+  int64_t last_output_usec() {
+    Mutex::Lock lock(mutex_);
+    return last_output_usec_;
+  }
+  bool exited() {
+    Mutex::Lock lock(mutex_);
+    return exited_;
+  }
+  int exit_code() {
+    Mutex::Lock lock(mutex_);
+    return exit_code_;
+  }
+  uint64_t ssh_cpu_nsec() {
+    Mutex::Lock lock(mutex_);
+    return ssh_cpu_nsec_;
+  }
+
+  virtual bool OpenFile(int fd, const char* name, int mode,
+                        InputInterface* stream) {
+    // Only stdio, opened by FileSystem.
+    if (name || fd < 0 || fd > 2)
+      return false;
+    streams_[fd] = stream;
+    return true;
+  }
+
+  virtual bool OpenSocket(int fd, const char* host, uint16_t port,
+                          InputInterface* stream) {
+    return false;
+  }
+
+  virtual bool Write(int fd, const char* data, size_t size) {
+    if (fd < 0 || fd > 2)
+      return false;
+    if (fd == 2) {
+      RawIo::Write(2, data, size);
+    } else if (fd == 1) {
+      Mutex::Lock lock(mutex_);
+      last_output_usec_ = GetTimeUsec();
+      if (!stdout_bytes_)
+        first_output_usec_ = last_output_usec_;
+      stdout_bytes_ += size;
+      cond_.broadcast();
+    }
+    written_[fd] += size;
+    pp::Module::Get()->core()->CallOnMainThread(0, factory_.NewCallback(
+        &BenchOutput::Acknowledge, fd, written_[fd]));
+    return true;
+  }
+
+  virtual bool WriteImage(int fd, const InlineImage& image) {
+    return true;
+  }
+
+  // Input is pushed by Type().
+  virtual bool Read(int fd, size_t size) {
+    return true;
+  }
+
+  virtual bool Close(int fd) {
+    return false;
+  }
+
+  virtual size_t GetWriteWindow() {
+    return kWriteWindow;
+  }
+
+  // Called on the ssh thread when the session ends.
+  virtual void SendExitCode(int error) {
+    uint64_t cpu = GetCpuNsec(CLOCK_THREAD_CPUTIME_ID);
+    Mutex::Lock lock(mutex_);
+    exit_code_ = error;
+    ssh_cpu_nsec_ = cpu;
+    exited_ = true;
+    cond_.broadcast();
+  }
+
+  virtual void SendTriggerMatches(const std::vector<TriggerMatch>& matches) {
+  }
+
+  // Output is counted when written, so the acknowledgement applies now.
+  virtual void SendEchoAck(uint64_t output_offset, uint64_t input_offset,
+                           int rtt_ms) {
+    Mutex::Lock lock(mutex_);
+    echoed_ = std::max(echoed_, input_offset);
+    cond_.broadcast();
+  }
+
+ private:
+  void Feed(int32_t result) {
+    std::string input;
+    {
+      Mutex::Lock lock(mutex_);
+      input.swap(input_);
+      typed_ += input.size();
+    }
+    if (!input.empty() && streams_[0])
+      streams_[0]->OnRead(input.data(), input.size());
+  }
+
+  void Acknowledge(int32_t result, int fd, uint64_t count) {
+    streams_[fd]->OnWriteAcknowledge(count);
+  }
+
+  pp::CompletionCallbackFactory<BenchOutput> factory_;
+  // Set before the first session.
+  InputInterface* streams_[3];
+  // Used on the main thread only.
+  uint64_t written_[3];
+
+  Mutex mutex_;
+  Cond cond_;
+  std::string input_;
+  // Stdin bytes given to ssh and mosh in all sessions so far, input offsets
+  // in echo acknowledgements count the same way.
+  uint64_t typed_;
+  uint64_t echoed_;
+  uint64_t stdout_bytes_;
+  int64_t first_output_usec_;
+  int64_t last_output_usec_;
+  bool exited_;
+  int exit_code_;
+  uint64_t ssh_cpu_nsec_;
+};
+
+BenchOutput* g_output = NULL;
+pthread_t g_main_thread;
+int g_status = 0;
+
+struct Config {
+  Config()
+      : port("22"), home("/tmp/ssh_bench"),
+        ciphers("aes128-ctr,aes256-ctr,aes128-cbc,arcfour256"),
+        macs("hmac-sha1,umac-64@openssh.com,hmac-sha2-256"),
+        compression("no,yes"),
+        scenarios("bulk,echo,upload,download,forward"),
+        bulk_bytes(1ULL << 30), transfer_bytes(256ULL << 20), keys(200),
+        channels(8), channel_bytes(32ULL << 20), idle_seconds(60),
+        udp_loss(0), mosh_server("mosh-server"), known_hosts(10000) {}
+
+  std::string port;
+  std::string home;
+  std::string ciphers;
+  std::string macs;
+  std::string compression;
+  std::string scenarios;
+  std::string destination;
+  uint64_t bulk_bytes;
+  uint64_t transfer_bytes;
+  int keys;
+  int channels;
+  uint64_t channel_bytes;
+  int idle_seconds;
+  int udp_loss;
+  std::string mosh_server;
+  int known_hosts;
+};
+
+struct Result {
+  Result() : status(-1), bytes(0), usec(0), ssh_cpu_nsec(0),
+             main_cpu_nsec(0), has_wakeups(false), first_lookup_usec(0),
+             append_lookup_usec(0) {}
+
+  int status;
+  uint64_t bytes;
+  int64_t usec;
+  uint64_t ssh_cpu_nsec;
+  uint64_t main_cpu_nsec;
+  std::vector<int64_t> latencies;
+  // Counted during the session for idle.
+  bool has_wakeups;
+  FileSystem::WakeupStats wakeups;
+  // Set for hostfile.
+  int64_t first_lookup_usec;
+  int64_t append_lookup_usec;
+};
+
+// One ssh_main run, the same steps the plugin takes for a session.
+class Session {
+ public:
+  Session(const std::vector<std::string>& args, bool raw_stdin)
+      : args_(args), raw_stdin_(raw_stdin), use_mosh_(false),
+        mosh_client_(NULL) {
+    pthread_getcpuclockid(g_main_thread, &main_clock_);
+  }
+
+  ~Session() {
+    delete mosh_client_;
+  }
+
+  // ssh only starts mosh-server and the session goes on in the mosh client,
+  // like startSession with mosh arguments in the plugin.
+  void UseMosh(const MoshClient::Params& params) {
+    use_mosh_ = true;
+    mosh_params_ = params;
+  }
+
+  void Start() {
+    FileSystem* sys = FileSystem::GetFileSystem();
+    sys->MarkSessionStart();
+    // The profile would skip round trips after the first run.
+    sys->UseHostProfile(false);
+    g_output->StartSession();
+    if (use_mosh_) {
+      FileStream* input;
+      FileStream* output;
+      sys->UsePipesForStdio(&input, &output);
+      mosh_client_ = new MoshClient(output);
+      input->release();
+      output->release();
+      sys->HoldExit(true);
+      if (!mosh_client_->Start(mosh_params_))
+        sys->HoldExit(false);
+    }
+    main_cpu_start_ = GetCpuNsec(main_clock_);
+    pthread_create(&thread_, NULL, &Session::Thread, this);
+  }
+
+  // Waits for ssh_main to return and fills in the CPU use.
+  void Finish(Result* result) {
+    g_output->WaitForExit();
+    pthread_join(thread_, NULL);
+    result->status = g_output->exit_code();
+    result->ssh_cpu_nsec = g_output->ssh_cpu_nsec();
+    result->main_cpu_nsec = GetCpuNsec(main_clock_) - main_cpu_start_;
+  }
+
+ private:
+  static void* Thread(void* arg) {
+    Session* session = static_cast<Session*>(arg);
+    // ssh puts the terminal in raw mode only when it allocates a pty.
+    if (session->raw_stdin_) {
+      termios tio;
+      tcgetattr(0, &tio);
+      cfmakeraw(&tio);
+      tcsetattr(0, TCSANOW, &tio);
+    }
+
+    std::vector<const char*> argv;
+    argv.push_back("ssh");
+    for (size_t i = 0; i < session->args_.size(); i++)
+      argv.push_back(session->args_[i].c_str());
+
+    // exit() from ssh resets the file system and reports the status.
+    ssh_reset_globals();
+    FileSystem* sys = FileSystem::GetFileSystem();
+    bool exited;
+    int status = sys->RunMain(&ssh_main, argv.size(), &argv[0], &exited);
+    if (exited)
+      return NULL;
+    if (sys->is_exit_held()) {
+      // Mosh client reports the exit code when the session ends.
+      sys->exit(status);
+      return NULL;
+    }
+    if (sys->is_reusable())
+      sys->Reset();
+    g_output->SendExitCode(status);
+    return NULL;
+  }
+
+  std::vector<std::string> args_;
+  bool raw_stdin_;
+  bool use_mosh_;
+  MoshClient::Params mosh_params_;
+  // Deleted once the session ended, its thread only exits then.
+  MoshClient* mosh_client_;
+  pthread_t thread_;
+  clockid_t main_clock_;
+  uint64_t main_cpu_start_;
+};
+
+std::vector<std::string> MakeArgs(const std::vector<std::string>& options,
+                                  const Config& config,
+                                  const std::string& command) {
+  std::vector<std::string> args(options);
+  args.push_back(config.destination);
+  args.push_back(command);
+  return args;
+}
+
+Result RunOutput(const std::vector<std::string>& options,
+                 const Config& config, const char* flag, uint64_t bytes) {
+  std::vector<std::string> args(options);
+  args.push_back(flag);
+  Session session(MakeArgs(args, config,
+                           "head -c " + ToString(bytes) + " /dev/zero"),
+                  false);
+  session.Start();
+  Result result;
+  session.Finish(&result);
+  result.bytes = g_output->stdout_bytes();
+  result.usec = g_output->last_output_usec() - g_output->first_output_usec();
+  return result;
+}
+
+Result RunBulk(const std::vector<std::string>& options,
+               const Config& config) {
+  return RunOutput(options, config, "-tt", config.bulk_bytes);
+}
+
+Result RunDownload(const std::vector<std::string>& options,
+                   const Config& config) {
+  return RunOutput(options, config, "-T", config.transfer_bytes);
+}
+
+Result RunEcho(const std::vector<std::string>& options,
+               const Config& config) {
+  std::vector<std::string> args(options);
+  args.push_back("-tt");
+  // The pty echoes every key as soon as it arrives.
+  Session session(MakeArgs(args, config,
+                           "stty raw && printf R && head -c " +
+                           ToString(config.keys) + " > /dev/null"),
+                  false);
+  session.Start();
+  Result result;
+  g_output->WaitForOutput(1);
+  uint64_t received = g_output->stdout_bytes();
+  for (int i = 0; received && i < config.keys; i++) {
+    int64_t start = GetTimeUsec();
+    g_output->Type("a");
+    int64_t end = g_output->WaitForOutput(received + 1);
+    if (g_output->stdout_bytes() <= received)
+      break;
+    received = g_output->stdout_bytes();
+    result.latencies.push_back(end - start);
+  }
+  session.Finish(&result);
+  result.bytes = result.latencies.size();
+  return result;
+}
+
+Result RunUpload(const std::vector<std::string>& options,
+                 const Config& config) {
+  std::vector<std::string> args(options);
+  args.push_back("-T");
+  Session session(MakeArgs(args, config,
+                           "echo R && head -c " +
+                           ToString(config.transfer_bytes) + " > /dev/null"),
+                  true);
+  session.Start();
+  Result result;
+  // Timing starts when the command runs, the terminal doesn't limit how
+  // much is typed so chunks are sent as ssh reads them.
+  g_output->WaitForOutput(2);
+  int64_t start = GetTimeUsec();
+  std::string chunk(kChunkSize, '\0');
+  uint64_t sent = 0;
+  while (!g_output->exited() && sent < config.transfer_bytes) {
+    if (g_output->IsInputPending()) {
+      Sleep(100);
+      continue;
+    }
+    size_t size = std::min<uint64_t>(chunk.size(),
+                                     config.transfer_bytes - sent);
+    g_output->Type(chunk.substr(0, size));
+    sent += size;
+  }
+  session.Finish(&result);
+  result.bytes = sent;
+  result.usec = GetTimeUsec() - start;
+  return result;
+}
+
+struct ForwardServer {
+  int fd;
+  int channels;
+  uint64_t bytes;
+};
+
+void* SendThread(void* arg) {
+  ForwardServer* server = static_cast<ForwardServer*>(arg);
+  int fd = server->fd;
+  std::vector<char> buf(64 * 1024);
+  uint64_t sent = 0;
+  while (sent < server->bytes) {
+    ssize_t n = RawIo::Write(fd, &buf[0], std::min<uint64_t>(
+        buf.size(), server->bytes - sent));
+    if (n <= 0)
+      break;
+    sent += n;
+  }
+  RawIo::Close(fd);
+  delete server;
+  return NULL;
+}
+
+// Serves |bytes| to each of |channels| connections, ssh connects to it
+// for the forwarded port.
+void* ServerThread(void* arg) {
+  ForwardServer* server = static_cast<ForwardServer*>(arg);
+  std::vector<pthread_t> threads;
+  for (int i = 0; i < server->channels; i++) {
+    int fd = RawIo::Accept(server->fd);
+    if (fd < 0)
+      break;
+    ForwardServer* connection = new ForwardServer(*server);
+    connection->fd = fd;
+    pthread_t thread;
+    if (!pthread_create(&thread, NULL, &SendThread, connection))
+      threads.push_back(thread);
+  }
+  for (size_t i = 0; i < threads.size(); i++)
+    pthread_join(threads[i], NULL);
+  return NULL;
+}
+
+struct ForwardClient {
+  uint16_t port;
+  uint64_t received;
+  int64_t start_usec;
+  int64_t end_usec;
+};
+
+// Connects to the port sshd listens on once the forwarding is set up and
+// reads until the server closes.
+void* ClientThread(void* arg) {
+  ForwardClient* client = static_cast<ForwardClient*>(arg);
+  int64_t deadline = GetTimeUsec() + kConnectTimeoutUsec;
+  int fd;
+  while ((fd = RawIo::ConnectLoopback(client->port)) < 0 &&
+         GetTimeUsec() < deadline) {
+    Sleep(10 * 1000);
+  }
+  if (fd < 0)
+    return NULL;
+  client->start_usec = GetTimeUsec();
+  std::vector<char> buf(64 * 1024);
+  ssize_t n;
+  while ((n = RawIo::Read(fd, &buf[0], buf.size())) > 0)
+    client->received += n;
+  client->end_usec = GetTimeUsec();
+  RawIo::Close(fd);
+  return NULL;
+}
+
+Result RunForward(const std::vector<std::string>& options,
+                  const Config& config) {
+  Result result;
+  uint16_t source_port, remote_port;
+  int source_fd = RawIo::BindLoopback(config.channels, &source_port);
+  // Free port for sshd to listen on.
+  int remote_fd = RawIo::BindLoopback(0, &remote_port);
+  if (source_fd < 0 || remote_fd < 0)
+    return result;
+  RawIo::Close(remote_fd);
+
+  std::vector<std::string> args(options);
+  args.push_back("-T");
+  args.push_back("-R");
+  args.push_back(ToString(remote_port) + ":127.0.0.1:" +
+                 ToString(source_port));
+  // Ends with the byte typed after all channels are done.
+  Session session(MakeArgs(args, config, "head -c 1 > /dev/null"), true);
+  session.Start();
+
+  ForwardServer server = { source_fd, config.channels, config.channel_bytes };
+  pthread_t server_thread;
+  pthread_create(&server_thread, NULL, &ServerThread, &server);
+  std::vector<ForwardClient> clients(config.channels);
+  std::vector<pthread_t> threads(config.channels);
+  for (int i = 0; i < config.channels; i++) {
+    ForwardClient client = { remote_port, 0, 0, 0 };
+    clients[i] = client;
+    pthread_create(&threads[i], NULL, &ClientThread, &clients[i]);
+  }
+  int64_t start = 0, end = 0;
+  for (int i = 0; i < config.channels; i++) {
+    pthread_join(threads[i], NULL);
+    if (!clients[i].start_usec)
+      continue;
+    if (!start || clients[i].start_usec < start)
+      start = clients[i].start_usec;
+    end = std::max(end, clients[i].end_usec);
+    result.bytes += clients[i].received;
+  }
+  result.usec = end - start;
+
+  g_output->Type("x");
+  session.Finish(&result);
+  // Unblocks accept() if some channels never connected.
+  syscall(SYS_shutdown, source_fd, SHUT_RDWR);
+  pthread_join(server_thread, NULL);
+  RawIo::Close(source_fd);
+  return result;
+}
+
+Result RunIdle(const std::vector<std::string>& options,
+               const Config& config) {
+  std::vector<std::string> args(options);
+  args.push_back("-T");
+  args.push_back("-oServerAliveInterval=1");
+  Session session(MakeArgs(args, config,
+                           "sleep " + ToString(config.idle_seconds)),
+                  true);
+  FileSystem* sys = FileSystem::GetFileSystem();
+  FileSystem::WakeupStats start;
+  uint32_t broadcasts, skipped_broadcasts;
+  sys->GetWakeupStats(&start, &broadcasts, &skipped_broadcasts);
+  int64_t start_usec = GetTimeUsec();
+  session.Start();
+  Result result;
+  session.Finish(&result);
+  result.usec = GetTimeUsec() - start_usec;
+  FileSystem::WakeupStats end;
+  sys->GetWakeupStats(&end, &broadcasts, &skipped_broadcasts);
+  result.has_wakeups = true;
+  result.wakeups.select_calls = end.select_calls - start.select_calls;
+  result.wakeups.timer_wakeups = end.timer_wakeups - start.timer_wakeups;
+  result.wakeups.io_wakeups = end.io_wakeups - start.io_wakeups;
+  result.wakeups.signal_wakeups = end.signal_wakeups - start.signal_wakeups;
+  result.wakeups.spurious_wakeups =
+      end.spurious_wakeups - start.spurious_wakeups;
+  result.wakeups.unchanged_notifications =
+      end.unchanged_notifications - start.unchanged_notifications;
+  result.bytes = result.wakeups.select_calls;
+  return result;
+}
+
+Result RunMosh(const std::vector<std::string>& options,
+               const Config& config) {
+  MoshClient::Params params;
+  params.host = config.destination.substr(config.destination.find('@') + 1);
+  params.server = config.mosh_server;
+  // The pty echoes every key, the session ends after the last one.
+  params.command = "sh -c 'stty raw && head -c " + ToString(config.keys) +
+      " > /dev/null'";
+  std::vector<std::string> args(options);
+  args.push_back("-n");
+  args.push_back("-tt");
+  Session session(MakeArgs(args, config,
+                           MoshClient::GetServerCommand(params)),
+                  false);
+  session.UseMosh(params);
+  session.Start();
+  Result result;
+  // The client writes to the terminal once it has the server address.
+  g_output->WaitForOutput(1);
+  for (int i = 0; i < config.keys && !g_output->exited(); i++) {
+    int64_t start = GetTimeUsec();
+    g_output->Type("a");
+    if (!g_output->WaitForEchoAck())
+      break;
+    result.latencies.push_back(GetTimeUsec() - start);
+  }
+  session.Finish(&result);
+  result.bytes = result.latencies.size();
+  return result;
+}
+
+// Hashed known_hosts line for |host| like "ssh-keygen -H" writes it, with
+// a random RSA key.
+std::string MakeHashedEntry(const std::string& host) {
+  unsigned char salt[SHA_DIGEST_LENGTH];
+  RAND_bytes(salt, sizeof(salt));
+  unsigned char hash[EVP_MAX_MD_SIZE];
+  unsigned int hash_len;
+  HMAC(EVP_sha1(), salt, sizeof(salt), (const unsigned char*)host.data(),
+       host.size(), hash, &hash_len);
+  // Size of the public key blob of a 2048 bit RSA key.
+  unsigned char key[279];
+  RAND_bytes(key, sizeof(key));
+  char salt64[64];
+  char hash64[64];
+  char key64[512];
+  b64_ntop(salt, sizeof(salt), salt64, sizeof(salt64));
+  b64_ntop(hash, hash_len, hash64, sizeof(hash64));
+  b64_ntop(key, sizeof(key), key64, sizeof(key64));
+  return std::string("|1|") + salt64 + "|" + hash64 + " ssh-rsa " + key64 +
+      "\n";
+}
+
+// Times one lookup of |host| in |path|, returns false if the view doesn't
+// have exactly |matches| hashed entries.
+bool LookUp(const std::string& path, const std::string& host, int matches,
+            int64_t* usec) {
+  int64_t start = GetTimeUsec();
+  std::string view;
+  if (!KnownHostsIndex(path).BuildView(host, &view))
+    return false;
+  *usec = GetTimeUsec() - start;
+  return std::count(view.begin(), view.end(), '|') == 3 * matches;
+}
+
+Result RunHostFile(const Config& config) {
+  Result result;
+  const std::string path = "/bench_known_hosts";
+  std::string host = "host" + ToString(config.known_hosts / 2) +
+      ".example.com";
+  std::string data;
+  for (int i = 0; i < config.known_hosts; i++)
+    data += MakeHashedEntry("host" + ToString(i) + ".example.com");
+  if (!KnownHostsIndex::WriteFile(path, data) ||
+      !KnownHostsIndex::WriteFile(path + ".idx", "")) {
+    return result;
+  }
+
+  clockid_t main_clock;
+  pthread_getcpuclockid(g_main_thread, &main_clock);
+  if (!LookUp(path, host, 1, &result.first_lookup_usec))
+    return result;
+  uint64_t cpu_start = GetCpuNsec(CLOCK_THREAD_CPUTIME_ID);
+  uint64_t main_cpu_start = GetCpuNsec(main_clock);
+  for (int i = 0; i < config.keys; i++) {
+    int64_t usec;
+    if (!LookUp(path, host, 1, &usec))
+      return result;
+    result.latencies.push_back(usec);
+  }
+  result.ssh_cpu_nsec = GetCpuNsec(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+  result.main_cpu_nsec = GetCpuNsec(main_clock) - main_cpu_start;
+  result.bytes = result.latencies.size();
+
+  // A new host key ssh would add.
+  data += MakeHashedEntry(host);
+  if (!KnownHostsIndex::WriteFile(path, data) ||
+      !LookUp(path, host, 2, &result.append_lookup_usec)) {
+    return result;
+  }
+  result.status = 0;
+  return result;
+}
+
+// What a stand-in proxy reads from the client and writes back, one reply
+// chunk per write() a little apart so the client gets short reads.
+struct ProxyStep {
+  std::string request;
+  std::vector<std::string> reply;
+};
+
+struct ProxyCase {
+  const char* name;
+  ProxyConfig::Type type;
+  const char* username;
+  const char* password;
+  std::vector<ProxyStep> steps;
+  // Result of connect(), errno value if it fails.
+  int error;
+};
+
+struct ProxyServer {
+  int fd;
+  const ProxyCase* test;
+  bool ok;
+};
+
+const char kProxyDestination[] = "dest.example";
+const uint16_t kProxyDestinationPort = 22;
+// What the destination sends first, the client must get it untouched after
+// the proxy reply.
+const char kProxyBanner[] = "SSH-2.0-bench\r\n";
+
+template <size_t N>
+std::string Bytes(const char (&data)[N]) {
+  return std::string(data, N - 1);
+}
+
+ProxyStep MakeProxyStep(const std::string& request, const std::string& reply1,
+                        const std::string& reply2 = "",
+                        const std::string& reply3 = "") {
+  ProxyStep step;
+  step.request = request;
+  step.reply.push_back(reply1);
+  if (!reply2.empty())
+    step.reply.push_back(reply2);
+  if (!reply3.empty())
+    step.reply.push_back(reply3);
+  return step;
+}
+
+std::vector<ProxyCase> MakeProxyCases() {
+  const std::string http_request =
+      "CONNECT dest.example:22 HTTP/1.1\r\nHost: dest.example:22\r\n";
+  const std::string socks_request =
+      Bytes("\x05\x01\x00\x03\x0c") + kProxyDestination + Bytes("\x00\x16");
+  std::vector<ProxyCase> cases;
+  ProxyCase test = { "http", ProxyConfig::HTTP, "", "" };
+  test.steps.push_back(MakeProxyStep(
+      http_request + "\r\n", "HTTP/1.0 200 Connection established\r",
+      "\n\r", std::string("\n") + kProxyBanner));
+  test.error = 0;
+  cases.push_back(test);
+
+  test.name = "http-auth";
+  test.username = "bench";
+  test.password = "secret";
+  test.steps.clear();
+  test.steps.push_back(MakeProxyStep(
+      http_request + "Proxy-Authorization: Basic YmVuY2g6c2VjcmV0\r\n\r\n",
+      "HTTP/1.1 407 Proxy Authentication Required\r\n"
+      "Proxy-Authenticate: Basic realm=\"bench\"\r\n\r\n"));
+  test.error = EACCES;
+  cases.push_back(test);
+
+  test.name = "http-eof";
+  test.username = "";
+  test.password = "";
+  test.steps.clear();
+  test.steps.push_back(MakeProxyStep(http_request + "\r\n",
+                                     "HTTP/1.1 200 OK\r\n"));
+  test.error = ECONNREFUSED;
+  cases.push_back(test);
+
+  test.name = "socks5";
+  test.type = ProxyConfig::SOCKS5;
+  test.steps.clear();
+  test.steps.push_back(MakeProxyStep(Bytes("\x05\x01\x00"), "\x05",
+                                     Bytes("\x00")));
+  test.steps.push_back(MakeProxyStep(
+      socks_request, "\x05", Bytes("\x00\x00\x01\x7f\x00"),
+      Bytes("\x00\x01\x00\x16") + kProxyBanner));
+  test.error = 0;
+  cases.push_back(test);
+
+  test.name = "socks5-auth";
+  test.username = "bench";
+  test.password = "secret";
+  test.steps.clear();
+  test.steps.push_back(MakeProxyStep(Bytes("\x05\x02\x00\x02"),
+                                     "\x05\x02"));
+  test.steps.push_back(MakeProxyStep(
+      Bytes("\x01\x05") + "bench" + Bytes("\x06") + "secret",
+      Bytes("\x01\x00")));
+  test.steps.push_back(MakeProxyStep(
+      socks_request, Bytes("\x05\x00\x00\x03\x04") + "host",
+      Bytes("\x00\x16") + kProxyBanner));
+  test.error = 0;
+  cases.push_back(test);
+
+  test.name = "socks5-badauth";
+  test.password = "wrong";
+  test.steps.clear();
+  test.steps.push_back(MakeProxyStep(Bytes("\x05\x02\x00\x02"),
+                                     "\x05\x02"));
+  test.steps.push_back(MakeProxyStep(
+      Bytes("\x01\x05") + "bench" + Bytes("\x05") + "wrong",
+      Bytes("\x01\x01")));
+  test.error = EACCES;
+  cases.push_back(test);
+
+  test.name = "socks5-eof";
+  test.username = "";
+  test.password = "";
+  test.steps.clear();
+  test.steps.push_back(MakeProxyStep(Bytes("\x05\x01\x00"),
+                                     Bytes("\x05\x00")));
+  test.steps.push_back(MakeProxyStep(socks_request,
+                                     Bytes("\x05\x00\x00\x01\x7f")));
+  test.error = ECONNREFUSED;
+  cases.push_back(test);
+  return cases;
+}
+
+// Serves one connection as scripted by the case and closes it, |ok| is
+// cleared if the client doesn't send what the proxy expects.
+void* ProxyThread(void* arg) {
+  ProxyServer* server = static_cast<ProxyServer*>(arg);
+  int fd = RawIo::Accept(server->fd);
+  if (fd < 0) {
+    server->ok = false;
+    return NULL;
+  }
+  const std::vector<ProxyStep>& steps = server->test->steps;
+  for (size_t i = 0; server->ok && i < steps.size(); i++) {
+    std::string request(steps[i].request.size(), '\0');
+    size_t received = 0;
+    while (received < request.size()) {
+      ssize_t n = RawIo::Read(fd, &request[received],
+                              request.size() - received);
+      if (n <= 0)
+        break;
+      received += n;
+    }
+    if (received < request.size() || request != steps[i].request) {
+      server->ok = false;
+      break;
+    }
+    for (size_t j = 0; j < steps[i].reply.size(); j++) {
+      if (j)
+        Sleep(10 * 1000);
+      const std::string& chunk = steps[i].reply[j];
+      if (RawIo::Write(fd, chunk.data(), chunk.size()) !=
+          ssize_t(chunk.size())) {
+        server->ok = false;
+      }
+    }
+  }
+  RawIo::Close(fd);
+  return NULL;
+}
+
+// Connects the way ssh does with the proxy set, returns the errno value
+// connect() fails with. |data| gets what is read from the tunnel.
+int ConnectThroughProxy(const ProxyConfig& proxy, std::string* data) {
+  FileSystem* sys = FileSystem::GetFileSystem();
+  sys->SetProxy(proxy);
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo* ai;
+  if (sys->getaddrinfo(kProxyDestination,
+                       ToString(kProxyDestinationPort).c_str(), &hints,
+                       &ai)) {
+    return EINVAL;
+  }
+  int fd = sys->socket(AF_INET, SOCK_STREAM, 0);
+  int error = 0;
+  if (sys->connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+    error = errno;
+  } else {
+    char buf[256];
+    size_t nread;
+    while (!sys->read(fd, buf, sizeof(buf), &nread) && nread &&
+           nread != (size_t)-1) {
+      data->append(buf, nread);
+    }
+  }
+  sys->close(fd);
+  sys->freeaddrinfo(ai);
+  return error;
+}
+
+// Connects through stand-in HTTP and SOCKS5 proxies on loopback, each case
+// is one connection. Latency is the time connect() takes.
+Result RunProxy() {
+  Result result;
+  std::vector<ProxyCase> cases = MakeProxyCases();
+  int failed = 0;
+  for (size_t i = 0; i < cases.size(); i++) {
+    const ProxyCase& test = cases[i];
+    uint16_t port;
+    ProxyServer server = { RawIo::BindLoopback(1, &port), &test, true };
+    if (server.fd < 0)
+      return result;
+    pthread_t thread;
+    pthread_create(&thread, NULL, &ProxyThread, &server);
+
+    ProxyConfig proxy;
+    proxy.type = test.type;
+    proxy.host = "127.0.0.1";
+    proxy.port = port;
+    proxy.username = test.username;
+    proxy.password = test.password;
+    std::string data;
+    int64_t start = GetTimeUsec();
+    int error = ConnectThroughProxy(proxy, &data);
+    result.latencies.push_back(GetTimeUsec() - start);
+    pthread_join(thread, NULL);
+    RawIo::Close(server.fd);
+
+    std::string expected = test.error ? "" : kProxyBanner;
+    if (error != test.error || data != expected || !server.ok) {
+      fprintf(stderr, "proxy %s: connect() gave %s, read %d bytes%s\n",
+              test.name, error ? strerror(error) : "success",
+              int(data.size()), server.ok ? "" : ", bad request");
+      failed++;
+    }
+  }
+  result.bytes = result.latencies.size();
+  result.status = failed;
+  return result;
+}
+
+int64_t GetPercentile(const std::vector<int64_t>& sorted, int percent) {
+  if (sorted.empty())
+    return 0;
+  return sorted[std::min(sorted.size() - 1, sorted.size() * percent / 100)];
+}
+
+void PrintResult(const char* scenario, const std::string& cipher,
+                 const std::string& mac, const std::string& compression,
+                 Result* result) {
+  printf("%-9s %-12s %-24s %-4s", scenario, cipher.c_str(), mac.c_str(),
+         compression.c_str());
+  if (result->status) {
+    printf(" failed with status %d\n", result->status);
+    g_status = 1;
+  } else {
+    double bytes = std::max<uint64_t>(result->bytes, 1);
+    if (result->latencies.empty() && !result->has_wakeups) {
+      printf(" %9.1f", result->usec > 0 ?
+             result->bytes / double(result->usec) : 0.0);
+    } else {
+      printf(" %9s", "-");
+    }
+    printf(" %9.2f %9.2f", result->ssh_cpu_nsec / bytes,
+           result->main_cpu_nsec / bytes);
+    std::vector<int64_t>& sorted = result->latencies;
+    std::sort(sorted.begin(), sorted.end());
+    if (!sorted.empty()) {
+      printf(" %7lld %7lld %7lld %7lld", (long long)GetPercentile(sorted, 50),
+             (long long)GetPercentile(sorted, 90),
+             (long long)GetPercentile(sorted, 99), (long long)sorted.back());
+    }
+    printf("\n");
+    if (result->first_lookup_usec) {
+      printf("  first lookup %.1f ms, after append %.1f ms\n",
+             result->first_lookup_usec / 1e3,
+             result->append_lookup_usec / 1e3);
+    }
+    if (result->has_wakeups) {
+      const FileSystem::WakeupStats& wakeups = result->wakeups;
+      double minutes = std::max<int64_t>(result->usec, 1) / 60e6;
+      printf("  wakeups per minute: select %.1f, timer %.1f, io %.1f, "
+             "spurious %.1f, broadcasts avoided %.1f\n",
+             wakeups.select_calls / minutes, wakeups.timer_wakeups / minutes,
+             wakeups.io_wakeups / minutes, wakeups.spurious_wakeups / minutes,
+             wakeups.unchanged_notifications / minutes);
+    }
+  }
+  fflush(stdout);
+}
+
+// Removes |name| from |scenarios|, returns whether it was there.
+bool TakeScenario(const char* name, std::vector<std::string>* scenarios) {
+  std::vector<std::string>::iterator it =
+      std::find(scenarios->begin(), scenarios->end(), name);
+  if (it == scenarios->end())
+    return false;
+  scenarios->erase(it);
+  return true;
+}
+
+void* DriverThread(void* arg) {
+  const Config& config = *static_cast<Config*>(arg);
+
+  // Same warm-up as the plugin, so the first run doesn't pay for it.
+  OpenSSL_add_all_algorithms();
+  ERR_load_crypto_strings();
+  RAND_status();
+  MontExp::Install();
+
+  printf("%-9s %-12s %-24s %-4s %9s %9s %9s %7s %7s %7s %7s\n", "scenario",
+         "cipher", "mac", "comp", "MB/s", "ssh ns/B", "main ns/B", "p50 us",
+         "p90 us", "p99 us", "max us");
+  std::vector<std::string> ciphers = Split(config.ciphers);
+  std::vector<std::string> macs = Split(config.macs);
+  std::vector<std::string> compression = Split(config.compression);
+  std::vector<std::string> scenarios = Split(config.scenarios);
+  // Scenarios without ssh run once.
+  if (TakeScenario("hostfile", &scenarios)) {
+    Result result = RunHostFile(config);
+    PrintResult("hostfile", "-", "-", "-", &result);
+  }
+  if (TakeScenario("proxy", &scenarios)) {
+    Result result = RunProxy();
+    PrintResult("proxy", "-", "-", "-", &result);
+  }
+  for (size_t c = 0; c < ciphers.size(); c++) {
+    for (size_t m = 0; m < macs.size(); m++) {
+      for (size_t z = 0; z < compression.size(); z++) {
+        std::vector<std::string> options;
+        options.push_back("-p");
+        options.push_back(config.port);
+        options.push_back("-c");
+        options.push_back(ciphers[c]);
+        options.push_back("-m");
+        options.push_back(macs[m]);
+        options.push_back("-oCompression=" + compression[z]);
+        options.push_back("-oBatchMode=yes");
+        options.push_back("-oStrictHostKeyChecking=no");
+        options.push_back("-oUserKnownHostsFile=/dev/null");
+        options.push_back("-oLogLevel=ERROR");
+        for (size_t s = 0; s < scenarios.size(); s++) {
+          const std::string& name = scenarios[s];
+          Result result;
+          if (name == "bulk") {
+            result = RunBulk(options, config);
+          } else if (name == "echo") {
+            result = RunEcho(options, config);
+          } else if (name == "upload") {
+            result = RunUpload(options, config);
+          } else if (name == "download") {
+            result = RunDownload(options, config);
+          } else if (name == "forward") {
+            result = RunForward(options, config);
+          } else if (name == "idle") {
+            result = RunIdle(options, config);
+          } else if (name == "mosh") {
+            result = RunMosh(options, config);
+          } else {
+            fprintf(stderr, "unknown scenario %s\n", name.c_str());
+            g_status = 1;
+            continue;
+          }
+          PrintResult(name.c_str(), ciphers[c], macs[m], compression[z],
+                      &result);
+        }
+      }
+    }
+  }
+  PepperHost::Quit();
+  return NULL;
+}
+
+bool ParseArgs(int argc, char* argv[], Config* config) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg[0] != '-') {
+      if (!config->destination.empty())
+        return false;
+      config->destination = arg;
+      continue;
+    }
+    if (i + 1 == argc)
+      return false;
+    const char* value = argv[++i];
+    if (arg == "-p") {
+      config->port = value;
+    } else if (arg == "-H") {
+      config->home = value;
+    } else if (arg == "-c") {
+      config->ciphers = value;
+    } else if (arg == "-m") {
+      config->macs = value;
+    } else if (arg == "-C") {
+      config->compression = value;
+    } else if (arg == "-s") {
+      config->scenarios = value;
+    } else if (arg == "-b") {
+      config->bulk_bytes = strtoull(value, NULL, 0);
+    } else if (arg == "-t") {
+      config->transfer_bytes = strtoull(value, NULL, 0);
+    } else if (arg == "-k") {
+      config->keys = atoi(value);
+    } else if (arg == "-n") {
+      config->channels = atoi(value);
+    } else if (arg == "-z") {
+      config->channel_bytes = strtoull(value, NULL, 0);
+    } else if (arg == "-i") {
+      config->idle_seconds = atoi(value);
+    } else if (arg == "-L") {
+      config->udp_loss = atoi(value);
+    } else if (arg == "-M") {
+      config->mosh_server = value;
+    } else if (arg == "-e") {
+      config->known_hosts = atoi(value);
+    } else {
+      return false;
+    }
+  }
+  // getpwuid() in syscalls.cc has no user name.
+  if (config->destination.empty()) {
+    const char* user = getenv("USER");
+    config->destination = std::string(user ? user : "root") + "@127.0.0.1";
+  }
+  return config->keys > 0 && config->channels > 0 &&
+      config->idle_seconds > 0 && config->udp_loss >= 0 &&
+      config->udp_loss < 100 && config->known_hosts > 0;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  Config config;
+  if (!ParseArgs(argc, argv, &config)) {
+    fprintf(stderr,
+            "usage: %s [-p port] [-H home] [-c ciphers] [-m macs]\n"
+            "    [-C compression] [-s scenarios] [-b bulk bytes]\n"
+            "    [-t transfer bytes] [-k keys] [-n channels]\n"
+            "    [-z channel bytes] [-i idle seconds] [-L UDP loss %%]\n"
+            "    [-M mosh-server] [-e known_hosts entries] [user@host]\n",
+            argv[0]);
+    // exit() is the one from syscalls.cc.
+    syscall(SYS_exit_group, 2);
+  }
+
+  PepperHost::Init(config.home.c_str());
+  PepperHost::SetUdpLoss(config.udp_loss);
+  g_main_thread = pthread_self();
+  BenchOutput output;
+  g_output = &output;
+  FileSystem file_system(NULL, &output);
+  file_system.SetReusable(true);
+
+  pthread_t driver;
+  pthread_create(&driver, NULL, &DriverThread, &config);
+  PepperHost::Run();
+  pthread_join(driver, NULL);
+  fflush(stdout);
+  syscall(SYS_exit_group, g_status);
+  return g_status;
+}
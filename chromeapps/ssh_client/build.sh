@@ -7,6 +7,8 @@ set -x
 
 DEBUG=0
 PNACL=1
+STATIC=0
+PREFER_STATIC=0
 
 CDS_ROOT="https://commondatastorage.googleapis.com"
 SDK_ROOT="$CDS_ROOT/nativeclient-mirror/nacl/nacl_sdk"
@@ -23,8 +25,19 @@ for i in $@; do
       PNACL=0
       ;;
 
+    "--static")
+      PNACL=0
+      STATIC=1
+      ;;
+
+    "--prefer-static")
+      PNACL=0
+      STATIC=1
+      PREFER_STATIC=1
+      ;;
+
     *)
-      echo "usage: $0 [--no-pnacl] [--debug]"
+      echo "usage: $0 [--no-pnacl] [--static] [--prefer-static] [--debug]"
       exit 1
       ;;
   esac
@@ -94,6 +107,8 @@ fi
 
 if [[ $PNACL == 1 ]]; then
   readonly DEFAULT_TARGET=all_newlib
+elif [[ $STATIC == 1 ]]; then
+  readonly DEFAULT_TARGET=all_glibc_static
 else
   readonly DEFAULT_TARGET=all_glibc
 fi
@@ -120,6 +135,22 @@ if [[ $PNACL == 1 ]]; then
   cp -f ../ssh_client_newlib_arm_chrome23.nmf \
     hterm/plugin/arm_23/ssh_client.nmf || exit 1
   cp -f ssh_client_nl_arm_chrome23.nexe hterm/plugin/arm_23 || exit 1
+elif [[ $STATIC == 1 ]]; then
+  # Packaged next to the other builds, html/nassh_plugin_bench.html compares
+  # their startup. nassh loads it on x86 only with --prefer-static.
+  rm -rf hterm/plugin/static
+  mkdir -p hterm/plugin/static
+
+  # Everything is linked in, no runnable-ld.so or shared libraries.
+  cp -f ../ssh_client_static.nmf hterm/plugin/static/ssh_client.nmf || exit 1
+  cp -f ssh_client_static_x86_32.nexe hterm/plugin/static/ || exit 1
+  cp -f ssh_client_static_x86_64.nexe hterm/plugin/static/ || exit 1
+
+  if [[ $PREFER_STATIC == 1 ]]; then
+    sed -i 's/^\(nassh.preferStaticPlugin = \)false;/\1true;/' \
+        hterm/js/nassh.js || exit 1
+    grep -q '^nassh.preferStaticPlugin = true;' hterm/js/nassh.js || exit 1
+  fi
 else
   rm -rf hterm/plugin/nacl
   mkdir -p hterm/plugin/nacl
@@ -0,0 +1,173 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "compression_tuner.h"
+
+#include <algorithm>
+
+#include <sys/time.h>
+
+// Level 0 keeps zlib framing but doesn't search for matches at all, level 1
+// uses the fast match finder, 6 is what openssh starts with.
+const int CompressionTuner::kLevels[kLevelCount] = { 0, 1, 3, 6 };
+const size_t CompressionTuner::kLevelCount;
+const size_t CompressionTuner::kWindowBytes;
+const size_t CompressionTuner::kMinLinkWrite;
+const int CompressionTuner::kProbeInterval;
+
+// Weight of the last measurement in running averages.
+static const double kAverageWeight = 0.5;
+
+static int64_t GetTimeUsec() {
+  timeval tv;
+  gettimeofday(&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void UpdateAverage(double* average, double value, bool first) {
+  if (first)
+    *average = value;
+  else
+    *average += (value - *average) * kAverageWeight;
+}
+
+CompressionTuner* CompressionTuner::GetTuner() {
+  static CompressionTuner tuner;
+  return &tuner;
+}
+
+CompressionTuner::CompressionTuner()
+  : level_index_(kLevelCount - 1), next_level_index_(kLevelCount - 1),
+    probe_index_(0), windows_since_probe_(0), in_bytes_(0), out_bytes_(0),
+    cpu_usec_(0), link_speed_(0) {
+}
+
+void CompressionTuner::BeforeCompress(z_stream* stream, std::string* out) {
+  Mutex::Lock lock(mutex_);
+  if (next_level_index_ == level_index_)
+    return;
+
+  // deflateParams() flushes data compressed with the old level first.
+  Bytef buf[256];
+  stream->next_in = NULL;
+  stream->avail_in = 0;
+  stream->next_out = buf;
+  stream->avail_out = sizeof(buf);
+  int result = deflateParams(stream, kLevels[next_level_index_],
+                             Z_DEFAULT_STRATEGY);
+  out->assign((const char*)buf, sizeof(buf) - stream->avail_out);
+  // Z_BUF_ERROR only means there was nothing to flush.
+  if (result != Z_OK && result != Z_BUF_ERROR) {
+    LOG("CompressionTuner: deflateParams failed %d\n", result);
+    next_level_index_ = level_index_;
+    return;
+  }
+
+  LOG("CompressionTuner: level %d -> %d\n",
+      kLevels[level_index_], kLevels[next_level_index_]);
+  level_index_ = next_level_index_;
+  in_bytes_ = 0;
+  out_bytes_ = 0;
+  cpu_usec_ = 0;
+}
+
+void CompressionTuner::AfterCompress(size_t in_bytes, size_t out_bytes,
+                                     int64_t usec) {
+  Mutex::Lock lock(mutex_);
+  in_bytes_ += in_bytes;
+  out_bytes_ += out_bytes;
+  cpu_usec_ += usec;
+  if (in_bytes_ < kWindowBytes)
+    return;
+
+  LevelStats& stats = stats_[level_index_];
+  bool first = stats.windows == 0;
+  UpdateAverage(&stats.ratio, (double)out_bytes_ / in_bytes_, first);
+  UpdateAverage(&stats.speed,
+                in_bytes_ * 1e6 / std::max(cpu_usec_, (int64_t)1), first);
+  stats.windows++;
+  windows_since_probe_++;
+  in_bytes_ = 0;
+  out_bytes_ = 0;
+  cpu_usec_ = 0;
+
+  SelectLevel();
+}
+
+void CompressionTuner::OnLinkWrite(size_t bytes, int64_t usec) {
+  // Small writes complete as soon as Pepper takes them and say nothing
+  // about the link.
+  if (bytes < kMinLinkWrite || usec <= 0)
+    return;
+
+  Mutex::Lock lock(mutex_);
+  UpdateAverage(&link_speed_, bytes * 1e6 / usec, link_speed_ == 0);
+}
+
+double CompressionTuner::GetThroughput(const LevelStats& stats) {
+  // Packets are compressed and sent one after another, so time per input
+  // byte is the sum of compression and transmission times.
+  return 1 / (1 / stats.speed + stats.ratio / link_speed_);
+}
+
+void CompressionTuner::SelectLevel() {
+  // Until bulk data goes through the link there is nothing to trade.
+  if (link_speed_ == 0)
+    return;
+
+  size_t best = level_index_;
+  for (size_t i = 0; i < kLevelCount; i++) {
+    if (!stats_[i].windows)
+      continue;
+    if (GetThroughput(stats_[i]) > GetThroughput(stats_[best]))
+      best = i;
+  }
+  next_level_index_ = best;
+
+  // Measure every level once, then recheck one of the others from time to
+  // time since data and link both change.
+  for (size_t i = 0; i < kLevelCount; i++) {
+    if (!stats_[i].windows) {
+      next_level_index_ = i;
+      return;
+    }
+  }
+  if (windows_since_probe_ >= kProbeInterval) {
+    windows_since_probe_ = 0;
+    probe_index_ = (probe_index_ + 1) % kLevelCount;
+    if (probe_index_ == best)
+      probe_index_ = (probe_index_ + 1) % kLevelCount;
+    next_level_index_ = probe_index_;
+  }
+}
+
+//------------------------------------------------------------------------------
+
+typedef struct Buffer Buffer;
+
+extern "C" z_stream outgoing_stream;
+extern "C" u_int buffer_len(Buffer* buffer);
+extern "C" void buffer_append(Buffer* buffer, const void* data, u_int len);
+
+// Original openssh function, renamed by openssh-5.9p1.patch.
+extern "C" void buffer_compress_zlib(Buffer* input_buffer,
+                                     Buffer* output_buffer);
+
+extern "C" void buffer_compress(Buffer* input_buffer, Buffer* output_buffer) {
+  CompressionTuner* tuner = CompressionTuner::GetTuner();
+  u_int in_bytes = buffer_len(input_buffer);
+  if (in_bytes == 0)
+    return;
+
+  std::string flush;
+  tuner->BeforeCompress(&outgoing_stream, &flush);
+  if (!flush.empty())
+    buffer_append(output_buffer, flush.data(), flush.size());
+
+  u_int out_start = buffer_len(output_buffer);
+  int64_t start = GetTimeUsec();
+  buffer_compress_zlib(input_buffer, output_buffer);
+  tuner->AfterCompress(in_bytes, buffer_len(output_buffer) - out_start,
+                       GetTimeUsec() - start);
+}
@@ -0,0 +1,74 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef COMPRESSION_TUNER_H
+#define COMPRESSION_TUNER_H
+
+#include <string>
+
+#include <zlib.h>
+
+#include "pthread_helpers.h"
+
+// Picks zlib level for outgoing ssh packets from measured compression ratio,
+// compressor speed and link throughput. zlib on PNaCl is plain C and level 6
+// is often slower than a LAN link, while on slow links it is a clear win.
+// Level can be changed at any packet boundary without telling the peer, so
+// the negotiated zlib stream is kept and level 0 is used as a bypass.
+class CompressionTuner {
+ public:
+  static CompressionTuner* GetTuner();
+
+  // Called by openssh before compressing every outgoing packet. Switches
+  // |stream| to a better level when it's time to, flush output produced by
+  // the switch is returned in |out|.
+  void BeforeCompress(z_stream* stream, std::string* out);
+  // Called after packet of |in_bytes| is compressed to |out_bytes|.
+  void AfterCompress(size_t in_bytes, size_t out_bytes, int64_t usec);
+
+  // Called by TCPSocket of the ssh connection when Pepper completes write of
+  // |bytes| that took |usec| microseconds.
+  void OnLinkWrite(size_t bytes, int64_t usec);
+
+ private:
+  struct LevelStats {
+    LevelStats() : ratio(0), speed(0), windows(0) {}
+
+    // Output to input size.
+    double ratio;
+    // Input bytes per second.
+    double speed;
+    int windows;
+  };
+
+  CompressionTuner();
+
+  double GetThroughput(const LevelStats& stats);
+  void SelectLevel();
+
+  static const size_t kLevelCount = 4;
+  static const int kLevels[kLevelCount];
+  static const size_t kWindowBytes = 256 * 1024;
+  static const size_t kMinLinkWrite = 16 * 1024;
+  static const int kProbeInterval = 32;
+
+  Mutex mutex_;
+  size_t level_index_;
+  size_t next_level_index_;
+  size_t probe_index_;
+  int windows_since_probe_;
+
+  // Current window.
+  uint64_t in_bytes_;
+  uint64_t out_bytes_;
+  int64_t cpu_usec_;
+
+  LevelStats stats_[kLevelCount];
+  // Bytes per second, 0 until there is enough bulk traffic.
+  double link_speed_;
+
+  DISALLOW_COPY_AND_ASSIGN(CompressionTuner);
+};
+
+#endif  // COMPRESSION_TUNER_H
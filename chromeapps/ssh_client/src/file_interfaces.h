@@ -9,12 +9,15 @@
 #include <fcntl.h>
 #include <sys/dir.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <stdarg.h>
 #include <string.h>
 #include <termios.h>
 #include <unistd.h>
 
+#include <vector>
+
 #include "nacl-mounts/base/nacl_dirent.h"
 
 class FileStream {
@@ -36,6 +39,9 @@ class FileStream {
     memset(out, 0, sizeof(nacl_abi_stat));
     return 0;
   }
+  virtual int ftruncate(nacl_abi_off_t length) {
+    return EINVAL;
+  }
   virtual int getdents(dirent* buf, size_t count, size_t* nread) {
     return ENOTDIR;
   }
@@ -61,6 +67,21 @@ class FileStream {
     return -1;
   }
 
+  // Socket operations, return 0 or errno value. Unknown socket options are
+  // accepted and ignored like on streams that are not sockets at all.
+  virtual int send(const char* buf, size_t count, int flags, size_t* nwrote) {
+    return write(buf, count, nwrote);
+  }
+  virtual int setsockopt(int level, int optname, const void* optval,
+                         socklen_t optlen) {
+    return 0;
+  }
+  virtual int getsockopt(int level, int optname, void* optval,
+                         socklen_t* optlen) {
+    memset(optval, 0, *optlen);
+    return 0;
+  }
+
   virtual bool is_read_ready() {
     return true;
   }
@@ -70,6 +91,13 @@ class FileStream {
   virtual bool is_exception() {
     return false;
   }
+
+  // select() conditions the stream meets as a bit mask, callbacks compare
+  // it before and after a change to skip broadcasts that wake nobody up.
+  int readiness() {
+    return (is_read_ready() ? 1 : 0) | (is_write_ready() ? 2 : 0) |
+        (is_exception() ? 4 : 0);
+  }
 };
 
 class PathHandler {
@@ -93,6 +121,9 @@ class InputInterface {
   virtual void OnClose() = 0;
 };
 
+struct InlineImage;
+struct TriggerMatch;
+
 class OutputInterface {
  public:
   virtual ~OutputInterface() {}
@@ -102,10 +133,16 @@ class OutputInterface {
   virtual bool OpenSocket(int fd, const char* host, uint16_t port,
                           InputInterface* stream) = 0;
   virtual bool Write(int fd, const char* data, size_t size) = 0;
+  virtual bool WriteImage(int fd, const InlineImage& image) = 0;
   virtual bool Read(int fd, size_t size) = 0;
   virtual bool Close(int fd) = 0;
   virtual size_t GetWriteWindow() = 0;
   virtual void SendExitCode(int error) = 0;
+  virtual void SendTriggerMatches(const std::vector<TriggerMatch>& matches) = 0;
+  // Terminal output up to |output_offset| shows the echo of the input up
+  // to |input_offset|.
+  virtual void SendEchoAck(uint64_t output_offset, uint64_t input_offset,
+                           int rtt_ms) = 0;
 };
 
 #endif  // FILE_INTERFACES_H
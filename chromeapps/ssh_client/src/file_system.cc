@@ -4,6 +4,8 @@
 
 #include "file_system.h"
 
+#include <vector>
+
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <netinet/in.h>
@@ -21,6 +23,8 @@
 #include "dev_tty.h"
 #include "js_file.h"
 #include "pepper_file.h"
+#include "pipe_stream.h"
+#include "session_log.h"
 #include "tcp_server_socket.h"
 #include "tcp_socket.h"
 #include "udp_socket.h"
@@ -40,9 +44,24 @@ FileSystem::FileSystem(pp::Instance* instance, OutputInterface* out)
       ppfs_path_handler_(NULL),
       fs_initialized_(false),
       factory_(this),
+      exit_code_acked_(false),
       host_resolver_(NULL),
       first_unused_addr_(kFirstAddr),
       use_js_socket_(false),
+      use_proxy_(false),
+      session_log_(NULL),
+      terminal_input_(NULL),
+      terminal_output_(NULL),
+      use_host_profile_(true),
+      use_fast_auth_(false),
+      session_start_usec_(0),
+      reusable_(false),
+      exit_held_(false),
+      held_exit_(false),
+      held_exit_status_(0),
+      exit_jump_(NULL),
+      main_thread_(),
+      exit_status_(0),
       col_(80), row_(24),
       is_resize_(false),
       handler_sigwinch_(SIG_DFL) {
@@ -63,12 +82,16 @@ FileSystem::FileSystem(pp::Instance* instance, OutputInterface* out)
   if (out->OpenFile(0, NULL, O_RDONLY, stdin_fs)) {
     AddFileStream(0, stdin_fs);
     stdin_fs->OnOpen(true);
+    stdin_fs->addref();
+    terminal_input_ = stdin_fs;
   }
 
   JsFile* stdout_fs = new JsFile(1, O_WRONLY, out);
   if (out->OpenFile(1, NULL, O_WRONLY, stdout_fs)) {
     AddFileStream(1, stdout_fs);
     stdout_fs->OnOpen(true);
+    stdout_fs->addref();
+    terminal_output_ = stdout_fs;
     AddPathHandler("/dev/tty", new DevTtyHandler(stdin_fs, stdout_fs));
   }
 
@@ -98,11 +121,18 @@ FileSystem::FileSystem(pp::Instance* instance, OutputInterface* out)
 }
 
 FileSystem::~FileSystem() {
+  if (session_log_)
+    session_log_->Destroy();
+  if (terminal_input_)
+    terminal_input_->release();
+  if (terminal_output_)
+    terminal_output_->release();
   for (PathHandlerMap::iterator it = paths_.begin(); it != paths_.end(); ++it)
     it->second->release();
   for (FileStreamMap::iterator it = streams_.begin(); it != streams_.end();
        ++it) {
-    it->second->release();
+    if (it->second && it->second != kBadFileStream)
+      it->second->release();
   }
   if (ppfs_path_handler_)
     ppfs_path_handler_->release();
@@ -119,9 +149,164 @@ void FileSystem::OnOpen(int32_t result, pp::FileSystem* fs) {
     delete fs;
   }
   fs_initialized_ = true;
+  if (session_log_)
+    session_log_->SetFileSystem(ppfs_);
   cond_.broadcast();
 }
 
+pp::FileSystem* FileSystem::GetPepperFileSystem() {
+  Mutex::Lock lock(mutex_);
+  while(!fs_initialized_)
+    cond_.wait(mutex_);
+  return ppfs_;
+}
+
+bool FileSystem::TryGetPepperFileSystem(pp::FileSystem** fs) {
+  Mutex::Lock lock(mutex_);
+  *fs = ppfs_;
+  return fs_initialized_;
+}
+
+void FileSystem::UsePipesForStdio(FileStream** input, FileStream** output) {
+  Mutex::Lock lock(mutex_);
+  PipeStream* stdin_read;
+  PipeStream* stdin_write;
+  PipeStream::CreatePipe(0, 0, &stdin_read, &stdin_write);
+  PipeStream* stdout_read;
+  PipeStream* stdout_write;
+  PipeStream::CreatePipe(1, 1, &stdout_read, &stdout_write);
+
+  // Terminal streams are still referenced by /dev/tty handler.
+  for (int fd = 0; fd <= 1; fd++) {
+    FileStream* stream = GetStream(fd);
+    if (stream && stream != kBadFileStream)
+      stream->release();
+  }
+  streams_[0] = stdin_read;
+  streams_[1] = stdout_write;
+  *input = stdin_write;
+  *output = stdout_read;
+}
+
+void FileSystem::SetSessionLog(SessionLog* log) {
+  Mutex::Lock lock(mutex_);
+  if (session_log_)
+    session_log_->Destroy();
+  session_log_ = log;
+}
+
+void FileSystem::MarkSessionStart() {
+  Mutex::Lock lock(mutex_);
+  timeval tv;
+  gettimeofday(&tv, NULL);
+  session_start_usec_ = tv.tv_sec * kMicrosecondsPerSecond + tv.tv_usec;
+}
+
+void FileSystem::QueueZmodemUpload(const std::vector<std::string>& paths) {
+  Mutex::Lock lock(mutex_);
+  zmodem_.QueueUpload(paths);
+}
+
+bool FileSystem::SetTriggers(const std::vector<std::string>& patterns,
+                             std::string* error) {
+  Mutex::Lock lock(mutex_);
+  return triggers_.SetPatterns(patterns, error);
+}
+
+uint64_t FileSystem::GetTerminalInputOffset() {
+  Mutex::Lock lock(mutex_);
+  return terminal_input_ ? terminal_input_->input_offset() : 0;
+}
+
+void FileSystem::SendEchoAck(uint64_t input_offset, int rtt_ms) {
+  Mutex::Lock lock(mutex_);
+  if (terminal_output_) {
+    output_->SendEchoAck(terminal_output_->output_offset(), input_offset,
+                         rtt_ms);
+  }
+}
+
+void FileSystem::UseHostProfile(bool use_profile) {
+  Mutex::Lock lock(mutex_);
+  use_host_profile_ = use_profile;
+}
+
+void FileSystem::UseFastAuth(bool fast_auth) {
+  Mutex::Lock lock(mutex_);
+  use_fast_auth_ = fast_auth;
+}
+
+void FileSystem::SetReusable(bool reusable) {
+  Mutex::Lock lock(mutex_);
+  reusable_ = reusable;
+}
+
+void FileSystem::HoldExit(bool hold) {
+  Mutex::Lock lock(mutex_);
+  exit_held_ = hold;
+  if (hold) {
+    held_exit_ = false;
+    held_exit_status_ = 0;
+  }
+}
+
+bool FileSystem::is_exit_held() {
+  Mutex::Lock lock(mutex_);
+  return exit_held_;
+}
+
+void FileSystem::Reset() {
+  // Writer thread needs the main thread to flush the log.
+  if (session_log_)
+    session_log_->Stop();
+
+  std::vector<int> fds;
+  {
+    Mutex::Lock lock(mutex_);
+    for (FileStreamMap::iterator it = streams_.begin(); it != streams_.end();
+         ++it) {
+      if (it->first > 2)
+        fds.push_back(it->first);
+    }
+  }
+  for (size_t i = 0; i < fds.size(); i++)
+    close(fds[i]);
+
+  Mutex::Lock lock(mutex_);
+  WaitForPendingCloses(0);
+  // Stdio goes back to the terminal if a mosh session put pipes there.
+  JsFile* terminal[] = { terminal_input_, terminal_output_ };
+  for (int fd = 0; fd <= 1; fd++) {
+    FileStream* stream = GetStream(fd);
+    if (!terminal[fd] || !stream || stream == kBadFileStream ||
+        stream == terminal[fd]) {
+      continue;
+    }
+    stream->release();
+    terminal[fd]->addref();
+    streams_[fd] = terminal[fd];
+  }
+  socket_types_.clear();
+  socket_flags_.clear();
+  socket_options_.clear();
+  if (session_log_)
+    session_log_->Destroy();
+  session_log_ = NULL;
+  use_js_socket_ = false;
+  proxy_ = ProxyConfig();
+  use_proxy_ = false;
+  zmodem_.Reset();
+  triggers_.Reset();
+  host_profile_.Reset();
+  use_host_profile_ = true;
+  use_fast_auth_ = false;
+  session_start_usec_ = 0;
+  exit_code_acked_ = false;
+  is_resize_ = false;
+  handler_sigwinch_ = SIG_DFL;
+  JsFile::InitTerminal();
+}
+
 FileSystem* FileSystem::GetFileSystem() {
   assert(file_system_);
   return FileSystem::GetFileSystemNoCrash();
@@ -132,10 +317,19 @@ FileSystem* FileSystem::GetFileSystemNoCrash() {
 }
 
 void FileSystem::AddPathHandler(const std::string& path, PathHandler* handler) {
+  Mutex::Lock lock(mutex_);
   assert(paths_.find(path) == paths_.end());
   paths_[path] = handler;
 }
 
+void FileSystem::RemovePathHandler(const std::string& path) {
+  Mutex::Lock lock(mutex_);
+  PathHandlerMap::iterator it = paths_.find(path);
+  assert(it != paths_.end());
+  it->second->release();
+  paths_.erase(it);
+}
+
 void FileSystem::AddFileStream(int fd, FileStream* stream) {
   assert(streams_.find(fd) == streams_.end() || !streams_.find(fd)->second);
   streams_[fd] = stream;
@@ -193,34 +387,51 @@ int FileSystem::open(const char* pathname, int oflag, mode_t cmode,
 
 int FileSystem::close(int fd) {
   Mutex::Lock lock(mutex_);
-  if (!IsKnowDescriptor(fd))
+  WaitForPendingCloses(kMaxPendingCloses - 1);
+  if (!IsKnowDescriptor(fd) || GetStream(fd) == kBadFileStream)
     return EBADF;
 
+  // The stream flushes what it has buffered and closes in the background.
+  // Its descriptor stays reserved until then, see AddPendingClose().
   FileStream* stream = GetStream(fd);
-  if (stream && stream != kBadFileStream) {
+  RemoveFileStream(fd);
+  if (stream) {
     stream->close();
     stream->release();
   }
-  RemoveFileStream(fd);
+  if (closing_fds_.find(fd) != closing_fds_.end())
+    AddFileStream(fd, kBadFileStream);
   return 0;
 }
 
 int FileSystem::read(int fd, char* buf, size_t count, size_t* nread) {
   Mutex::Lock lock(mutex_);
   FileStream* stream = GetStream(fd);
-  if (stream && stream != kBadFileStream)
-    return stream->read(buf, count, nread);
-  else
+  if (stream && stream != kBadFileStream) {
+    int result = stream->read(buf, count, nread);
+    if (!result && host_profile_.is_connection(fd) && *nread != (size_t)-1)
+      host_profile_.OnReceived(buf, *nread);
+    return result;
+  } else {
     return EBADF;
+  }
 }
 
 int FileSystem::write(int fd, const char* buf, size_t count, size_t* nwrote) {
   Mutex::Lock lock(mutex_);
   FileStream* stream = GetStream(fd);
-  if (stream && stream != kBadFileStream)
-    return stream->write(buf, count, nwrote);
-  else
+  if (stream && stream != kBadFileStream) {
+    int result = stream->write(buf, count, nwrote);
+    if (!result && host_profile_.is_counting()) {
+      if (host_profile_.is_connection(fd))
+        host_profile_.OnSent(*nwrote);
+      else if (fd == 1)
+        host_profile_.OnSessionOutput();
+    }
+    return result;
+  } else {
     return EBADF;
+  }
 }
 
 int FileSystem::seek(int fd, nacl_abi_off_t offset, int whence,
@@ -259,12 +470,12 @@ int FileSystem::dup2(int fd, int newfd) {
     return EBADF;
 
   FileStream* new_stream = GetStream(newfd);
-  if (stream == kBadFileStream) {
-    return EBADF;
-  } else if (!new_stream) {
+  if (new_stream == kBadFileStream)
+    return EBUSY;  // Still closing.
+  if (new_stream) {
+    RemoveFileStream(newfd);
     new_stream->close();
     new_stream->release();
-    RemoveFileStream(newfd);
   }
 
   AddFileStream(newfd, NULL);
@@ -285,6 +496,15 @@ int FileSystem::fstat(int fd, nacl_abi_stat* out) {
     return EBADF;
 }
 
+int FileSystem::ftruncate(int fd, nacl_abi_off_t length) {
+  Mutex::Lock lock(mutex_);
+  FileStream* stream = GetStream(fd);
+  if (stream && stream != kBadFileStream)
+    return stream->ftruncate(length);
+  else
+    return EBADF;
+}
+
 int FileSystem::stat(const char *pathname, nacl_abi_stat* out) {
   Mutex::Lock lock(mutex_);
   PathHandlerMap::iterator it = paths_.find(pathname);
@@ -343,8 +563,14 @@ int FileSystem::fcntl(int fd, int cmd, va_list ap) {
   FileStream* stream = GetStream(fd);
   if (stream && stream != kBadFileStream) {
     return stream->fcntl(cmd, ap);
-  } else if (IsKnowDescriptor(fd)) {
-    // Socket with reserved FD but not allocated yet, for now just ignore.
+  } else if (!stream && IsKnowDescriptor(fd)) {
+    // Socket with reserved FD but not allocated yet, keep the flags for
+    // connect().
+    if (cmd == F_GETFL) {
+      return socket_flags_[fd] | O_RDWR;
+    } else if (cmd == F_SETFL) {
+      socket_flags_[fd] = va_arg(ap, long) & O_NONBLOCK;
+    }
     return 0;
   } else {
     errno = EBADF;
@@ -405,34 +631,53 @@ int FileSystem::select(int nfds, fd_set* readfds, fd_set* writefds,
     gettimeofday(&tv_now, NULL);
     int64_t current_time_us =
         tv_now.tv_sec * kMicrosecondsPerSecond + tv_now.tv_usec;
-    int64_t wakeup_time_us =
-        current_time_us +
+    int64_t timeout_us =
         timeout->tv_sec * kMicrosecondsPerSecond + timeout->tv_usec;
+    int64_t wakeup_time_us = current_time_us + timeout_us;
+    if (timeout_us >= kCoalesceMinTimeoutUs) {
+      wakeup_time_us = (wakeup_time_us + kTimerSlackUs - 1) /
+          kTimerSlackUs * kTimerSlackUs;
+    }
      ts_abs.tv_sec = wakeup_time_us / kMicrosecondsPerSecond;
      ts_abs.tv_nsec =
         (wakeup_time_us - ts_abs.tv_sec * kMicrosecondsPerSecond) *
         kNanosecondsPerMicrosecond;
   }
 
+  wakeup_stats_.select_calls++;
+  bool waited = false;
   while(!(IsInterrupted() ||
           IsReady(nfds, readfds, &FileStream::is_read_ready, false) ||
           IsReady(nfds, writefds, &FileStream::is_write_ready, false) ||
           IsReady(nfds, exceptfds, &FileStream::is_exception, false))) {
+    if (timeout && !timeout->tv_sec && !timeout->tv_usec)
+      break;
+
+    if (waited)
+      wakeup_stats_.spurious_wakeups++;
+    waited = true;
     if (timeout) {
-      if (!timeout->tv_sec && !timeout->tv_usec)
+      int result = cond_.timedwait(mutex_, &ts_abs);
+      if (result == ETIMEDOUT) {
+        wakeup_stats_.timer_wakeups++;
+        waited = false;
         break;
-
-      if (cond_.timedwait(mutex_, &ts_abs)) {
-        if (errno == ETIMEDOUT)
-          break;
-        else
-          return -1;
+      } else if (result) {
+        errno = result;
+        return -1;
       }
     } else {
       cond_.wait(mutex_);
     }
   }
 
+  if (waited) {
+    if (IsInterrupted())
+      wakeup_stats_.signal_wakeups++;
+    else
+      wakeup_stats_.io_wakeups++;
+  }
+
   if (IsInterrupted()) {
     is_resize_ = false;
     handler_sigwinch_(SIGWINCH);
@@ -524,6 +769,20 @@ addrinfo* FileSystem::GetFakeAddress(const char* hostname, uint16_t port,
 
 int FileSystem::getaddrinfo(const char* hostname, const char* servname,
     const addrinfo* hints, addrinfo** res) {
+  // First lookup of the session is for the host ssh connects to. Profile
+  // file is read before locking, FileSystem can't do I/O while locked.
+  bool load_profile;
+  bool use_profile;
+  bool fast_auth;
+  {
+    Mutex::Lock lock(mutex_);
+    load_profile = !host_profile_.loaded();
+    use_profile = use_host_profile_;
+    fast_auth = use_fast_auth_;
+  }
+  if (load_profile)
+    host_profile_.Load(hostname, servname, use_profile, fast_auth);
+
   Mutex::Lock lock(mutex_);
   GetAddrInfoParams params;
   params.hostname = hostname;
@@ -535,7 +794,26 @@ int FileSystem::getaddrinfo(const char* hostname, const char* servname,
       &FileSystem::Resolve, &params, &result));
   while(result == PP_OK_COMPLETIONPENDING)
     cond_.wait(mutex_);
-  return result == PP_OK ? 0 : EAI_FAIL;
+  if (result != PP_OK)
+    return EAI_FAIL;
+  if (load_profile)
+    host_profile_.OrderAddresses(res);
+  return 0;
+}
+
+int FileSystem::GetDeferredAddrInfo(const char* hostname,
+    const char* servname, const addrinfo* hints, addrinfo** res) {
+  char* cp;
+  long port = servname ? strtol(servname, &cp, 10) : 0;
+  in6_addr in;
+  if (!hostname || port <= 0 || port > 65535 || *cp != '\0' ||
+      (hints && hints->ai_family == AF_INET6) ||
+      inet_pton(AF_INET, hostname, &in) || inet_pton(AF_INET6, hostname, &in))
+    return getaddrinfo(hostname, servname, hints, res);
+
+  Mutex::Lock lock(mutex_);
+  *res = GetFakeAddress(hostname, htons(port), hints);
+  return 0;
 }
 
 void FileSystem::Resolve(int32_t result, GetAddrInfoParams* params,
@@ -647,8 +925,9 @@ void FileSystem::Resolve(int32_t result, GetAddrInfoParams* params,
     return;
   }
 
-  // In case of JS socket don't use local host resolver.
-  if (!use_js_socket_ && pp::HostResolverPrivate::IsAvailable()) {
+  // In case of JS socket or proxy don't use local host resolver.
+  if (!use_js_socket_ && !use_proxy_ &&
+      pp::HostResolverPrivate::IsAvailable()) {
     PP_HostResolver_Private_Hint hint = { PP_NETADDRESSFAMILY_UNSPECIFIED, 0 };
     if (hints) {
       if (hints->ai_family == AF_INET)
@@ -737,6 +1016,8 @@ int FileSystem::socket(int socket_family, int socket_type, int protocol) {
   Mutex::Lock lock(mutex_);
   int fd = GetFirstUnusedDescriptor();
   socket_types_[fd] = socket_type;
+  socket_flags_.erase(fd);
+  socket_options_.erase(fd);
   if (socket_types_[fd] == SOCK_DGRAM) {
     UDPSocket* socket = new UDPSocket(fd, 0);
     AddFileStream(fd, socket);
@@ -770,6 +1051,18 @@ bool FileSystem::GetHostPort(const sockaddr* serv_addr, socklen_t addrlen,
   return true;
 }
 
+void FileSystem::ApplySocketOptions(int fd, FileStream* stream) {
+  SocketOptionsMap::iterator options = socket_options_.find(fd);
+  if (options == socket_options_.end())
+    return;
+  for (SocketOptionMap::iterator it = options->second.begin();
+       it != options->second.end(); ++it) {
+    stream->setsockopt(it->first.first, it->first.second, &it->second,
+                       sizeof(it->second));
+  }
+  socket_options_.erase(options);
+}
+
 int FileSystem::connect(int fd, const sockaddr* serv_addr, socklen_t addrlen) {
   Mutex::Lock lock(mutex_);
   if (streams_.find(fd) == streams_.end()) {
@@ -784,8 +1077,17 @@ int FileSystem::connect(int fd, const sockaddr* serv_addr, socklen_t addrlen) {
     return -1;
   }
   LOG("FileSystem::connect: [%s] port %d\n", hostname.c_str(), port);
+  if (session_start_usec_) {
+    timeval tv;
+    gettimeofday(&tv, NULL);
+    LOG("FileSystem::connect: %d ms after startSession\n",
+        int((tv.tv_sec * kMicrosecondsPerSecond + tv.tv_usec -
+             session_start_usec_) / 1000));
+    session_start_usec_ = 0;
+  }
 
   FileStream* stream = NULL;
+  bool direct = !use_js_socket_ && !use_proxy_;
   if (use_js_socket_) {
     // Only first socket will use JS proxy, other sockets are created for
     // connections made localhost so use Pepper sockets for them.
@@ -797,8 +1099,37 @@ int FileSystem::connect(int fd, const sockaddr* serv_addr, socklen_t addrlen) {
       return -1;
     }
     stream = socket;
+  } else if (use_proxy_) {
+    // Same as with JS socket, only the ssh connection goes through proxy.
+    use_proxy_ = false;
+    TCPSocket* socket = new TCPSocket(fd, O_RDWR);
+    ApplySocketOptions(fd, socket);
+    if (!socket->connect(proxy_.host.c_str(), proxy_.port)) {
+      errno = ECONNREFUSED;
+      socket->release();
+      return -1;
+    }
+    ProxyClient proxy(proxy_, socket);
+    int result = proxy.Connect(hostname, port);
+    if (result) {
+      socket->close();
+      socket->release();
+      errno = result;
+      return -1;
+    }
+    stream = socket;
+  } else if (socket_flags_[fd] & O_NONBLOCK) {
+    // The result is reported by SO_ERROR once the socket is writable.
+    TCPSocket* socket = new TCPSocket(fd, O_RDWR | O_NONBLOCK);
+    ApplySocketOptions(fd, socket);
+    socket->connect_async(hostname.c_str(), port);
+    AddFileStream(fd, socket);
+    host_profile_.OnConnect(fd, serv_addr, direct);
+    errno = EINPROGRESS;
+    return -1;
   } else {
     TCPSocket* socket = new TCPSocket(fd, O_RDWR);
+    ApplySocketOptions(fd, socket);
     if (!socket->connect(hostname.c_str(), port)) {
       errno = ECONNREFUSED;
       socket->release();
@@ -808,6 +1139,7 @@ int FileSystem::connect(int fd, const sockaddr* serv_addr, socklen_t addrlen) {
   }
 
   AddFileStream(fd, stream);
+  host_profile_.OnConnect(fd, serv_addr, direct);
   return 0;
 }
 
@@ -825,6 +1157,54 @@ int FileSystem::shutdown(int fd, int how) {
   }
 }
 
+int FileSystem::send(int fd, const char* buf, size_t count, int flags,
+                     size_t* nwrote) {
+  Mutex::Lock lock(mutex_);
+  FileStream* stream = GetStream(fd);
+  if (stream && stream != kBadFileStream)
+    return stream->send(buf, count, flags, nwrote);
+  else
+    return EBADF;
+}
+
+int FileSystem::setsockopt(int fd, int level, int optname, const void* optval,
+                           socklen_t optlen) {
+  Mutex::Lock lock(mutex_);
+  FileStream* stream = GetStream(fd);
+  if (stream && stream != kBadFileStream)
+    return stream->setsockopt(level, optname, optval, optlen);
+  if (stream || streams_.find(fd) == streams_.end())
+    return EBADF;
+  // Sockets get their stream on connect() or bind(), the options are set
+  // on it then. Like in FileStream, only int options are known.
+  if (optlen >= sizeof(int)) {
+    socket_options_[fd][std::make_pair(level, optname)] =
+        *static_cast<const int*>(optval);
+  }
+  return 0;
+}
+
+int FileSystem::getsockopt(int fd, int level, int optname, void* optval,
+                           socklen_t* optlen) {
+  Mutex::Lock lock(mutex_);
+  FileStream* stream = GetStream(fd);
+  if (stream && stream != kBadFileStream)
+    return stream->getsockopt(level, optname, optval, optlen);
+  if (stream || streams_.find(fd) == streams_.end())
+    return EBADF;
+  memset(optval, 0, *optlen);
+  SocketOptionsMap::iterator options = socket_options_.find(fd);
+  if (options == socket_options_.end() || *optlen < sizeof(int))
+    return 0;
+  SocketOptionMap::iterator it =
+      options->second.find(std::make_pair(level, optname));
+  if (it != options->second.end()) {
+    *static_cast<int*>(optval) = it->second;
+    *optlen = sizeof(int);
+  }
+  return 0;
+}
+
 int FileSystem::bind(int fd, const sockaddr* addr, socklen_t addrlen) {
   Mutex::Lock lock(mutex_);
   if (streams_.find(fd) == streams_.end() ||
@@ -834,9 +1214,12 @@ int FileSystem::bind(int fd, const sockaddr* addr, socklen_t addrlen) {
   }
 
   switch(socket_types_[fd]) {
-    case SOCK_STREAM:
-      AddFileStream(fd, new TCPServerSocket(fd, 0, addr, addrlen));
+    case SOCK_STREAM: {
+      TCPServerSocket* socket = new TCPServerSocket(fd, 0, addr, addrlen);
+      ApplySocketOptions(fd, socket);
+      AddFileStream(fd, socket);
       return 0;
+    }
 
     case SOCK_DGRAM: {
       UDPSocket* socket = static_cast<UDPSocket*>(GetStream(fd));
@@ -969,12 +1352,91 @@ int FileSystem::sigaction(int signum,
   }
 }
 
-void FileSystem::exit(int status) {
+bool FileSystem::exit(int status) {
+  {
+    // HoldExit(false) can come from the mosh thread at the same time.
+    Mutex::Lock lock(mutex_);
+    if (exit_held_) {
+      held_exit_ = true;
+      held_exit_status_ = status;
+      cond_.broadcast();
+      return true;
+    }
+  }
+
+  if (reusable_) {
+    // Nothing is torn down, so there is no need to wait for ACK.
+    Reset();
+    Mutex::Lock lock(mutex_);
+    output_->SendExitCode(status);
+    return false;
+  }
+
+  // Writer thread needs the main thread to flush the log so don't hold the
+  // lock while waiting for it.
+  if (session_log_)
+    session_log_->Stop();
+
   Mutex::Lock lock(mutex_);
+  // Data written before close() is still being flushed.
+  WaitForPendingCloses(0);
   output_->SendExitCode(status);
   // Wait for the page to ACK it, so we can abort.
   while (!exit_code_acked_)
     cond_.wait(mutex_);
+  return false;
+}
+
+int FileSystem::RunMain(int (*main)(int, const char**), int argc,
+                        const char** argv, bool* exited) {
+  jmp_buf exit_jump;
+  {
+    Mutex::Lock lock(mutex_);
+    assert(!exit_jump_);
+    exit_jump_ = &exit_jump;
+    main_thread_ = pthread_self();
+  }
+  int status;
+  if (!setjmp(exit_jump)) {
+    status = main(argc, argv);
+    *exited = false;
+  } else {
+    // Only openssh C frames are left behind.
+    status = exit_status_;
+    *exited = true;
+  }
+  Mutex::Lock lock(mutex_);
+  exit_jump_ = NULL;
+  return status;
+}
+
+void FileSystem::ReturnFromMain(int status) {
+  jmp_buf* jump = NULL;
+  {
+    Mutex::Lock lock(mutex_);
+    if (exit_jump_ && pthread_equal(main_thread_, pthread_self())) {
+      jump = exit_jump_;
+      exit_status_ = status;
+    }
+  }
+  if (jump)
+    longjmp(*jump, 1);
+  pthread_exit(NULL);
+}
+
+void FileSystem::NotifyIfChanged(FileStream* stream, int readiness) {
+  if (stream->readiness() != readiness)
+    cond_.broadcast();
+  else
+    wakeup_stats_.unchanged_notifications++;
+}
+
+void FileSystem::GetWakeupStats(WakeupStats* stats, uint32_t* broadcasts,
+                                uint32_t* skipped_broadcasts) {
+  Mutex::Lock lock(mutex_);
+  *stats = wakeup_stats_;
+  *broadcasts = cond_.broadcasts();
+  *skipped_broadcasts = cond_.skipped_broadcasts();
 }
 
 void FileSystem::ExitCodeAcked() {
@@ -982,6 +1444,28 @@ void FileSystem::ExitCodeAcked() {
   exit_code_acked_ = true;
 }
 
+void FileSystem::AddPendingClose(int fd) {
+  closing_fds_.insert(fd);
+}
+
+void FileSystem::RemovePendingClose(int fd) {
+  ClosingDescriptors::iterator it = closing_fds_.find(fd);
+  assert(it != closing_fds_.end());
+  closing_fds_.erase(it);
+  if (GetStream(fd) == kBadFileStream &&
+      closing_fds_.find(fd) == closing_fds_.end()) {
+    RemoveFileStream(fd);
+  }
+  cond_.broadcast();
+}
+
+void FileSystem::WaitForPendingCloses(int limit) {
+  if (pp::Module::Get()->core()->IsMainThread())
+    return;
+  while (closing_fds_.size() > (size_t)limit)
+    cond_.wait(mutex_);
+}
+
 void FileSystem::MakeDirectory(int32_t result, const char* pathname,
                                int32_t* pres) {
   Mutex::Lock lock(mutex_);
@@ -1024,6 +1508,12 @@ void FileSystem::UseJsSocket(bool use_js) {
   use_js_socket_ = use_js;
 }
 
+void FileSystem::SetProxy(const ProxyConfig& proxy) {
+  Mutex::Lock lock(mutex_);
+  proxy_ = proxy;
+  use_proxy_ = proxy.type != ProxyConfig::NONE;
+}
+
 bool FileSystem::CreateNetAddress(const sockaddr* saddr, socklen_t addrlen,
                                   PP_NetAddress_Private* addr) {
   if (saddr->sa_family == AF_INET) {
@@ -1068,3 +1558,11 @@ bool FileSystem::CreateSocketAddress(const PP_NetAddress_Private& addr,
   }
   return false;
 }
+
+// Called by openssh connect_to() instead of getaddrinfo(), see
+// openssh-5.9p1.patch.
+extern "C" int channel_getaddrinfo(const char* hostname, const char* servname,
+                                   const addrinfo* hints, addrinfo** res) {
+  return FileSystem::GetFileSystem()->GetDeferredAddrInfo(
+      hostname, servname, hints, res);
+}
@@ -9,6 +9,7 @@
 #include <errno.h>
 #include <memory.h>
 #include <netdb.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <sys/ioctl.h>
@@ -17,7 +18,10 @@
 #include <unistd.h>
 
 #include <map>
+#include <set>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "ppapi/cpp/file_ref.h"
 #include "ppapi/cpp/file_system.h"
@@ -25,7 +29,14 @@
 #include "ppapi/utility/completion_callback_factory.h"
 
 #include "file_interfaces.h"
+#include "host_profile.h"
+#include "proxy_client.h"
 #include "pthread_helpers.h"
+#include "trigger_matcher.h"
+#include "zmodem.h"
+
+class JsFile;
+class SessionLog;
 
 class FileSystem {
  public:
@@ -44,11 +55,78 @@ class FileSystem {
   Mutex& mutex() { return mutex_; }
   pp::Instance* instance() { return instance_; }
 
+  // Wait for HTML5 file system to be opened and return it, NULL if it is not
+  // available. Must not be called on the main thread.
+  pp::FileSystem* GetPepperFileSystem();
+  // Same as above but doesn't wait, returns false while the file system is
+  // still being opened. The session log gets it from OnOpen() in that case.
+  bool TryGetPepperFileSystem(pp::FileSystem** fs);
+
+  // Serve |path| with |handler| instead of HTML5 file system. FileSystem
+  // takes ownership of the handler.
+  void AddPathHandler(const std::string& path, PathHandler* handler);
+  void RemovePathHandler(const std::string& path);
+
+  // Connect ssh stdin and stdout to in-module pipes instead of the terminal,
+  // |input| feeds stdin and |output| returns stdout. /dev/tty and stderr
+  // still go to the terminal so prompts work as usual.
+  void UsePipesForStdio(FileStream** input, FileStream** output);
+
+  // Take ownership of the log, stdin and stdout are copied to it.
+  void SetSessionLog(SessionLog* log);
+  SessionLog* session_log() { return session_log_; }
+
+  // ZMODEM transfers in the terminal streams.
+  Zmodem* zmodem() { return &zmodem_; }
+  void QueueZmodemUpload(const std::vector<std::string>& paths);
+
+  // Patterns looked for in the terminal output.
+  TriggerMatcher* triggers() { return &triggers_; }
+  bool SetTriggers(const std::vector<std::string>& patterns,
+                   std::string* error);
+
+  // Local echo prediction in the terminal, see MoshClient. Input offset is
+  // the number of bytes JS sent to the terminal that have been read.
+  uint64_t GetTerminalInputOffset();
+  // Output written to the terminal so far shows the echo of the input up
+  // to |input_offset|. JS applies it once it has that output.
+  void SendEchoAck(uint64_t input_offset, int rtt_ms);
+
+  // What is known about the host ssh connects to, see HostProfile.
+  HostProfile* host_profile() { return &host_profile_; }
+  // Use profile stored by the previous connections, otherwise handshake is
+  // only measured.
+  void UseHostProfile(bool use_profile);
+  // Skip authentication queries the host profile knows answers to.
+  void UseFastAuth(bool fast_auth);
+
+  // Remember when startSession came, time to the first connect is logged.
+  void MarkSessionStart();
+
+  // Keep the module running after ssh exits so another session can be
+  // started in it.
+  void SetReusable(bool reusable);
+  bool is_reusable() { return reusable_; }
+  // While held, exit() only records the status and wakes up waiters, the
+  // session goes on after ssh ends. Used when ssh only starts the server
+  // side of the session. Held exit is checked with the mutex locked.
+  void HoldExit(bool hold);
+  bool is_exit_held();
+  bool has_held_exit() { return held_exit_; }
+  int held_exit_status() { return held_exit_status_; }
+  // Close everything the session opened and return terminal to initial
+  // state. Must be called on ssh thread without FileSystem mutex locked,
+  // sockets need the main thread to close.
+  void Reset();
+
   void SetTerminalSize(unsigned short col, unsigned short row);
   bool GetTerminalSize(unsigned short* col, unsigned short* row);
 
   // Switch TCP sockets between JS and Pepper implementations.
   void UseJsSocket(bool use_js);
+  // Tunnel first TCP connection through HTTP or SOCKS5 proxy. Host names
+  // aren't resolved locally then, proxy resolves them.
+  void SetProxy(const ProxyConfig& proxy);
 
   static bool CreateNetAddress(const sockaddr* saddr, socklen_t addrlen,
                                PP_NetAddress_Private* addr);
@@ -65,6 +143,7 @@ class FileSystem {
   int dup(int fd, int *newfd);
   int dup2(int fd, int newfd);
   int fstat(int fd, nacl_abi_stat* out);
+  int ftruncate(int fd, nacl_abi_off_t length);
   int stat(const char *pathname, nacl_abi_stat* out);
   int getdents(int fd, dirent*, size_t count, size_t* nread);
 
@@ -78,6 +157,11 @@ class FileSystem {
 
   int getaddrinfo(const char* hostname, const char* servname,
                   const addrinfo* hints, addrinfo** res);
+  // Same as getaddrinfo() but a host name is not looked up, it gets a fake
+  // address that a non-blocking connect() resolves. Used for forwarded
+  // connections so a slow lookup doesn't stop all the other channels.
+  int GetDeferredAddrInfo(const char* hostname, const char* servname,
+                          const addrinfo* hints, addrinfo** res);
   void freeaddrinfo(addrinfo* ai);
   int getnameinfo(const sockaddr* sa, socklen_t salen,
                   char *host, size_t hostlen,
@@ -86,6 +170,12 @@ class FileSystem {
   int socket(int socket_family, int socket_type, int protocol);
   int connect(int sockfd, const sockaddr* serv_addr, socklen_t addrlen);
   int shutdown(int sockfd, int how);
+  int send(int sockfd, const char* buf, size_t count, int flags,
+           size_t* nwrote);
+  int setsockopt(int sockfd, int level, int optname, const void* optval,
+                 socklen_t optlen);
+  int getsockopt(int sockfd, int level, int optname, void* optval,
+                 socklen_t* optlen);
   int bind(int sockfd, const sockaddr* serv_addr, socklen_t addrlen);
   int listen(int sockfd, int backlog);
   int accept(int sockfd, sockaddr* addr, socklen_t* addrlen);
@@ -101,16 +191,66 @@ class FileSystem {
                 const struct sigaction *act,
                 struct sigaction *oldact);
   const char* getenv(const char* name);
-  void exit(int status);
+  // Return true if the exit was held, the caller goes on then.
+  bool exit(int status);
+  // Runs ssh |main| on this thread. exit() of a held or reusable session
+  // comes back here instead of ending the thread with pthread_exit(), which
+  // would skip destructors of the caller's objects. |*exited| tells whether
+  // exit() was called, the status is reported already then.
+  int RunMain(int (*main)(int, const char**), int argc, const char** argv,
+              bool* exited);
+  // Leaves RunMain() of the calling thread, or ends the thread if it isn't
+  // running one.
+  void ReturnFromMain(int status);
 
   void ExitCodeAcked();
 
+  // Streams finish flushing and closing on the main thread after close()
+  // returned. A stream calls AddPendingClose() when its close starts and
+  // RemovePendingClose() on the main thread when it's torn down. Until then
+  // close() leaves its descriptor reserved by kBadFileStream, so a new stream
+  // can't get it while messages for the old one are still in flight. Both
+  // must be called with the mutex locked.
+  void AddPendingClose(int fd);
+  void RemovePendingClose(int fd);
+
+  // Why select() calls returned or woke up, for finding what keeps an idle
+  // session busy.
+  struct WakeupStats {
+    WakeupStats()
+      : select_calls(0), timer_wakeups(0), io_wakeups(0), signal_wakeups(0),
+        spurious_wakeups(0), unchanged_notifications(0) {}
+
+    uint32_t select_calls;
+    uint32_t timer_wakeups;
+    uint32_t io_wakeups;
+    uint32_t signal_wakeups;
+    // Woken up by broadcast but nothing selected became ready.
+    uint32_t spurious_wakeups;
+    // Stream callbacks that left the readiness unchanged and so didn't
+    // broadcast.
+    uint32_t unchanged_notifications;
+  };
+
+  // Broadcasts if |stream| readiness is not |readiness| any more, see
+  // FileStream::readiness(). Must be called with the mutex locked by
+  // callbacks that nobody waits for other than through readiness.
+  void NotifyIfChanged(FileStream* stream, int readiness);
+
+  void GetWakeupStats(WakeupStats* stats, uint32_t* broadcasts,
+                      uint32_t* skipped_broadcasts);
+
  private:
   typedef std::map<int, FileStream*> FileStreamMap;
+  typedef std::multiset<int> ClosingDescriptors;
   typedef std::map<std::string, PathHandler*> PathHandlerMap;
   typedef std::map<std::string, unsigned long> HostMap;
   typedef std::map<unsigned long, std::string> AddressMap;
   typedef std::map<int, int> SocketTypesMap;
+  typedef std::map<int, int> SocketFlagsMap;
+  // Option values by level and name.
+  typedef std::map<std::pair<int, int>, int> SocketOptionMap;
+  typedef std::map<int, SocketOptionMap> SocketOptionsMap;
 
   struct GetAddrInfoParams {
     const char* hostname;
@@ -119,7 +259,6 @@ class FileSystem {
     struct addrinfo** res;
   };
 
-  void AddPathHandler(const std::string& path, PathHandler* handler);
   void AddFileStream(int fd, FileStream* stream);
   void RemoveFileStream(int fd);
 
@@ -134,6 +273,8 @@ class FileSystem {
                            const addrinfo* hints);
   bool GetHostPort(const sockaddr* serv_addr, socklen_t addrlen,
                    std::string* hostname, uint16_t* port);
+  // Sets options kept for |fd| before it had a stream on |stream|.
+  void ApplySocketOptions(int fd, FileStream* stream);
   void Resolve(int32_t result, GetAddrInfoParams* params, int32_t* pres);
   void OnResolve(int32_t result, GetAddrInfoParams* params, int32_t* pres);
 
@@ -146,9 +287,18 @@ class FileSystem {
   int IsReady(int nfds, fd_set* fds, bool (FileStream::*is_ready)(),
               bool apply);
   bool IsInterrupted();
+  // Wait until no more than |limit| closes are in progress. Returns right
+  // away on the main thread, closes need it to finish.
+  void WaitForPendingCloses(int limit);
 
   static const int kFileIDOffset = 100;
+  // select() timeouts this long or longer end on a multiple of
+  // kTimerSlackUs, so timers of all sessions expire together.
+  static const int64_t kCoalesceMinTimeoutUs = 1000 * 1000;
+  static const int64_t kTimerSlackUs = 500 * 1000;
   static const unsigned long kFirstAddr = 0x00000000;
+  // close() waits when this many streams are still closing.
+  static const int kMaxPendingCloses = 16;
 
   static FileSystem* file_system_;
 
@@ -171,6 +321,27 @@ class FileSystem {
   AddressMap addrs_;
   unsigned long first_unused_addr_;
   bool use_js_socket_;
+  ProxyConfig proxy_;
+  bool use_proxy_;
+  SessionLog* session_log_;
+  Zmodem zmodem_;
+  TriggerMatcher triggers_;
+  // Terminal streams, also used after stdio is switched to pipes.
+  JsFile* terminal_input_;
+  JsFile* terminal_output_;
+  HostProfile host_profile_;
+  bool use_host_profile_;
+  bool use_fast_auth_;
+  int64_t session_start_usec_;
+  bool reusable_;
+  bool exit_held_;
+  bool held_exit_;
+  int held_exit_status_;
+  jmp_buf* exit_jump_;
+  pthread_t main_thread_;
+  int exit_status_;
+  ClosingDescriptors closing_fds_;
+  WakeupStats wakeup_stats_;
 
   unsigned short col_;
   unsigned short row_;
@@ -180,6 +351,10 @@ class FileSystem {
   // TODO(dpolukhin): remove this map and put all socket related info into
   // FileStream with type socket.
   SocketTypesMap socket_types_;
+  // File status flags set on sockets that are not connected yet.
+  SocketFlagsMap socket_flags_;
+  // Options set on sockets that are not connected, bound or listening yet.
+  SocketOptionsMap socket_options_;
 
   DISALLOW_COPY_AND_ASSIGN(FileSystem);
 };
@@ -0,0 +1,392 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "host_profile.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "file_system.h"
+#include "known_hosts_index.h"
+
+const size_t HostProfile::kMaxHosts;
+const size_t HostProfile::kMaxPacketSize;
+const size_t HostProfile::kMaxBannerSize;
+
+static const char kProfilesPath[] = "/.ssh/host_profiles";
+static const char kProfilesVersion[] = "v1\n";
+static const char kBannerPrefix[] = "SSH-";
+static const unsigned char kKexInitMessage = 20;  // SSH2_MSG_KEXINIT
+static const size_t kCookieSize = 16;
+static const int kNameLists = 10;
+
+// Names of KEXINIT lists kept in the profile, client to server direction
+// is enough for the others.
+static const char* const kNameListFields[kNameLists] = {
+  "kex", "hostkey", "ciphers", NULL, "macs", NULL, "compression", NULL,
+  NULL, NULL
+};
+
+static uint32_t GetUint32(const unsigned char* p) {
+  return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) |
+      (uint32_t(p[2]) << 8) | p[3];
+}
+
+HostProfile::HostProfile() {
+  Reset();
+}
+
+HostProfile::~HostProfile() {
+}
+
+void HostProfile::Reset() {
+  loaded_ = false;
+  use_stored_ = false;
+  found_ = false;
+  key_.clear();
+  fields_.clear();
+  fast_auth_ = false;
+  methods_seen_ = false;
+  offered_key_.clear();
+  signed_directly_ = false;
+  fd_ = -1;
+  sniff_state_ = SNIFF_BANNER;
+  sniffed_.clear();
+  counting_ = false;
+  sent_ = false;
+  round_trips_ = 0;
+  kex_round_trips_ = 0;
+  saved_round_trips_ = 0;
+  start_usec_ = 0;
+  handshake_usec_ = 0;
+}
+
+int64_t HostProfile::GetTimeUsec() {
+  timeval tv;
+  gettimeofday(&tv, NULL);
+  return int64_t(tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+void HostProfile::Load(const char* host, const char* port, bool use_stored,
+                       bool fast_auth) {
+  Reset();
+  loaded_ = true;
+  use_stored_ = use_stored;
+  fast_auth_ = use_stored && fast_auth;
+  counting_ = true;
+  start_usec_ = GetTimeUsec();
+  key_ = KnownHostsIndex::GetHostKey(std::string(host ? host : "") + ":" +
+                                     (port ? port : "22"));
+  if (!use_stored_)
+    return;
+
+  std::string data;
+  if (!KnownHostsIndex::ReadFile(kProfilesPath, &data) ||
+      data.compare(0, sizeof(kProfilesVersion) - 1, kProfilesVersion) != 0) {
+    return;
+  }
+
+  std::string prefix = key_ + ' ';
+  size_t pos = sizeof(kProfilesVersion) - 1;
+  while (pos < data.size()) {
+    size_t eol = data.find('\n', pos);
+    if (eol == std::string::npos)
+      eol = data.size();
+    if (data.compare(pos, prefix.size(), prefix) == 0) {
+      ParseLine(data.substr(pos + prefix.size(), eol - pos - prefix.size()),
+                &fields_);
+      found_ = true;
+      break;
+    }
+    pos = eol + 1;
+  }
+  LOG("HostProfile: %s for %s\n", found_ ? "found" : "no profile",
+      host ? host : "");
+}
+
+void HostProfile::Save() {
+  if (!loaded_ || !use_stored_ || sniff_state_ != SNIFF_DONE ||
+      fields_["kex"].empty()) {
+    return;
+  }
+
+  std::string line = key_;
+  for (Fields::const_iterator it = fields_.begin(); it != fields_.end();
+       ++it) {
+    if (!it->second.empty())
+      line += ' ' + it->first + '=' + it->second;
+  }
+  line += '\n';
+
+  // Keep other hosts, the least recently saved ones go first when the
+  // file is full.
+  std::string data;
+  std::vector<std::string> lines;
+  if (KnownHostsIndex::ReadFile(kProfilesPath, &data) &&
+      data.compare(0, sizeof(kProfilesVersion) - 1, kProfilesVersion) == 0) {
+    std::string prefix = key_ + ' ';
+    size_t pos = sizeof(kProfilesVersion) - 1;
+    while (pos < data.size()) {
+      size_t eol = data.find('\n', pos);
+      if (eol == std::string::npos)
+        break;
+      if (data.compare(pos, prefix.size(), prefix) != 0)
+        lines.push_back(data.substr(pos, eol + 1 - pos));
+      pos = eol + 1;
+    }
+  }
+  size_t first = lines.size() >= kMaxHosts ? lines.size() - kMaxHosts + 1 : 0;
+  data = kProfilesVersion;
+  for (size_t i = first; i < lines.size(); i++)
+    data += lines[i];
+  data += line;
+  if (!KnownHostsIndex::WriteFile(kProfilesPath, data))
+    LOG("HostProfile: can't write %s\n", kProfilesPath);
+}
+
+void HostProfile::ParseLine(const std::string& line, Fields* fields) {
+  size_t pos = 0;
+  while (pos < line.size()) {
+    size_t end = line.find(' ', pos);
+    if (end == std::string::npos)
+      end = line.size();
+    size_t eq = line.find('=', pos);
+    if (eq != std::string::npos && eq < end)
+      (*fields)[line.substr(pos, eq - pos)] = line.substr(eq + 1, end - eq - 1);
+    pos = end + 1;
+  }
+}
+
+std::string HostProfile::AddressToString(const sockaddr* addr) {
+  char buf[INET6_ADDRSTRLEN];
+  if (addr->sa_family == AF_INET) {
+    const sockaddr_in* sin4 = reinterpret_cast<const sockaddr_in*>(addr);
+    if (inet_ntop(AF_INET, &sin4->sin_addr, buf, sizeof(buf)))
+      return buf;
+  } else if (addr->sa_family == AF_INET6) {
+    const sockaddr_in6* sin6 = reinterpret_cast<const sockaddr_in6*>(addr);
+    if (inet_ntop(AF_INET6, &sin6->sin6_addr, buf, sizeof(buf)))
+      return buf;
+  }
+  return std::string();
+}
+
+void HostProfile::OrderAddresses(addrinfo** res) {
+  Fields::const_iterator it = fields_.find("addr");
+  if (!is_used() || it == fields_.end() || it->second.empty())
+    return;
+
+  for (addrinfo** ai = res; *ai; ai = &(*ai)->ai_next) {
+    if ((*ai)->ai_addr && AddressToString((*ai)->ai_addr) == it->second) {
+      if (ai != res) {
+        addrinfo* found = *ai;
+        *ai = found->ai_next;
+        found->ai_next = *res;
+        *res = found;
+      }
+      return;
+    }
+  }
+}
+
+void HostProfile::OnConnect(int fd, const sockaddr* addr, bool direct) {
+  if (!loaded_ || fd_ != -1)
+    return;
+  fd_ = fd;
+  // Connect and the server's banner that follows it count as one round
+  // trip.
+  sent_ = true;
+  if (direct)
+    fields_["addr"] = AddressToString(addr);
+}
+
+void HostProfile::OnSent(size_t count) {
+  if (counting_ && count)
+    sent_ = true;
+}
+
+void HostProfile::OnReceived(const char* buf, size_t count) {
+  if (counting_ && sent_ && count) {
+    round_trips_++;
+    sent_ = false;
+  }
+
+  const char* end = buf + count;
+  while (buf < end && sniff_state_ == SNIFF_BANNER) {
+    // Server may send other lines before the version one.
+    char c = *buf++;
+    if (c != '\n') {
+      sniffed_.push_back(c);
+      if (sniffed_.size() > kMaxBannerSize)
+        sniff_state_ = SNIFF_DONE;
+      continue;
+    }
+    if (sniffed_.compare(0, sizeof(kBannerPrefix) - 1, kBannerPrefix) == 0) {
+      // Comments after the version may have anything in them.
+      fields_["version"] = sniffed_.substr(0, sniffed_.find_first_of(" \r"));
+      sniff_state_ = SNIFF_KEXINIT;
+    }
+    sniffed_.clear();
+  }
+
+  if (buf < end && sniff_state_ == SNIFF_KEXINIT) {
+    // Server's KEXINIT is the first binary packet, it's never encrypted.
+    sniffed_.append(buf, end - buf);
+    if (sniffed_.size() < 4)
+      return;
+    size_t size = GetUint32((const unsigned char*)sniffed_.data()) + 4;
+    if (size > kMaxPacketSize) {
+      sniff_state_ = SNIFF_DONE;
+    } else if (sniffed_.size() >= size) {
+      if (!ParseKexInit(sniffed_.substr(0, size)))
+        LOG("HostProfile: can't parse server's KEXINIT\n");
+      sniff_state_ = SNIFF_DONE;
+    }
+  }
+  if (sniff_state_ == SNIFF_DONE)
+    sniffed_.clear();
+}
+
+bool HostProfile::ParseKexInit(const std::string& packet) {
+  const unsigned char* p = (const unsigned char*)packet.data();
+  size_t size = packet.size();
+  if (size < 5 || p[4] >= size - 5)
+    return false;
+  // Drop length, padding length and padding.
+  size -= p[4];
+  size_t pos = 5;
+  if (size < pos + 1 + kCookieSize || p[pos] != kKexInitMessage)
+    return false;
+  pos += 1 + kCookieSize;
+
+  Fields lists;
+  for (int i = 0; i < kNameLists; i++) {
+    if (size - pos < 4)
+      return false;
+    uint32_t len = GetUint32(p + pos);
+    pos += 4;
+    if (size - pos < len)
+      return false;
+    std::string list((const char*)p + pos, len);
+    pos += len;
+    if (list.find_first_of(" \t\r\n=") != std::string::npos)
+      return false;
+    if (kNameListFields[i])
+      lists[kNameListFields[i]] = list;
+  }
+
+  bool changed = false;
+  for (Fields::const_iterator it = lists.begin(); it != lists.end(); ++it) {
+    std::string& field = fields_[it->first];
+    changed |= found_ && field != it->second;
+    field = it->second;
+  }
+  if (changed)
+    LOG("HostProfile: server algorithms changed since the last connection\n");
+  return true;
+}
+
+void HostProfile::OnSessionOutput() {
+  if (!counting_)
+    return;
+  counting_ = false;
+  handshake_usec_ = GetTimeUsec() - start_usec_;
+  LOG("HostProfile: %s, %u round trips to session output (%u to the end "
+      "of key exchange), %d ms\n",
+      is_used() ? "profile used" : "no profile", round_trips_,
+      kex_round_trips_, int(handshake_usec_ / 1000));
+  if (fast_auth_)
+    LOG("HostProfile: fast authentication saved %u round trips\n",
+        saved_round_trips_);
+}
+
+void HostProfile::OnKexDone() {
+  kex_round_trips_ = round_trips_;
+}
+
+std::string HostProfile::GetAuthMethods() {
+  if (!fast_auth_)
+    return std::string();
+  std::string methods = fields_["methods"];
+  if (!methods.empty())
+    saved_round_trips_++;
+  return methods;
+}
+
+void HostProfile::OnAuthMethods(const char* methods) {
+  // The first list is the full one, later lists may be what's left after
+  // a partial success.
+  if (methods_seen_ || !methods ||
+      strpbrk(methods, " \t\r\n=") != NULL) {
+    return;
+  }
+  methods_seen_ = true;
+  fields_["methods"] = methods;
+}
+
+bool HostProfile::OnPublicKeyOffered(const char* filename) {
+  offered_key_ = KnownHostsIndex::GetHostKey(filename ? filename : "");
+  signed_directly_ = fast_auth_ && offered_key_ == fields_["key"];
+  return signed_directly_;
+}
+
+void HostProfile::OnAuthSuccess(const char* method) {
+  if (strcmp(method, "publickey") == 0 && !offered_key_.empty()) {
+    fields_["key"] = offered_key_;
+    if (signed_directly_)
+      saved_round_trips_++;
+  } else {
+    fields_.erase("key");
+  }
+}
+
+//------------------------------------------------------------------------------
+
+// Original openssh function, renamed by openssh-5.9p1.patch.
+extern "C" void ssh_kex2_default(char* host, sockaddr* hostaddr,
+                                 unsigned short port);
+
+extern "C" void ssh_kex2(char* host, sockaddr* hostaddr,
+                         unsigned short port) {
+  ssh_kex2_default(host, hostaddr, port);
+  // Host key is verified by now, ssh would have exited otherwise.
+  HostProfile* profile = FileSystem::GetFileSystem()->host_profile();
+  profile->OnKexDone();
+  profile->Save();
+}
+
+struct Authctxt;
+
+// Original openssh function, renamed by openssh-5.9p1.patch.
+extern "C" void userauth_default(Authctxt* authctxt, char* authlist);
+extern "C" char* xstrdup(const char* str);
+
+extern "C" void userauth(Authctxt* authctxt, char* authlist) {
+  FileSystem::GetFileSystem()->host_profile()->OnAuthMethods(authlist);
+  userauth_default(authctxt, authlist);
+}
+
+extern "C" int userauth_known_methods(Authctxt* authctxt) {
+  std::string methods =
+      FileSystem::GetFileSystem()->host_profile()->GetAuthMethods();
+  if (methods.empty())
+    return 0;
+  // Server's answer will have the real list if ours is out of date.
+  userauth_default(authctxt, xstrdup(methods.c_str()));
+  return 1;
+}
+
+extern "C" int userauth_pubkey_known(const char* filename) {
+  return FileSystem::GetFileSystem()->host_profile()->OnPublicKeyOffered(
+      filename);
+}
+
+extern "C" void userauth_succeeded(const char* method) {
+  HostProfile* profile = FileSystem::GetFileSystem()->host_profile();
+  profile->OnAuthSuccess(method);
+  profile->Save();
+}
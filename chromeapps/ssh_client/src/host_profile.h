@@ -0,0 +1,134 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef HOST_PROFILE_H
+#define HOST_PROFILE_H
+
+#include <netdb.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "pthread_helpers.h"
+
+// What previous connections learned about the host ssh connects to: the
+// address that worked, algorithms from the server's KEXINIT and what the
+// handshake cost. Profiles are stored in /.ssh/host_profiles by SHA1 of
+// "host:port". On the next connection the remembered address is tried
+// first. The key exchange proposal is left alone: without a guessed first
+// key exchange packet, reordering it can't save a round trip, the
+// negotiated algorithms would be the same.
+//
+// With fast authentication on, the remembered authentication methods and
+// key are used to skip the "none" probe and the publickey query, each of
+// them costs a round trip. Round trips saved this way are counted.
+//
+// Round trips of the handshake are counted with or without the profile
+// used, one round trip is a send to the server followed by data from it,
+// up to the first output of the session.
+//
+// Socket and stdio calls come with FileSystem mutex locked, Load(), Save()
+// and the authentication calls come from openssh code without it. All
+// calls come from ssh thread, except stats which are read from the main
+// thread.
+class HostProfile {
+ public:
+  HostProfile();
+  ~HostProfile();
+
+  // Start tracking connection to |host| and |port|, the profile is loaded
+  // from the file if |use_stored| is true. Reads the file so must be called
+  // without FileSystem mutex locked.
+  void Load(const char* host, const char* port, bool use_stored,
+            bool fast_auth);
+  // Write what was learned back to the file, same as Load() about locking.
+  void Save();
+  void Reset();
+
+  // Load() was called in this session.
+  bool loaded() const { return loaded_; }
+  // Remembered data is used for this connection.
+  bool is_used() const { return use_stored_ && found_; }
+
+  // Move the remembered address to the front of |res|.
+  void OrderAddresses(addrinfo** res);
+  // First connection after Load() is the ssh connection. Its address is
+  // remembered unless it's a fake one for JS socket or proxy.
+  void OnConnect(int fd, const sockaddr* addr, bool direct);
+  bool is_connection(int fd) const { return fd == fd_; }
+  void OnSent(size_t count);
+  void OnReceived(const char* buf, size_t count);
+  // Session started writing to stdout, the handshake is over.
+  void OnSessionOutput();
+  bool is_counting() const { return counting_; }
+
+  // Key exchange is over, the host key is verified.
+  void OnKexDone();
+
+  // Methods that can be tried without the "none" probe, empty if unknown or
+  // fast authentication is off.
+  std::string GetAuthMethods();
+  // Server listed |methods| as ones that can continue.
+  void OnAuthMethods(const char* methods);
+  // Public key from |filename| is about to be offered, return true if it
+  // was accepted last time and can be signed without asking first.
+  bool OnPublicKeyOffered(const char* filename);
+  void OnAuthSuccess(const char* method);
+
+  uint32_t round_trips() const { return round_trips_; }
+  uint32_t saved_round_trips() const { return saved_round_trips_; }
+  int64_t handshake_usec() const { return handshake_usec_; }
+
+ private:
+  typedef std::map<std::string, std::string> Fields;
+
+  enum SniffState {
+    SNIFF_BANNER,
+    SNIFF_KEXINIT,
+    SNIFF_DONE
+  };
+
+  bool ParseKexInit(const std::string& packet);
+
+  static void ParseLine(const std::string& line, Fields* fields);
+  static std::string AddressToString(const sockaddr* addr);
+  static int64_t GetTimeUsec();
+
+  static const size_t kMaxHosts = 256;
+  // Biggest packet RFC 4253 requires to handle, KEXINIT is much smaller.
+  static const size_t kMaxPacketSize = 35000;
+  static const size_t kMaxBannerSize = 8192;
+
+  bool loaded_;
+  bool use_stored_;
+  bool found_;
+  std::string key_;
+  // Profile of the host as loaded, updated as the handshake goes.
+  Fields fields_;
+
+  bool fast_auth_;
+  bool methods_seen_;
+  // SHA1 of the last offered key file and whether it was signed directly.
+  std::string offered_key_;
+  bool signed_directly_;
+
+  int fd_;
+  SniffState sniff_state_;
+  std::string sniffed_;
+
+  bool counting_;
+  bool sent_;
+  uint32_t round_trips_;
+  uint32_t kex_round_trips_;
+  uint32_t saved_round_trips_;
+  int64_t start_usec_;
+  int64_t handshake_usec_;
+
+  DISALLOW_COPY_AND_ASSIGN(HostProfile);
+};
+
+#endif  // HOST_PROFILE_H
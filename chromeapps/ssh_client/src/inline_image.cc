@@ -0,0 +1,502 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "inline_image.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+const size_t InlineImageDecoder::kMaxPrefixSize;
+const size_t InlineImageDecoder::kMaxArgsSize;
+const size_t InlineImageDecoder::kMaxEncodedSize;
+const uint32_t InlineImageDecoder::kMaxSixelSize;
+const int InlineImageDecoder::kSixelColors;
+
+static const unsigned char kEsc = 0x1b;
+static const unsigned char kBel = 0x07;
+static const unsigned char kCan = 0x18;
+static const unsigned char kSub = 0x1a;
+static const char kOscPrefix[] = "\x1b]1337;File=";
+static const size_t kOscPrefixLength = sizeof(kOscPrefix) - 1;
+static const size_t kMaxSixelParams = 8;
+static const int kMaxSixelParam = 100000;
+
+// VT340 default palette, RGB in percent.
+static const int kSixelPalette[16][3] = {
+  {  0,  0,  0 }, { 20, 20, 80 }, { 80, 13, 13 }, { 20, 80, 20 },
+  { 80, 20, 80 }, { 20, 80, 80 }, { 80, 80, 20 }, { 53, 53, 53 },
+  { 26, 26, 26 }, { 33, 33, 60 }, { 60, 26, 26 }, { 33, 60, 33 },
+  { 60, 33, 60 }, { 33, 60, 60 }, { 60, 60, 33 }, { 80, 80, 80 }
+};
+
+// Pixels are stored as bytes R, G, B, A in memory, NaCl is little endian.
+static uint32_t MakePixel(int r, int g, int b) {
+  return r | (g << 8) | (b << 16) | (0xffu << 24);
+}
+
+static int DecodeBase64Char(unsigned char c) {
+  if (c >= 'A' && c <= 'Z')
+    return c - 'A';
+  if (c >= 'a' && c <= 'z')
+    return c - 'a' + 26;
+  if (c >= '0' && c <= '9')
+    return c - '0' + 52;
+  if (c == '+')
+    return 62;
+  if (c == '/')
+    return 63;
+  return -1;
+}
+
+static uint32_t GetUint16(const std::vector<char>& data, size_t pos,
+                          bool big_endian) {
+  unsigned char first = data[pos];
+  unsigned char second = data[pos + 1];
+  return big_endian ? (first << 8) | second : (second << 8) | first;
+}
+
+// Reads image size from the file header.
+static void GetEncodedSize(const std::vector<char>& data,
+                           uint32_t* width, uint32_t* height) {
+  static const char kPngSignature[] = "\x89PNG\r\n\x1a\n";
+  *width = 0;
+  *height = 0;
+  if (data.size() >= 24 && !memcmp(&data[0], kPngSignature, 8)) {
+    // IHDR chunk is always the first one.
+    *width = (GetUint16(data, 16, true) << 16) | GetUint16(data, 18, true);
+    *height = (GetUint16(data, 20, true) << 16) | GetUint16(data, 22, true);
+  } else if (data.size() >= 10 && !memcmp(&data[0], "GIF8", 4)) {
+    *width = GetUint16(data, 6, false);
+    *height = GetUint16(data, 8, false);
+  } else if (data.size() >= 4 && (unsigned char)data[0] == 0xff &&
+             (unsigned char)data[1] == 0xd8) {
+    // Size is in the start of frame segment, segments before it are
+    // skipped.
+    size_t pos = 2;
+    while (pos + 9 <= data.size() && (unsigned char)data[pos] == 0xff) {
+      unsigned char marker = data[pos + 1];
+      if (marker == 0xff) {
+        pos++;
+        continue;
+      }
+      if (marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 &&
+          marker != 0xc8 && marker != 0xcc) {
+        *height = GetUint16(data, pos + 5, true);
+        *width = GetUint16(data, pos + 7, true);
+        break;
+      }
+      if ((marker >= 0xd0 && marker <= 0xd8) || marker == 0x01) {
+        pos += 2;
+      } else {
+        pos += 2 + GetUint16(data, pos + 2, true);
+      }
+    }
+  }
+}
+
+InlineImageDecoder::InlineImageDecoder()
+  : state_(TEXT), osc_(false), escape_(false), image_(NULL),
+    base64_group_(0), base64_count_(0), sixel_command_(0), sixel_x_(0),
+    sixel_y_(0), sixel_repeat_(1), raster_width_(0), raster_height_(0),
+    used_width_(0), used_height_(0), stride_(0), rows_(0), color_(0) {
+}
+
+InlineImageDecoder::~InlineImageDecoder() {
+  delete image_;
+}
+
+bool InlineImageDecoder::FilterOutput(const char* buf, size_t count,
+                                      std::string* terminal,
+                                      std::vector<InlineImage*>* images) {
+  // Almost all output has no escape sequences at all.
+  if (state_ == TEXT && !memchr(buf, kEsc, count))
+    return false;
+
+  terminal->clear();
+  terminal->reserve(count);
+  for (size_t i = 0; i < count; i++) {
+    unsigned char c = buf[i];
+    if (state_ == TEXT) {
+      // Plain text is copied in runs up to the next escape.
+      const char* esc = (const char*)memchr(buf + i, kEsc, count - i);
+      size_t end = esc ? esc - buf : count;
+      terminal->append(buf + i, end - i);
+      if (!esc)
+        break;
+      i = end;
+      prefix_.assign(1, kEsc);
+      state_ = PREFIX;
+    } else if (state_ == PREFIX) {
+      ProcessPrefix(c, terminal);
+    } else if (escape_) {
+      escape_ = false;
+      if (c == '\\') {
+        Finish(images, terminal->size());
+      } else {
+        // ESC in the middle cancels the sequence and starts a new one.
+        Abort("sequence is not terminated");
+        state_ = PREFIX;
+        prefix_.assign(1, kEsc);
+        ProcessPrefix(c, terminal);
+      }
+    } else if (c == kEsc) {
+      escape_ = true;
+    } else if (c == kBel && osc_) {
+      Finish(images, terminal->size());
+    } else if (c == kCan || c == kSub) {
+      Abort("sequence is cancelled");
+      state_ = TEXT;
+    } else {
+      ProcessBody(c);
+    }
+  }
+  // Incomplete sequence is held until the next write, the same way hterm
+  // would wait for the rest of it.
+  return true;
+}
+
+void InlineImageDecoder::ProcessPrefix(unsigned char c,
+                                       std::string* terminal) {
+  prefix_.push_back(c);
+  size_t length = prefix_.size();
+  if (prefix_[1] == ']') {
+    if (length <= kOscPrefixLength &&
+        c == (unsigned char)kOscPrefix[length - 1]) {
+      if (length == kOscPrefixLength)
+        StartOsc();
+      return;
+    }
+  } else if (prefix_[1] == 'P') {
+    if (length == 2 || (length < kMaxPrefixSize &&
+                        ((c >= '0' && c <= '9') || c == ';'))) {
+      return;
+    }
+    if (c == 'q') {
+      StartSixel();
+      return;
+    }
+  }
+
+  // Not an image, the terminal gets it as is.
+  prefix_.resize(length - 1);
+  terminal->append(prefix_);
+  if (c == kEsc) {
+    prefix_.assign(1, kEsc);
+  } else {
+    terminal->push_back(c);
+    state_ = TEXT;
+  }
+}
+
+void InlineImageDecoder::StartOsc() {
+  state_ = OSC_ARGS;
+  osc_ = true;
+  escape_ = false;
+  args_.clear();
+  base64_group_ = 0;
+  base64_count_ = 0;
+  delete image_;
+  image_ = new InlineImage();
+  image_->format = InlineImage::ENCODED;
+}
+
+void InlineImageDecoder::StartSixel() {
+  // Background select parameter is ignored, pixels that are not drawn are
+  // always transparent so the terminal background shows through.
+  state_ = SIXEL;
+  osc_ = false;
+  escape_ = false;
+  sixel_command_ = 0;
+  sixel_x_ = 0;
+  sixel_y_ = 0;
+  sixel_repeat_ = 1;
+  raster_width_ = 0;
+  raster_height_ = 0;
+  used_width_ = 0;
+  used_height_ = 0;
+  stride_ = 0;
+  rows_ = 0;
+  raster_.clear();
+  for (int i = 0; i < kSixelColors; i++) {
+    const int* rgb = kSixelPalette[i % 16];
+    SetColor(i, 2, rgb[0], rgb[1], rgb[2]);
+  }
+  color_ = palette_[0];
+  delete image_;
+  image_ = new InlineImage();
+  image_->format = InlineImage::RGBA;
+}
+
+void InlineImageDecoder::ProcessBody(unsigned char c) {
+  switch (state_) {
+    case OSC_ARGS:
+      if (c == ':') {
+        if (ParseOscArgs())
+          state_ = OSC_DATA;
+        else
+          Abort("unsupported OSC 1337 file");
+      } else if (args_.size() < kMaxArgsSize) {
+        args_.push_back(c);
+      } else {
+        Abort("OSC 1337 arguments are too long");
+      }
+      break;
+    case OSC_DATA:
+      DecodeBase64(c);
+      break;
+    case SIXEL:
+      ProcessSixel(c);
+      break;
+    case TEXT:
+    case PREFIX:
+    case SKIP:
+      break;
+  }
+}
+
+void InlineImageDecoder::Finish(std::vector<InlineImage*>* images,
+                                size_t offset) {
+  State state = state_;
+  state_ = TEXT;
+  if (state == SIXEL) {
+    if (sixel_command_) {
+      OnSixelCommand();
+      sixel_command_ = 0;
+    }
+    uint32_t width = std::min(std::max(used_width_, raster_width_),
+                              kMaxSixelSize);
+    uint32_t height = std::min(std::max(used_height_, raster_height_),
+                               kMaxSixelSize);
+    if (width && height) {
+      GrowRaster(width, height);
+      image_->width = width;
+      image_->height = height;
+      image_->data.resize(width * height * 4);
+      for (uint32_t y = 0; y < height; y++) {
+        memcpy(&image_->data[y * width * 4], &raster_[y * stride_],
+               width * 4);
+      }
+    }
+    std::vector<uint32_t>().swap(raster_);
+  } else if (state == OSC_DATA) {
+    if (base64_count_ >= 2)
+      image_->data.push_back(base64_group_ >> (base64_count_ * 6 - 8));
+    if (base64_count_ == 3)
+      image_->data.push_back(base64_group_ >> 2);
+    GetEncodedSize(image_->data, &image_->width, &image_->height);
+  }
+
+  if (image_ && !image_->data.empty()) {
+    image_->offset = offset;
+    images->push_back(image_);
+    image_ = NULL;
+  } else {
+    delete image_;
+    image_ = NULL;
+  }
+}
+
+void InlineImageDecoder::Abort(const char* reason) {
+  if (state_ != SKIP)
+    LOG("InlineImageDecoder: image dropped, %s\n", reason);
+  state_ = SKIP;
+  delete image_;
+  image_ = NULL;
+  std::vector<uint32_t>().swap(raster_);
+}
+
+bool InlineImageDecoder::ParseOscArgs() {
+  bool is_inline = false;
+  size_t start = 0;
+  while (start < args_.size()) {
+    size_t end = args_.find(';', start);
+    if (end == std::string::npos)
+      end = args_.size();
+    std::string arg = args_.substr(start, end - start);
+    start = end + 1;
+
+    size_t eq = arg.find('=');
+    if (eq == std::string::npos)
+      continue;
+    std::string name = arg.substr(0, eq);
+    std::string value = arg.substr(eq + 1);
+    if (name == "inline") {
+      is_inline = value == "1";
+    } else if (name == "width") {
+      image_->display_width = value;
+    } else if (name == "height") {
+      image_->display_height = value;
+    } else if (name == "preserveAspectRatio") {
+      image_->preserve_aspect_ratio = value != "0";
+    } else if (name == "size") {
+      size_t size = strtoul(value.c_str(), NULL, 10);
+      if (size > kMaxEncodedSize)
+        return false;
+      image_->data.reserve(size);
+    }
+  }
+  // Files that are not inline are downloads in iTerm2, these are left to
+  // ZMODEM.
+  return is_inline;
+}
+
+void InlineImageDecoder::DecodeBase64(unsigned char c) {
+  // Padding, line breaks and whatever else is not in alphabet is skipped.
+  int value = DecodeBase64Char(c);
+  if (value < 0)
+    return;
+  base64_group_ = (base64_group_ << 6) | value;
+  if (++base64_count_ < 4)
+    return;
+  if (image_->data.size() + 3 > kMaxEncodedSize) {
+    Abort("OSC 1337 file is too big");
+    return;
+  }
+  image_->data.push_back(base64_group_ >> 16);
+  image_->data.push_back(base64_group_ >> 8);
+  image_->data.push_back(base64_group_);
+  base64_group_ = 0;
+  base64_count_ = 0;
+}
+
+void InlineImageDecoder::ProcessSixel(unsigned char c) {
+  if (sixel_command_) {
+    if (c >= '0' && c <= '9') {
+      int& param = sixel_params_.back();
+      if (param < kMaxSixelParam)
+        param = param * 10 + (c - '0');
+      return;
+    }
+    if (c == ';') {
+      if (sixel_params_.size() < kMaxSixelParams)
+        sixel_params_.push_back(0);
+      return;
+    }
+    OnSixelCommand();
+    sixel_command_ = 0;
+  }
+
+  if (c >= '?' && c <= '~') {
+    PutSixel(c - '?');
+    return;
+  }
+  switch (c) {
+    case '"':
+    case '#':
+    case '!':
+      sixel_command_ = c;
+      sixel_params_.assign(1, 0);
+      break;
+    case '$':
+      sixel_x_ = 0;
+      break;
+    case '-':
+      sixel_x_ = 0;
+      sixel_y_ += 6;
+      break;
+    default:
+      // Line breaks that encoders add are ignored.
+      break;
+  }
+}
+
+void InlineImageDecoder::OnSixelCommand() {
+  const std::vector<int>& p = sixel_params_;
+  switch (sixel_command_) {
+    case '"':
+      // Pan;Pad;Ph;Pv, aspect ratio is always 1:1 here.
+      if (p.size() >= 4) {
+        raster_width_ = std::min(uint32_t(p[2]), kMaxSixelSize);
+        raster_height_ = std::min(uint32_t(p[3]), kMaxSixelSize);
+      }
+      break;
+    case '#':
+      if (p.size() >= 5)
+        SetColor(p[0], p[1], p[2], p[3], p[4]);
+      color_ = palette_[p[0] % kSixelColors];
+      break;
+    case '!':
+      sixel_repeat_ = std::max(1, std::min(p[0], int(kMaxSixelSize)));
+      break;
+  }
+}
+
+void InlineImageDecoder::PutSixel(unsigned int bits) {
+  uint32_t repeat = sixel_repeat_;
+  sixel_repeat_ = 1;
+  if (sixel_x_ + repeat > kMaxSixelSize || sixel_y_ + 6 > kMaxSixelSize) {
+    Abort("sixel image is too big");
+    return;
+  }
+
+  if (bits) {
+    GrowRaster(sixel_x_ + repeat, sixel_y_ + 6);
+    for (int i = 0; i < 6; i++) {
+      if (!(bits & (1 << i)))
+        continue;
+      uint32_t* row = &raster_[(sixel_y_ + i) * stride_];
+      std::fill(row + sixel_x_, row + sixel_x_ + repeat, color_);
+      used_height_ = std::max(used_height_, sixel_y_ + i + 1);
+    }
+  }
+  sixel_x_ += repeat;
+  used_width_ = std::max(used_width_, sixel_x_);
+}
+
+void InlineImageDecoder::GrowRaster(uint32_t width, uint32_t height) {
+  if (width <= stride_ && height <= rows_)
+    return;
+
+  // Size is usually unknown in advance and the first band grows a sixel at
+  // a time, so the raster is at least doubled.
+  uint32_t stride = stride_;
+  if (width > stride_)
+    stride = std::max(width, std::min(stride_ * 2, kMaxSixelSize));
+  uint32_t rows = rows_;
+  if (height > rows_)
+    rows = std::max(height, std::min(rows_ * 2, kMaxSixelSize));
+
+  std::vector<uint32_t> raster(stride * rows, 0);
+  for (uint32_t y = 0; y < rows_; y++) {
+    std::copy(raster_.begin() + y * stride_,
+              raster_.begin() + (y + 1) * stride_,
+              raster.begin() + y * stride);
+  }
+  raster_.swap(raster);
+  stride_ = stride;
+  rows_ = rows;
+}
+
+void InlineImageDecoder::SetColor(int index, int space, int x, int y, int z) {
+  index %= kSixelColors;
+  if (space == 1) {
+    // HLS with hue rotated by 120 degrees compared to the usual one: blue
+    // is at 0 and red at 120.
+    double h = ((x + 240) % 360) / 60.0;
+    double l = std::min(y, 100) / 100.0;
+    double s = std::min(z, 100) / 100.0;
+    double chroma = (1 - fabs(2 * l - 1)) * s;
+    double second = chroma * (1 - fabs(fmod(h, 2) - 1));
+    double r = 0, g = 0, b = 0;
+    switch (int(h)) {
+      case 0: r = chroma; g = second; break;
+      case 1: r = second; g = chroma; break;
+      case 2: g = chroma; b = second; break;
+      case 3: g = second; b = chroma; break;
+      case 4: r = second; b = chroma; break;
+      default: r = chroma; b = second; break;
+    }
+    double m = l - chroma / 2;
+    palette_[index] = MakePixel(int((r + m) * 255 + 0.5),
+                                int((g + m) * 255 + 0.5),
+                                int((b + m) * 255 + 0.5));
+  } else if (space == 2) {
+    palette_[index] = MakePixel(std::min(x, 100) * 255 / 100,
+                                std::min(y, 100) * 255 / 100,
+                                std::min(z, 100) * 255 / 100);
+  }
+}
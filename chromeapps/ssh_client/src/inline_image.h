@@ -0,0 +1,127 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef INLINE_IMAGE_H
+#define INLINE_IMAGE_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "pthread_helpers.h"
+
+// Image cut out of the terminal output.
+struct InlineImage {
+  enum Format {
+    // |data| is |width| x |height| RGBA pixels, decoded from sixel.
+    RGBA,
+    // |data| is an image file (PNG, JPEG, GIF...) from OSC 1337 which
+    // browser decodes itself. |width| and |height| are taken from PNG, GIF
+    // or JPEG header so the image can be placed before it's decoded, they
+    // are 0 for other formats.
+    ENCODED
+  };
+
+  InlineImage()
+      : format(RGBA), width(0), height(0), preserve_aspect_ratio(true),
+        offset(0) {}
+
+  Format format;
+  uint32_t width;
+  uint32_t height;
+  // OSC 1337 display size as given: N (cells), Npx, N% or auto.
+  std::string display_width;
+  std::string display_height;
+  bool preserve_aspect_ratio;
+  // Position of the image in the terminal output stream.
+  uint64_t offset;
+  std::vector<char> data;
+};
+
+// Recognizes inline image escape sequences in terminal output: sixel
+// (DCS P1;P2;P3 q ... ST) and iTerm2 OSC 1337 ; File=args:base64 (BEL|ST).
+// Their payload is decoded here so megabytes of escape data never go
+// through JSON and hterm's parser, the terminal gets the image instead.
+// Sequences may be split between writes; anything else is passed through.
+class InlineImageDecoder {
+ public:
+  InlineImageDecoder();
+  ~InlineImageDecoder();
+
+  // Returns false if |buf| should go to the terminal unchanged, otherwise
+  // the text is returned in |terminal| and images decoded from this
+  // buffer are appended to |images| with offset relative to |terminal|.
+  // Caller owns the images.
+  bool FilterOutput(const char* buf, size_t count, std::string* terminal,
+                    std::vector<InlineImage*>* images);
+
+ private:
+  enum State {
+    TEXT,
+    // Holding the start of what may be an image sequence.
+    PREFIX,
+    OSC_ARGS,
+    OSC_DATA,
+    SIXEL,
+    // Sequence is too big or broken, dropped until the terminator.
+    SKIP
+  };
+
+  void ProcessPrefix(unsigned char c, std::string* terminal);
+  void StartOsc();
+  void StartSixel();
+  void ProcessBody(unsigned char c);
+  void Finish(std::vector<InlineImage*>* images, size_t offset);
+  // Drops the image, the rest of the sequence is skipped.
+  void Abort(const char* reason);
+
+  bool ParseOscArgs();
+  void DecodeBase64(unsigned char c);
+
+  void ProcessSixel(unsigned char c);
+  void OnSixelCommand();
+  void PutSixel(unsigned int bits);
+  void GrowRaster(uint32_t width, uint32_t height);
+  void SetColor(int index, int space, int x, int y, int z);
+
+  static const size_t kMaxPrefixSize = 32;
+  static const size_t kMaxArgsSize = 4096;
+  static const size_t kMaxEncodedSize = 32 * 1024 * 1024;
+  static const uint32_t kMaxSixelSize = 4096;
+  static const int kSixelColors = 256;
+
+  State state_;
+  std::string prefix_;
+  bool osc_;
+  bool escape_;
+  InlineImage* image_;
+
+  // OSC 1337 state.
+  std::string args_;
+  uint32_t base64_group_;
+  int base64_count_;
+
+  // Sixel state.
+  char sixel_command_;
+  std::vector<int> sixel_params_;
+  uint32_t sixel_x_;
+  uint32_t sixel_y_;
+  uint32_t sixel_repeat_;
+  // Size from raster attributes, if any.
+  uint32_t raster_width_;
+  uint32_t raster_height_;
+  uint32_t used_width_;
+  uint32_t used_height_;
+  // RGBA pixels in memory order, |stride_| x |rows_| allocated.
+  std::vector<uint32_t> raster_;
+  uint32_t stride_;
+  uint32_t rows_;
+  uint32_t palette_[kSixelColors];
+  uint32_t color_;
+
+  DISALLOW_COPY_AND_ASSIGN(InlineImageDecoder);
+};
+
+#endif  // INLINE_IMAGE_H
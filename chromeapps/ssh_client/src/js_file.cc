@@ -13,6 +13,7 @@
 
 #include "file_system.h"
 #include "proxy_stream.h"
+#include "session_log.h"
 
 termios JsFile::tio_ = {};
 
@@ -63,12 +64,15 @@ int JsFileHandler::stat(const char* pathname, nacl_abi_stat* out) {
 
 JsFile::JsFile(int fd, int oflag, OutputInterface* out)
   : ref_(1), fd_(fd), oflag_(oflag), out_(out),
-    factory_(this), out_task_sent_(false), is_open_(false),
-    write_sent_(0), write_acknowledged_(0) {
+    factory_(this), read_received_(0), out_task_sent_(false),
+    is_open_(false), closing_(false), close_sent_(false), write_sent_(0),
+    write_acknowledged_(0), images_size_(0) {
 }
 
 JsFile::~JsFile() {
   assert(!ref_);
+  for (size_t i = 0; i < images_.size(); i++)
+    delete images_[i];
 }
 
 void JsFile::OnOpen(bool success) {
@@ -83,6 +87,16 @@ void JsFile::OnOpen(bool success) {
 void JsFile::OnRead(const char* buf, size_t size) {
   FileSystem* sys = FileSystem::GetFileSystem();
   Mutex::Lock lock(sys->mutex());
+  if (fd_ == 0 && sys->session_log())
+    sys->session_log()->Append(SessionLog::INPUT, buf, size);
+  // Dropped characters are counted too, they are only dropped in
+  // canonical mode and echo is only predicted in raw mode.
+  read_received_ += size;
+  if (fd_ == 0 && sys->zmodem()->is_active()) {
+    sys->zmodem()->OnUserInput(buf, size);
+    sys->cond().broadcast();
+    return;
+  }
   if (isatty()) {
     for (size_t i = 0; i < size; i++) {
       char c = buf[i];
@@ -123,9 +137,12 @@ void JsFile::OnWriteAcknowledge(uint64_t count) {
   FileSystem* sys = FileSystem::GetFileSystem();
   Mutex::Lock lock(sys->mutex());
   assert(write_acknowledged_ <= write_sent_);
+  int ready = readiness();
   write_acknowledged_ = count;
   PostWriteTask(false);
-  sys->cond().broadcast();
+  sys->NotifyIfChanged(this, ready);
+  if (closing_)
+    ContinueClose();
 }
 
 void JsFile::OnClose() {
@@ -133,6 +150,12 @@ void JsFile::OnClose() {
   Mutex::Lock lock(sys->mutex());
   is_open_ = false;
   sys->cond().broadcast();
+  if (closing_) {
+    closing_ = false;
+    sys->RemovePendingClose(fd_);
+    fd_ = -1;
+    release();
+  }
 }
 
 void JsFile::addref() {
@@ -149,28 +172,28 @@ FileStream* JsFile::dup(int fd) {
 }
 
 void JsFile::close() {
-  if (is_open()) {
+  if (is_open() && !closing_) {
     assert(fd_ >= 3);
-    pp::Module::Get()->core()->CallOnMainThread(0,
-        factory_.NewCallback(&JsFile::Close));
-
-    FileSystem* sys = FileSystem::GetFileSystem();
-    while(out_task_sent_)
-      sys->cond().wait(sys->mutex());
-    while(is_open_)
-      sys->cond().wait(sys->mutex());
-
-    fd_ = -1;
+    closing_ = true;
+    addref();
+    FileSystem::GetFileSystem()->AddPendingClose(fd_);
+    ContinueClose();
   }
 }
 
 int JsFile::read(char* buf, size_t count, size_t* nread) {
+  FileSystem* sys = FileSystem::GetFileSystem();
+  if (fd_ == 0 && sys->zmodem()->has_input()) {
+    *nread = sys->zmodem()->ReadInput(buf, count);
+    if (*nread)
+      return 0;
+  }
+
   if (is_open() && in_buf_.empty()) {
     pp::Module::Get()->core()->CallOnMainThread(0,
         factory_.NewCallback(&JsFile::Read, count));
   }
 
-  FileSystem* sys = FileSystem::GetFileSystem();
   if (is_block()) {
     while(is_open() && in_buf_.empty())
       sys->cond().wait(sys->mutex());
@@ -205,9 +228,57 @@ int JsFile::read(char* buf, size_t count, size_t* nread) {
 }
 
 int JsFile::write(const char* buf, size_t count, size_t* nwrote) {
-  if (!is_open())
+  if (!is_open() || closing_)
     return EIO;
 
+  FileSystem* sys = FileSystem::GetFileSystem();
+  *nwrote = count;
+  // ZMODEM does blocking file I/O so it's not used for local echo, which is
+  // written on the main thread.
+  std::string terminal;
+  if (fd_ == 1 && !pp::Module::Get()->core()->IsMainThread() &&
+      sys->zmodem()->FilterOutput(buf, count, &terminal)) {
+    buf = terminal.data();
+    count = terminal.size();
+  }
+
+  // Inline images are decoded here rather than in hterm. Local echo can't
+  // be a part of an image sequence.
+  std::string text;
+  std::vector<InlineImage*> images;
+  if (fd_ == 1 && !pp::Module::Get()->core()->IsMainThread() &&
+      image_decoder_.FilterOutput(buf, count, &text, &images)) {
+    buf = text.data();
+    count = text.size();
+  }
+
+  if (fd_ == 1 && sys->session_log())
+    sys->session_log()->Append(SessionLog::OUTPUT, buf, count);
+
+  if (fd_ == 1 && !pp::Module::Get()->core()->IsMainThread() &&
+      !sys->triggers()->empty()) {
+    std::vector<TriggerMatch> matches;
+    sys->triggers()->Scan(buf, count, write_sent_ + out_buf_.size(),
+                          &matches);
+    if (!matches.empty())
+      out_->SendTriggerMatches(matches);
+  }
+
+  size_t start = 0;
+  for (size_t i = 0; i < images.size(); i++) {
+    AppendOutput(buf + start, images[i]->offset - start);
+    start = images[i]->offset;
+    images[i]->offset = write_sent_ + out_buf_.size();
+    images_size_ += images[i]->data.size();
+    images_.push_back(images[i]);
+  }
+  AppendOutput(buf + start, count - start);
+
+  PostWriteTask(true);
+  return 0;
+}
+
+void JsFile::AppendOutput(const char* buf, size_t count) {
   out_buf_.insert(out_buf_.end(), buf, buf + count);
 
   if (isatty() && (tio_.c_oflag & OPOST) && (tio_.c_oflag & ONLCR)) {
@@ -219,10 +290,6 @@ int JsFile::write(const char* buf, size_t count, size_t* nwrote) {
       }
     }
   }
-
-  *nwrote = count;
-  PostWriteTask(true);
-  return 0;
 }
 
 int JsFile::fstat(nacl_abi_stat* out) {
@@ -304,16 +371,18 @@ bool JsFile::is_read_ready() {
   // HACK: fd_ != 0 is required for reading /dev/random in openssl, it expects
   // that /dev/random has some data ready to read. If there is no data,
   // it won't call read at all.
-  return fd_ != 0 || !in_buf_.empty();
+  return fd_ != 0 || !in_buf_.empty() ||
+      FileSystem::GetFileSystem()->zmodem()->has_input();
 }
 
 bool JsFile::is_write_ready() {
   size_t not_acknowledged = write_sent_ - write_acknowledged_;
-  return (not_acknowledged + out_buf_.size()) < out_->GetWriteWindow();
+  return (not_acknowledged + out_buf_.size() + images_size_) <
+      out_->GetWriteWindow();
 }
 
 void JsFile::PostWriteTask(bool always_post) {
-  if (!out_task_sent_ && !out_buf_.empty() &&
+  if (!out_task_sent_ && (!out_buf_.empty() || !images_.empty()) &&
       (write_sent_ - write_acknowledged_) < out_->GetWriteWindow()) {
     if (always_post || !pp::Module::Get()->core()->IsMainThread()) {
       pp::Module::Get()->core()->CallOnMainThread(
@@ -334,13 +403,26 @@ void JsFile::Write(int32_t result) {
   FileSystem* sys = FileSystem::GetFileSystem();
   Mutex::Lock lock(sys->mutex());
   out_task_sent_ = false;
+  // Output moves from the buffer to the window, so usually the write
+  // readiness stays the same.
+  int ready = readiness();
 
+  WriteImages();
   size_t count = std::min(
       size_t(write_acknowledged_ + out_->GetWriteWindow() - write_sent_),
       out_buf_.size());
+  // Text after an image waits for the next task so the image is placed
+  // between.
+  if (!images_.empty())
+    count = std::min(count, size_t(images_.front()->offset - write_sent_));
   if (count == 0) {
-    LOG("JsFile::Write: %d is not ready for write, cached %d\n",
-        fd_, out_buf_.size());
+    if (!out_buf_.empty() && images_.empty()) {
+      LOG("JsFile::Write: %d is not ready for write, cached %d\n",
+          fd_, out_buf_.size());
+    }
+    sys->NotifyIfChanged(this, ready);
+    if (closing_)
+      ContinueClose();
     return;
   }
 
@@ -352,14 +434,39 @@ void JsFile::Write(int32_t result) {
   if (out_->Write(fd_, &buf[0], count)) {
     write_sent_ += count;
     out_buf_.erase(out_buf_.begin(), out_buf_.begin() + count);
-    sys->cond().broadcast();
+    WriteImages();
+    PostWriteTask(true);
+    sys->NotifyIfChanged(this, ready);
+    if (closing_)
+      ContinueClose();
   } else {
     assert(0);
     PostWriteTask(true);
   }
 }
 
+void JsFile::WriteImages() {
+  while (!images_.empty() && images_.front()->offset == write_sent_) {
+    InlineImage* image = images_.front();
+    images_.pop_front();
+    images_size_ -= image->data.size();
+    out_->WriteImage(fd_, *image);
+    delete image;
+  }
+}
+
+void JsFile::ContinueClose() {
+  // Write task and acknowledgements come back here until all is written.
+  if (close_sent_ || out_task_sent_ || !out_buf_.empty() || !images_.empty())
+    return;
+  close_sent_ = true;
+  pp::Module::Get()->core()->CallOnMainThread(0,
+      factory_.NewCallback(&JsFile::Close));
+}
+
 void JsFile::Close(int32_t result) {
+  FileSystem* sys = FileSystem::GetFileSystem();
+  Mutex::Lock lock(sys->mutex());
   out_->Close(fd_);
 }
 
@@ -10,6 +10,7 @@
 #include "ppapi/cpp/completion_callback.h"
 
 #include "file_system.h"
+#include "inline_image.h"
 #include "pthread_helpers.h"
 
 class JsFile : public FileStream,
@@ -24,6 +25,10 @@ class JsFile : public FileStream,
   int oflag() { return oflag_; }
   bool is_block() { return !(oflag_ & O_NONBLOCK); }
   bool is_open() { return is_open_; }
+  // Bytes JS sent that have been read and bytes written so far, including
+  // the buffered ones. Echo acknowledgements refer to these offsets.
+  uint64_t input_offset() { return read_received_ - in_buf_.size(); }
+  uint64_t output_offset() { return write_sent_ + out_buf_.size(); }
 
   virtual void OnOpen(bool success);
   virtual void OnRead(const char* buf, size_t size);
@@ -50,10 +55,16 @@ class JsFile : public FileStream,
 
  protected:
   void PostWriteTask(bool always_post);
+  void AppendOutput(const char* buf, size_t count);
+  // Sends images that go right after what is already written.
+  void WriteImages();
 
   void Read(int32_t result, size_t size);
   void Write(int32_t result);
   void Close(int32_t result);
+  // Ask JS to close the file once buffered output is written, must be
+  // called with the mutex locked.
+  void ContinueClose();
 
   int ref_;
   int fd_;
@@ -61,11 +72,20 @@ class JsFile : public FileStream,
   OutputInterface* out_;
   pp::CompletionCallbackFactory<JsFile> factory_;
   std::deque<char> in_buf_;
+  uint64_t read_received_;
   std::deque<char> out_buf_;
   bool out_task_sent_;
   bool is_open_;
+  // close() was called, output is flushed and JS closes the file in the
+  // background. Teardown ends when JS acknowledges the close.
+  bool closing_;
+  bool close_sent_;
   uint64_t write_sent_;
   uint64_t write_acknowledged_;
+  // Images cut out of stdout, waiting for the text before them.
+  InlineImageDecoder image_decoder_;
+  std::deque<InlineImage*> images_;
+  size_t images_size_;
   static termios tio_;
 
   DISALLOW_COPY_AND_ASSIGN(JsFile);
@@ -0,0 +1,439 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "known_hosts_index.h"
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+#include <resolv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <zlib.h>
+
+#include <algorithm>
+
+#include "file_system.h"
+#include "mem_file.h"
+
+const size_t KnownHostsIndex::kMaxHosts;
+const size_t KnownHostsIndex::kMaxRangeReads;
+
+static const char kIndexSuffix[] = ".idx";
+static const char kIndexVersion[] = "v2";
+// Index key of the lines without hashed host names.
+static const char kPlainKey[] = "*";
+static const char kHashMagic[] = "|1|";
+static const size_t kReadSize = 64 * 1024;
+
+KnownHostsIndex::KnownHostsIndex(const std::string& path)
+    : path_(path), index_path_(path + kIndexSuffix), fd_(-1),
+      has_data_(false), size_(0), mtime_(0), mtime_nsec_(0), checksum_(0),
+      changed_(false) {
+}
+
+KnownHostsIndex::~KnownHostsIndex() {
+}
+
+bool KnownHostsIndex::ReadFile(const std::string& path, std::string* data) {
+  FileSystem* sys = FileSystem::GetFileSystem();
+  int fd;
+  if (sys->open(path.c_str(), O_RDONLY, 0, &fd))
+    return false;
+
+  data->clear();
+  std::vector<char> buf(kReadSize);
+  size_t nread;
+  while (!sys->read(fd, &buf[0], buf.size(), &nread) &&
+         nread && nread != (size_t)-1) {
+    data->append(&buf[0], nread);
+  }
+  sys->close(fd);
+  return true;
+}
+
+bool KnownHostsIndex::WriteFile(const std::string& path,
+                                const std::string& data) {
+  FileSystem* sys = FileSystem::GetFileSystem();
+  int fd;
+  if (sys->open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600, &fd))
+    return false;
+
+  size_t nwrote = 0;
+  int result = sys->write(fd, data.data(), data.size(), &nwrote);
+  sys->close(fd);
+  return !result && nwrote == data.size();
+}
+
+std::string KnownHostsIndex::GetHostKey(const std::string& host) {
+  // Don't keep plain host names in the index.
+  unsigned char digest[SHA_DIGEST_LENGTH];
+  SHA1((const unsigned char*)host.data(), host.size(), digest);
+  char hex[SHA_DIGEST_LENGTH * 2 + 1];
+  for (size_t i = 0; i < SHA_DIGEST_LENGTH; i++)
+    snprintf(hex + i * 2, 3, "%02x", digest[i]);
+  return hex;
+}
+
+const char* KnownHostsIndex::SkipMarker(const char* begin, const char* end) {
+  // Skip leading whitespace and optional @cert-authority or @revoked marker
+  // the same way hostfile.c does.
+  while (begin < end && (*begin == ' ' || *begin == '\t'))
+    begin++;
+  if (begin < end && *begin == '@') {
+    while (begin < end && *begin != ' ' && *begin != '\t')
+      begin++;
+    while (begin < end && (*begin == ' ' || *begin == '\t'))
+      begin++;
+  }
+  return begin;
+}
+
+bool KnownHostsIndex::IsHashedHost(const char* begin, const char* end) {
+  begin = SkipMarker(begin, end);
+  size_t magic_len = sizeof(kHashMagic) - 1;
+  return end - begin > (ptrdiff_t)magic_len &&
+      strncmp(begin, kHashMagic, magic_len) == 0;
+}
+
+bool KnownHostsIndex::ParseHashedHost(const char* begin, const char* end,
+                                      std::string* salt, std::string* hash) {
+  if (!IsHashedHost(begin, end))
+    return false;
+  begin = SkipMarker(begin, end) + sizeof(kHashMagic) - 1;
+
+  const char* host_end = begin;
+  while (host_end < end && *host_end != ' ' && *host_end != '\t')
+    host_end++;
+  const char* delim = static_cast<const char*>(
+      memchr(begin, '|', host_end - begin));
+  if (!delim)
+    return false;
+
+  unsigned char buf[SHA_DIGEST_LENGTH * 2];
+  std::string b64(begin, delim);
+  if (b64_pton(b64.c_str(), buf, sizeof(buf)) != SHA_DIGEST_LENGTH)
+    return false;
+  salt->assign((const char*)buf, SHA_DIGEST_LENGTH);
+  b64.assign(delim + 1, host_end);
+  if (b64_pton(b64.c_str(), buf, sizeof(buf)) != SHA_DIGEST_LENGTH)
+    return false;
+  hash->assign((const char*)buf, SHA_DIGEST_LENGTH);
+  return true;
+}
+
+void KnownHostsIndex::Load() {
+  size_ = 0;
+  mtime_ = 0;
+  mtime_nsec_ = 0;
+  checksum_ = 0;
+  plain_ = HostEntry();
+  hosts_.clear();
+
+  std::string index;
+  if (!ReadFile(index_path_, &index))
+    return;
+
+  const char* p = index.c_str();
+  char* next;
+  if (strncmp(p, kIndexVersion, sizeof(kIndexVersion) - 1) != 0)
+    return;
+  p += sizeof(kIndexVersion) - 1;
+  size_t size = strtoul(p, &next, 10);
+  p = next;
+  int64_t mtime = strtoll(p, &next, 10);
+  p = next;
+  int64_t mtime_nsec = strtoll(p, &next, 10);
+  p = next;
+  unsigned long checksum = strtoul(p, &next, 10);
+  p = next;
+
+  while (*p) {
+    while (*p == '\n' || *p == ' ')
+      p++;
+    const char* key_begin = p;
+    while (*p && *p != ' ' && *p != '\n')
+      p++;
+    if (p == key_begin)
+      break;
+    std::string key(key_begin, p);
+    HostEntry entry;
+    entry.scanned = strtoul(p, &next, 10);
+    p = next;
+    entry.scanned_lines = strtoul(p, &next, 10);
+    p = next;
+    bool valid = entry.scanned <= size;
+    while (*p == ' ') {
+      Span span;
+      span.line = strtoul(p, &next, 10);
+      if (next == p || *next != ':')
+        break;
+      span.offset = strtoul(next + 1, &next, 10);
+      if (*next != ':')
+        break;
+      span.size = strtoul(next + 1, &next, 10);
+      p = next;
+      if (span.offset + span.size > entry.scanned)
+        valid = false;
+      entry.lines.push_back(span);
+    }
+    if (!valid)
+      continue;
+    if (key == kPlainKey)
+      plain_ = entry;
+    else
+      hosts_[key] = entry;
+  }
+
+  size_ = size;
+  mtime_ = mtime;
+  mtime_nsec_ = mtime_nsec;
+  checksum_ = checksum;
+}
+
+void KnownHostsIndex::Save() {
+  std::string index;
+  char buf[96];
+  snprintf(buf, sizeof(buf), "%s %lu %lld %lld %lu\n", kIndexVersion,
+           (unsigned long)size_, (long long)mtime_, (long long)mtime_nsec_,
+           checksum_);
+  index += buf;
+  HostEntryMap entries(hosts_);
+  entries[kPlainKey] = plain_;
+  for (HostEntryMap::iterator it = entries.begin(); it != entries.end();
+       ++it) {
+    snprintf(buf, sizeof(buf), " %lu %lu",
+             (unsigned long)it->second.scanned, it->second.scanned_lines);
+    index += it->first + buf;
+    const std::vector<Span>& lines = it->second.lines;
+    for (size_t i = 0; i < lines.size(); i++) {
+      snprintf(buf, sizeof(buf), " %lu:%lu:%lu", lines[i].line,
+               (unsigned long)lines[i].offset, (unsigned long)lines[i].size);
+      index += buf;
+    }
+    index += '\n';
+  }
+  if (!WriteFile(index_path_, index))
+    LOG("KnownHostsIndex: can't write %s\n", index_path_.c_str());
+}
+
+bool KnownHostsIndex::Revalidate() {
+  if (!ReadAll())
+    return false;
+  changed_ = true;
+  uLong checksum = adler32(0, NULL, 0);
+  if (size_ <= data_.size())
+    checksum = adler32(checksum, (const Bytef*)data_.data(), size_);
+  if (size_ > data_.size() || checksum != checksum_) {
+    // known_hosts was edited, not just appended.
+    size_ = 0;
+    checksum = adler32(0, NULL, 0);
+    plain_ = HostEntry();
+    hosts_.clear();
+  }
+  checksum_ = adler32(checksum, (const Bytef*)data_.data() + size_,
+                      data_.size() - size_);
+  size_ = data_.size();
+  return true;
+}
+
+bool KnownHostsIndex::Scan(const std::string* host, HostEntry* entry) {
+  if (entry->scanned >= size_)
+    return true;
+  std::string data;
+  if (!ReadRange(entry->scanned, size_ - entry->scanned, &data))
+    return false;
+
+  std::string salt;
+  std::string hash;
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_len;
+  size_t pos = 0;
+  unsigned long linenum = entry->scanned_lines;
+  for (;;) {
+    size_t eol = data.find('\n', pos);
+    // Incomplete last line is not indexed, it will be rescanned next time.
+    if (eol == std::string::npos)
+      break;
+    linenum++;
+    const char* begin = data.data() + pos;
+    const char* end = data.data() + eol;
+    Span line(linenum, entry->scanned + pos, eol + 1 - pos);
+    if (!host) {
+      // Consecutive lines are kept as one span.
+      std::vector<Span>& lines = entry->lines;
+      if (!IsHashedHost(begin, end)) {
+        if (!lines.empty() &&
+            lines.back().offset + lines.back().size == line.offset) {
+          lines.back().size += line.size;
+        } else {
+          lines.push_back(line);
+        }
+      }
+    } else if (ParseHashedHost(begin, end, &salt, &hash)) {
+      HMAC(EVP_sha1(), salt.data(), salt.size(),
+           (const unsigned char*)host->data(), host->size(),
+           digest, &digest_len);
+      if (digest_len == hash.size() &&
+          memcmp(digest, hash.data(), digest_len) == 0) {
+        entry->lines.push_back(line);
+      }
+    }
+    pos = eol + 1;
+  }
+  if (pos)
+    changed_ = true;
+  entry->scanned += pos;
+  entry->scanned_lines = linenum;
+  return true;
+}
+
+bool KnownHostsIndex::ReadAll() {
+  if (has_data_)
+    return true;
+  FileSystem* sys = FileSystem::GetFileSystem();
+  if (sys->seek(fd_, 0, SEEK_SET, NULL))
+    return false;
+  data_.clear();
+  std::vector<char> buf(kReadSize);
+  size_t nread;
+  while (!sys->read(fd_, &buf[0], buf.size(), &nread) &&
+         nread && nread != (size_t)-1) {
+    data_.append(&buf[0], nread);
+  }
+  has_data_ = true;
+  return true;
+}
+
+bool KnownHostsIndex::ReadRange(size_t offset, size_t size,
+                                std::string* data) {
+  if (has_data_) {
+    if (offset + size > data_.size())
+      return false;
+    data->assign(data_, offset, size);
+    return true;
+  }
+
+  FileSystem* sys = FileSystem::GetFileSystem();
+  if (sys->seek(fd_, offset, SEEK_SET, NULL))
+    return false;
+  data->resize(size);
+  size_t done = 0;
+  while (done < size) {
+    size_t nread;
+    if (sys->read(fd_, &(*data)[done], size - done, &nread) ||
+        !nread || nread == (size_t)-1) {
+      return false;
+    }
+    done += nread;
+  }
+  return true;
+}
+
+bool KnownHostsIndex::BuildView(const std::string& host, std::string* view) {
+  FileSystem* sys = FileSystem::GetFileSystem();
+  if (sys->open(path_.c_str(), O_RDONLY, 0, &fd_))
+    return false;
+  bool result = FillView(host, view);
+  sys->close(fd_);
+  fd_ = -1;
+  data_.clear();
+  has_data_ = false;
+  if (result && changed_)
+    Save();
+  return result;
+}
+
+bool KnownHostsIndex::FillView(const std::string& host, std::string* view) {
+  FileSystem* sys = FileSystem::GetFileSystem();
+  nacl_abi_stat st;
+  if (sys->fstat(fd_, &st))
+    return false;
+
+  Load();
+  if (size_ != (size_t)st.nacl_abi_st_size ||
+      mtime_ != st.nacl_abi_st_mtime ||
+      mtime_nsec_ != st.nacl_abi_st_mtimensec) {
+    if (!Revalidate())
+      return false;
+    mtime_ = st.nacl_abi_st_mtime;
+    mtime_nsec_ = st.nacl_abi_st_mtimensec;
+  }
+
+  std::string key = GetHostKey(host);
+  HostEntryMap::iterator it = hosts_.find(key);
+  if (it == hosts_.end()) {
+    if (hosts_.size() >= kMaxHosts)
+      hosts_.clear();
+    it = hosts_.insert(std::make_pair(key, HostEntry())).first;
+  }
+  HostEntry& entry = it->second;
+  if (!Scan(NULL, &plain_) || !Scan(&host, &entry))
+    return false;
+
+  std::vector<Span> lines(plain_.lines.size() + entry.lines.size());
+  std::merge(plain_.lines.begin(), plain_.lines.end(),
+             entry.lines.begin(), entry.lines.end(), lines.begin());
+  // Incomplete last line is kept as is.
+  size_t tail = size_ - plain_.scanned;
+  if (lines.size() + (tail ? 1 : 0) > kMaxRangeReads && !ReadAll())
+    return false;
+
+  view->clear();
+  std::string text;
+  unsigned long linenum = 1;
+  for (size_t i = 0; i < lines.size(); i++) {
+    if (lines[i].line < linenum ||
+        !ReadRange(lines[i].offset, lines[i].size, &text)) {
+      return false;
+    }
+    view->append(lines[i].line - linenum, '\n');
+    view->append(text);
+    linenum = lines[i].line + std::count(text.begin(), text.end(), '\n');
+  }
+  if (linenum > plain_.scanned_lines + 1)
+    return false;
+  view->append(plain_.scanned_lines + 1 - linenum, '\n');
+  if (tail) {
+    if (!ReadRange(plain_.scanned, tail, &text))
+      return false;
+    view->append(text);
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+
+struct hostkeys;
+
+// Original openssh function, renamed by openssh-5.9p1.patch.
+extern "C" void load_hostkeys_linear(struct hostkeys* hostkeys,
+                                     const char* host, const char* path);
+
+extern "C" void load_hostkeys(struct hostkeys* hostkeys, const char* host,
+                              const char* path) {
+  timeval start;
+  gettimeofday(&start, NULL);
+
+  std::string view;
+  if (!KnownHostsIndex(path).BuildView(host, &view)) {
+    load_hostkeys_linear(hostkeys, host, path);
+    return;
+  }
+
+  // Let openssh parse the view instead of the real file. It is safe because
+  // ssh doesn't open known_hosts from other threads.
+  FileSystem* sys = FileSystem::GetFileSystem();
+  sys->AddPathHandler(path, new MemFileHandler(view));
+  load_hostkeys_linear(hostkeys, host, path);
+  sys->RemovePathHandler(path);
+
+  timeval end;
+  gettimeofday(&end, NULL);
+  LOG("load_hostkeys: %s in %s took %d ms\n", host, path,
+      int((end.tv_sec - start.tv_sec) * 1000 +
+          (end.tv_usec - start.tv_usec) / 1000));
+}
@@ -0,0 +1,105 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef KNOWN_HOSTS_INDEX_H
+#define KNOWN_HOSTS_INDEX_H
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "pthread_helpers.h"
+
+// Persistent index of hashed known_hosts entries. Checking "|1|salt|hash"
+// entry requires HMAC-SHA1 of the host name with per-entry salt so openssh
+// computes it for every hashed line on every connection. The index, stored
+// in <known_hosts>.idx, remembers where the lines without hashed host names
+// are and, for each looked up host (by SHA1 of its name), where the hashed
+// lines that matched are and how much of the file was scanned. Only these
+// lines are read while size and modification time of the file are the same
+// as in the index. Otherwise one checksum of the indexed part tells if
+// entries were just appended, they are scanned incrementally then, any
+// other change of the file drops the index.
+class KnownHostsIndex {
+ public:
+  explicit KnownHostsIndex(const std::string& path);
+  ~KnownHostsIndex();
+
+  // Build copy of known_hosts where hashed entries not matching |host| are
+  // replaced with empty lines, so line numbers in openssh messages are still
+  // correct. Return false if known_hosts can't be read.
+  bool BuildView(const std::string& host, std::string* view);
+
+  // Whole file helpers, they go through FileSystem so must be called
+  // without its mutex locked.
+  static bool ReadFile(const std::string& path, std::string* data);
+  static bool WriteFile(const std::string& path, const std::string& data);
+  // Hex SHA1 of |host|, plain host names aren't kept in the files.
+  static std::string GetHostKey(const std::string& host);
+
+ private:
+  // Whole lines of known_hosts starting at |line|, |size| includes the
+  // last newline.
+  struct Span {
+    Span() : line(0), offset(0), size(0) {}
+    Span(unsigned long line, size_t offset, size_t size)
+        : line(line), offset(offset), size(size) {}
+
+    bool operator<(const Span& other) const { return line < other.line; }
+
+    unsigned long line;
+    size_t offset;
+    size_t size;
+  };
+
+  struct HostEntry {
+    HostEntry() : scanned(0), scanned_lines(0) {}
+
+    size_t scanned;
+    unsigned long scanned_lines;
+    std::vector<Span> lines;
+  };
+
+  typedef std::map<std::string, HostEntry> HostEntryMap;
+
+  bool FillView(const std::string& host, std::string* view);
+  void Load();
+  void Save();
+  bool Revalidate();
+  // Scan lines after |entry->scanned| for hashed entries matching |host|,
+  // or for lines without hashed host names if |host| is NULL.
+  bool Scan(const std::string* host, HostEntry* entry);
+  bool ReadAll();
+  bool ReadRange(size_t offset, size_t size, std::string* data);
+
+  static const char* SkipMarker(const char* begin, const char* end);
+  static bool IsHashedHost(const char* begin, const char* end);
+  static bool ParseHashedHost(const char* begin, const char* end,
+                              std::string* salt, std::string* hash);
+
+  static const size_t kMaxHosts = 256;
+  // Views needing more reads than this read the whole file at once.
+  static const size_t kMaxRangeReads = 16;
+
+  std::string path_;
+  std::string index_path_;
+  int fd_;
+  // Whole known_hosts once it had to be read.
+  std::string data_;
+  bool has_data_;
+  size_t size_;
+  int64_t mtime_;
+  int64_t mtime_nsec_;
+  unsigned long checksum_;
+  bool changed_;
+  // Lines without hashed host names, they are in every view.
+  HostEntry plain_;
+  HostEntryMap hosts_;
+
+  DISALLOW_COPY_AND_ASSIGN(KnownHostsIndex);
+};
+
+#endif  // KNOWN_HOSTS_INDEX_H
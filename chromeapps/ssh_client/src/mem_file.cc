@@ -0,0 +1,123 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mem_file.h"
+
+#include <algorithm>
+
+#include <assert.h>
+#include <string.h>
+
+MemFileHandler::MemFileHandler(const std::string& data)
+    : ref_(1), data_(data) {
+}
+
+MemFileHandler::~MemFileHandler() {
+  assert(!ref_);
+}
+
+void MemFileHandler::addref() {
+  ++ref_;
+}
+
+void MemFileHandler::release() {
+  if (!--ref_)
+    delete this;
+}
+
+FileStream* MemFileHandler::open(int fd, const char* pathname, int oflag) {
+  if ((oflag & O_ACCMODE) != O_RDONLY)
+    return NULL;
+  return new MemFile(fd, oflag, data_);
+}
+
+int MemFileHandler::stat(const char* pathname, nacl_abi_stat* out) {
+  memset(out, 0, sizeof(nacl_abi_stat));
+  out->nacl_abi_st_size = data_.size();
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+
+MemFile::MemFile(int fd, int oflag, const std::string& data)
+  : ref_(1), fd_(fd), oflag_(oflag), data_(data), offset_(0) {
+}
+
+MemFile::~MemFile() {
+  assert(!ref_);
+}
+
+void MemFile::addref() {
+  ++ref_;
+}
+
+void MemFile::release() {
+  if (!--ref_)
+    delete this;
+}
+
+FileStream* MemFile::dup(int fd) {
+  return new MemFile(fd, oflag_, data_);
+}
+
+void MemFile::close() {
+  fd_ = -1;
+}
+
+int MemFile::read(char* buf, size_t count, size_t* nread) {
+  *nread = 0;
+  if (offset_ < data_.size()) {
+    *nread = std::min(count, data_.size() - offset_);
+    memcpy(buf, data_.data() + offset_, *nread);
+    offset_ += *nread;
+  }
+  return 0;
+}
+
+int MemFile::write(const char* buf, size_t count, size_t* nwrote) {
+  return EBADF;
+}
+
+int MemFile::seek(nacl_abi_off_t offset, int whence,
+                  nacl_abi_off_t* new_offset) {
+  nacl_abi_off_t base;
+  switch (whence) {
+    case SEEK_SET:
+      base = 0;
+      break;
+    case SEEK_CUR:
+      base = offset_;
+      break;
+    case SEEK_END:
+      base = data_.size();
+      break;
+    default:
+      if (new_offset)
+        *new_offset = -1;
+      return EINVAL;
+  }
+  if (base + offset < 0)
+    return EINVAL;
+  offset_ = base + offset;
+  if (new_offset)
+    *new_offset = offset_;
+  return 0;
+}
+
+int MemFile::fstat(nacl_abi_stat* out) {
+  memset(out, 0, sizeof(nacl_abi_stat));
+  out->nacl_abi_st_size = data_.size();
+  return 0;
+}
+
+int MemFile::fcntl(int cmd, va_list ap) {
+  if (cmd == F_GETFL) {
+    return oflag_;
+  } else if (cmd == F_SETFL) {
+    oflag_ = va_arg(ap, long);
+    return 0;
+  } else {
+    return -1;
+  }
+}
@@ -0,0 +1,60 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef MEM_FILE_H
+#define MEM_FILE_H
+
+#include <string>
+
+#include "file_interfaces.h"
+#include "pthread_helpers.h"
+
+// Read-only file with content kept in memory.
+class MemFileHandler : public PathHandler {
+ public:
+  explicit MemFileHandler(const std::string& data);
+  virtual ~MemFileHandler();
+
+  virtual void addref();
+  virtual void release();
+
+  virtual FileStream* open(int fd, const char* pathname, int oflag);
+  virtual int stat(const char* pathname, nacl_abi_stat* out);
+
+ private:
+  int ref_;
+  std::string data_;
+
+  DISALLOW_COPY_AND_ASSIGN(MemFileHandler);
+};
+
+class MemFile : public FileStream {
+ public:
+  MemFile(int fd, int oflag, const std::string& data);
+  virtual ~MemFile();
+
+  virtual void addref();
+  virtual void release();
+  virtual FileStream* dup(int fd);
+
+  virtual void close();
+  virtual int read(char* buf, size_t count, size_t* nread);
+  virtual int write(const char* buf, size_t count, size_t* nwrote);
+  virtual int seek(nacl_abi_off_t offset, int whence,
+                   nacl_abi_off_t* new_offset);
+  virtual int fstat(nacl_abi_stat* out);
+
+  virtual int fcntl(int cmd,  va_list ap);
+
+ private:
+  int ref_;
+  int fd_;
+  int oflag_;
+  std::string data_;
+  size_t offset_;
+
+  DISALLOW_COPY_AND_ASSIGN(MemFile);
+};
+
+#endif  // MEM_FILE_H
@@ -0,0 +1,343 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mont_exp.h"
+
+#include <string.h>
+#include <sys/time.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <openssl/crypto.h>
+#include <openssl/dh.h>
+#include <openssl/rsa.h>
+
+#include "pthread_helpers.h"
+
+typedef uint32_t Word;
+typedef uint64_t DWord;
+
+const int MontExp::kMaxBits;
+
+static Mutex stats_mutex;
+static uint32_t stats_calls = 0;
+static uint64_t stats_usec = 0;
+
+static RSA_METHOD rsa_method;
+static DH_METHOD dh_method;
+
+// 1024-bit known answers: a^p mod m for a full size exponent, which is
+// the size of RSA-2048 CRT halves, and for the usual public exponent.
+static const char kKatModulus[] =
+    "B6B8DF02CC34FBC059B7CF227459A938EBC49189F5BD6D5B5B62A5806F9E2874"
+    "BE7EA2AC0356A08D6F74A7AE0539224089969DECF5C4497C46271D27D582B559"
+    "9859778A6DB610794E2B2FD5F3B83B295EF39B377F89B8C2AFF15E4C0453377D"
+    "D9476DC26E42800F4D70481547B4370DD2E270F91FC641862EBC12938BFB2FCF";
+static const char kKatBase[] =
+    "04C8B9D6C6209AA5F643BAFC8BC35B750A4095AA5951BD13A18172E5C98BCC2A"
+    "6E465AC15FE469FDCFC147751376A042DD6CF94646F77426FFDB58A3B0D0A659"
+    "796A466B4CE2446CF661A7D9AADDA2C6179D87AA21D8CAC943059C7628E3549E"
+    "D4DBB0D3A4CDE252D7A86F737743B973695D9FC80B8C4F89B9182228ABEACDE4";
+static const char kKatExponent[] =
+    "8013BC39BA0CDC5AE47A1D708F19AE57346E878EF3977952B6E80C86042F0D86"
+    "7905EBFDE2BD81BC3494A278F1FC7B639263D25F7899B684BEBAD17EC7B66F89"
+    "AF7597882A82D663D065CFF5E65B15360CD30B6F2BBA4C5C43E65A013DDC169D"
+    "560A8C54733C8199DE5F50F90A7FE23939CBBAB7DDEBC93EAAE2BBE446EC4FB9";
+static const char kKatResult[] =
+    "0F34C4A4AAFD929041476E83E98610DF57356FD44441EB46D27B37211A0C0050"
+    "551B27345288D884A249D0FE6CA3F50C38F8C6D653BA7C5E35D530B0BFD69551"
+    "3511071E2DA0B550D3B6735579B9C2F554203C093AF63BFCE3E5628CDBB163D3"
+    "1EB0F3C99A30660DBB21461D720DE04C17BD02AF3CF934550F54A3C747245198";
+static const char kKatPublicResult[] =
+    "3A29D23FD957B5968B450DFB87659BC6094A655E0059F85F1CEA8E8326F0E69A"
+    "81A4937B8FC57BA9F44B45855B44A84D55A451B353FEF058948A7FFBB05FE0BD"
+    "5B322F84E8D78E0CF85F4E06B0DE17636156306F1733F59B1DA9901135E9ED69"
+    "6794B244BDDB6E8D9D7419428B6C9C57F073871A6E3E672F25E9B09402EFFC90";
+
+static int64_t GetTimeUsec() {
+  timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+// Little endian words of |bn|, which must fit in |n| words.
+static void ToWords(const BIGNUM* bn, Word* words, int n) {
+  std::vector<unsigned char> bytes(n * 4);
+  BN_bn2bin(bn, &bytes[n * 4 - BN_num_bytes(bn)]);
+  for (int i = 0; i < n; i++) {
+    const unsigned char* p = &bytes[(n - 1 - i) * 4];
+    words[i] = (Word(p[0]) << 24) | (Word(p[1]) << 16) | (Word(p[2]) << 8) |
+        p[3];
+  }
+  OPENSSL_cleanse(&bytes[0], bytes.size());
+}
+
+static bool FromWords(const Word* words, int n, BIGNUM* bn) {
+  std::vector<unsigned char> bytes(n * 4);
+  for (int i = 0; i < n; i++) {
+    unsigned char* p = &bytes[(n - 1 - i) * 4];
+    p[0] = words[i] >> 24;
+    p[1] = words[i] >> 16;
+    p[2] = words[i] >> 8;
+    p[3] = words[i];
+  }
+  bool result = BN_bin2bn(&bytes[0], bytes.size(), bn) != NULL;
+  OPENSSL_cleanse(&bytes[0], bytes.size());
+  return result;
+}
+
+// -m^-1 mod 2^32 for odd m. Each Newton step doubles the correct bits,
+// m0 itself is its inverse modulo 8.
+static Word GetMontFactor(Word m0) {
+  Word inv = m0;
+  for (int i = 0; i < 4; i++)
+    inv *= 2 - m0 * inv;
+  return 0 - inv;
+}
+
+// r = a * b / 2^(32n) mod m, for a, b < m. |t| has room for n + 1 words,
+// |r| may be the same as |a| or |b|.
+static void MontMul(Word* r, const Word* a, const Word* b, const Word* m,
+                    Word m0inv, int n, Word* t) {
+  memset(t, 0, (n + 1) * sizeof(Word));
+  for (int i = 0; i < n; i++) {
+    // t = (t + a * b[i] + q * m) / 2^32 with q that zeroes the low word.
+    // Product and reduction carries are separate chains in one pass.
+    Word bi = b[i];
+    DWord c = DWord(a[0]) * bi + t[0];
+    Word q = Word(c) * m0inv;
+    DWord d = (DWord(q) * m[0] + Word(c)) >> 32;
+    c >>= 32;
+    for (int j = 1; j < n; j++) {
+      c += DWord(a[j]) * bi + t[j];
+      d += DWord(q) * m[j] + Word(c);
+      t[j - 1] = Word(d);
+      c >>= 32;
+      d >>= 32;
+    }
+    c += t[n];
+    d += Word(c);
+    t[n - 1] = Word(d);
+    t[n] = Word(c >> 32) + Word(d >> 32);
+  }
+
+  // t < 2m, subtract m unless that borrows past t[n]. Selected with a
+  // mask so timing doesn't show which.
+  Word borrow = 0;
+  for (int j = 0; j < n; j++) {
+    DWord d = DWord(t[j]) - m[j] - borrow;
+    r[j] = Word(d);
+    borrow = Word(d >> 32) & 1;
+  }
+  Word keep = 0 - (~t[n] & borrow & 1);
+  for (int j = 0; j < n; j++)
+    r[j] = (r[j] & ~keep) | (t[j] & keep);
+}
+
+// Same window sizes as BN_mod_exp_mont_consttime uses.
+static int GetWindowBits(int bits) {
+  if (bits > 937)
+    return 6;
+  if (bits > 306)
+    return 5;
+  if (bits > 89)
+    return 4;
+  if (bits > 22)
+    return 3;
+  return 1;
+}
+
+static Word GetWindow(const Word* e, int pos, int w) {
+  Word value = 0;
+  for (int i = w - 1; i >= 0; i--)
+    value = (value << 1) | ((e[(pos + i) / 32] >> ((pos + i) % 32)) & 1);
+  return value;
+}
+
+// Copy table entry |index| reading every entry, for secret exponents.
+static void Gather(Word* r, const Word* table, int size, Word index, int n) {
+  memset(r, 0, n * sizeof(Word));
+  for (int k = 0; k < size; k++) {
+    Word diff = Word(k) ^ index;
+    Word mask = ((diff | (0 - diff)) >> 31) - 1;
+    const Word* entry = table + k * n;
+    for (int j = 0; j < n; j++)
+      r[j] |= entry[j] & mask;
+  }
+}
+
+static int RsaModExp(BIGNUM* r, const BIGNUM* a, const BIGNUM* p,
+                     const BIGNUM* m, BN_CTX* ctx, BN_MONT_CTX* m_ctx) {
+  return MontExp::ModExp(r, a, p, m, ctx);
+}
+
+static int DhModExp(const DH* dh, BIGNUM* r, const BIGNUM* a,
+                    const BIGNUM* p, const BIGNUM* m, BN_CTX* ctx,
+                    BN_MONT_CTX* m_ctx) {
+  return MontExp::ModExp(r, a, p, m, ctx);
+}
+
+bool MontExp::ModExp(BIGNUM* r, const BIGNUM* a, const BIGNUM* p,
+                     const BIGNUM* m, BN_CTX* ctx) {
+  int64_t start = GetTimeUsec();
+  bool secret = BN_get_flags(p, BN_FLG_CONSTTIME) != 0;
+  int mbits = BN_num_bits(m);
+  if (!BN_is_odd(m) || mbits > kMaxBits || BN_is_negative(p)) {
+    if (secret)
+      return BN_mod_exp_mont_consttime(r, a, p, m, ctx, NULL);
+    return BN_mod_exp(r, a, p, m, ctx);
+  }
+
+  int bits = BN_num_bits(p);
+  if (bits == 0) {
+    if (BN_is_one(m)) {
+      BN_zero(r);
+      return true;
+    }
+    return BN_one(r);
+  }
+
+  BN_CTX_start(ctx);
+  bool result = false;
+  BIGNUM* base = BN_CTX_get(ctx);
+  BIGNUM* rr = BN_CTX_get(ctx);
+  int n = (mbits + 31) / 32;
+  int w = GetWindowBits(bits);
+  int size = 1 << w;
+  std::vector<Word> words(n * 6 + 1);
+  Word* mw = &words[0];
+  Word* acc = mw + n;
+  Word* tmp = acc + n;
+  Word* rrw = tmp + n;
+  Word* one = rrw + n;
+  Word* t = one + n;
+  std::vector<Word> table(size * n);
+  std::vector<Word> e((bits + 31) / 32);
+
+  // R^2 mod m with R = 2^(32n) takes values into Montgomery form.
+  if (rr && BN_nnmod(base, a, m, ctx) && BN_set_bit(rr, 64 * n) &&
+      BN_mod(rr, rr, m, ctx)) {
+    ToWords(m, mw, n);
+    ToWords(rr, rrw, n);
+    ToWords(base, tmp, n);
+    ToWords(p, &e[0], e.size());
+    Word m0inv = GetMontFactor(mw[0]);
+
+    // Table of base^i in Montgomery form, entry 0 is R mod m.
+    one[0] = 1;
+    MontMul(&table[0], rrw, one, mw, m0inv, n, t);
+    MontMul(&table[n], tmp, rrw, mw, m0inv, n, t);
+    for (int i = 2; i < size; i++)
+      MontMul(&table[i * n], &table[(i - 1) * n], &table[n], mw, m0inv, n, t);
+
+    int pos = (bits - 1) / w * w;
+    Word window = GetWindow(&e[0], pos, std::min(w, bits - pos));
+    if (secret)
+      Gather(acc, &table[0], size, window, n);
+    else
+      memcpy(acc, &table[window * n], n * sizeof(Word));
+    for (pos -= w; pos >= 0; pos -= w) {
+      for (int i = 0; i < w; i++)
+        MontMul(acc, acc, acc, mw, m0inv, n, t);
+      window = GetWindow(&e[0], pos, w);
+      if (secret) {
+        Gather(tmp, &table[0], size, window, n);
+        MontMul(acc, acc, tmp, mw, m0inv, n, t);
+      } else if (window) {
+        MontMul(acc, acc, &table[window * n], mw, m0inv, n, t);
+      }
+    }
+
+    // Multiplying by plain 1 takes the result out of Montgomery form.
+    MontMul(acc, acc, one, mw, m0inv, n, t);
+    result = FromWords(acc, n, r);
+  }
+
+  OPENSSL_cleanse(&e[0], e.size() * sizeof(Word));
+  OPENSSL_cleanse(&table[0], table.size() * sizeof(Word));
+  OPENSSL_cleanse(&words[0], words.size() * sizeof(Word));
+  BN_CTX_end(ctx);
+
+  Mutex::Lock lock(stats_mutex);
+  stats_calls++;
+  stats_usec += GetTimeUsec() - start;
+  return result;
+}
+
+void MontExp::GetStats(uint32_t* calls, uint64_t* usec) {
+  Mutex::Lock lock(stats_mutex);
+  *calls = stats_calls;
+  *usec = stats_usec;
+}
+
+bool MontExp::Install() {
+  BN_CTX* ctx = BN_CTX_new();
+  BIGNUM* m = NULL;
+  BIGNUM* a = NULL;
+  BIGNUM* p = NULL;
+  BIGNUM* expected = NULL;
+  BIGNUM* expected_public = NULL;
+  BIGNUM* r = BN_new();
+  BIGNUM* e = BN_new();
+  bool passed = false;
+  int64_t time_usec = 0;
+  int64_t openssl_usec = 0;
+  if (ctx && r && e && BN_hex2bn(&m, kKatModulus) &&
+      BN_hex2bn(&a, kKatBase) && BN_hex2bn(&p, kKatExponent) &&
+      BN_hex2bn(&expected, kKatResult) &&
+      BN_hex2bn(&expected_public, kKatPublicResult) &&
+      BN_set_word(e, RSA_F4)) {
+    BN_set_flags(p, BN_FLG_CONSTTIME);
+    passed = ModExp(r, a, e, m, ctx) && !BN_cmp(r, expected_public);
+    // Same private size exponentiation in OpenSSL is timed too, which one
+    // is faster depends on the architecture. Best of two runs each.
+    for (int i = 0; i < 2 && passed; i++) {
+      int64_t start = GetTimeUsec();
+      passed = ModExp(r, a, p, m, ctx) && !BN_cmp(r, expected);
+      int64_t usec = GetTimeUsec() - start;
+      if (!i || usec < time_usec)
+        time_usec = usec;
+      start = GetTimeUsec();
+      BN_mod_exp_mont_consttime(r, a, p, m, ctx, NULL);
+      usec = GetTimeUsec() - start;
+      if (!i || usec < openssl_usec)
+        openssl_usec = usec;
+    }
+  }
+  BN_free(expected_public);
+  BN_free(expected);
+  BN_free(p);
+  BN_free(a);
+  BN_free(m);
+  BN_free(e);
+  BN_free(r);
+  BN_CTX_free(ctx);
+
+  // The known answer runs don't count.
+  {
+    Mutex::Lock lock(stats_mutex);
+    stats_calls = 0;
+    stats_usec = 0;
+  }
+  if (!passed) {
+    LOG("MontExp: known answer test failed, using OpenSSL\n");
+    return false;
+  }
+  LOG("MontExp: 1024-bit modexp %d us, OpenSSL %d us\n",
+      int(time_usec), int(openssl_usec));
+  if (time_usec >= openssl_usec)
+    return false;
+
+  rsa_method = *RSA_get_default_method();
+  rsa_method.name = "RSA with MontExp";
+  rsa_method.bn_mod_exp = &RsaModExp;
+  RSA_set_default_method(&rsa_method);
+
+  dh_method = *DH_get_default_method();
+  dh_method.name = "DH with MontExp";
+  dh_method.bn_mod_exp = &DhModExp;
+  DH_set_default_method(&dh_method);
+  return true;
+}
@@ -0,0 +1,36 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef MONT_EXP_H
+#define MONT_EXP_H
+
+#include <stdint.h>
+
+#include <openssl/bn.h>
+
+// Modular exponentiation for RSA and DH. OpenSSL in NaCl builds has no
+// assembly, its generic code multiplies and reduces in separate passes
+// with BN_CTX temporaries. Here Montgomery multiplication interleaves
+// both (CIOS) in 32-bit words, which every NaCl target multiplies to 64
+// bits natively, and exponentiation uses a fixed window. Exponents marked
+// BN_FLG_CONSTTIME read the window table with masks only, so neither the
+// operations nor the memory accesses depend on the exponent.
+class MontExp {
+ public:
+  // Check the known answers, then make default RSA and DH methods use
+  // ModExp() if it is faster than OpenSSL on this architecture. Keys and
+  // groups created before this keep their method.
+  static bool Install();
+
+  // r = a^p mod m. Moduli that are even or over kMaxBits go to OpenSSL.
+  static bool ModExp(BIGNUM* r, const BIGNUM* a, const BIGNUM* p,
+                     const BIGNUM* m, BN_CTX* ctx);
+
+  // Exponentiations done by ModExp() and time spent in them.
+  static void GetStats(uint32_t* calls, uint64_t* usec);
+
+  static const int kMaxBits = 16384;
+};
+
+#endif  // MONT_EXP_H
@@ -0,0 +1,890 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mosh_client.h"
+
+#include <algorithm>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <zlib.h>
+
+#include "file_system.h"
+
+// Protocol constants from mosh 1.2 sources.
+static const uint64_t kProtocolVersion = 2;
+// State number of the last state, sent to end the session.
+static const uint64_t kShutdownNum = uint64_t(-1);
+static const int kNoTimestamp = 0xffff;
+// Sequence numbers of packets to the client have the top bit set.
+static const uint64_t kToClient = uint64_t(1) << 63;
+// Fragment id and number with the "final" bit.
+static const size_t kFragmentHeaderSize = 10;
+static const size_t kMaxFragments = 4096;
+
+// Field numbers of transport instruction.
+static const int kInstProtocolVersion = 1;
+static const int kInstOldNum = 2;
+static const int kInstNewNum = 3;
+static const int kInstAckNum = 4;
+static const int kInstThrowawayNum = 5;
+static const int kInstDiff = 6;
+
+// Field numbers of user and host messages.
+static const int kMessageInstruction = 1;
+static const int kUserKeystroke = 2;
+static const int kUserResize = 3;
+static const int kKeystrokeKeys = 4;
+static const int kResizeWidth = 5;
+static const int kResizeHeight = 6;
+static const int kHostBytes = 2;
+static const int kHostBytesString = 4;
+static const int kEchoAck = 7;
+static const int kEchoAckNum = 8;
+
+// Ctrl-^ starts escape sequence, "." after it ends the session.
+static const char kEscapeKey = 0x1e;
+
+// Terminal goes to the alternate screen for the session, mosh screens are
+// drawn over a blank one.
+static const char kEnterScreen[] = "\x1b[?1049h\x1b[H\x1b[2J";
+static const char kLeaveScreen[] = "\x1b[?1049l\r\n";
+
+const int64_t MoshClient::kConnectTimeoutMs;
+const int64_t MoshClient::kAckDelayMs;
+const int64_t MoshClient::kHeartbeatIntervalMs;
+const int64_t MoshClient::kMinTimeoutMs;
+const int64_t MoshClient::kMaxTimeoutMs;
+const int64_t MoshClient::kPortHopIntervalMs;
+const int64_t MoshClient::kShutdownTimeoutMs;
+const size_t MoshClient::kMaxFragmentSize;
+const size_t MoshClient::kMaxPacketSize;
+const size_t MoshClient::kMaxPayloadSize;
+const size_t MoshClient::kMaxInputStates;
+
+volatile bool MoshClient::window_changed_ = false;
+
+static int64_t GetTimeMs() {
+  timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+}
+
+static void PutUInt16(std::string* out, uint16_t value) {
+  out->push_back(value >> 8);
+  out->push_back(value);
+}
+
+static void PutUInt64(std::string* out, uint64_t value) {
+  for (int shift = 56; shift >= 0; shift -= 8)
+    out->push_back(value >> shift);
+}
+
+static uint16_t ReadUInt16(const char* p) {
+  const uint8_t* u = reinterpret_cast<const uint8_t*>(p);
+  return (uint16_t(u[0]) << 8) | u[1];
+}
+
+static uint64_t ReadUInt64(const char* p) {
+  const uint8_t* u = reinterpret_cast<const uint8_t*>(p);
+  uint64_t value = 0;
+  for (int i = 0; i < 8; i++)
+    value = (value << 8) | u[i];
+  return value;
+}
+
+// Protocol buffers encoding, only varint and length delimited fields are
+// used by mosh.
+static void PutVarint(std::string* out, uint64_t value) {
+  while (value >= 0x80) {
+    out->push_back((value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+  out->push_back(value);
+}
+
+static void PutVarintField(std::string* out, int field, uint64_t value) {
+  PutVarint(out, field << 3);
+  PutVarint(out, value);
+}
+
+static void PutBytesField(std::string* out, int field,
+                          const std::string& value) {
+  PutVarint(out, (field << 3) | 2);
+  PutVarint(out, value.size());
+  out->append(value);
+}
+
+static bool GetVarint(const std::string& in, size_t* pos, uint64_t* value) {
+  *value = 0;
+  for (int shift = 0; shift < 64 && *pos < in.size(); shift += 7) {
+    uint8_t byte = in[(*pos)++];
+    *value |= uint64_t(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+// Read the next field, |value| is set for varints and |bytes| for length
+// delimited fields. Fixed size fields are skipped.
+static bool GetField(const std::string& in, size_t* pos, int* field,
+                     uint64_t* value, std::string* bytes) {
+  uint64_t key;
+  if (!GetVarint(in, pos, &key))
+    return false;
+  *field = key >> 3;
+  switch (key & 7) {
+    case 0:
+      return GetVarint(in, pos, value);
+    case 1:
+      if (in.size() - *pos < 8)
+        return false;
+      *pos += 8;
+      return true;
+    case 2: {
+      uint64_t size;
+      if (!GetVarint(in, pos, &size) || in.size() - *pos < size)
+        return false;
+      bytes->assign(in, *pos, size);
+      *pos += size;
+      return true;
+    }
+    case 5:
+      if (in.size() - *pos < 4)
+        return false;
+      *pos += 4;
+      return true;
+  }
+  return false;
+}
+
+static std::string Compress(const std::string& data) {
+  uLongf size = compressBound(data.size());
+  std::string out(size, 0);
+  if (compress(reinterpret_cast<Bytef*>(&out[0]), &size,
+               reinterpret_cast<const Bytef*>(data.data()),
+               data.size()) != Z_OK) {
+    return std::string();
+  }
+  out.resize(size);
+  return out;
+}
+
+static bool Uncompress(const std::string& data, size_t max_size,
+                       std::string* out) {
+  z_stream stream = {};
+  if (inflateInit(&stream) != Z_OK)
+    return false;
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  stream.avail_in = data.size();
+  out->clear();
+  int result = Z_OK;
+  char buf[16 * 1024];
+  while (result == Z_OK && out->size() <= max_size) {
+    stream.next_out = reinterpret_cast<Bytef*>(buf);
+    stream.avail_out = sizeof(buf);
+    result = inflate(&stream, Z_NO_FLUSH);
+    out->append(buf, sizeof(buf) - stream.avail_out);
+  }
+  inflateEnd(&stream);
+  return result == Z_STREAM_END && out->size() <= max_size;
+}
+
+// Key is 16 bytes in base64 without padding.
+static bool DecodeKey(const std::string& text, uint8_t* key) {
+  static const char kAlphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  if (text.size() != 22)
+    return false;
+  uint32_t bits = 0;
+  int count = 0;
+  size_t size = 0;
+  for (size_t i = 0; i < text.size(); i++) {
+    const char* p = strchr(kAlphabet, text[i]);
+    if (!p || !*p)
+      return false;
+    bits = (bits << 6) | (p - kAlphabet);
+    count += 6;
+    if (count >= 8) {
+      count -= 8;
+      if (size < OcbCipher::kKeySize)
+        key[size++] = bits >> count;
+    }
+  }
+  return size == OcbCipher::kKeySize;
+}
+
+//------------------------------------------------------------------------------
+
+MoshClient::MoshClient(FileStream* output)
+  : output_(output), thread_(), tty_fd_(-1), socket_fd_(-1),
+    server_addr_(), server_addr_len_(0), saved_tio_(), width_(0), height_(0),
+    escape_(false), send_seq_(0), fragment_id_(0),
+    saved_timestamp_(-1), saved_timestamp_ms_(0), srtt_ms_(0), rttvar_ms_(0),
+    rtt_hit_(false), events_base_(0), sent_num_(0), acked_num_(0),
+    last_send_ms_(0), ack_due_ms_(0), shutdown_(false), shutdown_ms_(0),
+    input_offset_(0), echo_acked_num_(0), echo_acked_offset_(0),
+    remote_num_(0), fragments_id_(0), fragments_total_(0),
+    fragments_count_(0), last_heard_ms_(0), last_port_hop_ms_(0) {
+  output_->addref();
+  sent_states_[0] = 0;
+}
+
+MoshClient::~MoshClient() {
+  output_->release();
+}
+
+std::string MoshClient::GetServerCommand(const Params& params) {
+  // Server binds to the address ssh connected to and needs UTF-8 locale.
+  std::string command = params.server + " new -s -c 256 -l LANG=en_US.UTF-8";
+  if (!params.command.empty())
+    command += " -- " + params.command;
+  return command;
+}
+
+bool MoshClient::Start(const Params& params) {
+  if (params.host.empty() || params.server.empty())
+    return false;
+  params_ = params;
+  return !pthread_create(&thread_, NULL, &MoshClient::SessionThread, this);
+}
+
+void* MoshClient::SessionThread(void* arg) {
+  MoshClient* client = static_cast<MoshClient*>(arg);
+  client->SessionThreadImpl();
+  return NULL;
+}
+
+void MoshClient::SessionThreadImpl() {
+  FileSystem* sys = FileSystem::GetFileSystem();
+  int status = 1;
+  if (OpenTerminal()) {
+    if (ReadConnectLine()) {
+      if (OpenSocket())
+        status = Run();
+      else
+        WriteTerminal("mosh: can't reach " + params_.host + "\r\n");
+    } else {
+      Mutex::Lock lock(sys->mutex());
+      if (sys->held_exit_status())
+        status = sys->held_exit_status();
+    }
+    CloseSocket();
+    CloseTerminal();
+  }
+
+  // Session ends with mosh, after ssh has exited.
+  {
+    Mutex::Lock lock(sys->mutex());
+    while (!sys->has_held_exit())
+      sys->cond().wait(sys->mutex());
+  }
+  sys->HoldExit(false);
+  exit(status);
+}
+
+bool MoshClient::ReadConnectLine() {
+  FileSystem* sys = FileSystem::GetFileSystem();
+  Mutex::Lock lock(sys->mutex());
+  // ssh output is read until it exits, so it doesn't restore the terminal
+  // mode after the session set it.
+  bool found = false;
+  bool eof = false;
+  std::string line;
+  std::string text;
+  while (!sys->has_held_exit()) {
+    if (eof || !output_->is_read_ready()) {
+      sys->cond().wait(sys->mutex());
+      continue;
+    }
+    char buf[1024];
+    size_t nread;
+    if (output_->read(buf, sizeof(buf), &nread) || !nread) {
+      eof = true;
+      continue;
+    }
+    for (size_t i = 0; i < nread; i++) {
+      if (buf[i] == '\n') {
+        if (!line.empty() && line[line.size() - 1] == '\r')
+          line.resize(line.size() - 1);
+        if (!found && ParseConnectLine(line))
+          found = true;
+        else
+          text += line + "\r\n";
+        line.clear();
+      } else if (line.size() < 4096) {
+        line += buf[i];
+      }
+    }
+  }
+
+  // What mosh-server said is shown when it didn't start.
+  if (!found) {
+    WriteTerminal(text + line);
+    WriteTerminal("\r\nmosh: server didn't start\r\n");
+  }
+  return found;
+}
+
+bool MoshClient::ParseConnectLine(const std::string& line) {
+  static const char kPrefix[] = "MOSH CONNECT ";
+  if (line.compare(0, sizeof(kPrefix) - 1, kPrefix))
+    return false;
+  size_t port_start = sizeof(kPrefix) - 1;
+  size_t port_end = line.find(' ', port_start);
+  if (port_end == std::string::npos || port_end == port_start)
+    return false;
+  std::string port = line.substr(port_start, port_end - port_start);
+  if (port.find_first_not_of("0123456789") != std::string::npos ||
+      atoi(port.c_str()) <= 0 || atoi(port.c_str()) > 65535) {
+    return false;
+  }
+
+  uint8_t key[OcbCipher::kKeySize];
+  if (!DecodeKey(line.substr(port_end + 1), key))
+    return false;
+  cipher_.SetKey(key);
+  memset(key, 0, sizeof(key));
+  port_ = port;
+  return true;
+}
+
+bool MoshClient::OpenTerminal() {
+  FileSystem* sys = FileSystem::GetFileSystem();
+  return !sys->open("/dev/tty", O_RDWR, 0, &tty_fd_);
+}
+
+void MoshClient::CloseTerminal() {
+  if (tty_fd_ != -1) {
+    FileSystem::GetFileSystem()->close(tty_fd_);
+    tty_fd_ = -1;
+  }
+}
+
+bool MoshClient::OpenSocket() {
+  FileSystem* sys = FileSystem::GetFileSystem();
+  if (!server_addr_len_) {
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    addrinfo* res = NULL;
+    if (sys->getaddrinfo(params_.host.c_str(), port_.c_str(), &hints, &res) ||
+        !res) {
+      return false;
+    }
+    server_addr_len_ = std::min((size_t)res->ai_addrlen, sizeof(server_addr_));
+    memcpy(&server_addr_, res->ai_addr, server_addr_len_);
+    sys->freeaddrinfo(res);
+  }
+
+  socket_fd_ = sys->socket(server_addr_.ss_family, SOCK_DGRAM, 0);
+  if (socket_fd_ == -1)
+    return false;
+  // Blocking UDP socket sends only when the next send comes.
+  fcntl(socket_fd_, F_SETFL, O_NONBLOCK);
+  return true;
+}
+
+void MoshClient::CloseSocket() {
+  if (socket_fd_ != -1) {
+    FileSystem::GetFileSystem()->close(socket_fd_);
+    socket_fd_ = -1;
+  }
+}
+
+int MoshClient::Run() {
+  FileSystem* sys = FileSystem::GetFileSystem();
+  termios tio;
+  sys->tcgetattr(tty_fd_, &saved_tio_);
+  tio = saved_tio_;
+  tio.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL |
+                   IXON);
+  tio.c_oflag &= ~OPOST;
+  tio.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+  sys->tcsetattr(tty_fd_, TCSANOW, &tio);
+
+  struct sigaction action = {};
+  action.sa_handler = &MoshClient::OnWindowChange;
+  sys->sigaction(SIGWINCH, &action, NULL);
+
+  WriteTerminal(kEnterScreen);
+  int64_t start_ms = GetTimeMs();
+  last_port_hop_ms_ = start_ms;
+  // Server terminal is resized before anything is drawn.
+  OnResize();
+
+  int status = 0;
+  while (true) {
+    int64_t now_ms = GetTimeMs();
+    int64_t next_ms = SendIfDue(now_ms);
+    if (remote_num_ == kShutdownNum && !ack_due_ms_)
+      break;
+    if (shutdown_ && (acked_num_ == kShutdownNum ||
+                      now_ms - shutdown_ms_ >= kShutdownTimeoutMs)) {
+      break;
+    }
+    if (!last_heard_ms_ && now_ms - start_ms >= kConnectTimeoutMs) {
+      WriteTerminal(kLeaveScreen);
+      WriteTerminal("mosh: no reply from " + params_.host + "\r\n");
+      status = 1;
+      break;
+    }
+
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(tty_fd_, &fds);
+    FD_SET(socket_fd_, &fds);
+    int64_t wait_ms = std::max(int64_t(0), next_ms - now_ms);
+    timeval timeout = { wait_ms / 1000, (wait_ms % 1000) * 1000 };
+    int count = sys->select(std::max(tty_fd_, socket_fd_) + 1, &fds, NULL,
+                            NULL, &timeout);
+    if (window_changed_) {
+      window_changed_ = false;
+      OnResize();
+    }
+    if (count <= 0)
+      continue;
+
+    now_ms = GetTimeMs();
+    if (FD_ISSET(socket_fd_, &fds))
+      ReceivePackets(now_ms);
+    if (FD_ISSET(tty_fd_, &fds) && !ReadTerminal(now_ms)) {
+      shutdown_ = true;
+      shutdown_ms_ = now_ms;
+    }
+
+    // Nothing comes back, maybe the network changed. Server follows the
+    // new source port, it is also a way around a stuck NAT mapping.
+    int64_t last_ms = std::max(last_heard_ms_, start_ms);
+    if (now_ms - last_ms >= kPortHopIntervalMs &&
+        now_ms - last_port_hop_ms_ >= kPortHopIntervalMs) {
+      LOG("MoshClient: changing source port\n");
+      CloseSocket();
+      if (!OpenSocket()) {
+        status = 1;
+        break;
+      }
+      last_port_hop_ms_ = now_ms;
+    }
+  }
+
+  if (!status)
+    WriteTerminal(kLeaveScreen);
+  action.sa_handler = SIG_DFL;
+  sys->sigaction(SIGWINCH, &action, NULL);
+  sys->tcsetattr(tty_fd_, TCSANOW, &saved_tio_);
+  return status;
+}
+
+bool MoshClient::ReadTerminal(int64_t now_ms) {
+  FileSystem* sys = FileSystem::GetFileSystem();
+  char buf[4096];
+  size_t nread;
+  if (sys->read(tty_fd_, buf, sizeof(buf), &nread) || nread == (size_t)-1)
+    return true;
+  if (!nread)
+    return false;
+  input_offset_ = sys->GetTerminalInputOffset();
+
+  std::string keys;
+  for (size_t i = 0; i < nread; i++) {
+    char c = buf[i];
+    if (escape_) {
+      escape_ = false;
+      if (c == '.') {
+        shutdown_ = true;
+        shutdown_ms_ = now_ms;
+        break;
+      }
+      keys += kEscapeKey;
+      if (c == '^' || c == kEscapeKey)
+        continue;
+    } else if (c == kEscapeKey) {
+      escape_ = true;
+      continue;
+    }
+    keys += c;
+  }
+
+  if (!keys.empty()) {
+    std::string keystroke;
+    PutBytesField(&keystroke, kKeystrokeKeys, keys);
+    std::string event;
+    PutBytesField(&event, kUserKeystroke, keystroke);
+    AddUserEvent(event);
+  }
+  return true;
+}
+
+void MoshClient::OnResize() {
+  FileSystem* sys = FileSystem::GetFileSystem();
+  unsigned short width;
+  unsigned short height;
+  if (!sys->GetTerminalSize(&width, &height) ||
+      (width == width_ && height == height_)) {
+    return;
+  }
+  width_ = width;
+  height_ = height;
+
+  std::string resize;
+  PutVarintField(&resize, kResizeWidth, width);
+  PutVarintField(&resize, kResizeHeight, height);
+  std::string event;
+  PutBytesField(&event, kUserResize, resize);
+  AddUserEvent(event);
+}
+
+void MoshClient::OnWindowChange(int signum) {
+  window_changed_ = true;
+}
+
+void MoshClient::AddUserEvent(const std::string& event) {
+  events_.push_back(event);
+}
+
+void MoshClient::ReceivePackets(int64_t now_ms) {
+  FileSystem* sys = FileSystem::GetFileSystem();
+  std::vector<char> buf(kMaxPacketSize);
+  while (true) {
+    sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    ssize_t size = sys->recvfrom(socket_fd_, &buf[0], buf.size(), 0,
+                                 (sockaddr*)&addr, &addr_len);
+    if (size <= 0)
+      break;
+    if (!OnPacket(std::string(&buf[0], size), now_ms))
+      LOG("MoshClient: dropped bad packet of %d bytes\n", (int)size);
+  }
+}
+
+bool MoshClient::OnPacket(const std::string& packet, int64_t now_ms) {
+  if (packet.size() < 8 + OcbCipher::kTagSize)
+    return false;
+  uint64_t seq = ReadUInt64(packet.data());
+  if (!(seq & kToClient))
+    return false;
+
+  uint8_t nonce[OcbCipher::kNonceSize] = {};
+  memcpy(nonce + 4, packet.data(), 8);
+  std::string plaintext;
+  if (!cipher_.Decrypt(nonce, packet.substr(8), &plaintext) ||
+      plaintext.size() < 4) {
+    return false;
+  }
+
+  // Timestamps are in milliseconds modulo 2^16, the server echoes ours
+  // back advanced by how long it held it.
+  saved_timestamp_ = ReadUInt16(plaintext.data());
+  saved_timestamp_ms_ = now_ms;
+  int reply = ReadUInt16(plaintext.data() + 2);
+  if (reply != kNoTimestamp) {
+    double rtt = uint16_t(now_ms - reply);
+    // Same smoothing as TCP (RFC 6298), late echoes are ignored.
+    if (rtt < 5000) {
+      if (!rtt_hit_) {
+        srtt_ms_ = rtt;
+        rttvar_ms_ = rtt / 2;
+        rtt_hit_ = true;
+      } else {
+        rttvar_ms_ = 0.75 * rttvar_ms_ + 0.25 * fabs(srtt_ms_ - rtt);
+        srtt_ms_ = 0.875 * srtt_ms_ + 0.125 * rtt;
+      }
+    }
+  }
+  last_heard_ms_ = now_ms;
+
+  std::string payload;
+  if (!OnFragment(plaintext.substr(4), &payload))
+    return true;
+
+  Instruction inst;
+  uint64_t version = 0;
+  size_t pos = 0;
+  while (pos < payload.size()) {
+    int field;
+    uint64_t value = 0;
+    std::string bytes;
+    if (!GetField(payload, &pos, &field, &value, &bytes))
+      return false;
+    switch (field) {
+      case kInstProtocolVersion:
+        version = value;
+        break;
+      case kInstOldNum:
+        inst.old_num = value;
+        break;
+      case kInstNewNum:
+        inst.new_num = value;
+        break;
+      case kInstAckNum:
+        inst.ack_num = value;
+        break;
+      case kInstThrowawayNum:
+        inst.throwaway_num = value;
+        break;
+      case kInstDiff:
+        inst.diff.swap(bytes);
+        break;
+    }
+  }
+  if (version != kProtocolVersion)
+    return false;
+
+  OnInstruction(inst, now_ms);
+  return true;
+}
+
+bool MoshClient::OnFragment(const std::string& fragment,
+                            std::string* payload) {
+  if (fragment.size() < kFragmentHeaderSize)
+    return false;
+  uint64_t id = ReadUInt64(fragment.data());
+  uint16_t num = ReadUInt16(fragment.data() + 8);
+  bool final = (num & 0x8000) != 0;
+  num &= 0x7fff;
+  if (num >= kMaxFragments)
+    return false;
+
+  if (id != fragments_id_ || fragments_.empty()) {
+    fragments_id_ = id;
+    fragments_.clear();
+    fragments_arrived_.clear();
+    fragments_total_ = 0;
+    fragments_count_ = 0;
+  }
+  if (fragments_.size() <= num) {
+    fragments_.resize(num + 1);
+    fragments_arrived_.resize(num + 1);
+  }
+  if (!fragments_arrived_[num]) {
+    fragments_arrived_[num] = true;
+    fragments_[num].assign(fragment, kFragmentHeaderSize, std::string::npos);
+    fragments_count_++;
+  }
+  if (final)
+    fragments_total_ = num + 1;
+  if (!fragments_total_ || fragments_count_ < fragments_total_)
+    return false;
+
+  std::string compressed;
+  for (size_t i = 0; i < fragments_total_; i++)
+    compressed += fragments_[i];
+  fragments_.clear();
+  fragments_arrived_.clear();
+  return Uncompress(compressed, kMaxPayloadSize, payload);
+}
+
+void MoshClient::OnInstruction(const Instruction& inst, int64_t now_ms) {
+  if (inst.ack_num == kShutdownNum && shutdown_) {
+    acked_num_ = kShutdownNum;
+  } else if (inst.ack_num > acked_num_ && sent_states_.count(inst.ack_num)) {
+    // Older states and the events in them are not needed anymore.
+    acked_num_ = inst.ack_num;
+    sent_states_.erase(sent_states_.begin(),
+                       sent_states_.lower_bound(acked_num_));
+    uint64_t count = sent_states_[acked_num_];
+    events_.erase(events_.begin(), events_.begin() + (count - events_base_));
+    events_base_ = count;
+  }
+
+  // Duplicate or diff from a screen this client doesn't have.
+  if (inst.new_num <= remote_num_ || inst.old_num != remote_num_)
+    return;
+
+  if (!inst.diff.empty())
+    ApplyHostMessage(inst.diff);
+  remote_num_ = inst.new_num;
+  if (remote_num_ == kShutdownNum)
+    ack_due_ms_ = now_ms;
+  else if (!inst.diff.empty() && !ack_due_ms_)
+    ack_due_ms_ = now_ms + kAckDelayMs;
+}
+
+void MoshClient::ApplyHostMessage(const std::string& diff) {
+  // Echo acknowledgement comes with the screen update it is for, it goes
+  // to the terminal after the update.
+  uint64_t echo_num = 0;
+  size_t pos = 0;
+  while (pos < diff.size()) {
+    int field;
+    uint64_t value;
+    std::string instruction;
+    if (!GetField(diff, &pos, &field, &value, &instruction))
+      return;
+    if (field != kMessageInstruction)
+      continue;
+
+    // The size follows the terminal, only screen updates and echo
+    // acknowledgements matter.
+    size_t inst_pos = 0;
+    while (inst_pos < instruction.size()) {
+      std::string message;
+      if (!GetField(instruction, &inst_pos, &field, &value, &message))
+        return;
+      if (field != kHostBytes && field != kEchoAck)
+        continue;
+      size_t message_pos = 0;
+      while (message_pos < message.size()) {
+        std::string data;
+        if (!GetField(message, &message_pos, &field, &value, &data))
+          return;
+        if (field == kHostBytesString)
+          WriteTerminal(data);
+        else if (field == kEchoAckNum)
+          echo_num = std::max(echo_num, value);
+      }
+    }
+  }
+  OnEchoAck(echo_num);
+}
+
+void MoshClient::OnEchoAck(uint64_t num) {
+  if (num <= echo_acked_num_)
+    return;
+  echo_acked_num_ = num;
+  std::map<uint64_t, uint64_t>::iterator it = input_states_.upper_bound(num);
+  if (it == input_states_.begin())
+    return;
+  --it;
+  uint64_t offset = it->second;
+  // Later acknowledgements can still land on this state.
+  input_states_.erase(input_states_.begin(), it);
+  if (offset > echo_acked_offset_) {
+    echo_acked_offset_ = offset;
+    FileSystem::GetFileSystem()->SendEchoAck(offset, int(srtt_ms_));
+  }
+}
+
+void MoshClient::WriteTerminal(const std::string& data) {
+  FileSystem* sys = FileSystem::GetFileSystem();
+  size_t pos = 0;
+  while (pos < data.size()) {
+    size_t nwrote;
+    if (sys->write(tty_fd_, data.data() + pos, data.size() - pos, &nwrote) ||
+        nwrote == (size_t)-1) {
+      return;
+    }
+    pos += nwrote;
+  }
+}
+
+int64_t MoshClient::SendIfDue(int64_t now_ms) {
+  uint64_t count = events_base_ + events_.size();
+  bool unacked = sent_states_[sent_num_] > sent_states_[acked_num_];
+  int64_t timeout_ms = GetTimeout();
+
+  if (shutdown_) {
+    if (!last_send_ms_ || now_ms - last_send_ms_ >= timeout_ms ||
+        now_ms == shutdown_ms_) {
+      SendState(kShutdownNum, now_ms);
+    }
+    return last_send_ms_ + timeout_ms;
+  }
+
+  // New input goes right away, lost states are covered by the next diff
+  // from the acknowledged state.
+  if (count > sent_states_[sent_num_] ||
+      (unacked && now_ms - last_send_ms_ >= timeout_ms) ||
+      (ack_due_ms_ && now_ms >= ack_due_ms_) ||
+      now_ms - last_send_ms_ >= kHeartbeatIntervalMs) {
+    SendState(sent_num_ + 1, now_ms);
+    unacked = sent_states_[sent_num_] > sent_states_[acked_num_];
+  }
+
+  int64_t next_ms = last_send_ms_ + kHeartbeatIntervalMs;
+  if (unacked)
+    next_ms = std::min(next_ms, last_send_ms_ + timeout_ms);
+  if (ack_due_ms_)
+    next_ms = std::min(next_ms, ack_due_ms_);
+  return next_ms;
+}
+
+void MoshClient::SendState(uint64_t new_num, int64_t now_ms) {
+  uint64_t count = events_base_ + events_.size();
+  if (new_num != kShutdownNum) {
+    sent_states_[new_num] = count;
+    sent_num_ = new_num;
+    if (input_states_.empty() ||
+        input_states_.rbegin()->second != input_offset_) {
+      input_states_[new_num] = input_offset_;
+      if (input_states_.size() > kMaxInputStates)
+        input_states_.erase(input_states_.begin());
+    }
+  }
+
+  std::string diff;
+  for (size_t i = sent_states_[acked_num_] - events_base_; i < events_.size();
+       i++) {
+    PutBytesField(&diff, kMessageInstruction, events_[i]);
+  }
+
+  std::string inst;
+  PutVarintField(&inst, kInstProtocolVersion, kProtocolVersion);
+  PutVarintField(&inst, kInstOldNum, acked_num_);
+  PutVarintField(&inst, kInstNewNum, new_num);
+  PutVarintField(&inst, kInstAckNum, remote_num_);
+  PutVarintField(&inst, kInstThrowawayNum, acked_num_);
+  PutBytesField(&inst, kInstDiff, diff);
+
+  std::string payload = Compress(inst);
+  fragment_id_++;
+  size_t pos = 0;
+  do {
+    size_t size = std::min(kMaxFragmentSize, payload.size() - pos);
+    bool final = pos + size == payload.size();
+    std::string fragment;
+    PutUInt64(&fragment, fragment_id_);
+    PutUInt16(&fragment, (final ? 0x8000 : 0) | (pos / kMaxFragmentSize));
+    fragment.append(payload, pos, size);
+    SendPacket(fragment, now_ms);
+    pos += size;
+  } while (pos < payload.size());
+
+  last_send_ms_ = now_ms;
+  ack_due_ms_ = 0;
+}
+
+void MoshClient::SendPacket(const std::string& payload, int64_t now_ms) {
+  std::string plaintext;
+  PutUInt16(&plaintext, now_ms);
+  int reply = kNoTimestamp;
+  if (saved_timestamp_ != -1 && now_ms - saved_timestamp_ms_ < 1000) {
+    reply = uint16_t(saved_timestamp_ + (now_ms - saved_timestamp_ms_));
+    saved_timestamp_ = -1;
+  }
+  PutUInt16(&plaintext, reply);
+  plaintext += payload;
+
+  // Packets to the server have the top bit of sequence number clear.
+  std::string packet;
+  PutUInt64(&packet, send_seq_++ & ~kToClient);
+  uint8_t nonce[OcbCipher::kNonceSize] = {};
+  memcpy(nonce + 4, packet.data(), 8);
+  std::string ciphertext;
+  cipher_.Encrypt(nonce, plaintext, &ciphertext);
+  packet += ciphertext;
+
+  FileSystem* sys = FileSystem::GetFileSystem();
+  if (sys->sendto(socket_fd_, packet.data(), packet.size(), 0,
+                  (const sockaddr*)&server_addr_, server_addr_len_) < 0) {
+    LOG("MoshClient: send failed %d\n", errno);
+  }
+}
+
+int64_t MoshClient::GetTimeout() {
+  if (!rtt_hit_)
+    return kMaxTimeoutMs;
+  int64_t timeout = srtt_ms_ + 4 * rttvar_ms_;
+  return std::max(kMinTimeoutMs, std::min(kMaxTimeoutMs, timeout));
+}
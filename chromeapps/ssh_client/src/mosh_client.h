@@ -0,0 +1,180 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef MOSH_CLIENT_H
+#define MOSH_CLIENT_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <termios.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "file_interfaces.h"
+#include "ocb_cipher.h"
+#include "pthread_helpers.h"
+
+// Mosh client for interactive sessions over lossy links. ssh only starts
+// mosh-server on the host, the "MOSH CONNECT <port> <key>" line it prints
+// comes through a pipe bound to ssh stdout. After that the session goes
+// over UDP with mosh State Synchronization Protocol: each side sends the
+// difference between the state the other side acknowledged and its
+// current state, user input one way and the screen the other way. Lost
+// packets are never retransmitted, the next diff covers them. Packets are
+// encrypted with AES-128-OCB and the server follows the client wherever
+// its packets come from, so the session survives network changes.
+//
+// Screen diffs are escape sequences that turn the screen the diff starts
+// from into the new one and they are written to the terminal as is. Only
+// the newest screen is kept, a diff from any other screen is dropped and
+// the server falls back to the one the client acknowledged. Local echo is
+// predicted by the terminal, it has the screen: the server acknowledges
+// the newest input state its screen shows the echo of and the client
+// turns that into terminal input and output offsets for it, see
+// FileSystem::SendEchoAck. Ctrl-^ . ends the session.
+class MoshClient {
+ public:
+  struct Params {
+    Params() : server("mosh-server") {}
+
+    std::string host;
+    std::string server;
+    // Run instead of the login shell if not empty.
+    std::string command;
+  };
+
+  // |output| is connected to ssh stdout.
+  explicit MoshClient(FileStream* output);
+  ~MoshClient();
+
+  // Remote command for ssh that starts mosh-server.
+  static std::string GetServerCommand(const Params& params);
+
+  bool Start(const Params& params);
+
+ private:
+  struct Instruction {
+    Instruction()
+      : old_num(0), new_num(0), ack_num(0), throwaway_num(0) {}
+
+    uint64_t old_num;
+    uint64_t new_num;
+    uint64_t ack_num;
+    uint64_t throwaway_num;
+    std::string diff;
+  };
+
+  // Bootstrap: wait for mosh-server address and key, or for ssh to end.
+  bool ReadConnectLine();
+  bool ParseConnectLine(const std::string& line);
+  bool OpenTerminal();
+  void CloseTerminal();
+  bool OpenSocket();
+  void CloseSocket();
+
+  // Session loop, return exit code.
+  int Run();
+  bool ReadTerminal(int64_t now_ms);
+  void OnResize();
+  void ReceivePackets(int64_t now_ms);
+  bool OnPacket(const std::string& packet, int64_t now_ms);
+  bool OnFragment(const std::string& fragment, std::string* payload);
+  void OnInstruction(const Instruction& inst, int64_t now_ms);
+  void ApplyHostMessage(const std::string& diff);
+  void OnEchoAck(uint64_t num);
+  void WriteTerminal(const std::string& data);
+
+  // Send current user input state if it's due, return time the next send
+  // is due at.
+  int64_t SendIfDue(int64_t now_ms);
+  void SendState(uint64_t new_num, int64_t now_ms);
+  void SendPacket(const std::string& payload, int64_t now_ms);
+  void AddUserEvent(const std::string& event);
+  int64_t GetTimeout();
+
+  static void OnWindowChange(int signum);
+  static void* SessionThread(void* arg);
+  void SessionThreadImpl();
+
+  // mosh-server waits this long for the first packet.
+  static const int64_t kConnectTimeoutMs = 60 * 1000;
+  // Delay of acknowledgement of a new screen, it can go with input.
+  static const int64_t kAckDelayMs = 100;
+  static const int64_t kHeartbeatIntervalMs = 3000;
+  static const int64_t kMinTimeoutMs = 50;
+  static const int64_t kMaxTimeoutMs = 1000;
+  // Source port is changed when nothing came back for this long.
+  static const int64_t kPortHopIntervalMs = 10 * 1000;
+  static const int64_t kShutdownTimeoutMs = 2000;
+  static const size_t kMaxFragmentSize = 1200;
+  static const size_t kMaxPacketSize = 64 * 1024;
+  static const size_t kMaxPayloadSize = 4 * 1024 * 1024;
+  // Servers that don't acknowledge echo don't make the input states pile
+  // up past this.
+  static const size_t kMaxInputStates = 1024;
+
+  static volatile bool window_changed_;
+
+  FileStream* output_;
+  Params params_;
+  pthread_t thread_;
+
+  std::string port_;
+  OcbCipher cipher_;
+  int tty_fd_;
+  int socket_fd_;
+  sockaddr_storage server_addr_;
+  socklen_t server_addr_len_;
+  termios saved_tio_;
+  unsigned short width_;
+  unsigned short height_;
+  bool escape_;
+
+  // Outgoing packets.
+  uint64_t send_seq_;
+  uint64_t fragment_id_;
+  // Timestamp from the server to echo and when it came, for RTT.
+  int saved_timestamp_;
+  int64_t saved_timestamp_ms_;
+  double srtt_ms_;
+  double rttvar_ms_;
+  bool rtt_hit_;
+
+  // User input as serialized UserMessage instructions, events_[0] is
+  // event number |events_base_|. Sent states map state number to number
+  // of events in it, states up to the acknowledged one are dropped.
+  std::vector<std::string> events_;
+  uint64_t events_base_;
+  std::map<uint64_t, uint64_t> sent_states_;
+  uint64_t sent_num_;
+  uint64_t acked_num_;
+  int64_t last_send_ms_;
+  int64_t ack_due_ms_;
+  bool shutdown_;
+  int64_t shutdown_ms_;
+  // Terminal input offset after the last read, and the offset in the sent
+  // states that added input. States are dropped up to the one the echo of
+  // which was acknowledged last.
+  uint64_t input_offset_;
+  std::map<uint64_t, uint64_t> input_states_;
+  uint64_t echo_acked_num_;
+  uint64_t echo_acked_offset_;
+
+  // Incoming screen state and the fragments of the next instruction.
+  uint64_t remote_num_;
+  uint64_t fragments_id_;
+  std::vector<std::string> fragments_;
+  std::vector<bool> fragments_arrived_;
+  size_t fragments_total_;
+  size_t fragments_count_;
+  int64_t last_heard_ms_;
+  int64_t last_port_hop_ms_;
+
+  DISALLOW_COPY_AND_ASSIGN(MoshClient);
+};
+
+#endif  // MOSH_CLIENT_H
@@ -0,0 +1,180 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "ocb_cipher.h"
+
+#include <string.h>
+
+const size_t OcbCipher::kKeySize;
+const size_t OcbCipher::kNonceSize;
+const size_t OcbCipher::kTagSize;
+
+// Number of trailing zero bits, |i| is never 0.
+static int CountTrailingZeros(uint64_t i) {
+  int n = 0;
+  while (!(i & 1)) {
+    i >>= 1;
+    n++;
+  }
+  return n;
+}
+
+OcbCipher::OcbCipher() {
+  memset(&encrypt_key_, 0, sizeof(encrypt_key_));
+  memset(&decrypt_key_, 0, sizeof(decrypt_key_));
+}
+
+OcbCipher::~OcbCipher() {
+  memset(&encrypt_key_, 0, sizeof(encrypt_key_));
+  memset(&decrypt_key_, 0, sizeof(decrypt_key_));
+}
+
+void OcbCipher::SetKey(const uint8_t* key) {
+  AES_set_encrypt_key(key, kKeySize * 8, &encrypt_key_);
+  AES_set_decrypt_key(key, kKeySize * 8, &decrypt_key_);
+
+  Block zeros = {};
+  AES_encrypt(zeros, l_star_, &encrypt_key_);
+  Double(l_star_, l_dollar_);
+  Double(l_dollar_, l_[0]);
+  for (int i = 1; i < kMaxL; i++)
+    Double(l_[i - 1], l_[i]);
+}
+
+void OcbCipher::Encrypt(const uint8_t* nonce, const std::string& plaintext,
+                        std::string* out) {
+  Block offset;
+  Block checksum = {};
+  GetOffset(nonce, offset);
+
+  out->resize(plaintext.size() + kTagSize);
+  const uint8_t* in = reinterpret_cast<const uint8_t*>(plaintext.data());
+  uint8_t* dst = reinterpret_cast<uint8_t*>(&(*out)[0]);
+  size_t blocks = plaintext.size() / 16;
+  for (size_t i = 1; i <= blocks; i++, in += 16, dst += 16) {
+    NextOffset(i, offset);
+    Block block;
+    memcpy(block, in, 16);
+    Xor(checksum, block);
+    Xor(block, offset);
+    AES_encrypt(block, dst, &encrypt_key_);
+    Xor(dst, offset);
+  }
+
+  size_t rest = plaintext.size() % 16;
+  if (rest) {
+    Xor(offset, l_star_);
+    Block pad;
+    AES_encrypt(offset, pad, &encrypt_key_);
+    for (size_t i = 0; i < rest; i++)
+      dst[i] = in[i] ^ pad[i];
+    Block last = {};
+    memcpy(last, in, rest);
+    last[rest] = 0x80;
+    Xor(checksum, last);
+    dst += rest;
+  }
+
+  GetTag(checksum, offset, dst);
+}
+
+bool OcbCipher::Decrypt(const uint8_t* nonce, const std::string& ciphertext,
+                        std::string* plaintext) {
+  if (ciphertext.size() < kTagSize)
+    return false;
+
+  Block offset;
+  Block checksum = {};
+  GetOffset(nonce, offset);
+
+  size_t size = ciphertext.size() - kTagSize;
+  plaintext->resize(size);
+  const uint8_t* in = reinterpret_cast<const uint8_t*>(ciphertext.data());
+  uint8_t* dst = reinterpret_cast<uint8_t*>(&(*plaintext)[0]);
+  size_t blocks = size / 16;
+  for (size_t i = 1; i <= blocks; i++, in += 16, dst += 16) {
+    NextOffset(i, offset);
+    Block block;
+    memcpy(block, in, 16);
+    Xor(block, offset);
+    AES_decrypt(block, dst, &decrypt_key_);
+    Xor(dst, offset);
+    Xor(checksum, dst);
+  }
+
+  size_t rest = size % 16;
+  if (rest) {
+    Xor(offset, l_star_);
+    Block pad;
+    AES_encrypt(offset, pad, &encrypt_key_);
+    Block last = {};
+    for (size_t i = 0; i < rest; i++)
+      last[i] = dst[i] = in[i] ^ pad[i];
+    last[rest] = 0x80;
+    Xor(checksum, last);
+    in += rest;
+  }
+
+  Block tag;
+  GetTag(checksum, offset, tag);
+  // Compare in constant time.
+  uint8_t diff = 0;
+  for (size_t i = 0; i < kTagSize; i++)
+    diff |= tag[i] ^ in[i];
+  if (diff) {
+    plaintext->clear();
+    return false;
+  }
+  return true;
+}
+
+void OcbCipher::GetOffset(const uint8_t* nonce, Block offset) {
+  // Nonce is formatted as 7 bits of tag length mod 128, zero padding, a 1
+  // bit and the nonce itself. Its last 6 bits select where the offset is
+  // taken from the stretched key.
+  Block formatted = {};
+  formatted[15 - kNonceSize] = 1;
+  memcpy(formatted + 16 - kNonceSize, nonce, kNonceSize);
+  int bottom = formatted[15] & 0x3f;
+  formatted[15] &= 0xc0;
+
+  uint8_t stretch[24];
+  AES_encrypt(formatted, stretch, &encrypt_key_);
+  for (int i = 0; i < 8; i++)
+    stretch[16 + i] = stretch[i] ^ stretch[i + 1];
+
+  int bytes = bottom / 8;
+  int bits = bottom % 8;
+  for (int i = 0; i < 16; i++) {
+    offset[i] = stretch[i + bytes] << bits;
+    if (bits)
+      offset[i] |= stretch[i + bytes + 1] >> (8 - bits);
+  }
+}
+
+void OcbCipher::NextOffset(uint64_t i, Block offset) {
+  Xor(offset, l_[CountTrailingZeros(i) % kMaxL]);
+}
+
+void OcbCipher::GetTag(const Block checksum, const Block offset,
+                       Block tag) {
+  // There is no associated data so its hash is zero.
+  Block block;
+  memcpy(block, checksum, 16);
+  Xor(block, offset);
+  Xor(block, l_dollar_);
+  AES_encrypt(block, tag, &encrypt_key_);
+}
+
+void OcbCipher::Double(const Block in, Block out) {
+  uint8_t carry = in[0] >> 7;
+  for (int i = 0; i < 15; i++)
+    out[i] = (in[i] << 1) | (in[i + 1] >> 7);
+  out[15] = (in[15] << 1) ^ (carry ? 0x87 : 0);
+}
+
+void OcbCipher::Xor(Block out, const uint8_t* in) {
+  for (int i = 0; i < 16; i++)
+    out[i] ^= in[i];
+}
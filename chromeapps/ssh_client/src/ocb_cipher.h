@@ -0,0 +1,60 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef OCB_CIPHER_H
+#define OCB_CIPHER_H
+
+#include <stdint.h>
+
+#include <string>
+
+#include <openssl/aes.h>
+
+#include "pthread_helpers.h"
+
+// AES-128 in OCB mode (RFC 7253) with 96-bit nonces, 128-bit tags and no
+// associated data, the way mosh encrypts its packets. OpenSSL this module
+// is built with has AES but not OCB so the mode is done here.
+class OcbCipher {
+ public:
+  static const size_t kKeySize = 16;
+  static const size_t kNonceSize = 12;
+  static const size_t kTagSize = 16;
+
+  OcbCipher();
+  ~OcbCipher();
+
+  void SetKey(const uint8_t* key);
+
+  // |out| is the ciphertext followed by the tag.
+  void Encrypt(const uint8_t* nonce, const std::string& plaintext,
+               std::string* out);
+  // Return false if |ciphertext| is too short or its tag doesn't match.
+  bool Decrypt(const uint8_t* nonce, const std::string& ciphertext,
+               std::string* plaintext);
+
+ private:
+  typedef uint8_t Block[16];
+
+  void GetOffset(const uint8_t* nonce, Block offset);
+  // Offset of block |i|, counting from 1, from the offset of block i - 1.
+  void NextOffset(uint64_t i, Block offset);
+  void GetTag(const Block checksum, const Block offset, Block tag);
+
+  static void Double(const Block in, Block out);
+  static void Xor(Block out, const uint8_t* in);
+
+  // L_i for blocks up to 2^kMaxL - 1, packets are far shorter.
+  static const int kMaxL = 32;
+
+  AES_KEY encrypt_key_;
+  AES_KEY decrypt_key_;
+  Block l_star_;
+  Block l_dollar_;
+  Block l_[kMaxL];
+
+  DISALLOW_COPY_AND_ASSIGN(OcbCipher);
+};
+
+#endif  // OCB_CIPHER_H
@@ -51,7 +51,8 @@ int PepperFileHandler::stat(const char* pathname, nacl_abi_stat* out) {
 
 PepperFile::PepperFile(int fd, int oflag, pp::FileSystem* file_system)
   : ref_(1), fd_(fd), oflag_(oflag), factory_(this), file_system_(file_system),
-    file_io_(NULL), offset_(0), file_info_(), write_sent_(false) {
+    file_io_(NULL), offset_(0), file_info_(), write_sent_(false),
+    closing_(false) {
 }
 
 PepperFile::~PepperFile() {
@@ -83,12 +84,13 @@ bool PepperFile::open(const char* pathname) {
 }
 
 void PepperFile::close() {
-  int32_t result = PP_OK_COMPLETIONPENDING;
-  pp::Module::Get()->core()->CallOnMainThread(0,
-      factory_.NewCallback(&PepperFile::Close, &result));
-  FileSystem* sys = FileSystem::GetFileSystem();
-  while(result == PP_OK_COMPLETIONPENDING)
-    sys->cond().wait(sys->mutex());
+  if (is_open()) {
+    closing_ = true;
+    addref();
+    FileSystem::GetFileSystem()->AddPendingClose(fd_);
+    pp::Module::Get()->core()->CallOnMainThread(0,
+        factory_.NewCallback(&PepperFile::Close));
+  }
 }
 
 int PepperFile::read(char* buf, size_t count, size_t* nread) {
@@ -182,9 +184,28 @@ int PepperFile::seek(nacl_abi_off_t offset, int whence,
 int PepperFile::fstat(nacl_abi_stat* out) {
   memset(out, 0, sizeof(nacl_abi_stat));
   out->nacl_abi_st_size = file_info_.size;
+  // Time of the last change when the file was opened.
+  double mtime = file_info_.last_modified_time;
+  out->nacl_abi_st_mtime = (nacl_abi_time_t)mtime;
+  out->nacl_abi_st_mtimensec =
+      (int64_t)((mtime - out->nacl_abi_st_mtime) * 1e9);
   return 0;
 }
 
+int PepperFile::ftruncate(nacl_abi_off_t length) {
+  if (!is_open())
+    return EBADF;
+  if ((oflag_ & O_ACCMODE) == O_RDONLY || length < 0)
+    return EINVAL;
+  int32_t result = PP_OK_COMPLETIONPENDING;
+  pp::Module::Get()->core()->CallOnMainThread(0,
+      factory_.NewCallback(&PepperFile::SetLength, (int64_t)length, &result));
+  FileSystem* sys = FileSystem::GetFileSystem();
+  while(result == PP_OK_COMPLETIONPENDING)
+    sys->cond().wait(sys->mutex());
+  return result == PP_OK ? 0 : EIO;
+}
+
 int PepperFile::fcntl(int cmd, va_list ap) {
   if (cmd == F_GETFL) {
     return oflag_;
@@ -290,7 +311,7 @@ void PepperFile::OnRead(int32_t result, int32_t* pres) {
   Mutex::Lock lock(sys->mutex());
   if (result >= 0) {
     in_buf_.insert(in_buf_.end(), &read_buf_[0], &read_buf_[0] + result);
-    if (result && !is_block() && in_buf_.size() < kBufSize)
+    if (result && !is_block() && !closing_ && in_buf_.size() < kBufSize)
       Read(PP_OK, kBufSize, NULL);
   } else {
     delete file_io_;
@@ -309,7 +330,7 @@ void PepperFile::Write(int32_t result, int32_t* pres) {
     if (write_buf_.size()) {
       // Previous write operation is in progress.
       pp::Module::Get()->core()->CallOnMainThread(1,
-          factory_.NewCallback(&PepperFile::Write, &result));
+          factory_.NewCallback(&PepperFile::Write, pres));
       return;
     }
     assert(out_buf_.size());
@@ -323,9 +344,13 @@ void PepperFile::Write(int32_t result, int32_t* pres) {
   if (result != PP_OK_COMPLETIONPENDING) {
     delete file_io_;
     file_io_ = NULL;
+    write_sent_ = false;
+    write_buf_.clear();
     if (pres)
       *pres = result;
     sys->cond().broadcast();
+    if (closing_)
+      ContinueClose();
   }
 }
 
@@ -342,14 +367,54 @@ void PepperFile::OnWrite(int32_t result, int32_t* pres) {
     *pres = result;
   write_buf_.clear();
   sys->cond().broadcast();
+  if (closing_)
+    ContinueClose();
 }
 
-void PepperFile::Close(int32_t result, int32_t* pres) {
+void PepperFile::SetLength(int32_t result, int64_t length, int32_t* pres) {
   FileSystem* sys = FileSystem::GetFileSystem();
   Mutex::Lock lock(sys->mutex());
+  if (!file_io_) {
+    *pres = PP_ERROR_FAILED;
+    sys->cond().broadcast();
+    return;
+  }
+  result = file_io_->SetLength(length,
+      factory_.NewCallback(&PepperFile::OnSetLength, length, pres));
+  if (result != PP_OK_COMPLETIONPENDING) {
+    *pres = result;
+    sys->cond().broadcast();
+  }
+}
+
+void PepperFile::OnSetLength(int32_t result, int64_t length, int32_t* pres) {
+  FileSystem* sys = FileSystem::GetFileSystem();
+  Mutex::Lock lock(sys->mutex());
+  if (result == PP_OK)
+    file_info_.size = length;
+  *pres = result;
+  sys->cond().broadcast();
+}
+
+void PepperFile::Close(int32_t result) {
+  FileSystem* sys = FileSystem::GetFileSystem();
+  Mutex::Lock lock(sys->mutex());
+  ContinueClose();
+}
+
+void PepperFile::ContinueClose() {
+  if (file_io_ && (write_sent_ || !write_buf_.empty()))
+    return;  // Write completion comes back here.
+  if (file_io_ && !out_buf_.empty()) {
+    write_sent_ = true;
+    pp::Module::Get()->core()->CallOnMainThread(0,
+        factory_.NewCallback(&PepperFile::Write, (int32_t*)NULL));
+    return;
+  }
   delete file_io_;
   file_io_ = NULL;
-  if (pres)
-    *pres = PP_OK;
+  FileSystem* sys = FileSystem::GetFileSystem();
+  sys->RemovePendingClose(fd_);
   sys->cond().broadcast();
+  release();
 }
@@ -39,7 +39,7 @@ class PepperFile : public FileStream {
   virtual ~PepperFile();
 
   bool is_block() { return !(oflag_ & O_NONBLOCK); }
-  bool is_open() { return file_io_ != NULL; }
+  bool is_open() { return file_io_ != NULL && !closing_; }
 
   bool open(const char* pathname);
 
@@ -53,6 +53,7 @@ class PepperFile : public FileStream {
   virtual int seek(nacl_abi_off_t offset, int whence,
                    nacl_abi_off_t* new_offset);
   virtual int fstat(nacl_abi_stat* out);
+  virtual int ftruncate(nacl_abi_off_t length);
 
   virtual int fcntl(int cmd,  va_list ap);
 
@@ -71,7 +72,14 @@ class PepperFile : public FileStream {
   void Write(int32_t result, int32_t* pres);
   void OnWrite(int32_t result, int32_t* pres);
 
-  void Close(int32_t result, int32_t* pres);
+  void SetLength(int32_t result, int64_t length, int32_t* pres);
+  void OnSetLength(int32_t result, int64_t length, int32_t* pres);
+
+  void Close(int32_t result);
+  // Delete the file once buffered data is written, called on the main
+  // thread with the mutex locked. May release the last reference, so
+  // nothing can touch the object after it.
+  void ContinueClose();
 
   static const size_t kBufSize = 64 * 1024;
 
@@ -88,6 +96,8 @@ class PepperFile : public FileStream {
   std::vector<char> read_buf_;
   std::vector<char> write_buf_;
   bool write_sent_;
+  // close() was called, the file is flushed in the background.
+  bool closing_;
 
   DISALLOW_COPY_AND_ASSIGN(PepperFile);
 };
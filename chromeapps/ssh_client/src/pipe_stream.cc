@@ -0,0 +1,137 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "pipe_stream.h"
+
+#include <algorithm>
+
+#include <assert.h>
+
+#include "file_system.h"
+#include "proxy_stream.h"
+
+const size_t PipeStream::kBufSize;
+
+void PipeStream::CreatePipe(int read_fd, int write_fd,
+                            PipeStream** read_end, PipeStream** write_end) {
+  Buffer* buffer = new Buffer();
+  *read_end = new PipeStream(read_fd, O_RDONLY, buffer);
+  *write_end = new PipeStream(write_fd, O_WRONLY, buffer);
+  buffer->release();
+}
+
+PipeStream::PipeStream(int fd, int oflag, Buffer* buffer)
+  : ref_(1), fd_(fd), oflag_(oflag), buffer_(buffer) {
+  buffer_->addref();
+}
+
+PipeStream::~PipeStream() {
+  assert(!ref_);
+  close();
+  buffer_->release();
+}
+
+void PipeStream::addref() {
+  ++ref_;
+}
+
+void PipeStream::release() {
+  if (!--ref_)
+    delete this;
+}
+
+FileStream* PipeStream::dup(int fd) {
+  return new ProxyStream(fd, oflag_, this);
+}
+
+void PipeStream::close() {
+  if (fd_ == -1)
+    return;
+  if ((oflag_ & O_ACCMODE) == O_RDONLY)
+    buffer_->reader_closed = true;
+  else
+    buffer_->writer_closed = true;
+  fd_ = -1;
+  FileSystem::GetFileSystem()->cond().broadcast();
+}
+
+int PipeStream::read(char* buf, size_t count, size_t* nread) {
+  FileSystem* sys = FileSystem::GetFileSystem();
+  if (is_block()) {
+    while (buffer_->data.empty() && !buffer_->writer_closed && fd_ != -1)
+      sys->cond().wait(sys->mutex());
+  }
+  if (fd_ == -1) {
+    // Closed by another thread while waiting.
+    *nread = -1;
+    return EBADF;
+  }
+
+  if (buffer_->data.empty() && !buffer_->writer_closed) {
+    *nread = -1;
+    return EAGAIN;
+  }
+
+  *nread = std::min(count, buffer_->data.size());
+  std::copy(buffer_->data.begin(), buffer_->data.begin() + *nread, buf);
+  buffer_->data.erase(buffer_->data.begin(), buffer_->data.begin() + *nread);
+  sys->cond().broadcast();
+  return 0;
+}
+
+int PipeStream::write(const char* buf, size_t count, size_t* nwrote) {
+  FileSystem* sys = FileSystem::GetFileSystem();
+  *nwrote = 0;
+  while (*nwrote < count) {
+    if (fd_ == -1) {
+      *nwrote = -1;
+      return EBADF;
+    }
+    if (buffer_->reader_closed) {
+      if (*nwrote)
+        break;
+      *nwrote = -1;
+      return EPIPE;
+    }
+    if (buffer_->data.size() >= kBufSize) {
+      if (!is_block()) {
+        if (*nwrote)
+          break;
+        *nwrote = -1;
+        return EAGAIN;
+      }
+      sys->cond().wait(sys->mutex());
+      continue;
+    }
+    size_t size = std::min(count - *nwrote, kBufSize - buffer_->data.size());
+    buffer_->data.insert(buffer_->data.end(), buf + *nwrote,
+                         buf + *nwrote + size);
+    *nwrote += size;
+    sys->cond().broadcast();
+  }
+  return 0;
+}
+
+int PipeStream::fcntl(int cmd, va_list ap) {
+  if (cmd == F_GETFL) {
+    return oflag_;
+  } else if (cmd == F_SETFL) {
+    oflag_ = (oflag_ & O_ACCMODE) | (va_arg(ap, long) & ~O_ACCMODE);
+    return 0;
+  } else {
+    return -1;
+  }
+}
+
+bool PipeStream::is_read_ready() {
+  return !buffer_->data.empty() || buffer_->writer_closed;
+}
+
+bool PipeStream::is_write_ready() {
+  return buffer_->data.size() < kBufSize || buffer_->reader_closed;
+}
+
+bool PipeStream::is_exception() {
+  return false;
+}
@@ -0,0 +1,66 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef PIPE_STREAM_H
+#define PIPE_STREAM_H
+
+#include <deque>
+
+#include "file_interfaces.h"
+#include "pthread_helpers.h"
+
+// One end of in-module pipe. Like all other streams it must be used with
+// FileSystem mutex locked, blocking operations wait on FileSystem cond.
+class PipeStream : public FileStream {
+ public:
+  // Create connected pair, data written to |write_end| is read from
+  // |read_end|.
+  static void CreatePipe(int read_fd, int write_fd,
+                         PipeStream** read_end, PipeStream** write_end);
+
+  virtual ~PipeStream();
+
+  bool is_block() { return !(oflag_ & O_NONBLOCK); }
+
+  virtual void addref();
+  virtual void release();
+  virtual FileStream* dup(int fd);
+
+  virtual void close();
+  virtual int read(char* buf, size_t count, size_t* nread);
+  virtual int write(const char* buf, size_t count, size_t* nwrote);
+
+  virtual int fcntl(int cmd,  va_list ap);
+
+  virtual bool is_read_ready();
+  virtual bool is_write_ready();
+  virtual bool is_exception();
+
+ private:
+  // Data shared by both ends of the pipe.
+  struct Buffer {
+    Buffer() : ref(1), reader_closed(false), writer_closed(false) {}
+
+    void addref() { ++ref; }
+    void release() { if (!--ref) delete this; }
+
+    int ref;
+    std::deque<char> data;
+    bool reader_closed;
+    bool writer_closed;
+  };
+
+  PipeStream(int fd, int oflag, Buffer* buffer);
+
+  static const size_t kBufSize = 64 * 1024;
+
+  int ref_;
+  int fd_;
+  int oflag_;
+  Buffer* buffer_;
+
+  DISALLOW_COPY_AND_ASSIGN(PipeStream);
+};
+
+#endif  // PIPE_STREAM_H
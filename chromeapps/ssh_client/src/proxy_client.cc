@@ -0,0 +1,263 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "proxy_client.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+
+const size_t ProxyClient::kMaxHttpHeaderSize;
+
+// RFC 1928 and RFC 1929 constants.
+static const char kSocksVersion = 5;
+static const char kSocksAuthVersion = 1;
+static const char kSocksMethodNone = 0;
+static const char kSocksMethodPassword = 2;
+static const unsigned char kSocksMethodUnacceptable = 0xff;
+static const char kSocksCommandConnect = 1;
+static const char kSocksAddressIPv4 = 1;
+static const char kSocksAddressDomain = 3;
+static const char kSocksAddressIPv6 = 4;
+
+// Maps SOCKS5 reply code to errno value.
+static int GetSocksError(int reply) {
+  switch (reply) {
+    case 2:
+      return EACCES;
+    case 3:
+      return ENETUNREACH;
+    case 4:
+      return EHOSTUNREACH;
+    case 6:
+      return ETIMEDOUT;
+    default:
+      return ECONNREFUSED;
+  }
+}
+
+ProxyClient::ProxyClient(const ProxyConfig& config, FileStream* stream)
+  : config_(config), stream_(stream) {
+}
+
+ProxyClient::~ProxyClient() {
+}
+
+int ProxyClient::Connect(const std::string& host, uint16_t port) {
+  LOG("ProxyClient::Connect: [%s] port %d through %s proxy [%s] port %d\n",
+      host.c_str(), port, config_.type == ProxyConfig::HTTP ? "HTTP" : "SOCKS5",
+      config_.host.c_str(), config_.port);
+  switch (config_.type) {
+    case ProxyConfig::HTTP:
+      return ConnectHttp(host, port);
+    case ProxyConfig::SOCKS5:
+      return ConnectSocks5(host, port);
+    case ProxyConfig::NONE:
+      break;
+  }
+  return EINVAL;
+}
+
+int ProxyClient::ConnectHttp(const std::string& host, uint16_t port) {
+  char port_str[8];
+  snprintf(port_str, sizeof(port_str), "%d", port);
+  std::string authority = host.find(':') == std::string::npos ?
+      host : "[" + host + "]";
+  authority += ":";
+  authority += port_str;
+
+  std::string request = "CONNECT " + authority + " HTTP/1.1\r\n";
+  request += "Host: " + authority + "\r\n";
+  if (!config_.username.empty()) {
+    request += "Proxy-Authorization: Basic " +
+        EncodeBase64(config_.username + ":" + config_.password) + "\r\n";
+  }
+  request += "\r\n";
+  int result = Send(request);
+  if (result)
+    return result;
+
+  // Header is read a byte at a time since ssh server speaks first and its
+  // version string may come in the same packet. Bytes come from the socket
+  // buffer so it's cheap.
+  std::string header;
+  while (header.size() < 4 ||
+         header.compare(header.size() - 4, 4, "\r\n\r\n")) {
+    if (header.size() >= kMaxHttpHeaderSize) {
+      LOG("ProxyClient: HTTP proxy response is too long\n");
+      return EPROTO;
+    }
+    char c;
+    result = Receive(&c, 1);
+    if (result)
+      return result;
+    header.push_back(c);
+  }
+
+  int major, minor, status;
+  if (sscanf(header.c_str(), "HTTP/%d.%d %d", &major, &minor, &status) != 3) {
+    LOG("ProxyClient: invalid HTTP proxy response\n");
+    return EPROTO;
+  }
+  if (status / 100 != 2) {
+    LOG("ProxyClient: HTTP proxy refused: %s\n",
+        header.substr(0, header.find('\r')).c_str());
+    return status == 407 ? EACCES : ECONNREFUSED;
+  }
+  return 0;
+}
+
+int ProxyClient::ConnectSocks5(const std::string& host, uint16_t port) {
+  bool use_password = !config_.username.empty();
+  std::string greeting;
+  greeting.push_back(kSocksVersion);
+  greeting.push_back(use_password ? 2 : 1);
+  greeting.push_back(kSocksMethodNone);
+  if (use_password)
+    greeting.push_back(kSocksMethodPassword);
+  int result = Send(greeting);
+  if (result)
+    return result;
+
+  char reply[4];
+  result = Receive(reply, 2);
+  if (result)
+    return result;
+  if (reply[0] != kSocksVersion) {
+    LOG("ProxyClient: invalid SOCKS5 version %d\n", reply[0]);
+    return EPROTO;
+  }
+  if ((unsigned char)reply[1] == kSocksMethodUnacceptable) {
+    LOG("ProxyClient: SOCKS5 proxy accepts none of auth methods\n");
+    return EACCES;
+  }
+
+  if (reply[1] == kSocksMethodPassword && use_password) {
+    if (config_.username.size() > 255 || config_.password.size() > 255)
+      return EINVAL;
+    std::string auth;
+    auth.push_back(kSocksAuthVersion);
+    auth.push_back(config_.username.size());
+    auth += config_.username;
+    auth.push_back(config_.password.size());
+    auth += config_.password;
+    result = Send(auth);
+    if (result)
+      return result;
+    result = Receive(reply, 2);
+    if (result)
+      return result;
+    if (reply[1] != 0) {
+      LOG("ProxyClient: SOCKS5 authentication failed\n");
+      return EACCES;
+    }
+  } else if (reply[1] != kSocksMethodNone) {
+    LOG("ProxyClient: unexpected SOCKS5 auth method %d\n", reply[1]);
+    return EPROTO;
+  }
+
+  // Names are passed to proxy as is, it may be the only one who can
+  // resolve them.
+  std::string request;
+  request.push_back(kSocksVersion);
+  request.push_back(kSocksCommandConnect);
+  request.push_back(0);
+  in_addr addr4;
+  in6_addr addr6;
+  if (inet_pton(AF_INET, host.c_str(), &addr4) == 1) {
+    request.push_back(kSocksAddressIPv4);
+    request.append((const char*)&addr4, sizeof(addr4));
+  } else if (inet_pton(AF_INET6, host.c_str(), &addr6) == 1) {
+    request.push_back(kSocksAddressIPv6);
+    request.append((const char*)&addr6, sizeof(addr6));
+  } else {
+    if (host.size() > 255)
+      return EINVAL;
+    request.push_back(kSocksAddressDomain);
+    request.push_back(host.size());
+    request += host;
+  }
+  request.push_back(port >> 8);
+  request.push_back(port & 0xff);
+  result = Send(request);
+  if (result)
+    return result;
+
+  result = Receive(reply, 4);
+  if (result)
+    return result;
+  if (reply[0] != kSocksVersion) {
+    LOG("ProxyClient: invalid SOCKS5 version %d\n", reply[0]);
+    return EPROTO;
+  }
+  if (reply[1] != 0) {
+    LOG("ProxyClient: SOCKS5 proxy refused with code %d\n", reply[1]);
+    return GetSocksError(reply[1]);
+  }
+
+  // Skip bound address and port.
+  size_t length;
+  switch (reply[3]) {
+    case kSocksAddressIPv4:
+      length = 4;
+      break;
+    case kSocksAddressIPv6:
+      length = 16;
+      break;
+    case kSocksAddressDomain:
+      result = Receive(reply, 1);
+      if (result)
+        return result;
+      length = (unsigned char)reply[0];
+      break;
+    default:
+      LOG("ProxyClient: unknown SOCKS5 address type %d\n", reply[3]);
+      return EPROTO;
+  }
+  std::string bound(length + 2, 0);
+  return Receive(&bound[0], bound.size());
+}
+
+int ProxyClient::Send(const std::string& data) {
+  size_t nwrote;
+  int result = stream_->write(data.data(), data.size(), &nwrote);
+  if (result)
+    return result;
+  return nwrote == data.size() ? 0 : EIO;
+}
+
+int ProxyClient::Receive(char* buf, size_t count) {
+  while (count) {
+    size_t nread;
+    int result = stream_->read(buf, count, &nread);
+    if (result)
+      return result;
+    if (nread == 0) {
+      LOG("ProxyClient: proxy closed connection\n");
+      return ECONNREFUSED;
+    }
+    buf += nread;
+    count -= nread;
+  }
+  return 0;
+}
+
+std::string ProxyClient::EncodeBase64(const std::string& data) {
+  static const char kAlphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string out;
+  for (size_t i = 0; i < data.size(); i += 3) {
+    uint32_t group = (unsigned char)data[i] << 16;
+    if (i + 1 < data.size())
+      group |= (unsigned char)data[i + 1] << 8;
+    if (i + 2 < data.size())
+      group |= (unsigned char)data[i + 2];
+    out.push_back(kAlphabet[(group >> 18) & 0x3f]);
+    out.push_back(kAlphabet[(group >> 12) & 0x3f]);
+    out.push_back(i + 1 < data.size() ? kAlphabet[(group >> 6) & 0x3f] : '=');
+    out.push_back(i + 2 < data.size() ? kAlphabet[group & 0x3f] : '=');
+  }
+  return out;
+}
@@ -0,0 +1,63 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef PROXY_CLIENT_H
+#define PROXY_CLIENT_H
+
+#include <stdint.h>
+
+#include <string>
+
+#include "file_interfaces.h"
+#include "pthread_helpers.h"
+
+struct ProxyConfig {
+  enum Type {
+    NONE,
+    HTTP,
+    SOCKS5
+  };
+
+  ProxyConfig() : type(NONE), port(0) {}
+
+  Type type;
+  std::string host;
+  uint16_t port;
+  // Optional, sent as Basic credentials to HTTP proxy and with
+  // username/password method to SOCKS5 one.
+  std::string username;
+  std::string password;
+};
+
+// Asks HTTP (CONNECT) or SOCKS5 proxy to open a tunnel to the destination.
+// ProxyCommand needs fork() so this replaces it for the common proxies.
+// Works over blocking |stream| already connected to the proxy, on ssh thread
+// with FileSystem mutex locked. Proxy reply is read exactly, so anything
+// destination sent after it stays in the stream for openssh.
+class ProxyClient {
+ public:
+  ProxyClient(const ProxyConfig& config, FileStream* stream);
+  ~ProxyClient();
+
+  // Returns 0 when tunnel is open or errno value for connect().
+  int Connect(const std::string& host, uint16_t port);
+
+ private:
+  int ConnectHttp(const std::string& host, uint16_t port);
+  int ConnectSocks5(const std::string& host, uint16_t port);
+
+  int Send(const std::string& data);
+  int Receive(char* buf, size_t count);
+
+  static std::string EncodeBase64(const std::string& data);
+
+  static const size_t kMaxHttpHeaderSize = 8 * 1024;
+
+  const ProxyConfig& config_;
+  FileStream* stream_;
+
+  DISALLOW_COPY_AND_ASSIGN(ProxyClient);
+};
+
+#endif  // PROXY_CLIENT_H
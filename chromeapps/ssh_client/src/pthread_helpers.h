@@ -66,9 +66,12 @@ class Mutex {
   pthread_mutex_t mutex_;
 };
 
+// Condition variable that skips broadcasts nobody waits for, so callbacks
+// that don't change anything a waiter cares about cost nothing. Both wait
+// and broadcast must be called with the same mutex locked.
 class Cond {
  public:
-  Cond() {
+  Cond() : waiters_(0), broadcasts_(0), skipped_broadcasts_(0) {
     pthread_cond_init(&cond_, NULL);
   }
 
@@ -81,24 +84,46 @@ class Cond {
   }
 
   void broadcast() {
+    if (!waiters_) {
+      skipped_broadcasts_++;
+      return;
+    }
+    broadcasts_++;
     pthread_cond_broadcast(&cond_);
   }
 
   void signal() {
+    if (!waiters_) {
+      skipped_broadcasts_++;
+      return;
+    }
+    broadcasts_++;
     pthread_cond_signal(&cond_);
   }
 
   int wait(Mutex& mutex) {
-    return pthread_cond_wait(&cond_, mutex.get());
+    waiters_++;
+    int result = pthread_cond_wait(&cond_, mutex.get());
+    waiters_--;
+    return result;
   }
 
   int timedwait(Mutex& mutex, const timespec* abstime) {
-    return pthread_cond_timedwait(&cond_, mutex.get(), abstime);
+    waiters_++;
+    int result = pthread_cond_timedwait(&cond_, mutex.get(), abstime);
+    waiters_--;
+    return result;
   }
 
+  uint32_t broadcasts() { return broadcasts_; }
+  uint32_t skipped_broadcasts() { return skipped_broadcasts_; }
+
  private:
   DISALLOW_COPY_AND_ASSIGN(Cond);
   pthread_cond_t cond_;
+  int waiters_;
+  uint32_t broadcasts_;
+  uint32_t skipped_broadcasts_;
 };
 
 #ifndef NDEBUG
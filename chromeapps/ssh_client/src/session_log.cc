@@ -0,0 +1,385 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "session_log.h"
+
+#include <errno.h>
+#include <stdio.h>
+
+#include "ppapi/c/pp_errors.h"
+#include "ppapi/cpp/file_ref.h"
+#include "ppapi/cpp/module.h"
+
+#include "file_system.h"
+
+const size_t SessionLog::kDefaultBufferSize;
+const size_t SessionLog::kFlushSize;
+const size_t SessionLog::kMaxTimingSize;
+const size_t SessionLog::kSpillFactor;
+const int64_t SessionLog::kFlushDelayMs;
+
+SessionLog::SessionLog(const std::string& path, bool timestamps, bool compress,
+                       size_t buffer_size, OverflowPolicy policy)
+    : timestamps_(timestamps), compress_(compress),
+      buffer_size_(buffer_size ? buffer_size : kDefaultBufferSize),
+      policy_(policy), factory_(this), writer_thread_(), started_(false),
+      stopping_(false), writer_done_(false), delete_when_done_(false),
+      failed_(false), instance_(PP_Instance(0)), fs_ready_(false),
+      last_record_(),
+      dropped_(0), dropped_total_(0), zstream_() {
+  data_file_.path = path;
+  if (timestamps_)
+    timing_file_.path = path + ".timing";
+}
+
+SessionLog::~SessionLog() {
+  assert(!started_ || delete_when_done_);
+}
+
+bool SessionLog::Start() {
+  FileSystem* sys = FileSystem::GetFileSystem();
+  pp::FileSystem* fs;
+  bool fs_ready = sys->TryGetPepperFileSystem(&fs);
+
+  Mutex::Lock lock(mutex_);
+  assert(!started_);
+  instance_ = pp::InstanceHandle(sys->instance());
+  if (fs_ready)
+    SetFileSystem(fs);
+  buf_.reserve(buffer_size_);
+  gettimeofday(&last_record_, NULL);
+  if (pthread_create(&writer_thread_, NULL, &SessionLog::WriterThread, this)) {
+    failed_ = true;
+    return false;
+  }
+  started_ = true;
+  return true;
+}
+
+void SessionLog::SetFileSystem(const pp::FileSystem* fs) {
+  Mutex::Lock lock(mutex_);
+  if (fs)
+    ppfs_ = *fs;
+  fs_ready_ = true;
+  cond_.broadcast();
+}
+
+void SessionLog::Stop() {
+  {
+    Mutex::Lock lock(mutex_);
+    if (!started_ || stopping_)
+      return;
+    stopping_ = true;
+    cond_.broadcast();
+  }
+  pthread_join(writer_thread_, NULL);
+  Mutex::Lock lock(mutex_);
+  started_ = false;
+}
+
+void SessionLog::Destroy() {
+  if (!pp::Module::Get()->core()->IsMainThread()) {
+    Stop();
+    delete this;
+    return;
+  }
+
+  {
+    Mutex::Lock lock(mutex_);
+    if (started_ && !writer_done_) {
+      stopping_ = true;
+      delete_when_done_ = true;
+      cond_.broadcast();
+      pthread_detach(writer_thread_);
+      return;
+    }
+  }
+  if (started_)
+    pthread_join(writer_thread_, NULL);
+  delete this;
+}
+
+void SessionLog::Append(Direction dir, const char* buf, size_t count) {
+  if (!count)
+    return;
+
+  Mutex::Lock lock(mutex_);
+  if (!started_ || stopping_ || failed_)
+    return;
+
+  size_t limit = policy_ == SPILL ? buffer_size_ * kSpillFactor : buffer_size_;
+  if (buf_.size() + count > limit ||
+      (timestamps_ && timing_.size() >= kMaxTimingSize)) {
+    dropped_ += count;
+    dropped_total_ += count;
+    return;
+  }
+
+  bool was_empty = buf_.empty();
+  timeval now;
+  if (timestamps_) {
+    gettimeofday(&now, NULL);
+    AddTimingRecord(dir == INPUT ? 'I' : 'O', count, now);
+  }
+  if (dropped_)
+    LOG("SessionLog::Append: dropped %llu bytes\n", dropped_);
+  dropped_ = 0;
+  buf_.insert(buf_.end(), buf, buf + count);
+
+  // Wake up writer only when it has to start flush timer or block is full,
+  // there is no need to do it for every keystroke.
+  if (was_empty || (buf_.size() >= kFlushSize &&
+                    buf_.size() - count < kFlushSize)) {
+    cond_.broadcast();
+  }
+}
+
+void SessionLog::AddTimingRecord(char type, size_t count, const timeval& now) {
+  int64_t delay_us = (now.tv_sec - last_record_.tv_sec) * 1000000LL +
+                     (now.tv_usec - last_record_.tv_usec);
+  if (delay_us < 0)
+    delay_us = 0;
+  last_record_ = now;
+
+  char line[64];
+  snprintf(line, sizeof(line), "%c %d.%06d %u\n", type,
+           int(delay_us / 1000000), int(delay_us % 1000000), unsigned(count));
+  timing_ += line;
+}
+
+bool SessionLog::Deflate(const std::vector<char>& in, int flush,
+                         std::vector<char>* out) {
+  out->clear();
+  zstream_.next_in = (Bytef*)(in.empty() ? NULL : &in[0]);
+  zstream_.avail_in = in.size();
+  int result;
+  do {
+    // Full output buffer means deflate has more to write.
+    size_t pos = out->size();
+    out->resize(pos + deflateBound(&zstream_, zstream_.avail_in) + 64);
+    zstream_.next_out = (Bytef*)&(*out)[pos];
+    zstream_.avail_out = out->size() - pos;
+    result = deflate(&zstream_, flush);
+    out->resize(out->size() - zstream_.avail_out);
+  } while (result == Z_OK && !zstream_.avail_out);
+  if ((result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR) ||
+      zstream_.avail_in || (flush == Z_FINISH && result != Z_STREAM_END)) {
+    LOG("SessionLog::Deflate: failed %d\n", result);
+    return false;
+  }
+  return true;
+}
+
+void* SessionLog::WriterThread(void* arg) {
+  SessionLog* log = static_cast<SessionLog*>(arg);
+  log->WriterThreadImpl();
+  return NULL;
+}
+
+void SessionLog::WriterThreadImpl() {
+  // File system is opened asynchronously on startup, wait for it here and not
+  // on the main thread. Once the log is detached FileSystem is gone and won't
+  // report it anymore.
+  bool ok;
+  {
+    Mutex::Lock lock(mutex_);
+    while (!fs_ready_ && !delete_when_done_)
+      cond_.wait(mutex_);
+    ok = !ppfs_.is_null();
+  }
+  ok = ok && OpenFile(&data_file_) &&
+      (!timestamps_ || OpenFile(&timing_file_));
+  if (ok && compress_) {
+    // Window bits 15 + 16 produce gzip stream so log can be read with zcat.
+    ok = deflateInit2(&zstream_, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                      Z_DEFAULT_STRATEGY) == Z_OK;
+  }
+  if (!ok) {
+    LOG("SessionLog: can't open %s\n", data_file_.path.c_str());
+    Mutex::Lock lock(mutex_);
+    failed_ = true;
+    buf_.clear();
+    timing_.clear();
+  }
+
+  std::vector<char> data;
+  std::vector<char> timing;
+  std::vector<char> deflated;
+  bool done = !ok;
+  while (!done) {
+    {
+      Mutex::Lock lock(mutex_);
+      bool has_deadline = false;
+      timespec deadline;
+      while (!stopping_ && buf_.size() < kFlushSize) {
+        if (buf_.empty()) {
+          has_deadline = false;
+          cond_.wait(mutex_);
+          continue;
+        }
+        if (!has_deadline) {
+          timeval now;
+          gettimeofday(&now, NULL);
+          int64_t wakeup_ms = now.tv_sec * 1000LL + now.tv_usec / 1000 +
+                              kFlushDelayMs;
+          deadline.tv_sec = wakeup_ms / 1000;
+          deadline.tv_nsec = (wakeup_ms % 1000) * 1000000;
+          has_deadline = true;
+        }
+        if (cond_.timedwait(mutex_, &deadline) == ETIMEDOUT)
+          break;
+      }
+      // Swap keeps allocated capacity in both buffers so steady state logging
+      // doesn't allocate memory.
+      data.clear();
+      data.swap(buf_);
+      timing.assign(timing_.begin(), timing_.end());
+      timing_.clear();
+      done = stopping_;
+    }
+
+    if (compress_ && !Deflate(data, done ? Z_FINISH : Z_SYNC_FLUSH,
+                              &deflated)) {
+      Mutex::Lock lock(mutex_);
+      failed_ = true;
+      break;
+    }
+    if (compress_)
+      data.swap(deflated);
+    if ((!data.empty() && !WriteFile(&data_file_, &data)) ||
+        (!timing.empty() && !WriteFile(&timing_file_, &timing))) {
+      Mutex::Lock lock(mutex_);
+      failed_ = true;
+      break;
+    }
+  }
+
+  if (compress_)
+    deflateEnd(&zstream_);
+  CloseFile(&data_file_);
+  CloseFile(&timing_file_);
+  LOG("SessionLog: closed %s, %llu bytes dropped\n",
+      data_file_.path.c_str(), dropped_total_);
+
+  bool delete_log;
+  {
+    Mutex::Lock lock(mutex_);
+    writer_done_ = true;
+    delete_log = delete_when_done_;
+  }
+  if (delete_log)
+    delete this;
+}
+
+bool SessionLog::OpenFile(LogFile* file) {
+  int32_t result = PP_OK_COMPLETIONPENDING;
+  pp::Module::Get()->core()->CallOnMainThread(0,
+      factory_.NewCallback(&SessionLog::Open, file, &result));
+  Mutex::Lock lock(mutex_);
+  while(result == PP_OK_COMPLETIONPENDING)
+    cond_.wait(mutex_);
+  return result == PP_OK;
+}
+
+bool SessionLog::WriteFile(LogFile* file, std::vector<char>* buf) {
+  write_buf_.swap(*buf);
+  while (!write_buf_.empty()) {
+    int32_t result = PP_OK_COMPLETIONPENDING;
+    pp::Module::Get()->core()->CallOnMainThread(0,
+        factory_.NewCallback(&SessionLog::Write, file, &result));
+    Mutex::Lock lock(mutex_);
+    while(result == PP_OK_COMPLETIONPENDING)
+      cond_.wait(mutex_);
+    if (result <= 0)
+      break;
+  }
+  bool success = write_buf_.empty();
+  write_buf_.swap(*buf);
+  buf->clear();
+  return success;
+}
+
+void SessionLog::CloseFile(LogFile* file) {
+  if (!file->io)
+    return;
+  int32_t result = PP_OK_COMPLETIONPENDING;
+  pp::Module::Get()->core()->CallOnMainThread(0,
+      factory_.NewCallback(&SessionLog::Close, file, &result));
+  Mutex::Lock lock(mutex_);
+  while(result == PP_OK_COMPLETIONPENDING)
+    cond_.wait(mutex_);
+}
+
+void SessionLog::Open(int32_t result, LogFile* file, int32_t* pres) {
+  Mutex::Lock lock(mutex_);
+  pp::FileRef file_ref(ppfs_, file->path.c_str());
+  file->io = new pp::FileIO(instance_);
+  result = file->io->Open(file_ref,
+      PP_FILEOPENFLAG_WRITE | PP_FILEOPENFLAG_CREATE,
+      factory_.NewCallback(&SessionLog::OnOpen, file, pres));
+  if (result != PP_OK_COMPLETIONPENDING) {
+    delete file->io;
+    file->io = NULL;
+    *pres = result;
+    cond_.broadcast();
+  }
+}
+
+void SessionLog::OnOpen(int32_t result, LogFile* file, int32_t* pres) {
+  Mutex::Lock lock(mutex_);
+  if (result == PP_OK) {
+    result = file->io->Query(&file->info,
+        factory_.NewCallback(&SessionLog::OnQuery, file, pres));
+    if (result == PP_OK_COMPLETIONPENDING)
+      return;
+  }
+  delete file->io;
+  file->io = NULL;
+  *pres = result;
+  cond_.broadcast();
+}
+
+void SessionLog::OnQuery(int32_t result, LogFile* file, int32_t* pres) {
+  Mutex::Lock lock(mutex_);
+  if (result == PP_OK) {
+    // Always append, so one log file can hold several sessions.
+    file->offset = file->info.size;
+  } else {
+    delete file->io;
+    file->io = NULL;
+  }
+  *pres = result;
+  cond_.broadcast();
+}
+
+void SessionLog::Write(int32_t result, LogFile* file, int32_t* pres) {
+  Mutex::Lock lock(mutex_);
+  assert(file->io);
+  result = file->io->Write(file->offset, &write_buf_[0], write_buf_.size(),
+      factory_.NewCallback(&SessionLog::OnWrite, file, pres));
+  if (result != PP_OK_COMPLETIONPENDING) {
+    *pres = result < 0 ? result : PP_ERROR_FAILED;
+    cond_.broadcast();
+  }
+}
+
+void SessionLog::OnWrite(int32_t result, LogFile* file, int32_t* pres) {
+  Mutex::Lock lock(mutex_);
+  if (result > 0) {
+    file->offset += result;
+    write_buf_.erase(write_buf_.begin(), write_buf_.begin() + result);
+  } else if (result == 0) {
+    result = PP_ERROR_FAILED;
+  }
+  *pres = result;
+  cond_.broadcast();
+}
+
+void SessionLog::Close(int32_t result, LogFile* file, int32_t* pres) {
+  Mutex::Lock lock(mutex_);
+  delete file->io;
+  file->io = NULL;
+  *pres = PP_OK;
+  cond_.broadcast();
+}
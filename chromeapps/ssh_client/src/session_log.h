@@ -0,0 +1,136 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SESSION_LOG_H
+#define SESSION_LOG_H
+
+#include <sys/time.h>
+#include <zlib.h>
+
+#include <string>
+#include <vector>
+
+#include "ppapi/c/ppb_file_io.h"
+#include "ppapi/cpp/file_io.h"
+#include "ppapi/cpp/file_system.h"
+#include "ppapi/cpp/instance_handle.h"
+#include "ppapi/utility/completion_callback_factory.h"
+
+#include "pthread_helpers.h"
+
+// Copy of the terminal traffic written to the HTML5 file system. Append()
+// only copies bytes into a bounded in-memory buffer, a background thread
+// flushes it to the file in large blocks so slow file system never stalls
+// ssh or the terminal.
+//
+// With timestamps enabled a second file <path>.timing is written, each line
+// is "<type> <delay> <bytes>" where type is I (input) or O (output) and delay
+// is seconds since previous record. It is the same format as script
+// --log-timing so the session can be replayed with scriptreplay. Dropped
+// data has no record, it's only counted in the plugin log.
+class SessionLog {
+ public:
+  enum Direction {
+    INPUT,
+    OUTPUT
+  };
+
+  enum OverflowPolicy {
+    // Discard new data while the buffer is full.
+    DROP,
+    // Let the buffer grow up to kSpillFactor times its size before dropping.
+    SPILL
+  };
+
+  static const size_t kDefaultBufferSize = 256 * 1024;
+
+  SessionLog(const std::string& path, bool timestamps, bool compress,
+             size_t buffer_size, OverflowPolicy policy);
+
+  // Start background writer thread. Must be called on the main thread.
+  bool Start();
+  // Called by FileSystem when the HTML5 file system opened after Start(),
+  // |fs| is NULL if it failed.
+  void SetFileSystem(const pp::FileSystem* fs);
+  // Flush buffered data, close files and stop writer thread. Must not be
+  // called on the main thread, the writer needs it to flush.
+  void Stop();
+  // Stop and delete the log. On the main thread this doesn't wait, the
+  // writer deletes the log itself once it has flushed.
+  void Destroy();
+
+  // Copy data to the log. Can be called on any thread, never waits for
+  // the writer.
+  void Append(Direction dir, const char* buf, size_t count);
+
+ private:
+  ~SessionLog();
+
+  struct LogFile {
+    LogFile() : io(NULL), offset(0), info() {}
+
+    std::string path;
+    pp::FileIO* io;
+    int64_t offset;
+    PP_FileInfo info;
+  };
+
+  bool OpenFile(LogFile* file);
+  bool WriteFile(LogFile* file, std::vector<char>* buf);
+  void CloseFile(LogFile* file);
+
+  void Open(int32_t result, LogFile* file, int32_t* pres);
+  void OnOpen(int32_t result, LogFile* file, int32_t* pres);
+  void OnQuery(int32_t result, LogFile* file, int32_t* pres);
+  void Write(int32_t result, LogFile* file, int32_t* pres);
+  void OnWrite(int32_t result, LogFile* file, int32_t* pres);
+  void Close(int32_t result, LogFile* file, int32_t* pres);
+
+  void AddTimingRecord(char type, size_t count, const timeval& now);
+  bool Deflate(const std::vector<char>& in, int flush, std::vector<char>* out);
+
+  void WriterThreadImpl();
+  static void* WriterThread(void* arg);
+
+  static const size_t kFlushSize = 64 * 1024;
+  static const size_t kMaxTimingSize = 64 * 1024;
+  static const size_t kSpillFactor = 4;
+  static const int64_t kFlushDelayMs = 1000;
+
+  bool timestamps_;
+  bool compress_;
+  size_t buffer_size_;
+  OverflowPolicy policy_;
+  pp::CompletionCallbackFactory<SessionLog> factory_;
+  Mutex mutex_;
+  Cond cond_;
+  pthread_t writer_thread_;
+  bool started_;
+  bool stopping_;
+  bool writer_done_;
+  bool delete_when_done_;
+  bool failed_;
+  // Copies taken on the main thread, so the writer never touches FileSystem
+  // which can be gone before a detached writer finishes.
+  pp::InstanceHandle instance_;
+  pp::FileSystem ppfs_;
+  bool fs_ready_;
+
+  // Data waiting for writer, guarded by mutex_.
+  std::vector<char> buf_;
+  std::string timing_;
+  timeval last_record_;
+  uint64_t dropped_;
+  uint64_t dropped_total_;
+
+  // Owned by writer thread.
+  LogFile data_file_;
+  LogFile timing_file_;
+  std::vector<char> write_buf_;
+  z_stream zstream_;
+
+  DISALLOW_COPY_AND_ASSIGN(SessionLog);
+};
+
+#endif  // SESSION_LOG_H
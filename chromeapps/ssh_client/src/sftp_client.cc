@@ -0,0 +1,667 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sftp_client.h"
+
+#include <algorithm>
+
+#include <stdio.h>
+#include <sys/time.h>
+
+#include "ppapi/cpp/module.h"
+
+#include "file_system.h"
+
+// Protocol constants from draft-ietf-secsh-filexfer-02 (SFTP version 3).
+static const uint32_t kSftpVersion = 3;
+
+static const uint8_t kFxpInit = 1;
+static const uint8_t kFxpVersion = 2;
+static const uint8_t kFxpOpen = 3;
+static const uint8_t kFxpClose = 4;
+static const uint8_t kFxpRead = 5;
+static const uint8_t kFxpWrite = 6;
+static const uint8_t kFxpFstat = 8;
+static const uint8_t kFxpFsetstat = 10;
+static const uint8_t kFxpStatus = 101;
+static const uint8_t kFxpHandle = 102;
+static const uint8_t kFxpData = 103;
+static const uint8_t kFxpAttrs = 105;
+
+static const uint32_t kFxfRead = 0x01;
+static const uint32_t kFxfWrite = 0x02;
+static const uint32_t kFxfCreat = 0x08;
+static const uint32_t kFxfTrunc = 0x10;
+
+static const uint32_t kFileXferAttrSize = 0x01;
+
+static const uint32_t kFxOk = 0;
+static const uint32_t kFxEof = 1;
+
+static const size_t kMaxRequests = 1024;
+
+const size_t SftpClient::kMaxPacketSize;
+const size_t SftpClient::kWriteChunkSize;
+const int64_t SftpClient::kProgressIntervalMs;
+
+static int64_t GetTimeMs() {
+  timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+}
+
+static void PutUInt32(std::vector<char>* buf, uint32_t value) {
+  buf->push_back(value >> 24);
+  buf->push_back(value >> 16);
+  buf->push_back(value >> 8);
+  buf->push_back(value);
+}
+
+static void PutUInt64(std::vector<char>* buf, uint64_t value) {
+  PutUInt32(buf, value >> 32);
+  PutUInt32(buf, value);
+}
+
+static void PutString(std::vector<char>* buf, const char* data, size_t size) {
+  PutUInt32(buf, size);
+  buf->insert(buf->end(), data, data + size);
+}
+
+static uint32_t ReadUInt32(const char* p) {
+  const uint8_t* u = reinterpret_cast<const uint8_t*>(p);
+  return (uint32_t(u[0]) << 24) | (uint32_t(u[1]) << 16) |
+         (uint32_t(u[2]) << 8) | u[3];
+}
+
+static bool GetUInt32(const std::vector<char>& buf, size_t* pos,
+                      uint32_t* value) {
+  if (buf.size() < *pos + 4)
+    return false;
+  *value = ReadUInt32(&buf[*pos]);
+  *pos += 4;
+  return true;
+}
+
+static bool GetUInt64(const std::vector<char>& buf, size_t* pos,
+                      uint64_t* value) {
+  uint32_t high, low;
+  if (!GetUInt32(buf, pos, &high) || !GetUInt32(buf, pos, &low))
+    return false;
+  *value = (uint64_t(high) << 32) | low;
+  return true;
+}
+
+static bool GetString(const std::vector<char>& buf, size_t* pos,
+                      std::string* value) {
+  uint32_t size;
+  if (!GetUInt32(buf, pos, &size) || buf.size() - *pos < size)
+    return false;
+  value->assign(buf.begin() + *pos, buf.begin() + *pos + size);
+  *pos += size;
+  return true;
+}
+
+//------------------------------------------------------------------------------
+
+SftpClient::SftpClient(FileStream* input, FileStream* output,
+                       TransferListener* listener)
+  : input_(input), output_(output), listener_(listener), thread_(),
+    started_(false), thread_done_(false), delete_when_done_(false),
+    next_id_(0), packet_start_(0), local_fd_(-1), total_(0), bytes_done_(0),
+    last_progress_ms_(0), out_offset_(0) {
+  input_->addref();
+  output_->addref();
+}
+
+SftpClient::~SftpClient() {
+  // A detached client may outlive FileSystem, the pipes are left to it.
+  if (!delete_when_done_) {
+    input_->release();
+    output_->release();
+  }
+}
+
+bool SftpClient::Start(const Params& params) {
+  if (params.remote_path.empty() ||
+      (params.direction == UPLOAD && params.local_path.empty()) ||
+      params.max_requests < 1 || params.max_requests > kMaxRequests ||
+      params.block_size < 1 || params.block_size > kMaxPacketSize - 1024 ||
+      params.stripe_count < 1 || params.stripe_index >= params.stripe_count) {
+    return false;
+  }
+  params_ = params;
+  started_ = !pthread_create(&thread_, NULL, &SftpClient::TransferThread,
+                             this);
+  return started_;
+}
+
+void SftpClient::Destroy() {
+  if (!started_) {
+    delete this;
+    return;
+  }
+
+  // Closed pipes fail the read or write the transfer thread waits for.
+  ClosePipes();
+  if (pp::Module::Get()->core()->IsMainThread()) {
+    Mutex::Lock lock(mutex_);
+    if (!thread_done_) {
+      listener_ = NULL;
+      delete_when_done_ = true;
+      pthread_detach(thread_);
+      return;
+    }
+  }
+  pthread_join(thread_, NULL);
+  delete this;
+}
+
+void SftpClient::ClosePipes() {
+  Mutex::Lock lock(FileSystem::GetFileSystem()->mutex());
+  input_->close();
+  output_->close();
+}
+
+void* SftpClient::TransferThread(void* arg) {
+  SftpClient* client = static_cast<SftpClient*>(arg);
+  client->TransferThreadImpl();
+  return NULL;
+}
+
+void SftpClient::TransferThreadImpl() {
+  int64_t start_ms = GetTimeMs();
+  bool success = Init() &&
+      (params_.direction == DOWNLOAD ? Download() : Upload());
+
+  bool delete_client;
+  {
+    // Destroy() waits for this instead of detaching, FileSystem and the
+    // listener are still there.
+    Mutex::Lock lock(mutex_);
+    delete_client = delete_when_done_;
+    if (!delete_client) {
+      FileSystem* sys = FileSystem::GetFileSystem();
+      if (local_fd_ != -1)
+        sys->close(local_fd_);
+      // EOF on ssh stdin closes the channel and ends the session. Output
+      // ssh still has for us fails with EPIPE instead of filling the pipe.
+      ClosePipes();
+
+      ReportProgress(true);
+      int64_t msec = GetTimeMs() - start_ms;
+      LOG("SftpClient: %s %llu bytes in %lld ms\n",
+          success ? "transferred" : "failed after", bytes_done_, msec);
+      listener_->OnTransferComplete(success, error_, bytes_done_, msec);
+    }
+    thread_done_ = true;
+  }
+  if (delete_client)
+    delete this;
+}
+
+bool SftpClient::Init() {
+  // INIT has version in place of request id.
+  BeginPacket(kFxpInit, kSftpVersion);
+  EndPacket();
+  if (!SendPackets())
+    return false;
+
+  uint8_t type;
+  uint32_t version;
+  std::vector<char> payload;
+  if (!ReceivePacket(&type, &version, &payload))
+    return false;
+  if (type != kFxpVersion || version < kSftpVersion) {
+    error_ = "unsupported sftp server";
+    return false;
+  }
+  return true;
+}
+
+void SftpClient::GetStripe(uint64_t size, uint64_t* begin, uint64_t* end) {
+  // Stripes are aligned to block size so all connections send full sized
+  // requests.
+  uint64_t blocks = (size + params_.block_size - 1) / params_.block_size;
+  uint64_t stripe_blocks =
+      (blocks + params_.stripe_count - 1) / params_.stripe_count;
+  *begin = std::min<uint64_t>(
+      size, params_.stripe_index * stripe_blocks * params_.block_size);
+  *end = std::min<uint64_t>(size, *begin + stripe_blocks * params_.block_size);
+}
+
+bool SftpClient::Download() {
+  if (!OpenRemote(kFxfRead))
+    return false;
+  bool size_known = GetRemoteSize();
+  if (is_striped() && !size_known) {
+    error_ = "can't get size of " + params_.remote_path;
+    return false;
+  }
+
+  uint64_t size = total_;
+  uint64_t offset = 0;
+  uint64_t end = total_;
+  if (is_striped()) {
+    GetStripe(total_, &offset, &end);
+    total_ = end - offset;
+    out_offset_ = offset;
+  }
+
+  if (!params_.local_path.empty()) {
+    int oflag = O_WRONLY | O_CREAT | (is_striped() ? 0 : O_TRUNC);
+    int result = FileSystem::GetFileSystem()->open(
+        params_.local_path.c_str(), oflag, 0644, &local_fd_);
+    if (result) {
+      local_fd_ = -1;
+      error_ = "can't open " + params_.local_path;
+      return false;
+    }
+    if (is_striped() && params_.stripe_index == 0 &&
+        FileSystem::GetFileSystem()->ftruncate(local_fd_, size)) {
+      error_ = "can't write " + params_.local_path;
+      return false;
+    }
+  }
+
+  // Keep up to max_requests reads in flight, each reply is replaced with a
+  // new request. Replies can come out of order, Deliver() puts them back in
+  // order. Reading stops at EOF or at the size returned by FSTAT.
+  bool eof = false;
+  std::vector<char> payload;
+  for (;;) {
+    while (!eof && requests_.size() < params_.max_requests &&
+           (!size_known || offset < end)) {
+      uint32_t length = params_.block_size;
+      if (size_known && end - offset < length)
+        length = end - offset;
+      QueueRead(offset, length);
+      offset += length;
+    }
+    if (requests_.empty())
+      break;
+    if (!SendPackets())
+      return false;
+
+    uint8_t type;
+    uint32_t id;
+    if (!ReceivePacket(&type, &id, &payload))
+      return false;
+    RequestMap::iterator it = requests_.find(id);
+    if (it == requests_.end()) {
+      error_ = "unexpected sftp reply";
+      return false;
+    }
+    Request request = it->second;
+    requests_.erase(it);
+
+    if (type == kFxpData) {
+      size_t pos = 0;
+      uint32_t size;
+      if (!GetUInt32(payload, &pos, &size) ||
+          payload.size() - pos < size || size > request.length) {
+        error_ = "bad sftp data packet";
+        return false;
+      }
+      if (!size) {
+        eof = true;
+        continue;
+      }
+      // Server can return less than requested, ask for the rest.
+      if (size < request.length)
+        QueueRead(request.offset + size, request.length - size);
+      payload.erase(payload.begin(), payload.begin() + pos);
+      payload.resize(size);
+      if (!Deliver(request.offset, &payload))
+        return false;
+    } else if (type == kFxpStatus) {
+      size_t pos = 0;
+      uint32_t code;
+      if (GetUInt32(payload, &pos, &code) && code == kFxEof) {
+        eof = true;
+      } else {
+        SetStatusError(payload, 0);
+        return false;
+      }
+    } else {
+      error_ = "unexpected sftp reply";
+      return false;
+    }
+    ReportProgress(false);
+  }
+
+  if (!FlushOutput())
+    return false;
+  if (!chunks_.empty()) {
+    error_ = "remote file is truncated";
+    return false;
+  }
+  return CloseRemote();
+}
+
+bool SftpClient::Upload() {
+  FileSystem* sys = FileSystem::GetFileSystem();
+  if (sys->open(params_.local_path.c_str(), O_RDONLY, 0, &local_fd_)) {
+    local_fd_ = -1;
+    error_ = "can't open " + params_.local_path;
+    return false;
+  }
+  nacl_abi_stat st;
+  if (!sys->fstat(local_fd_, &st))
+    total_ = st.nacl_abi_st_size;
+  uint64_t size = total_;
+
+  uint64_t offset = 0;
+  uint64_t end = 0;
+  if (is_striped()) {
+    GetStripe(total_, &offset, &end);
+    total_ = end - offset;
+    if (sys->seek(local_fd_, offset, SEEK_SET, NULL)) {
+      error_ = "can't read " + params_.local_path;
+      return false;
+    }
+  }
+
+  if (!OpenRemote(kFxfWrite | kFxfCreat | (is_striped() ? 0 : kFxfTrunc)))
+    return false;
+  if (is_striped() && params_.stripe_index == 0 && !SetRemoteSize(size))
+    return false;
+
+  bool eof = is_striped() && offset >= end;
+  std::vector<char> buf(params_.block_size);
+  std::vector<char> payload;
+  for (;;) {
+    while (!eof && requests_.size() < params_.max_requests) {
+      size_t count = buf.size();
+      if (is_striped() && end - offset < count)
+        count = end - offset;
+      size_t nread;
+      if (sys->read(local_fd_, &buf[0], count, &nread)) {
+        error_ = "can't read " + params_.local_path;
+        return false;
+      }
+      if (nread) {
+        QueueWrite(offset, &buf[0], nread);
+        offset += nread;
+      }
+      if (!nread || (is_striped() && offset >= end))
+        eof = true;
+    }
+    if (requests_.empty())
+      break;
+    if (!SendPackets())
+      return false;
+
+    uint8_t type;
+    uint32_t id;
+    if (!ReceivePacket(&type, &id, &payload))
+      return false;
+    RequestMap::iterator it = requests_.find(id);
+    size_t pos = 0;
+    uint32_t code;
+    if (it == requests_.end() || type != kFxpStatus ||
+        !GetUInt32(payload, &pos, &code)) {
+      error_ = "unexpected sftp reply";
+      return false;
+    }
+    if (code != kFxOk) {
+      SetStatusError(payload, 0);
+      return false;
+    }
+    bytes_done_ += it->second.length;
+    requests_.erase(it);
+    ReportProgress(false);
+  }
+
+  return CloseRemote();
+}
+
+bool SftpClient::OpenRemote(uint32_t pflags) {
+  uint32_t id = next_id_++;
+  BeginPacket(kFxpOpen, id);
+  PutString(&send_buf_, params_.remote_path.data(),
+            params_.remote_path.size());
+  PutUInt32(&send_buf_, pflags);
+  // Empty attributes.
+  PutUInt32(&send_buf_, 0);
+  EndPacket();
+  if (!SendPackets())
+    return false;
+
+  uint8_t type;
+  uint32_t reply_id;
+  std::vector<char> payload;
+  if (!ReceivePacket(&type, &reply_id, &payload))
+    return false;
+  size_t pos = 0;
+  if (reply_id == id && type == kFxpHandle &&
+      GetString(payload, &pos, &handle_)) {
+    return true;
+  }
+  if (reply_id == id && type == kFxpStatus)
+    SetStatusError(payload, 0);
+  else
+    error_ = "unexpected sftp reply";
+  return false;
+}
+
+bool SftpClient::GetRemoteSize() {
+  uint32_t id = next_id_++;
+  BeginPacket(kFxpFstat, id);
+  PutString(&send_buf_, handle_.data(), handle_.size());
+  EndPacket();
+  if (!SendPackets())
+    return false;
+
+  uint8_t type;
+  uint32_t reply_id;
+  std::vector<char> payload;
+  if (!ReceivePacket(&type, &reply_id, &payload))
+    return false;
+  size_t pos = 0;
+  uint32_t flags;
+  uint64_t size;
+  if (reply_id == id && type == kFxpAttrs &&
+      GetUInt32(payload, &pos, &flags) && (flags & kFileXferAttrSize) &&
+      GetUInt64(payload, &pos, &size)) {
+    total_ = size;
+    return true;
+  }
+  return false;
+}
+
+bool SftpClient::SetRemoteSize(uint64_t size) {
+  uint32_t id = next_id_++;
+  BeginPacket(kFxpFsetstat, id);
+  PutString(&send_buf_, handle_.data(), handle_.size());
+  PutUInt32(&send_buf_, kFileXferAttrSize);
+  PutUInt64(&send_buf_, size);
+  EndPacket();
+  return SendPackets() && ReceiveStatus(id);
+}
+
+bool SftpClient::CloseRemote() {
+  uint32_t id = next_id_++;
+  BeginPacket(kFxpClose, id);
+  PutString(&send_buf_, handle_.data(), handle_.size());
+  EndPacket();
+  return SendPackets() && ReceiveStatus(id);
+}
+
+void SftpClient::QueueRead(uint64_t offset, uint32_t length) {
+  uint32_t id = next_id_++;
+  BeginPacket(kFxpRead, id);
+  PutString(&send_buf_, handle_.data(), handle_.size());
+  PutUInt64(&send_buf_, offset);
+  PutUInt32(&send_buf_, length);
+  EndPacket();
+  Request& request = requests_[id];
+  request.offset = offset;
+  request.length = length;
+}
+
+void SftpClient::QueueWrite(uint64_t offset, const char* data,
+                            uint32_t length) {
+  uint32_t id = next_id_++;
+  BeginPacket(kFxpWrite, id);
+  PutString(&send_buf_, handle_.data(), handle_.size());
+  PutUInt64(&send_buf_, offset);
+  PutString(&send_buf_, data, length);
+  EndPacket();
+  Request& request = requests_[id];
+  request.offset = offset;
+  request.length = length;
+}
+
+void SftpClient::BeginPacket(uint8_t type, uint32_t id) {
+  packet_start_ = send_buf_.size();
+  // Length is filled in EndPacket().
+  PutUInt32(&send_buf_, 0);
+  send_buf_.push_back(type);
+  PutUInt32(&send_buf_, id);
+}
+
+void SftpClient::EndPacket() {
+  uint32_t length = send_buf_.size() - packet_start_ - 4;
+  send_buf_[packet_start_] = length >> 24;
+  send_buf_[packet_start_ + 1] = length >> 16;
+  send_buf_[packet_start_ + 2] = length >> 8;
+  send_buf_[packet_start_ + 3] = length;
+}
+
+bool SftpClient::SendPackets() {
+  FileSystem* sys = FileSystem::GetFileSystem();
+  Mutex::Lock lock(sys->mutex());
+  size_t pos = 0;
+  while (pos < send_buf_.size()) {
+    size_t nwrote;
+    if (input_->write(&send_buf_[pos], send_buf_.size() - pos, &nwrote)) {
+      error_ = "connection closed";
+      return false;
+    }
+    pos += nwrote;
+  }
+  send_buf_.clear();
+  return true;
+}
+
+bool SftpClient::ReadFully(char* buf, size_t count) {
+  FileSystem* sys = FileSystem::GetFileSystem();
+  Mutex::Lock lock(sys->mutex());
+  size_t pos = 0;
+  while (pos < count) {
+    size_t nread;
+    if (output_->read(buf + pos, count - pos, &nread) || !nread) {
+      error_ = "connection closed";
+      return false;
+    }
+    pos += nread;
+  }
+  return true;
+}
+
+bool SftpClient::ReceivePacket(uint8_t* type, uint32_t* id,
+                               std::vector<char>* payload) {
+  char header[9];
+  if (!ReadFully(header, sizeof(header)))
+    return false;
+  uint32_t length = ReadUInt32(header);
+  if (length < 5 || length > kMaxPacketSize) {
+    error_ = "bad sftp packet";
+    return false;
+  }
+  *type = header[4];
+  *id = ReadUInt32(header + 5);
+  payload->resize(length - 5);
+  return payload->empty() || ReadFully(&(*payload)[0], payload->size());
+}
+
+bool SftpClient::ReceiveStatus(uint32_t id) {
+  uint8_t type;
+  uint32_t reply_id;
+  std::vector<char> payload;
+  if (!ReceivePacket(&type, &reply_id, &payload))
+    return false;
+  size_t pos = 0;
+  uint32_t code;
+  if (reply_id != id || type != kFxpStatus ||
+      !GetUInt32(payload, &pos, &code)) {
+    error_ = "unexpected sftp reply";
+    return false;
+  }
+  if (code != kFxOk)
+    return SetStatusError(payload, 0);
+  return true;
+}
+
+bool SftpClient::SetStatusError(const std::vector<char>& payload, size_t pos) {
+  uint32_t code = 0;
+  std::string message;
+  if (GetUInt32(payload, &pos, &code) && GetString(payload, &pos, &message) &&
+      !message.empty()) {
+    error_ = message;
+  } else {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "sftp error %u", code);
+    error_ = buf;
+  }
+  return false;
+}
+
+bool SftpClient::Deliver(uint64_t offset, std::vector<char>* data) {
+  bytes_done_ += data->size();
+  if (offset != out_offset_) {
+    chunks_[offset].swap(*data);
+    return true;
+  }
+
+  out_buf_.insert(out_buf_.end(), data->begin(), data->end());
+  out_offset_ += data->size();
+  // Append chunks which arrived ahead of this one.
+  ChunkMap::iterator it;
+  while ((it = chunks_.begin()) != chunks_.end() && it->first == out_offset_) {
+    out_buf_.insert(out_buf_.end(), it->second.begin(), it->second.end());
+    out_offset_ += it->second.size();
+    chunks_.erase(it);
+  }
+
+  if (out_buf_.size() >= kWriteChunkSize)
+    return FlushOutput();
+  return true;
+}
+
+bool SftpClient::FlushOutput() {
+  if (out_buf_.empty())
+    return true;
+
+  if (local_fd_ != -1) {
+    // Positioned write, other stripes write the same file in parallel.
+    FileSystem* sys = FileSystem::GetFileSystem();
+    size_t nwrote;
+    if (sys->seek(local_fd_, out_offset_ - out_buf_.size(), SEEK_SET, NULL) ||
+        sys->write(local_fd_, &out_buf_[0], out_buf_.size(), &nwrote) ||
+        nwrote != out_buf_.size()) {
+      error_ = "can't write " + params_.local_path;
+      return false;
+    }
+  } else {
+    Mutex::Lock lock(mutex_);
+    if (!listener_) {
+      error_ = "transfer cancelled";
+      return false;
+    }
+    listener_->OnTransferData(&out_buf_[0], out_buf_.size());
+  }
+  out_buf_.clear();
+  return true;
+}
+
+void SftpClient::ReportProgress(bool force) {
+  int64_t now = GetTimeMs();
+  if (force || now - last_progress_ms_ >= kProgressIntervalMs) {
+    last_progress_ms_ = now;
+    Mutex::Lock lock(mutex_);
+    if (listener_)
+      listener_->OnTransferProgress(bytes_done_, total_);
+  }
+}
@@ -0,0 +1,143 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SFTP_CLIENT_H
+#define SFTP_CLIENT_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "file_interfaces.h"
+#include "pthread_helpers.h"
+
+class TransferListener {
+ public:
+  virtual ~TransferListener() {}
+
+  virtual void OnTransferProgress(uint64_t done, uint64_t total) = 0;
+  // Downloaded data in file order when there is no local file.
+  virtual void OnTransferData(const char* data, size_t size) = 0;
+  virtual void OnTransferComplete(bool success, const std::string& error,
+                                  uint64_t bytes, int64_t msec) = 0;
+};
+
+// SFTP version 3 client talking to "ssh -s host sftp" through pipes bound to
+// its stdin and stdout. Unlike running sftp in the terminal, data never goes
+// through JS as base64 and many read or write requests are kept in flight,
+// so throughput isn't bound by round trip time.
+class SftpClient {
+ public:
+  enum Direction {
+    DOWNLOAD,
+    UPLOAD
+  };
+
+  struct Params {
+    Params()
+      : direction(DOWNLOAD), max_requests(64), block_size(32 * 1024),
+        stripe_index(0), stripe_count(1) {}
+
+    Direction direction;
+    std::string remote_path;
+    // HTML5 file system path, empty for downloads streamed to the listener.
+    std::string local_path;
+    size_t max_requests;
+    size_t block_size;
+    // Transfer only part |stripe_index| of |stripe_count| block aligned
+    // parts of the file. Every part is sent over its own connection and
+    // written at its offset, so the destination is not truncated on open.
+    // Stripe 0 sets it to the final size instead, that drops the tail of
+    // an older longer file and keeps what other stripes have written.
+    size_t stripe_index;
+    size_t stripe_count;
+  };
+
+  // |input| is connected to ssh stdin, |output| to ssh stdout.
+  SftpClient(FileStream* input, FileStream* output,
+             TransferListener* listener);
+
+  bool Start(const Params& params);
+  // Stop the transfer and delete the client. Local file reads and writes
+  // wait for the main thread, so on it the transfer thread isn't joined.
+  // It's detached instead, the listener isn't called any more and the
+  // thread deletes the client once it's done.
+  void Destroy();
+
+ private:
+  ~SftpClient();
+
+  struct Request {
+    uint64_t offset;
+    uint32_t length;
+  };
+
+  typedef std::map<uint32_t, Request> RequestMap;
+  typedef std::map<uint64_t, std::vector<char> > ChunkMap;
+
+  bool Init();
+  bool Download();
+  bool Upload();
+
+  bool is_striped() { return params_.stripe_count > 1; }
+  void GetStripe(uint64_t size, uint64_t* begin, uint64_t* end);
+
+  bool OpenRemote(uint32_t pflags);
+  bool GetRemoteSize();
+  bool SetRemoteSize(uint64_t size);
+  bool CloseRemote();
+  void QueueRead(uint64_t offset, uint32_t length);
+  void QueueWrite(uint64_t offset, const char* data, uint32_t length);
+
+  void BeginPacket(uint8_t type, uint32_t id);
+  void EndPacket();
+  bool SendPackets();
+  bool ReadFully(char* buf, size_t count);
+  bool ReceivePacket(uint8_t* type, uint32_t* id, std::vector<char>* payload);
+  bool ReceiveStatus(uint32_t id);
+  bool SetStatusError(const std::vector<char>& payload, size_t pos);
+
+  bool Deliver(uint64_t offset, std::vector<char>* data);
+  bool FlushOutput();
+  void ReportProgress(bool force);
+
+  void ClosePipes();
+  void TransferThreadImpl();
+  static void* TransferThread(void* arg);
+
+  static const size_t kMaxPacketSize = 256 * 1024;
+  static const size_t kWriteChunkSize = 256 * 1024;
+  static const int64_t kProgressIntervalMs = 100;
+
+  FileStream* input_;
+  FileStream* output_;
+  TransferListener* listener_;
+  Params params_;
+  pthread_t thread_;
+  bool started_;
+  // Guards the listener and the end of the transfer thread against
+  // Destroy() on the main thread.
+  Mutex mutex_;
+  bool thread_done_;
+  bool delete_when_done_;
+
+  uint32_t next_id_;
+  std::string handle_;
+  RequestMap requests_;
+  std::vector<char> send_buf_;
+  size_t packet_start_;
+  std::string error_;
+
+  int local_fd_;
+  uint64_t total_;
+  uint64_t bytes_done_;
+  int64_t last_progress_ms_;
+  ChunkMap chunks_;
+  uint64_t out_offset_;
+  std::vector<char> out_buf_;
+
+  DISALLOW_COPY_AND_ASSIGN(SftpClient);
+};
+
+#endif  // SFTP_CLIENT_H
@@ -0,0 +1,105 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "ssh_buffer.h"
+
+#include <string.h>
+#include <sys/types.h>
+
+// Same limits as in openssh buffer.c.
+static const u_int kMaxChunk = 0x100000;
+static const u_int kMaxLength = 0xa00000;
+static const u_int kAllocSize = 0x008000;
+// Data is moved when the consumed space is this many times larger, so a
+// byte is moved at most 1 / kCompactRatio times on average.
+static const u_int kCompactRatio = 2;
+
+// Buffers are used on the ssh thread and stats are read on the main one.
+// Atomic adds keep the appends from taking a lock.
+static uint64_t bytes_appended = 0;
+static uint64_t bytes_moved = 0;
+
+// Same layout as Buffer in openssh buffer.h.
+struct Buffer {
+  u_char* buf;
+  u_int alloc;
+  u_int offset;
+  u_int end;
+};
+
+extern "C" void* xrealloc(void* ptr, size_t nmemb, size_t size);
+extern "C" void fatal(const char* format, ...)
+    __attribute__((noreturn, format(printf, 1, 2)));
+
+static u_int GetAllocSize(Buffer* buffer, u_int len) {
+  return (buffer->alloc + len + kAllocSize - 1) / kAllocSize * kAllocSize;
+}
+
+static void AddStats(uint64_t appended, uint64_t moved) {
+  if (appended)
+    __sync_fetch_and_add(&bytes_appended, appended);
+  if (moved)
+    __sync_fetch_and_add(&bytes_moved, moved);
+}
+
+// Move the data to the start of the buffer if the consumed space in front
+// of it is large enough, or if the buffer can't grow any more.
+static bool Compact(Buffer* buffer, u_int len) {
+  u_int size = buffer->end - buffer->offset;
+  if (!buffer->offset || (buffer->offset < size * kCompactRatio &&
+                          GetAllocSize(buffer, len) <= kMaxLength)) {
+    return false;
+  }
+  memmove(buffer->buf, buffer->buf + buffer->offset, size);
+  buffer->offset = 0;
+  buffer->end = size;
+  AddStats(0, size);
+  return true;
+}
+
+// Original openssh functions renamed by openssh-5.9p1.patch are not used,
+// these replace them.
+extern "C" void* buffer_append_space(Buffer* buffer, u_int len) {
+  if (len > kMaxChunk)
+    fatal("buffer_append_space: len %u not supported", len);
+
+  // If the buffer is empty, start using it from the beginning.
+  if (buffer->offset == buffer->end) {
+    buffer->offset = 0;
+    buffer->end = 0;
+  }
+  while (buffer->end + len >= buffer->alloc) {
+    if (Compact(buffer, len))
+      continue;
+    u_int new_alloc = GetAllocSize(buffer, len);
+    if (new_alloc > kMaxLength)
+      fatal("buffer_append_space: alloc %u not supported", new_alloc);
+    buffer->buf = static_cast<u_char*>(xrealloc(buffer->buf, 1, new_alloc));
+    buffer->alloc = new_alloc;
+    AddStats(0, buffer->end);
+  }
+
+  void* p = buffer->buf + buffer->end;
+  buffer->end += len;
+  AddStats(len, 0);
+  return p;
+}
+
+// Must follow the same math as buffer_append_space().
+extern "C" int buffer_check_alloc(Buffer* buffer, u_int len) {
+  if (buffer->offset == buffer->end) {
+    buffer->offset = 0;
+    buffer->end = 0;
+  }
+  while (buffer->end + len >= buffer->alloc) {
+    if (!Compact(buffer, len))
+      return GetAllocSize(buffer, len) <= kMaxLength;
+  }
+  return 1;
+}
+
+void SshBuffer::GetStats(uint64_t* appended, uint64_t* moved) {
+  *appended = __sync_fetch_and_add(&bytes_appended, 0);
+  *moved = __sync_fetch_and_add(&bytes_moved, 0);
+}
@@ -0,0 +1,28 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SSH_BUFFER_H
+#define SSH_BUFFER_H
+
+#include <stdint.h>
+
+// Growth of openssh Buffer, which holds packets and channel data. openssh
+// moves data to the start of the buffer only after 1 MB was consumed in
+// front of it and grows the buffer otherwise, so with large windows the
+// buffers keep growing and every realloc copies the consumed bytes too.
+// Here the data is moved as soon as the consumed space is twice as large
+// as the data and the buffer grows only when the data takes more of it.
+// Large windows then keep the buffers a few times the window size and
+// moves bounded by the bytes consumed.
+//
+// Callers read and write through buffer_ptr() and buffer_append_space(),
+// so the data must stay contiguous and a ring buffer can't be used.
+class SshBuffer {
+ public:
+  // Bytes appended to all buffers and bytes moved by compaction and
+  // realloc, realloc is counted as copying all the data.
+  static void GetStats(uint64_t* appended, uint64_t* moved);
+};
+
+#endif  // SSH_BUFFER_H
@@ -7,19 +7,33 @@
 #include <stdio.h>
 #include <string.h>
 #include <resolv.h>
+#include <sys/time.h>
+
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
 
 #include "ppapi/cpp/module.h"
+#include "ppapi/cpp/var_array_buffer.h"
 
 #include "json/reader.h"
 #include "json/writer.h"
 
 #include "file_system.h"
+#include "inline_image.h"
+#include "mont_exp.h"
+#include "session_log.h"
+#include "ssh_buffer.h"
 
 const char kMessageNameAttr[] = "name";
 const char kMessageArgumentsAttr[] = "arguments";
 
 // These are C++ the method names as JavaScript sees them.
 const char kStartSessionMethodId[] = "startSession";
+const char kTransferFileMethodId[] = "transferFile";
+const char kGetStatsMethodId[] = "getStats";
+const char kZmodemSendMethodId[] = "zmodemSend";
+const char kSetTriggersMethodId[] = "setTriggers";
 const char kOnOpenFileMethodId[] = "onOpenFile";
 const char kOnOpenSocketMethodId[] = "onOpenSocket";
 const char kOnReadMethodId[] = "onRead";
@@ -38,6 +52,48 @@ const char kUseJsSocketAttr[] = "useJsSocket";
 const char kEnvironmentAttr[] = "environment";
 const char kArgumentsAttr[] = "arguments";
 const char kWriteWindowAttr[] = "writeWindow";
+const char kSessionLogAttr[] = "sessionLog";
+const char kReusableAttr[] = "reusable";
+const char kProxyAttr[] = "proxy";
+const char kUseHostProfileAttr[] = "useHostProfile";
+const char kFastAuthAttr[] = "fastAuth";
+const char kMoshAttr[] = "mosh";
+
+// Known sessionLog attributes.
+const char kLogPathAttr[] = "path";
+const char kLogTimestampsAttr[] = "timestamps";
+const char kLogCompressAttr[] = "compress";
+const char kLogBufferSizeAttr[] = "bufferSize";
+const char kLogOverflowAttr[] = "overflow";
+const char kLogOverflowSpill[] = "spill";
+
+// Known proxy attributes.
+const char kProxyTypeAttr[] = "type";
+const char kProxyHostAttr[] = "host";
+const char kProxyPortAttr[] = "port";
+const char kProxyUsernameAttr[] = "username";
+const char kProxyPasswordAttr[] = "password";
+const char kProxyTypeHttp[] = "http";
+const char kProxyTypeSocks5[] = "socks5";
+
+// Known mosh attributes.
+const char kMoshHostAttr[] = "host";
+const char kMoshServerAttr[] = "server";
+const char kMoshCommandAttr[] = "command";
+
+// Known transferFile attributes, in addition to startSession ones.
+const char kTransferDirectionAttr[] = "direction";
+const char kTransferRemotePathAttr[] = "remotePath";
+const char kTransferLocalPathAttr[] = "localPath";
+const char kTransferMaxRequestsAttr[] = "maxRequests";
+const char kTransferBlockSizeAttr[] = "blockSize";
+const char kTransferStripeIndexAttr[] = "stripeIndex";
+const char kTransferStripeCountAttr[] = "stripeCount";
+const char kTransferUpload[] = "upload";
+
+// Known writeImage formats.
+const char kImageFormatRgba[] = "rgba";
+const char kImageFormatEncoded[] = "encoded";
 
 // These are JavaScript method names as C++ code sees them.
 const char kPrintLogMethodId[] = "printLog";
@@ -45,12 +101,19 @@ const char kExitMethodId[] = "exit";
 const char kOpenFileMethodId[] = "openFile";
 const char kOpenSocketMethodId[] = "openSocket";
 const char kWriteMethodId[] = "write";
+const char kWriteImageMethodId[] = "writeImage";
 const char kReadMethodId[] = "read";
 const char kCloseMethodId[] = "close";
+const char kTransferProgressMethodId[] = "transferProgress";
+const char kTransferCompleteMethodId[] = "transferComplete";
+const char kStatsMethodId[] = "stats";
+const char kTriggerMatchesMethodId[] = "triggerMatches";
+const char kEchoAckMethodId[] = "echoAck";
 
 const size_t kDefaultWriteWindow = 64 * 1024;
 
 extern "C" int ssh_main(int ac, const char **av);
+extern "C" void ssh_reset_globals();
 
 //------------------------------------------------------------------------------
 
@@ -60,12 +123,44 @@ SshPluginInstance::SshPluginInstance(PP_Instance instance)
     : pp::Instance(instance),
       core_(pp::Module::Get()->core()),
       openssh_thread_(NULL),
+      warm_up_(new WarmUp()),
+      warm_up_started_(false),
       factory_(this),
-      file_system_(this, this) {
+      file_system_(this, this),
+      sftp_client_(NULL),
+      mosh_client_(NULL) {
   instance_ = this;
+  gettimeofday(&created_, NULL);
+  warm_up_->created = created_;
+  // FileSystem has already started opening HTML5 file system.
+  warm_up_->running = !pthread_create(&warm_up_->thread, NULL,
+                                      &SshPluginInstance::WarmUpThread,
+                                      warm_up_);
+  warm_up_started_ = warm_up_->running;
 }
 
 SshPluginInstance::~SshPluginInstance() {
+  // Don't join, without NACL_IRT_RANDOM RAND_status() reads /dev/random
+  // through JS and needs the main thread.
+  bool started;
+  {
+    Mutex::Lock lock(file_system_.mutex());
+    started = warm_up_started_;
+    warm_up_started_ = false;
+  }
+  if (started)
+    pthread_detach(warm_up_->thread);
+  bool done;
+  {
+    Mutex::Lock lock(warm_up_->mutex);
+    done = !warm_up_->running || warm_up_->done;
+    warm_up_->orphaned = true;
+  }
+  if (done)
+    delete warm_up_;
+  if (sftp_client_)
+    sftp_client_->Destroy();
+  delete mosh_client_;
   instance_ = NULL;
 }
 
@@ -86,6 +181,14 @@ void SshPluginInstance::Invoke(const std::string& function,
                                const Json::Value& args) {
   if (function == kStartSessionMethodId) {
     StartSession(args);
+  } else if (function == kTransferFileMethodId) {
+    TransferFile(args);
+  } else if (function == kGetStatsMethodId) {
+    GetStats(args);
+  } else if (function == kZmodemSendMethodId) {
+    ZmodemSend(args);
+  } else if (function == kSetTriggersMethodId) {
+    SetTriggers(args);
   } else if (function == kOnOpenFileMethodId ||
              function == kOnOpenSocketMethodId) {
     OnOpen(args);
@@ -124,6 +227,9 @@ void SshPluginInstance::PrintLog(const std::string& msg) {
 }
 
 void SshPluginInstance::SendExitCodeImpl(int32_t result, int error) {
+  // Cleared here and not on ssh thread, StartSession() reads it on the
+  // main thread.
+  openssh_thread_ = NULL;
   Json::Value call_args(Json::arrayValue);
   call_args.append(error);
   InvokeJS(kExitMethodId, call_args);
@@ -132,7 +238,87 @@ void SshPluginInstance::SendExitCodeImpl(int32_t result, int error) {
 void SshPluginInstance::SendExitCode(int error) {
   core_->CallOnMainThread(0, factory_.NewCallback(
       &SshPluginInstance::SendExitCodeImpl, error));
-  openssh_thread_ = NULL;
+}
+
+void SshPluginInstance::SendTriggerMatchesImpl(int32_t result,
+                                               const Json::Value& args) {
+  InvokeJS(kTriggerMatchesMethodId, args);
+}
+
+void SshPluginInstance::SendTriggerMatches(
+    const std::vector<TriggerMatch>& matches) {
+  // Flat list of pattern index and offset pairs, one message per write.
+  Json::Value call_args(Json::arrayValue);
+  for (size_t i = 0; i < matches.size(); i++) {
+    call_args.append(matches[i].pattern);
+    call_args.append(double(matches[i].offset));
+  }
+  core_->CallOnMainThread(0, factory_.NewCallback(
+      &SshPluginInstance::SendTriggerMatchesImpl, call_args));
+}
+
+void SshPluginInstance::SendEchoAckImpl(int32_t result,
+                                        const Json::Value& args) {
+  InvokeJS(kEchoAckMethodId, args);
+}
+
+void SshPluginInstance::SendEchoAck(uint64_t output_offset,
+                                    uint64_t input_offset, int rtt_ms) {
+  Json::Value call_args(Json::arrayValue);
+  call_args.append(double(output_offset));
+  call_args.append(double(input_offset));
+  call_args.append(rtt_ms);
+  core_->CallOnMainThread(0, factory_.NewCallback(
+      &SshPluginInstance::SendEchoAckImpl, call_args));
+}
+
+void SshPluginInstance::SendTransferProgressImpl(int32_t result,
+                                                 uint64_t done,
+                                                 uint64_t total) {
+  // Json library doesn't support 64-bit integers.
+  Json::Value call_args(Json::arrayValue);
+  call_args.append(double(done));
+  call_args.append(double(total));
+  InvokeJS(kTransferProgressMethodId, call_args);
+}
+
+void SshPluginInstance::OnTransferProgress(uint64_t done, uint64_t total) {
+  core_->CallOnMainThread(0, factory_.NewCallback(
+      &SshPluginInstance::SendTransferProgressImpl, done, total));
+}
+
+void SshPluginInstance::SendTransferDataImpl(int32_t result,
+                                             std::vector<char>* data) {
+  // Raw ArrayBuffer messages carry file content in order, all other
+  // messages are JSON strings.
+  pp::VarArrayBuffer buffer(data->size());
+  memcpy(buffer.Map(), &(*data)[0], data->size());
+  buffer.Unmap();
+  PostMessage(buffer);
+  delete data;
+}
+
+void SshPluginInstance::OnTransferData(const char* data, size_t size) {
+  core_->CallOnMainThread(0, factory_.NewCallback(
+      &SshPluginInstance::SendTransferDataImpl,
+      new std::vector<char>(data, data + size)));
+}
+
+void SshPluginInstance::SendTransferCompleteImpl(int32_t result,
+                                                 const Json::Value& args) {
+  InvokeJS(kTransferCompleteMethodId, args);
+}
+
+void SshPluginInstance::OnTransferComplete(bool success,
+                                           const std::string& error,
+                                           uint64_t bytes, int64_t msec) {
+  Json::Value call_args(Json::arrayValue);
+  call_args.append(success);
+  call_args.append(error);
+  call_args.append(double(bytes));
+  call_args.append(double(msec));
+  core_->CallOnMainThread(0, factory_.NewCallback(
+      &SshPluginInstance::SendTransferCompleteImpl, call_args));
 }
 
 bool SshPluginInstance::OpenFile(int fd, const char* name, int mode,
@@ -183,6 +369,27 @@ bool SshPluginInstance::Write(int fd, const char* data, size_t size) {
   return true;
 }
 
+bool SshPluginInstance::WriteImage(int fd, const InlineImage& image) {
+  // Pixels follow as ArrayBuffer message, it's much cheaper for JS than
+  // base64 in JSON.
+  Json::Value call_args(Json::arrayValue);
+  call_args.append(fd);
+  call_args.append(image.format == InlineImage::RGBA ? kImageFormatRgba
+                                                     : kImageFormatEncoded);
+  call_args.append(image.width);
+  call_args.append(image.height);
+  call_args.append(image.display_width);
+  call_args.append(image.display_height);
+  call_args.append(image.preserve_aspect_ratio);
+  InvokeJS(kWriteImageMethodId, call_args);
+
+  pp::VarArrayBuffer buffer(image.data.size());
+  memcpy(buffer.Map(), &image.data[0], image.data.size());
+  buffer.Unmap();
+  PostMessage(buffer);
+  return true;
+}
+
 bool SshPluginInstance::Read(int fd, size_t size) {
   Json::Value call_args(Json::arrayValue);
   call_args.append(fd);
@@ -206,7 +413,54 @@ size_t SshPluginInstance::GetWriteWindow() {
   return kDefaultWriteWindow;
 }
 
+void* SshPluginInstance::WarmUpThread(void* arg) {
+  WarmUp* warm_up = static_cast<WarmUp*>(arg);
+  timeval start;
+  gettimeofday(&start, NULL);
+
+  // Same calls ssh_main makes, repeated ones are cheap.
+  OpenSSL_add_all_algorithms();
+  ERR_load_crypto_strings();
+  // Seed PRNG from /dev/urandom now, seed_rng() only checks RAND_status().
+  RAND_status();
+  // Before ssh creates any keys or DH groups.
+  MontExp::Install();
+
+  timeval end;
+  gettimeofday(&end, NULL);
+  LOG("WarmUpThread: took %d ms\n",
+      int((end.tv_sec - start.tv_sec) * 1000 +
+          (end.tv_usec - start.tv_usec) / 1000));
+
+  bool orphaned;
+  {
+    Mutex::Lock lock(warm_up->mutex);
+    warm_up->done = true;
+    warm_up->usec = (end.tv_sec - warm_up->created.tv_sec) * 1000000LL +
+                    (end.tv_usec - warm_up->created.tv_usec);
+    orphaned = warm_up->orphaned;
+  }
+  if (orphaned)
+    delete warm_up;
+  return NULL;
+}
+
+void SshPluginInstance::WaitForWarmUp() {
+  // OpenSSL initialization is not thread safe so ssh_main must not run
+  // concurrently with warm-up.
+  bool started;
+  {
+    Mutex::Lock lock(file_system_.mutex());
+    started = warm_up_started_;
+    warm_up_started_ = false;
+  }
+  if (started)
+    pthread_join(warm_up_->thread, NULL);
+}
+
 void SshPluginInstance::SessionThreadImpl() {
+  WaitForWarmUp();
+
   // Call renamed ssh main.
   std::vector<const char*> argv;
   // argv[0]
@@ -214,6 +468,14 @@ void SshPluginInstance::SessionThreadImpl() {
 #ifdef DEBUG
   argv.push_back("-vvv");
 #endif
+  // Run sftp subsystem instead of shell for file transfers.
+  if (sftp_client_)
+    argv.push_back("-s");
+  // Only mosh-server is started, with its output going to the mosh client.
+  if (mosh_client_) {
+    argv.push_back("-n");
+    argv.push_back("-tt");
+  }
   if (session_args_.isMember(kArgumentsAttr) &&
       session_args_[kArgumentsAttr].isArray()) {
     const Json::Value& args = session_args_[kArgumentsAttr];
@@ -240,12 +502,37 @@ void SshPluginInstance::SessionThreadImpl() {
         session_args_[kHostAttr].asString();
     argv.push_back(username_hostname.c_str());
   }
+  if (sftp_client_)
+    argv.push_back("sftp");
+  std::string mosh_command;
+  if (mosh_client_) {
+    MoshClient::Params params;
+    const Json::Value& mosh = session_args_[kMoshAttr];
+    params.server = mosh[kMoshServerAttr].asString();
+    params.command = mosh[kMoshCommandAttr].asString();
+    mosh_command = MoshClient::GetServerCommand(params);
+    argv.push_back(mosh_command.c_str());
+  }
 
   LOG("ssh main args:\n");
   for (size_t i = 0; i < argv.size(); i++)
     LOG("  argv[%d] = %s\n", i, argv[i]);
 
-  SendExitCode(ssh_main(argv.size(), &argv[0]));
+  // Command line flags from the previous session are still set.
+  ssh_reset_globals();
+  bool exited;
+  int status = file_system_.RunMain(&ssh_main, argv.size(), &argv[0],
+                                    &exited);
+  if (exited)
+    return;
+  if (file_system_.is_exit_held()) {
+    // Mosh client reports the exit code when the session ends.
+    file_system_.exit(status);
+    return;
+  }
+  if (file_system_.is_reusable())
+    file_system_.Reset();
+  SendExitCode(status);
 }
 
 void* SshPluginInstance::SessionThread(void* arg) {
@@ -257,6 +544,11 @@ void* SshPluginInstance::SessionThread(void* arg) {
 void SshPluginInstance::StartSession(const Json::Value& args) {
   if (args.size() == 1 && args[(size_t)0].isObject() && !openssh_thread_) {
     session_args_ = args[(size_t)0];
+    file_system_.MarkSessionStart();
+    {
+      Mutex::Lock lock(warm_up_->mutex);
+      LOG("startSession: %s start\n", warm_up_->done ? "warm" : "cold");
+    }
     if (session_args_.isMember(kTerminalWidthAttr) &&
         session_args_[kTerminalWidthAttr].isNumeric() &&
         session_args_.isMember(kTerminalHeightAttr) &&
@@ -268,6 +560,21 @@ void SshPluginInstance::StartSession(const Json::Value& args) {
         session_args_[kUseJsSocketAttr].isBool()) {
       file_system_.UseJsSocket(session_args_[kUseJsSocketAttr].asBool());
     }
+    if (session_args_.isMember(kProxyAttr) &&
+        session_args_[kProxyAttr].isObject()) {
+      SetProxy(session_args_[kProxyAttr]);
+    }
+    if (session_args_.isMember(kUseHostProfileAttr) &&
+        session_args_[kUseHostProfileAttr].isBool()) {
+      file_system_.UseHostProfile(session_args_[kUseHostProfileAttr].asBool());
+    }
+    if (session_args_.isMember(kFastAuthAttr) &&
+        session_args_[kFastAuthAttr].isBool()) {
+      file_system_.UseFastAuth(session_args_[kFastAuthAttr].asBool());
+    }
+    for (size_t i = 0; i < environment_.size(); i++)
+      unsetenv(environment_[i].c_str());
+    environment_.clear();
     if (session_args_.isMember(kEnvironmentAttr) &&
         session_args_[kEnvironmentAttr].isObject()) {
       Json::Value::iterator end = session_args_[kEnvironmentAttr].end();
@@ -276,18 +583,274 @@ void SshPluginInstance::StartSession(const Json::Value& args) {
         if (it.key().isString() && (*it).isString()) {
           LOG("env[%s] = %s\n", it.key().asCString(), (*it).asCString());
           setenv(it.key().asCString(), (*it).asCString(), 1);
+          environment_.push_back(it.key().asString());
         }
       }
     }
+    if (session_args_.isMember(kMoshAttr) &&
+        !StartMosh(session_args_[kMoshAttr])) {
+      SendExitCodeImpl(0, -1);
+      return;
+    }
+    // Transfer and mosh instances are dedicated to a single session.
+    file_system_.SetReusable(!sftp_client_ && !mosh_client_ &&
+        session_args_.isMember(kReusableAttr) &&
+        session_args_[kReusableAttr].isBool() &&
+        session_args_[kReusableAttr].asBool());
+    if (session_args_.isMember(kSessionLogAttr) &&
+        session_args_[kSessionLogAttr].isObject()) {
+      StartSessionLog(session_args_[kSessionLogAttr]);
+    }
     if (pthread_create(&openssh_thread_, NULL,
                        &SshPluginInstance::SessionThread, this)) {
       SendExitCodeImpl(0, -1);
+    } else if (file_system_.is_reusable()) {
+      // Nobody joins ssh threads of reusable instance.
+      pthread_detach(openssh_thread_);
     }
   } else {
     PrintLogImpl(0, "startSession: invalid arguments\n");
   }
 }
 
+void SshPluginInstance::StartSessionLog(const Json::Value& args) {
+  if (!args.isMember(kLogPathAttr) || !args[kLogPathAttr].isString()) {
+    PrintLogImpl(0, "startSession: invalid sessionLog path\n");
+    return;
+  }
+
+  bool timestamps = args.isMember(kLogTimestampsAttr) &&
+      args[kLogTimestampsAttr].isBool() && args[kLogTimestampsAttr].asBool();
+  bool compress = args.isMember(kLogCompressAttr) &&
+      args[kLogCompressAttr].isBool() && args[kLogCompressAttr].asBool();
+  size_t buffer_size = SessionLog::kDefaultBufferSize;
+  if (args.isMember(kLogBufferSizeAttr) &&
+      args[kLogBufferSizeAttr].isNumeric() &&
+      args[kLogBufferSizeAttr].asInt() > 0) {
+    buffer_size = args[kLogBufferSizeAttr].asInt();
+  }
+  SessionLog::OverflowPolicy policy = SessionLog::DROP;
+  if (args.isMember(kLogOverflowAttr) && args[kLogOverflowAttr].isString() &&
+      args[kLogOverflowAttr].asString() == kLogOverflowSpill) {
+    policy = SessionLog::SPILL;
+  }
+
+  SessionLog* log = new SessionLog(args[kLogPathAttr].asString(), timestamps,
+                                   compress, buffer_size, policy);
+  if (!log->Start()) {
+    PrintLogImpl(0, "startSession: can't start session log\n");
+    log->Destroy();
+    return;
+  }
+  file_system_.SetSessionLog(log);
+}
+
+void SshPluginInstance::SetProxy(const Json::Value& args) {
+  ProxyConfig proxy;
+  std::string type = args.isMember(kProxyTypeAttr) &&
+      args[kProxyTypeAttr].isString() ? args[kProxyTypeAttr].asString() : "";
+  if (type == kProxyTypeHttp)
+    proxy.type = ProxyConfig::HTTP;
+  else if (type == kProxyTypeSocks5)
+    proxy.type = ProxyConfig::SOCKS5;
+  if (proxy.type == ProxyConfig::NONE ||
+      !args.isMember(kProxyHostAttr) || !args[kProxyHostAttr].isString() ||
+      !args.isMember(kProxyPortAttr) || !args[kProxyPortAttr].isNumeric() ||
+      args[kProxyPortAttr].asInt() <= 0 ||
+      args[kProxyPortAttr].asInt() > 65535) {
+    PrintLogImpl(0, "startSession: invalid proxy\n");
+    return;
+  }
+
+  proxy.host = args[kProxyHostAttr].asString();
+  proxy.port = args[kProxyPortAttr].asInt();
+  if (args.isMember(kProxyUsernameAttr) &&
+      args[kProxyUsernameAttr].isString()) {
+    proxy.username = args[kProxyUsernameAttr].asString();
+  }
+  if (args.isMember(kProxyPasswordAttr) &&
+      args[kProxyPasswordAttr].isString()) {
+    proxy.password = args[kProxyPasswordAttr].asString();
+  }
+  file_system_.SetProxy(proxy);
+}
+
+bool SshPluginInstance::StartMosh(const Json::Value& args) {
+  // Mosh packets go over Pepper UDP straight to the host.
+  if (!args.isObject() || !args.isMember(kMoshHostAttr) ||
+      !args[kMoshHostAttr].isString() || sftp_client_ || mosh_client_ ||
+      (session_args_.isMember(kUseJsSocketAttr) &&
+       session_args_[kUseJsSocketAttr].isBool() &&
+       session_args_[kUseJsSocketAttr].asBool()) ||
+      session_args_.isMember(kProxyAttr)) {
+    PrintLogImpl(0, "startSession: invalid mosh arguments\n");
+    return false;
+  }
+
+  MoshClient::Params params;
+  params.host = args[kMoshHostAttr].asString();
+  if (args.isMember(kMoshServerAttr) && args[kMoshServerAttr].isString() &&
+      !args[kMoshServerAttr].asString().empty()) {
+    params.server = args[kMoshServerAttr].asString();
+  }
+  if (args.isMember(kMoshCommandAttr) && args[kMoshCommandAttr].isString())
+    params.command = args[kMoshCommandAttr].asString();
+  // Normalized so ssh thread builds the same server command.
+  session_args_[kMoshAttr][kMoshServerAttr] = params.server;
+  session_args_[kMoshAttr][kMoshCommandAttr] = params.command;
+
+  // ssh output is the mosh-server bootstrap, the client takes the terminal
+  // once ssh exits.
+  FileStream* input;
+  FileStream* output;
+  file_system_.UsePipesForStdio(&input, &output);
+  mosh_client_ = new MoshClient(output);
+  input->release();
+  output->release();
+  file_system_.HoldExit(true);
+  if (!mosh_client_->Start(params)) {
+    file_system_.HoldExit(false);
+    PrintLogImpl(0, "startSession: can't start mosh\n");
+    return false;
+  }
+  return true;
+}
+
+// Reads optional non-negative integer attribute |name| into |value|.
+static bool GetSizeAttr(const Json::Value& attrs, const char* name,
+                        size_t* value) {
+  if (!attrs.isMember(name))
+    return true;
+  if (!attrs[name].isConvertibleTo(Json::uintValue))
+    return false;
+  *value = attrs[name].asUInt();
+  return true;
+}
+
+void SshPluginInstance::TransferFile(const Json::Value& args) {
+  if (args.size() != 1 || !args[(size_t)0].isObject() || openssh_thread_ ||
+      sftp_client_ || !args[(size_t)0][kTransferRemotePathAttr].isString()) {
+    PrintLogImpl(0, "transferFile: invalid arguments\n");
+    return;
+  }
+
+  const Json::Value& attrs = args[(size_t)0];
+  SftpClient::Params params;
+  if (attrs[kTransferDirectionAttr].isString() &&
+      attrs[kTransferDirectionAttr].asString() == kTransferUpload) {
+    params.direction = SftpClient::UPLOAD;
+  }
+  params.remote_path = attrs[kTransferRemotePathAttr].asString();
+  if (attrs[kTransferLocalPathAttr].isString())
+    params.local_path = attrs[kTransferLocalPathAttr].asString();
+  if (!GetSizeAttr(attrs, kTransferMaxRequestsAttr, &params.max_requests) ||
+      !GetSizeAttr(attrs, kTransferBlockSizeAttr, &params.block_size) ||
+      (attrs.isMember(kTransferStripeIndexAttr) !=
+       attrs.isMember(kTransferStripeCountAttr)) ||
+      !GetSizeAttr(attrs, kTransferStripeIndexAttr, &params.stripe_index) ||
+      !GetSizeAttr(attrs, kTransferStripeCountAttr, &params.stripe_count)) {
+    PrintLogImpl(0, "transferFile: invalid arguments\n");
+    return;
+  }
+
+  // This plugin instance is dedicated to the transfer: ssh stdio is bound to
+  // the sftp client and the session is started as usual.
+  FileStream* input;
+  FileStream* output;
+  file_system_.UsePipesForStdio(&input, &output);
+  sftp_client_ = new SftpClient(input, output, this);
+  input->release();
+  output->release();
+  if (!sftp_client_->Start(params)) {
+    PrintLogImpl(0, "transferFile: invalid transfer parameters\n");
+    SendExitCodeImpl(0, -1);
+    return;
+  }
+  StartSession(args);
+}
+
+void SshPluginInstance::ZmodemSend(const Json::Value& args) {
+  std::vector<std::string> paths;
+  for (size_t i = 0; i < args.size(); i++) {
+    if (!args[i].isString()) {
+      PrintLogImpl(0, "zmodemSend: invalid arguments\n");
+      return;
+    }
+    paths.push_back(args[i].asString());
+  }
+  file_system_.QueueZmodemUpload(paths);
+}
+
+void SshPluginInstance::SetTriggers(const Json::Value& args) {
+  std::vector<std::string> patterns;
+  for (size_t i = 0; i < args.size(); i++) {
+    if (!args[i].isString()) {
+      PrintLogImpl(0, "setTriggers: invalid arguments\n");
+      return;
+    }
+    patterns.push_back(args[i].asString());
+  }
+  std::string error;
+  if (!file_system_.SetTriggers(patterns, &error))
+    PrintLogImpl(0, "setTriggers: " + error + "\n");
+}
+
+void SshPluginInstance::GetStats(const Json::Value& args) {
+  FileSystem::WakeupStats wakeups;
+  uint32_t broadcasts;
+  uint32_t skipped_broadcasts;
+  file_system_.GetWakeupStats(&wakeups, &broadcasts, &skipped_broadcasts);
+  bool profile_used;
+  uint32_t round_trips;
+  uint32_t saved_round_trips;
+  int64_t handshake_usec;
+  double warm_up_ms;
+  {
+    Mutex::Lock lock(warm_up_->mutex);
+    warm_up_ms = warm_up_->done ? warm_up_->usec / 1000.0 : -1;
+  }
+  {
+    Mutex::Lock lock(file_system_.mutex());
+    profile_used = file_system_.host_profile()->is_used();
+    round_trips = file_system_.host_profile()->round_trips();
+    saved_round_trips = file_system_.host_profile()->saved_round_trips();
+    handshake_usec = file_system_.host_profile()->handshake_usec();
+  }
+  uint32_t mod_exp_calls;
+  uint64_t mod_exp_usec;
+  MontExp::GetStats(&mod_exp_calls, &mod_exp_usec);
+  uint64_t buffer_appended;
+  uint64_t buffer_moved;
+  SshBuffer::GetStats(&buffer_appended, &buffer_moved);
+
+  timeval now;
+  gettimeofday(&now, NULL);
+  Json::Value stats(Json::objectValue);
+  stats["uptimeMs"] = double((now.tv_sec - created_.tv_sec) * 1000.0 +
+                             (now.tv_usec - created_.tv_usec) / 1000);
+  stats["warmUpMs"] = warm_up_ms;
+  stats["selectCalls"] = wakeups.select_calls;
+  stats["timerWakeups"] = wakeups.timer_wakeups;
+  stats["ioWakeups"] = wakeups.io_wakeups;
+  stats["signalWakeups"] = wakeups.signal_wakeups;
+  stats["spuriousWakeups"] = wakeups.spurious_wakeups;
+  stats["unchangedNotifications"] = wakeups.unchanged_notifications;
+  stats["broadcasts"] = broadcasts;
+  stats["skippedBroadcasts"] = skipped_broadcasts;
+  stats["hostProfileUsed"] = profile_used;
+  stats["handshakeRoundTrips"] = round_trips;
+  stats["authRoundTripsSaved"] = saved_round_trips;
+  stats["handshakeMs"] = double(handshake_usec / 1000);
+  stats["modExpCalls"] = mod_exp_calls;
+  stats["modExpMs"] = double(mod_exp_usec / 1000);
+  stats["bufferBytesAppended"] = double(buffer_appended);
+  stats["bufferBytesMoved"] = double(buffer_moved);
+
+  Json::Value call_args(Json::arrayValue);
+  call_args.append(stats);
+  InvokeJS(kStatsMethodId, call_args);
+}
+
 void SshPluginInstance::OnOpen(const Json::Value& args) {
   const Json::Value& fd = args[(size_t)0];
   const Json::Value& result = args[(size_t)1];
@@ -345,8 +908,11 @@ void SshPluginInstance::OnClose(const Json::Value& args) {
   const Json::Value& fd = args[(size_t)0];
   InputStreams::iterator it = streams_.find(fd.asInt());
   if (it != streams_.end()) {
-    it->second->OnClose();
+    // Drop the entry first, the descriptor is free for OpenFile() as soon as
+    // the stream has closed.
+    InputInterface* stream = it->second;
     streams_.erase(it);
+    stream->OnClose();
   } else {
     PrintLogImpl(0, "onClose: for unknown file descriptor\n");
   }
@@ -7,6 +7,9 @@
 
 #include <string>
 #include <map>
+#include <vector>
+
+#include <sys/time.h>
 
 #include "ppapi/cpp/completion_callback.h"
 #include "ppapi/cpp/instance.h"
@@ -16,9 +19,12 @@
 
 #include "pthread_helpers.h"
 #include "file_system.h"
+#include "mosh_client.h"
+#include "sftp_client.h"
 
 class SshPluginInstance : public pp::Instance,
-                          public OutputInterface {
+                          public OutputInterface,
+                          public TransferListener {
  public:
   explicit SshPluginInstance(PP_Instance instance);
   virtual ~SshPluginInstance();
@@ -35,15 +41,32 @@ class SshPluginInstance : public pp::Instance,
   virtual bool OpenSocket(int fd, const char* host, uint16_t port,
                           InputInterface* stream);
   virtual bool Write(int fd, const char* data, size_t size);
+  virtual bool WriteImage(int fd, const InlineImage& image);
   virtual bool Read(int fd, size_t size);
   virtual bool Close(int fd);
   virtual size_t GetWriteWindow();
   virtual void SendExitCode(int error);
+  virtual void SendTriggerMatches(const std::vector<TriggerMatch>& matches);
+  virtual void SendEchoAck(uint64_t output_offset, uint64_t input_offset,
+                           int rtt_ms);
+
+  // Implements TransferListener.
+  virtual void OnTransferProgress(uint64_t done, uint64_t total);
+  virtual void OnTransferData(const char* data, size_t size);
+  virtual void OnTransferComplete(bool success, const std::string& error,
+                                  uint64_t bytes, int64_t msec);
 
  private:
   typedef std::map<int, InputInterface*> InputStreams;
 
   void StartSession(const Json::Value& args);
+  void StartSessionLog(const Json::Value& args);
+  void SetProxy(const Json::Value& args);
+  bool StartMosh(const Json::Value& args);
+  void TransferFile(const Json::Value& args);
+  void GetStats(const Json::Value& args);
+  void ZmodemSend(const Json::Value& args);
+  void SetTriggers(const Json::Value& args);
   void OnOpen(const Json::Value& args);
   void OnRead(const Json::Value& args);
   void OnWriteAcknowledge(const Json::Value& args);
@@ -54,6 +77,11 @@ class SshPluginInstance : public pp::Instance,
   void SessionThreadImpl();
   static void* SessionThread(void* arg);
 
+  // Do what ssh_main does first while the page is still prompting for
+  // connection details.
+  static void* WarmUpThread(void* arg);
+  void WaitForWarmUp();
+
   void Invoke(const std::string& function, const Json::Value& args);
   void InvokeJS(const std::string& function, const Json::Value& args);
 
@@ -61,15 +89,47 @@ class SshPluginInstance : public pp::Instance,
   void PrintLogImpl(int32_t result, const std::string& msg);
 
   void SendExitCodeImpl(int32_t result, int error);
+  void SendTriggerMatchesImpl(int32_t result, const Json::Value& args);
+  void SendEchoAckImpl(int32_t result, const Json::Value& args);
+
+  void SendTransferProgressImpl(int32_t result, uint64_t done, uint64_t total);
+  void SendTransferDataImpl(int32_t result, std::vector<char>* data);
+  void SendTransferCompleteImpl(int32_t result, const Json::Value& args);
 
   static SshPluginInstance* instance_;
 
   pp::Core* core_;
   pthread_t openssh_thread_;
+  timeval created_;
+  // Shared with the warm-up thread. The destructor detaches the thread, so
+  // whichever of them finishes last deletes it.
+  struct WarmUp {
+    WarmUp()
+        : thread(), created(), running(false), done(false), orphaned(false),
+          usec(0) {}
+
+    Mutex mutex;
+    pthread_t thread;
+    timeval created;
+    // The thread was created, only the instance writes it.
+    bool running;
+    bool done;
+    // The instance is gone.
+    bool orphaned;
+    // Time since created until warm-up finished, reported by getStats.
+    int64_t usec;
+  };
+  WarmUp* warm_up_;
+  // Guarded by file_system_.mutex().
+  bool warm_up_started_;
   Json::Value session_args_;
+  // Environment variables set by the last startSession.
+  std::vector<std::string> environment_;
   pp::CompletionCallbackFactory<SshPluginInstance> factory_;
   InputStreams streams_;
   FileSystem file_system_;
+  SftpClient* sftp_client_;
+  MoshClient* mosh_client_;
 
   DISALLOW_COPY_AND_ASSIGN(SshPluginInstance);
 };
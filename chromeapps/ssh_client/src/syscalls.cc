@@ -11,6 +11,11 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <termios.h>
+#ifdef SSH_BENCH
+#include <errno.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 #include "nacl-mounts/base/irt_syscalls.h"
 
@@ -113,7 +118,16 @@ struct nacl_irt_fdio {
 };
 
 int libnacl_write(int fd, const void *buf, size_t count, size_t *nwrote) {
+#ifdef SSH_BENCH
+  // No NaCl IRT in the Linux build for bench/ssh_bench.cc.
+  ssize_t rv = syscall(SYS_write, fd, buf, count);
+  if (rv < 0)
+    return errno;
+  *nwrote = rv;
+  return 0;
+#else
   return __libnacl_irt_fdio.write(fd, buf, count, nwrote);
+#endif
 }
 #endif
 
@@ -266,7 +280,13 @@ int select(int nfds, fd_set *readfds, fd_set *writefds,
 void exit(int status) {
   LOG("exit: %d\n", status);
   g_exit_called = true;
-  FileSystem::GetFileSystem()->exit(status);
+  FileSystem* sys = FileSystem::GetFileSystem();
+  if (sys->exit(status) || sys->is_reusable()) {
+    // Only ssh main ends, the module waits for the next session or the
+    // session goes on without ssh.
+    g_exit_called = false;
+    sys->ReturnFromMain(status);
+  }
   abort();  // Can we chain to the real exit?
 }
 
@@ -278,7 +298,11 @@ void _exit(int status) {
     pthread_exit(NULL);
   }
   g_exit_called = true;
-  FileSystem::GetFileSystem()->exit(status);
+  FileSystem* sys = FileSystem::GetFileSystem();
+  if (sys->exit(status)) {
+    g_exit_called = false;
+    sys->ReturnFromMain(status);
+  }
   abort();  // Can we chain to the real _exit?
 }
 
@@ -331,7 +355,11 @@ void freeaddrinfo(struct addrinfo* ai) {
 
 int getnameinfo(const struct sockaddr *sa, socklen_t salen,
                 char *host, socklen_t hostlen,
+#ifdef SSH_BENCH
+                char *serv, socklen_t servlen, int flags) {
+#else
                 char *serv, socklen_t servlen, unsigned int flags) {
+#endif
   LOG("getnameinfo\n");
   return FileSystem::GetFileSystem()->getnameinfo(
       sa, salen, host, hostlen, serv, servlen, flags);
@@ -402,13 +430,24 @@ int listen(int sockfd, int backlog) {
 int setsockopt(int socket, int level, int option_name,
                const void *option_value, socklen_t option_len) {
   LOG("setsockopt: %d %d %d\n", socket, level, option_name);
+  int rv = FileSystem::GetFileSystem()->setsockopt(
+      socket, level, option_name, option_value, option_len);
+  if (rv) {
+    errno = rv;
+    return -1;
+  }
   return 0;
 }
 
 int getsockopt(int socket, int level, int option_name,
                void * option_value, socklen_t * option_len) {
   LOG("getsockopt: %d %d %d\n", socket, level, option_name);
-  memset(option_value, 0, *option_len);
+  int rv = FileSystem::GetFileSystem()->getsockopt(
+      socket, level, option_name, option_value, option_len);
+  if (rv) {
+    errno = rv;
+    return -1;
+  }
   return 0;
 }
 
@@ -440,11 +479,15 @@ int sched_setscheduler(pid_t pid, int policy,
 }
 
 ssize_t send(int fd, const void* buf, size_t count, int flags) {
-  VLOG("send: %d %d\n", fd, count);
+  VLOG("send: %d %d %d\n", fd, count, flags);
   size_t sent = 0;
-  int rv = FileSystem::GetFileSystem()->write(fd, (const char*)buf,
-                                              count, &sent);
-  return rv == 0 ? sent : -1;
+  int rv = FileSystem::GetFileSystem()->send(fd, (const char*)buf,
+                                             count, flags, &sent);
+  if (rv) {
+    errno = rv;
+    return -1;
+  }
+  return sent;
 }
 
 ssize_t recv(int fd, void *buf, size_t count, int flags) {
@@ -16,9 +16,9 @@
 TCPServerSocket::TCPServerSocket(int fd, int oflag,
                                  const sockaddr* saddr, socklen_t addrlen)
   : ref_(1), fd_(fd), oflag_(oflag), factory_(this), socket_(NULL),
-    sin6_(), resource_(0) {
+    sin6_(), resource_(0), closing_(false) {
   assert(sizeof(sin6_) >= addrlen);
-  memcpy(&sin6_, saddr, std::min(sizeof(sin6_), addrlen));
+  memcpy(&sin6_, saddr, std::min<size_t>(sizeof(sin6_), addrlen));
 }
 
 TCPServerSocket::~TCPServerSocket() {
@@ -48,13 +48,12 @@ int TCPServerSocket::write(const char* buf, size_t count, size_t* nwrote) {
 }
 
 void TCPServerSocket::close() {
-  if (socket_) {
-    int32_t result = PP_OK_COMPLETIONPENDING;
+  if (socket_ && !closing_) {
+    closing_ = true;
+    addref();
+    FileSystem::GetFileSystem()->AddPendingClose(fd_);
     pp::Module::Get()->core()->CallOnMainThread(0,
-        factory_.NewCallback(&TCPServerSocket::Close, &result));
-    FileSystem* sys = FileSystem::GetFileSystem();
-    while(result == PP_OK_COMPLETIONPENDING)
-      sys->cond().wait(sys->mutex());
+        factory_.NewCallback(&TCPServerSocket::Close));
   }
 }
 
@@ -147,11 +146,12 @@ void TCPServerSocket::OnAccept(int32_t result) {
   sys->cond().broadcast();
 }
 
-void TCPServerSocket::Close(int32_t result, int32_t* pres) {
+void TCPServerSocket::Close(int32_t result) {
   FileSystem* sys = FileSystem::GetFileSystem();
   Mutex::Lock lock(sys->mutex());
   delete socket_;
   socket_ = NULL;
-  *pres = PP_OK;
+  sys->RemovePendingClose(fd_);
   sys->cond().broadcast();
+  release();
 }
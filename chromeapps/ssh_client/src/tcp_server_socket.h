@@ -44,7 +44,7 @@ class TCPServerSocket : public FileStream {
   void Listen(int32_t result, int backlog, int32_t* pres);
   void Accept(int32_t result, int32_t* pres);
   void OnAccept(int32_t result);
-  void Close(int32_t result, int32_t* pres);
+  void Close(int32_t result);
 
   int ref_;
   int fd_;
@@ -53,6 +53,8 @@ class TCPServerSocket : public FileStream {
   pp::TCPServerSocketPrivate* socket_;
   sockaddr_in6 sin6_;
   PP_Resource resource_;
+  // close() was called, the socket is deleted in the background.
+  bool closing_;
 
   DISALLOW_COPY_AND_ASSIGN(TCPServerSocket);
 };
@@ -6,16 +6,33 @@
 
 #include <algorithm>
 #include <assert.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <string.h>
+#include <sys/time.h>
 
 #include "ppapi/c/pp_errors.h"
 #include "ppapi/cpp/module.h"
 
+#include "compression_tuner.h"
 #include "file_system.h"
 
+const size_t TCPSocket::kBufSize;
+const size_t TCPSocket::kMinBufSize;
+const size_t TCPSocket::kMaxBufSize;
+
+static int64_t GetTimeUsec() {
+  timeval tv;
+  gettimeofday(&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
 TCPSocket::TCPSocket(int fd, int oflag)
   : ref_(1), fd_(fd), oflag_(oflag), factory_(this), socket_(NULL),
-    read_buf_(kBufSize), read_sent_(false), write_sent_(false) {
+    read_buf_(kBufSize), read_sent_(false), write_sent_(false),
+    write_start_usec_(0), send_buf_size_(kBufSize), recv_buf_size_(kBufSize),
+    send_lowat_(1), recv_lowat_(1), corked_(false), more_(false),
+    closing_(false), connect_result_(PP_OK) {
 }
 
 TCPSocket::~TCPSocket() {
@@ -46,6 +63,18 @@ bool TCPSocket::connect(const char* host, uint16_t port) {
   return result == PP_OK;
 }
 
+void TCPSocket::connect_async(const char* host, uint16_t port) {
+  // Connect() runs later on the main thread, keep the host name until then.
+  // The socket can be closed and released meanwhile, OnConnect() drops the
+  // reference taken here.
+  connect_host_ = host;
+  connect_result_ = PP_OK_COMPLETIONPENDING;
+  addref();
+  pp::Module::Get()->core()->CallOnMainThread(0,
+      factory_.NewCallback(&TCPSocket::Connect, connect_host_.c_str(), port,
+                           &connect_result_));
+}
+
 bool TCPSocket::accept(PP_Resource resource) {
   int32_t result = PP_OK_COMPLETIONPENDING;
   pp::Module::Get()->core()->CallOnMainThread(0,
@@ -57,17 +86,26 @@ bool TCPSocket::accept(PP_Resource resource) {
 }
 
 void TCPSocket::close() {
-  if (socket_) {
-    int32_t result = PP_OK_COMPLETIONPENDING;
+  if (is_open()) {
+    // Nobody waits for the close, data held back by cork is sent too.
+    closing_ = true;
+    corked_ = false;
+    more_ = false;
+    addref();
+    FileSystem::GetFileSystem()->AddPendingClose(fd_);
     pp::Module::Get()->core()->CallOnMainThread(0,
-        factory_.NewCallback(&TCPSocket::Close, &result));
-    FileSystem* sys = FileSystem::GetFileSystem();
-    while(result == PP_OK_COMPLETIONPENDING)
-      sys->cond().wait(sys->mutex());
+        factory_.NewCallback(&TCPSocket::Close));
+  } else if (is_connecting()) {
+    // Connect() hasn't made the socket yet, OnConnect() drops it.
+    closing_ = true;
   }
 }
 
 int TCPSocket::read(char* buf, size_t count, size_t* nread) {
+  if (is_connecting()) {
+    *nread = -1;
+    return EAGAIN;
+  }
   if (is_block()) {
     FileSystem* sys = FileSystem::GetFileSystem();
     while (in_buf_.empty() && is_open())
@@ -95,28 +133,131 @@ int TCPSocket::read(char* buf, size_t count, size_t* nread) {
 }
 
 int TCPSocket::write(const char* buf, size_t count, size_t* nwrote) {
+  return send(buf, count, 0, nwrote);
+}
+
+int TCPSocket::send(const char* buf, size_t count, int flags,
+                    size_t* nwrote) {
+  if (is_connecting()) {
+    *nwrote = -1;
+    return EAGAIN;
+  }
   if (!is_open())
     return EIO;
 
+  more_ = (flags & MSG_MORE) != 0;
   out_buf_.insert(out_buf_.end(), buf, buf + count);
-  if (is_block()) {
+  if (is_corked() && out_buf_.size() < send_buf_size_) {
+    *nwrote = count;
+    return 0;
+  }
+
+  if (!Flush()) {
+    *nwrote = -1;
+    return EIO;
+  }
+  *nwrote = count;
+  return 0;
+}
+
+bool TCPSocket::Flush() {
+  if (!is_open())
+    return false;
+  if (!is_block()) {
+    // With a write in flight OnWrite() sends the rest.
+    PostWriteTask(NULL, true);
+    return true;
+  }
+
+  // Data held back by cork goes in the same Pepper write. A write already
+  // in flight doesn't post the rest when it completes, so wait for it first.
+  FileSystem* sys = FileSystem::GetFileSystem();
+  while (is_open() && (write_sent_ || !out_buf_.empty())) {
+    if (write_sent_) {
+      sys->cond().wait(sys->mutex());
+      continue;
+    }
     int32_t result = PP_OK_COMPLETIONPENDING;
     PostWriteTask(&result, true);
-    FileSystem* sys = FileSystem::GetFileSystem();
     while(result == PP_OK_COMPLETIONPENDING)
       sys->cond().wait(sys->mutex());
-    if ((size_t)result != count) {
-      *nwrote = -1;
-      return EIO;
-    } else {
-      *nwrote = count;
-      return 0;
+    if (result < 0)
+      return false;
+  }
+  // Peer can close right after reading the data, that's not a write error.
+  return !write_sent_ && out_buf_.empty();
+}
+
+int TCPSocket::setsockopt(int level, int optname, const void* optval,
+                          socklen_t optlen) {
+  if (optlen < sizeof(int))
+    return EINVAL;
+  int value = *static_cast<const int*>(optval);
+  if (level == SOL_SOCKET) {
+    switch (optname) {
+      case SO_SNDBUF:
+        send_buf_size_ = std::max(kMinBufSize,
+                                  std::min(kMaxBufSize, (size_t)value));
+        return 0;
+      case SO_RCVBUF:
+        recv_buf_size_ = std::max(kMinBufSize,
+                                  std::min(kMaxBufSize, (size_t)value));
+        PostReadTask();
+        return 0;
+      case SO_SNDLOWAT:
+        send_lowat_ = std::max(1, value);
+        return 0;
+      case SO_RCVLOWAT:
+        recv_lowat_ = std::max(1, value);
+        PostReadTask();
+        return 0;
     }
-  } else {
-    PostWriteTask(NULL, true);
-    *nwrote = count;
+  } else if (level == IPPROTO_TCP && optname == TCP_CORK) {
+    corked_ = value != 0;
+    // Write errors are reported by the next send.
+    if (!is_corked())
+      Flush();
     return 0;
   }
+  return 0;
+}
+
+int TCPSocket::getsockopt(int level, int optname, void* optval,
+                          socklen_t* optlen) {
+  if (*optlen < sizeof(int))
+    return EINVAL;
+  int value = 0;
+  if (level == SOL_SOCKET) {
+    switch (optname) {
+      case SO_SNDBUF:
+        value = send_buf_size_;
+        break;
+      case SO_RCVBUF:
+        value = recv_buf_size_;
+        break;
+      case SO_SNDLOWAT:
+        value = send_lowat_;
+        break;
+      case SO_RCVLOWAT:
+        value = recv_lowat_;
+        break;
+      case SO_TYPE:
+        value = SOCK_STREAM;
+        break;
+      case SO_ERROR:
+        if (!is_connecting() && connect_result_ != PP_OK) {
+          value = ECONNREFUSED;
+          connect_result_ = PP_OK;
+        }
+        break;
+    }
+  } else if (level == IPPROTO_TCP && optname == TCP_CORK) {
+    value = corked_;
+  }
+  memset(optval, 0, *optlen);
+  *static_cast<int*>(optval) = value;
+  *optlen = sizeof(int);
+  return 0;
 }
 
 int TCPSocket::fcntl(int cmd, va_list ap) {
@@ -131,19 +272,29 @@ int TCPSocket::fcntl(int cmd, va_list ap) {
 }
 
 bool TCPSocket::is_read_ready() {
-  return !is_open() || !in_buf_.empty();
+  if (is_connecting())
+    return false;
+  return !is_open() || (!in_buf_.empty() && in_buf_.size() >= recv_lowat_);
 }
 
 bool TCPSocket::is_write_ready() {
-  return !is_open() || out_buf_.size() < kBufSize;
+  if (is_connecting())
+    return false;
+  return !is_open() ||
+      (out_buf_.size() < send_buf_size_ &&
+       send_buf_size_ - out_buf_.size() >=
+           std::min(send_lowat_, send_buf_size_));
 }
 
 bool TCPSocket::is_exception() {
-  return !is_open();
+  return !is_connecting() && !is_open();
 }
 
 void TCPSocket::PostReadTask() {
-  if (is_open() && !read_sent_ && in_buf_.size() < kBufSize / 2) {
+  // Keep reading past half of the buffer if that's needed to reach the
+  // low-water mark.
+  size_t limit = std::max(recv_buf_size_ / 2, recv_lowat_);
+  if (is_open() && !read_sent_ && in_buf_.size() < limit) {
     read_sent_ = true;
     if (!pp::Module::Get()->core()->IsMainThread()) {
       pp::Module::Get()->core()->CallOnMainThread(
@@ -156,7 +307,7 @@ void TCPSocket::PostReadTask() {
 }
 
 void TCPSocket::PostWriteTask(int32_t* pres, bool always_post) {
-  if (is_open() && !write_sent_ && !out_buf_.empty()) {
+  if (socket_ && !write_sent_ && !out_buf_.empty()) {
     write_sent_ = true;
     if (always_post || !pp::Module::Get()->core()->IsMainThread()) {
       pp::Module::Get()->core()->CallOnMainThread(0,
@@ -173,16 +324,22 @@ void TCPSocket::Connect(int32_t result, const char* host, uint16_t port,
   FileSystem* sys = FileSystem::GetFileSystem();
   Mutex::Lock lock(sys->mutex());
   assert(!socket_);
+  if (closing_) {
+    OnConnect(PP_ERROR_ABORTED, pres);
+    return;
+  }
   socket_ = new pp::TCPSocketPrivate(sys->instance());
-  *pres = socket_->Connect(host, port,
+  result = socket_->Connect(host, port,
       factory_.NewCallback(&TCPSocket::OnConnect, pres));
-  if (*pres != PP_OK_COMPLETIONPENDING)
-    sys->cond().broadcast();
+  if (result != PP_OK_COMPLETIONPENDING)
+    OnConnect(result, pres);
 }
 
 void TCPSocket::OnConnect(int32_t result, int32_t* pres) {
   FileSystem* sys = FileSystem::GetFileSystem();
   Mutex::Lock lock(sys->mutex());
+  if (closing_ && result == PP_OK)
+    result = PP_ERROR_ABORTED;
   if (result == PP_OK) {
     PostReadTask();
   } else {
@@ -191,6 +348,8 @@ void TCPSocket::OnConnect(int32_t result, int32_t* pres) {
   }
   *pres = result;
   sys->cond().broadcast();
+  if (pres == &connect_result_)
+    release();
 }
 
 void TCPSocket::Read(int32_t result) {
@@ -203,7 +362,11 @@ void TCPSocket::Read(int32_t result) {
     return;
   }
 
-  result = socket_->Read(&read_buf_[0], read_buf_.size(),
+  // No read is in flight so the buffer can grow for larger SO_RCVBUF.
+  if (read_buf_.size() < recv_buf_size_)
+    read_buf_.resize(recv_buf_size_);
+  result = socket_->Read(&read_buf_[0],
+      std::min(read_buf_.size(), recv_buf_size_),
       factory_.NewCallback(&TCPSocket::OnRead));
   if (result != PP_OK_COMPLETIONPENDING) {
     delete socket_;
@@ -223,6 +386,7 @@ void TCPSocket::OnRead(int32_t result) {
     return;
   }
 
+  int ready = readiness();
   if (result > 0) {
     in_buf_.insert(in_buf_.end(),
                    read_buf_.begin(), read_buf_.begin() + result);
@@ -231,18 +395,24 @@ void TCPSocket::OnRead(int32_t result) {
     delete socket_;
     socket_ = NULL;
   }
-  sys->cond().broadcast();
+  // A blocking read waits for any data, even below the low-water mark.
+  if (is_block())
+    sys->cond().broadcast();
+  else
+    sys->NotifyIfChanged(this, ready);
 }
 
 void TCPSocket::Write(int32_t result, int32_t* pres) {
   FileSystem* sys = FileSystem::GetFileSystem();
   Mutex::Lock lock(sys->mutex());
 
-  if (!is_open()) {
+  if (!socket_) {
     if (pres)
       *pres = PP_ERROR_FAILED;
     write_sent_ = false;
     sys->cond().broadcast();
+    if (closing_)
+      ContinueClose();
     return;
   }
 
@@ -252,7 +422,9 @@ void TCPSocket::Write(int32_t result, int32_t* pres) {
     return;
   }
   assert(out_buf_.size());
+  int ready = readiness();
   write_buf_.swap(out_buf_);
+  write_start_usec_ = GetTimeUsec();
   result = socket_->Write(&write_buf_[0], write_buf_.size(),
       factory_.NewCallback(&TCPSocket::OnWrite, pres));
   if (result != PP_OK_COMPLETIONPENDING) {
@@ -263,21 +435,30 @@ void TCPSocket::Write(int32_t result, int32_t* pres) {
       *pres = result;
     write_sent_ = false;
     sys->cond().broadcast();
+    if (closing_)
+      ContinueClose();
+    return;
   }
+  // The emptied buffer can take more data.
+  sys->NotifyIfChanged(this, ready);
 }
 
 void TCPSocket::OnWrite(int32_t result, int32_t* pres) {
   FileSystem* sys = FileSystem::GetFileSystem();
   Mutex::Lock lock(sys->mutex());
 
+  bool partial = false;
   write_sent_ = false;
-  if (!is_open()) {
+  if (!socket_) {
     if (pres)
       *pres = PP_ERROR_FAILED;
     sys->cond().broadcast();
+    if (closing_)
+      ContinueClose();
     return;
   }
 
+  int ready = readiness();
   if (result < 0 || (size_t)result > write_buf_.size()) {
     // Write error.
     LOG("TCPSocket::OnWrite: close socket %d\n", fd_);
@@ -286,28 +467,53 @@ void TCPSocket::OnWrite(int32_t result, int32_t* pres) {
   } else if ((size_t)result < write_buf_.size()) {
     // Partial write. Insert remaining bytes at the beginning of out_buf_.
     out_buf_.insert(out_buf_.begin(), &write_buf_[result], &*write_buf_.end());
+    partial = true;
+  }
+  // Forwarded channels have their own links, only the ssh connection tells
+  // how fast compressed packets go out.
+  if (result > 0 && sys->host_profile()->is_connection(fd_)) {
+    CompressionTuner::GetTuner()->OnLinkWrite(
+        result, GetTimeUsec() - write_start_usec_);
   }
   if (pres)
     *pres = result;
   write_buf_.clear();
-  sys->cond().broadcast();
+  // Blocking writes and Flush() wait for the completion itself.
+  if (pres || is_block())
+    sys->cond().broadcast();
+  else
+    sys->NotifyIfChanged(this, ready);
 
-  if (!is_block()) {
+  if (closing_) {
+    ContinueClose();
+  } else if (!is_block() &&
+             (partial || !is_corked() || out_buf_.size() >= send_buf_size_)) {
     // For async sockets some more data could be written while Pepper sends
     // previous portion so check do we have some data to write. For sync case,
-    // we always wait write operation completion.
+    // we always wait write operation completion. Data held back by cork
+    // stays until the buffer fills or the cork is removed.
     PostWriteTask(NULL, false);
   }
 }
 
-void TCPSocket::Close(int32_t result, int32_t* pres) {
+void TCPSocket::Close(int32_t result) {
   FileSystem* sys = FileSystem::GetFileSystem();
   Mutex::Lock lock(sys->mutex());
+  ContinueClose();
+}
+
+void TCPSocket::ContinueClose() {
+  if (socket_ && (write_sent_ || !out_buf_.empty())) {
+    // Write completion comes back here.
+    PostWriteTask(NULL, true);
+    return;
+  }
   delete socket_;
   socket_ = NULL;
-  if (pres)
-    *pres = PP_OK;
+  FileSystem* sys = FileSystem::GetFileSystem();
+  sys->RemovePendingClose(fd_);
   sys->cond().broadcast();
+  release();
 }
 
 bool TCPSocket::Accept(int32_t result, PP_Resource resource, int32_t* pres) {
@@ -5,8 +5,10 @@
 #ifndef SOCKET_H
 #define SOCKET_H
 
+#include <string>
 #include <vector>
 
+#include "ppapi/c/pp_errors.h"
 #include "ppapi/cpp/completion_callback.h"
 #include "ppapi/cpp/private/tcp_socket_private.h"
 
@@ -21,9 +23,14 @@ class TCPSocket : public FileStream {
   int fd() { return fd_; }
   int oflag() { return oflag_; }
   bool is_block() { return !(oflag_ & O_NONBLOCK); }
-  bool is_open() { return socket_ != NULL; }
+  bool is_open() { return socket_ != NULL && !closing_; }
+  bool is_connecting() { return connect_result_ == PP_OK_COMPLETIONPENDING; }
 
   bool connect(const char* host, uint16_t port);
+  // Start connecting and return, host names are resolved by Pepper. The
+  // socket is not ready until the connection is made or failed, then it is
+  // writable and SO_ERROR tells which, like a non-blocking connect().
+  void connect_async(const char* host, uint16_t port);
   bool accept(PP_Resource resource);
 
   virtual void addref();
@@ -35,6 +42,11 @@ class TCPSocket : public FileStream {
   virtual int write(const char* buf, size_t count, size_t* nwrote);
 
   virtual int fcntl(int cmd,  va_list ap);
+  virtual int send(const char* buf, size_t count, int flags, size_t* nwrote);
+  virtual int setsockopt(int level, int optname, const void* optval,
+                         socklen_t optlen);
+  virtual int getsockopt(int level, int optname, void* optval,
+                         socklen_t* optlen);
 
   virtual bool is_read_ready();
   virtual bool is_write_ready();
@@ -43,6 +55,12 @@ class TCPSocket : public FileStream {
  private:
   void PostReadTask();
   void PostWriteTask(int32_t* pres, bool always_post);
+  // Small writes are held back while corked until the buffer is full.
+  // Nothing sets TCP_CORK or MSG_MORE yet, openssh writes its whole output
+  // buffer in one call anyway.
+  bool is_corked() { return corked_ || more_; }
+  // Send everything buffered, for blocking socket wait until it is sent.
+  bool Flush();
 
   void Connect(int32_t result, const char* host, uint16_t port, int32_t* pres);
   void OnConnect(int32_t result, int32_t* pres);
@@ -53,11 +71,17 @@ class TCPSocket : public FileStream {
   void Write(int32_t result, int32_t* pres);
   void OnWrite(int32_t result, int32_t* pres);
 
-  void Close(int32_t result, int32_t* pres);
+  void Close(int32_t result);
+  // Delete the socket once buffered data is sent, called on the main thread
+  // with the mutex locked. May release the last reference, so nothing can
+  // touch the object after it.
+  void ContinueClose();
 
   bool Accept(int32_t result, PP_Resource resource, int32_t* pres);
 
   static const size_t kBufSize = 64 * 1024;
+  static const size_t kMinBufSize = 4 * 1024;
+  static const size_t kMaxBufSize = 1024 * 1024;
 
   int ref_;
   int fd_;
@@ -70,6 +94,20 @@ class TCPSocket : public FileStream {
   std::vector<char> write_buf_;
   bool read_sent_;
   bool write_sent_;
+  int64_t write_start_usec_;
+  // SO_SNDBUF, SO_RCVBUF, SO_SNDLOWAT and SO_RCVLOWAT.
+  size_t send_buf_size_;
+  size_t recv_buf_size_;
+  size_t send_lowat_;
+  size_t recv_lowat_;
+  // TCP_CORK is set or the last send() had MSG_MORE.
+  bool corked_;
+  bool more_;
+  // close() was called, the socket is flushed in the background.
+  bool closing_;
+  // Result of connect_async(), reported once by SO_ERROR.
+  std::string connect_host_;
+  int32_t connect_result_;
 
   DISALLOW_COPY_AND_ASSIGN(TCPSocket);
 };
@@ -0,0 +1,540 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "trigger_matcher.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+const size_t TriggerMatcher::kMaxPatternSize;
+const size_t TriggerMatcher::kMaxNfaStates;
+const size_t TriggerMatcher::kMaxDfaStates;
+const int TriggerMatcher::kMaxDepth;
+
+static const unsigned char kEsc = 0x1b;
+static const unsigned char kBel = 0x07;
+static const unsigned char kCan = 0x18;
+static const unsigned char kSub = 0x1a;
+
+static void SetRange(std::bitset<256>* bytes, int first, int last) {
+  for (int c = first; c <= last; c++)
+    bytes->set(c);
+}
+
+static int GetHexDigit(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+TriggerMatcher::TriggerMatcher()
+  : pattern_(0), state_(0), escape_(ESCAPE_NONE) {
+  memset(start_exit_, 0, sizeof(start_exit_));
+}
+
+TriggerMatcher::~TriggerMatcher() {
+  ClearDfa();
+}
+
+bool TriggerMatcher::SetPatterns(const std::vector<std::string>& patterns,
+                                 std::string* error) {
+  std::vector<NfaState> old_nfa;
+  std::vector<int> old_starts;
+  nfa_.swap(old_nfa);
+  starts_.swap(old_starts);
+
+  for (size_t i = 0; i < patterns.size(); i++) {
+    const std::string& s = patterns[i];
+    pattern_ = i;
+    Fragment frag;
+    size_t pos = 0;
+    bool ok = s.size() <= kMaxPatternSize;
+    if (!ok)
+      *error = "pattern is too long";
+    if (ok)
+      ok = ParseAlternation(s, &pos, 0, &frag, error);
+    if (ok && pos < s.size()) {
+      *error = "unmatched )";
+      ok = false;
+    }
+    if (ok && nfa_.size() >= kMaxNfaStates) {
+      *error = "too many patterns";
+      ok = false;
+    }
+    if (ok) {
+      int match = AddNfaState(NfaState::MATCH, -1, -1);
+      Patch(frag.exits, match);
+      std::vector<char> seen(nfa_.size());
+      std::vector<int> set;
+      std::vector<int> matched;
+      AddToClosure(frag.start, &seen, &set, &matched);
+      if (!matched.empty()) {
+        *error = "pattern matches empty string";
+        ok = false;
+      }
+    }
+    if (!ok) {
+      char index[16];
+      snprintf(index, sizeof(index), "%d", (int)i);
+      *error = "pattern " + std::string(index) + ": " + *error;
+      nfa_.swap(old_nfa);
+      starts_.swap(old_starts);
+      return false;
+    }
+    starts_.push_back(frag.start);
+  }
+
+  ClearDfa();
+  state_ = 0;
+  escape_ = ESCAPE_NONE;
+  if (starts_.empty())
+    return true;
+
+  std::vector<char> seen(nfa_.size());
+  std::vector<int> set;
+  std::vector<int> matched;
+  for (size_t i = 0; i < starts_.size(); i++)
+    AddToClosure(starts_[i], &seen, &set, &matched);
+  std::sort(set.begin(), set.end());
+  AddDfaState(set, matched);
+  for (int c = 0; c < 256; c++)
+    start_exit_[c] = c == kEsc || Transition(0, c) != 0;
+  return true;
+}
+
+void TriggerMatcher::Scan(const char* buf, size_t count, uint64_t offset,
+                          std::vector<TriggerMatch>* matches) {
+  if (dfa_.empty())
+    return;
+
+  const unsigned char* start = (const unsigned char*)buf;
+  const unsigned char* end = start + count;
+  const unsigned char* p = start;
+  int state = state_;
+  while (p < end) {
+    if (escape_ != ESCAPE_NONE) {
+      SkipEscape(*p++);
+      continue;
+    }
+    if (state == 0) {
+      // Prefilter, most of the output can't start a match.
+      while (p < end && !start_exit_[*p])
+        p++;
+      if (p == end)
+        break;
+    }
+
+    unsigned char c = *p++;
+    if (c == kEsc) {
+      escape_ = ESCAPE_START;
+      continue;
+    }
+    int next = dfa_[state]->next[c];
+    if (next < 0)
+      next = Transition(state, c);
+    state = next;
+    const std::vector<int>& matched = dfa_[state]->matches;
+    for (size_t i = 0; i < matched.size(); i++)
+      matches->push_back(TriggerMatch(matched[i], offset + (p - start)));
+  }
+  state_ = state;
+}
+
+void TriggerMatcher::Reset() {
+  nfa_.clear();
+  starts_.clear();
+  ClearDfa();
+  state_ = 0;
+  escape_ = ESCAPE_NONE;
+}
+
+bool TriggerMatcher::ParseAlternation(const std::string& s, size_t* pos,
+                                      int depth, Fragment* frag,
+                                      std::string* error) {
+  if (!ParseConcatenation(s, pos, depth, frag, error))
+    return false;
+  while (*pos < s.size() && s[*pos] == '|') {
+    ++*pos;
+    Fragment right;
+    if (!ParseConcatenation(s, pos, depth, &right, error))
+      return false;
+    int split = AddNfaState(NfaState::SPLIT, frag->start, right.start);
+    frag->start = split;
+    frag->exits.insert(frag->exits.end(), right.exits.begin(),
+                       right.exits.end());
+  }
+  return true;
+}
+
+bool TriggerMatcher::ParseConcatenation(const std::string& s, size_t* pos,
+                                        int depth, Fragment* frag,
+                                        std::string* error) {
+  int empty = AddNfaState(NfaState::EMPTY, -1, -1);
+  frag->start = empty;
+  frag->exits.assign(1, empty * 2);
+  while (*pos < s.size() && s[*pos] != '|' && s[*pos] != ')') {
+    Fragment next;
+    if (!ParseRepetition(s, pos, depth, &next, error))
+      return false;
+    Patch(frag->exits, next.start);
+    frag->exits.swap(next.exits);
+  }
+  return true;
+}
+
+bool TriggerMatcher::ParseRepetition(const std::string& s, size_t* pos,
+                                     int depth, Fragment* frag,
+                                     std::string* error) {
+  if (!ParseAtom(s, pos, depth, frag, error))
+    return false;
+  while (*pos < s.size()) {
+    char c = s[*pos];
+    if (c != '*' && c != '+' && c != '?')
+      break;
+    ++*pos;
+    int split = AddNfaState(NfaState::SPLIT, frag->start, -1);
+    if (c == '*') {
+      Patch(frag->exits, split);
+      frag->start = split;
+      frag->exits.assign(1, split * 2 + 1);
+    } else if (c == '+') {
+      Patch(frag->exits, split);
+      frag->exits.assign(1, split * 2 + 1);
+    } else {
+      frag->start = split;
+      frag->exits.push_back(split * 2 + 1);
+    }
+  }
+  return true;
+}
+
+bool TriggerMatcher::ParseAtom(const std::string& s, size_t* pos, int depth,
+                               Fragment* frag, std::string* error) {
+  std::bitset<256> bytes;
+  char c = s[(*pos)++];
+  switch (c) {
+    case '(':
+      if (depth >= kMaxDepth) {
+        *error = "too many nested groups";
+        return false;
+      }
+      if (s.compare(*pos, 2, "?:") == 0)
+        *pos += 2;
+      if (!ParseAlternation(s, pos, depth + 1, frag, error))
+        return false;
+      if (*pos >= s.size() || s[*pos] != ')') {
+        *error = "missing )";
+        return false;
+      }
+      ++*pos;
+      return true;
+    case '*':
+    case '+':
+    case '?':
+      *error = "nothing to repeat";
+      return false;
+    case '^':
+    case '$':
+      *error = "anchors are not supported";
+      return false;
+    case '[':
+      if (!ParseClass(s, pos, &bytes, error))
+        return false;
+      break;
+    case '.':
+      bytes.set();
+      bytes.reset('\n');
+      break;
+    case '\\':
+      if (!ParseEscape(s, pos, &bytes, error))
+        return false;
+      break;
+    default:
+      bytes.set((unsigned char)c);
+      break;
+  }
+  int state = AddNfaState(NfaState::BYTES, -1, -1);
+  nfa_[state].bytes = bytes;
+  frag->start = state;
+  frag->exits.assign(1, state * 2);
+  return true;
+}
+
+bool TriggerMatcher::ParseClass(const std::string& s, size_t* pos,
+                                std::bitset<256>* bytes,
+                                std::string* error) {
+  bool negate = *pos < s.size() && s[*pos] == '^';
+  if (negate)
+    ++*pos;
+  bool first = true;
+  while (*pos < s.size() && (s[*pos] != ']' || first)) {
+    first = false;
+    std::bitset<256> item;
+    unsigned char c = s[(*pos)++];
+    if (c == '\\') {
+      if (!ParseEscape(s, pos, &item, error))
+        return false;
+    } else {
+      item.set(c);
+    }
+    if (item.count() == 1 && *pos + 1 < s.size() && s[*pos] == '-' &&
+        s[*pos + 1] != ']') {
+      ++*pos;
+      std::bitset<256> last;
+      unsigned char d = s[(*pos)++];
+      if (d == '\\') {
+        if (!ParseEscape(s, pos, &last, error))
+          return false;
+      } else {
+        last.set(d);
+      }
+      int from = 0;
+      while (!item[from])
+        from++;
+      int to = 0;
+      while (to < 256 && !last[to])
+        to++;
+      if (last.count() != 1 || to < from) {
+        *error = "invalid range in []";
+        return false;
+      }
+      SetRange(&item, from, to);
+    }
+    *bytes |= item;
+  }
+  if (*pos >= s.size()) {
+    *error = "missing ]";
+    return false;
+  }
+  ++*pos;
+  if (negate)
+    bytes->flip();
+  return true;
+}
+
+bool TriggerMatcher::ParseEscape(const std::string& s, size_t* pos,
+                                 std::bitset<256>* bytes,
+                                 std::string* error) {
+  if (*pos >= s.size()) {
+    *error = "trailing \\";
+    return false;
+  }
+  char c = s[(*pos)++];
+  switch (c) {
+    case 'd':
+    case 'D':
+      SetRange(bytes, '0', '9');
+      break;
+    case 'w':
+    case 'W':
+      SetRange(bytes, '0', '9');
+      SetRange(bytes, 'A', 'Z');
+      SetRange(bytes, 'a', 'z');
+      bytes->set('_');
+      break;
+    case 's':
+    case 'S':
+      bytes->set(' ');
+      SetRange(bytes, '\t', '\r');
+      break;
+    case 'n':
+      bytes->set('\n');
+      break;
+    case 'r':
+      bytes->set('\r');
+      break;
+    case 't':
+      bytes->set('\t');
+      break;
+    case 'x': {
+      int high = *pos < s.size() ? GetHexDigit(s[*pos]) : -1;
+      int low = *pos + 1 < s.size() ? GetHexDigit(s[*pos + 1]) : -1;
+      if (high < 0 || low < 0) {
+        *error = "invalid \\x";
+        return false;
+      }
+      *pos += 2;
+      bytes->set(high * 16 + low);
+      break;
+    }
+    default:
+      bytes->set((unsigned char)c);
+      break;
+  }
+  if (c == 'D' || c == 'W' || c == 'S')
+    bytes->flip();
+  return true;
+}
+
+int TriggerMatcher::AddNfaState(NfaState::Type type, int out, int out1) {
+  NfaState state;
+  state.type = type;
+  state.out = out;
+  state.out1 = out1;
+  state.pattern = pattern_;
+  nfa_.push_back(state);
+  return nfa_.size() - 1;
+}
+
+void TriggerMatcher::Patch(const std::vector<int>& exits, int target) {
+  for (size_t i = 0; i < exits.size(); i++) {
+    NfaState& state = nfa_[exits[i] / 2];
+    if (exits[i] % 2)
+      state.out1 = target;
+    else
+      state.out = target;
+  }
+}
+
+void TriggerMatcher::AddToClosure(int state, std::vector<char>* seen,
+                                  std::vector<int>* set,
+                                  std::vector<int>* matched) {
+  std::vector<int> stack(1, state);
+  while (!stack.empty()) {
+    int s = stack.back();
+    stack.pop_back();
+    if (s < 0 || (*seen)[s])
+      continue;
+    (*seen)[s] = 1;
+    const NfaState& nfa = nfa_[s];
+    switch (nfa.type) {
+      case NfaState::BYTES:
+        set->push_back(s);
+        break;
+      case NfaState::SPLIT:
+        stack.push_back(nfa.out1);
+        stack.push_back(nfa.out);
+        break;
+      case NfaState::EMPTY:
+        stack.push_back(nfa.out);
+        break;
+      case NfaState::MATCH:
+        matched->push_back(nfa.pattern);
+        break;
+    }
+  }
+}
+
+void TriggerMatcher::ClearDfa() {
+  for (size_t i = 0; i < dfa_.size(); i++)
+    delete dfa_[i];
+  dfa_.clear();
+  dfa_index_.clear();
+}
+
+int TriggerMatcher::AddDfaState(const std::vector<int>& nfa,
+                                const std::vector<int>& matches) {
+  std::vector<int> key(nfa);
+  key.push_back(-1);
+  key.insert(key.end(), matches.begin(), matches.end());
+  std::map<std::vector<int>, int>::iterator it = dfa_index_.find(key);
+  if (it != dfa_index_.end())
+    return it->second;
+
+  DfaState* state = new DfaState();
+  state->nfa = nfa;
+  state->matches = matches;
+  for (int c = 0; c < 256; c++)
+    state->next[c] = -1;
+  dfa_.push_back(state);
+  dfa_index_[key] = dfa_.size() - 1;
+  return dfa_.size() - 1;
+}
+
+int TriggerMatcher::Transition(int from, unsigned char c) {
+  std::vector<char> seen(nfa_.size());
+  std::vector<int> set;
+  std::vector<int> matched;
+  const std::vector<int>& current = dfa_[from]->nfa;
+  for (size_t i = 0; i < current.size(); i++) {
+    const NfaState& nfa = nfa_[current[i]];
+    if (nfa.bytes[c])
+      AddToClosure(nfa.out, &seen, &set, &matched);
+  }
+  if (!matched.empty()) {
+    // Search for a pattern that has matched starts over.
+    std::sort(matched.begin(), matched.end());
+    matched.erase(std::unique(matched.begin(), matched.end()), matched.end());
+    std::vector<int> rest;
+    for (size_t i = 0; i < set.size(); i++) {
+      if (!std::binary_search(matched.begin(), matched.end(),
+                              nfa_[set[i]].pattern)) {
+        rest.push_back(set[i]);
+      }
+    }
+    set.swap(rest);
+  }
+
+  // Unanchored search, every pattern may start at the next byte.
+  std::vector<char> start_seen(nfa_.size());
+  std::vector<int> no_matches;
+  for (size_t i = 0; i < starts_.size(); i++)
+    AddToClosure(starts_[i], &start_seen, &set, &no_matches);
+  std::sort(set.begin(), set.end());
+  set.erase(std::unique(set.begin(), set.end()), set.end());
+
+  // Cache is dropped when it's full, like RE2 does. Start state is always
+  // the first one.
+  bool flush = dfa_.size() >= kMaxDfaStates;
+  if (flush) {
+    std::vector<int> start(dfa_[0]->nfa);
+    ClearDfa();
+    AddDfaState(start, std::vector<int>());
+  }
+  int next = AddDfaState(set, matched);
+  if (!flush)
+    dfa_[from]->next[c] = next;
+  return next;
+}
+
+void TriggerMatcher::SkipEscape(unsigned char c) {
+  if (c == kCan || c == kSub) {
+    escape_ = ESCAPE_NONE;
+    return;
+  }
+  switch (escape_) {
+    case ESCAPE_START:
+      if (c == '[')
+        escape_ = ESCAPE_CSI;
+      else if (c == ']' || c == 'P' || c == '_' || c == '^' || c == 'X')
+        escape_ = ESCAPE_STRING;
+      else if (c >= 0x20 && c <= 0x2f)
+        escape_ = ESCAPE_INTERMEDIATE;
+      else if (c != kEsc)
+        escape_ = ESCAPE_NONE;
+      break;
+    case ESCAPE_CSI:
+      if (c == kEsc)
+        escape_ = ESCAPE_START;
+      else if (c >= 0x40 && c <= 0x7e)
+        escape_ = ESCAPE_NONE;
+      break;
+    case ESCAPE_INTERMEDIATE:
+      if (c >= 0x30 && c <= 0x7e)
+        escape_ = ESCAPE_NONE;
+      break;
+    case ESCAPE_STRING:
+      if (c == kBel)
+        escape_ = ESCAPE_NONE;
+      else if (c == kEsc)
+        escape_ = ESCAPE_STRING_ESC;
+      break;
+    case ESCAPE_STRING_ESC:
+      // ESC that is not a part of ST starts a new sequence.
+      escape_ = ESCAPE_START;
+      if (c != '\\')
+        SkipEscape(c);
+      else
+        escape_ = ESCAPE_NONE;
+      break;
+    case ESCAPE_NONE:
+      break;
+  }
+}
@@ -0,0 +1,143 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef TRIGGER_MATCHER_H
+#define TRIGGER_MATCHER_H
+
+#include <stdint.h>
+
+#include <bitset>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "pthread_helpers.h"
+
+struct TriggerMatch {
+  TriggerMatch(int pattern, uint64_t offset)
+      : pattern(pattern), offset(offset) {}
+
+  // Index of the pattern in SetPatterns() list.
+  int pattern;
+  // Stream offset right after the last byte of the match.
+  uint64_t offset;
+};
+
+// Finds user defined patterns (errors, prompts, URLs...) in terminal output
+// as it goes through the plugin. All patterns are compiled into one DFA
+// which is built lazily, so a byte costs a table lookup whatever the number
+// of patterns is. While DFA is in its start state, bytes that can't begin a
+// match are skipped in a tight loop.
+//
+// Patterns are a subset of extended regular expressions over bytes:
+// literals, ".", "[...]" and "[^...]" classes, \d \w \s and their
+// negations, \xHH, groups, "|", "*", "+" and "?". Escape sequences in the
+// output are skipped so colors in the middle of a word don't break a match.
+// Matches of one pattern don't overlap, its search restarts after the end
+// of each match.
+class TriggerMatcher {
+ public:
+  TriggerMatcher();
+  ~TriggerMatcher();
+
+  bool empty() { return dfa_.empty(); }
+
+  // Replaces patterns. On error, |error| tells what's wrong and old
+  // patterns are kept.
+  bool SetPatterns(const std::vector<std::string>& patterns,
+                   std::string* error);
+
+  // Scans the next piece of output, |offset| is stream offset of |buf|.
+  void Scan(const char* buf, size_t count, uint64_t offset,
+            std::vector<TriggerMatch>* matches);
+
+  // Drops all patterns.
+  void Reset();
+
+ private:
+  struct NfaState {
+    enum Type {
+      BYTES,
+      SPLIT,
+      EMPTY,
+      MATCH
+    };
+
+    Type type;
+    std::bitset<256> bytes;
+    int out;
+    int out1;
+    int pattern;
+  };
+
+  // Part of NFA being built. Its dangling exits are kept as state * 2 for
+  // out and state * 2 + 1 for out1.
+  struct Fragment {
+    int start;
+    std::vector<int> exits;
+  };
+
+  struct DfaState {
+    // Sorted BYTES states of NFA.
+    std::vector<int> nfa;
+    // Patterns that end at the byte leading to this state.
+    std::vector<int> matches;
+    int next[256];
+  };
+
+  enum EscapeState {
+    ESCAPE_NONE,
+    ESCAPE_START,
+    ESCAPE_CSI,
+    ESCAPE_INTERMEDIATE,
+    ESCAPE_STRING,
+    ESCAPE_STRING_ESC
+  };
+
+  // Recursive descent parser, |pos| is advanced over what's parsed.
+  bool ParseAlternation(const std::string& s, size_t* pos, int depth,
+                        Fragment* frag, std::string* error);
+  bool ParseConcatenation(const std::string& s, size_t* pos, int depth,
+                          Fragment* frag, std::string* error);
+  bool ParseRepetition(const std::string& s, size_t* pos, int depth,
+                       Fragment* frag, std::string* error);
+  bool ParseAtom(const std::string& s, size_t* pos, int depth,
+                 Fragment* frag, std::string* error);
+  bool ParseClass(const std::string& s, size_t* pos,
+                  std::bitset<256>* bytes, std::string* error);
+  bool ParseEscape(const std::string& s, size_t* pos,
+                   std::bitset<256>* bytes, std::string* error);
+
+  int AddNfaState(NfaState::Type type, int out, int out1);
+  void Patch(const std::vector<int>& exits, int target);
+  void AddToClosure(int state, std::vector<char>* seen,
+                    std::vector<int>* set, std::vector<int>* matched);
+
+  void ClearDfa();
+  int AddDfaState(const std::vector<int>& nfa,
+                  const std::vector<int>& matches);
+  int Transition(int from, unsigned char c);
+  void SkipEscape(unsigned char c);
+
+  static const size_t kMaxPatternSize = 1024;
+  static const size_t kMaxNfaStates = 64 * 1024;
+  static const size_t kMaxDfaStates = 1024;
+  static const int kMaxDepth = 64;
+
+  int pattern_;
+  std::vector<NfaState> nfa_;
+  std::vector<int> starts_;
+
+  std::vector<DfaState*> dfa_;
+  std::map<std::vector<int>, int> dfa_index_;
+  // Bytes that take DFA out of the start state.
+  bool start_exit_[256];
+
+  int state_;
+  EscapeState escape_;
+
+  DISALLOW_COPY_AND_ASSIGN(TriggerMatcher);
+};
+
+#endif  // TRIGGER_MATCHER_H
@@ -16,7 +16,8 @@
 
 UDPSocket::UDPSocket(int fd, int oflag)
   : ref_(1), fd_(fd), oflag_(oflag), factory_(this), socket_(NULL),
-    read_buf_(kBufSize), read_sent_(false), write_sent_(false) {
+    read_buf_(kBufSize), read_sent_(false), write_sent_(false),
+    closing_(false) {
 }
 
 UDPSocket::~UDPSocket() {
@@ -69,7 +70,7 @@ ssize_t UDPSocket::sendto(const char* buf, size_t len, int flags,
   }
   out_queue_.resize(out_queue_.size() + 1);
   memcpy(&out_queue_.back().first, dest_addr,
-         std::min(addrlen, sizeof(sockaddr_in6)));
+         std::min<size_t>(addrlen, sizeof(sockaddr_in6)));
   out_queue_.back().second.assign(buf, buf + len);
   PostWriteTask();
   return 0;
@@ -84,7 +85,7 @@ ssize_t UDPSocket::recvfrom(char* buffer, size_t len, int flags,
   }
 
   if (!in_queue_.empty()) {
-    *addrlen = std::min(*addrlen, sizeof(sockaddr_in6));
+    *addrlen = std::min<size_t>(*addrlen, sizeof(sockaddr_in6));
     memcpy(addr, &in_queue_.front().first, *addrlen);
     len = std::min(len, in_queue_.front().second.size());
     std::copy(in_queue_.front().second.begin(),
@@ -112,13 +113,12 @@ ssize_t UDPSocket::recvfrom(char* buffer, size_t len, int flags,
 }
 
 void UDPSocket::close() {
-  if (socket_) {
-    int32_t result = PP_OK_COMPLETIONPENDING;
+  if (socket_ && !closing_) {
+    closing_ = true;
+    addref();
+    FileSystem::GetFileSystem()->AddPendingClose(fd_);
     pp::Module::Get()->core()->CallOnMainThread(0,
-        factory_.NewCallback(&UDPSocket::Close, &result));
-    FileSystem* sys = FileSystem::GetFileSystem();
-    while(result == PP_OK_COMPLETIONPENDING)
-      sys->cond().wait(sys->mutex());
+        factory_.NewCallback(&UDPSocket::Close));
   }
 }
 
@@ -155,12 +155,16 @@ bool UDPSocket::is_exception() {
   return !is_open();
 }
 
-void UDPSocket::Close(int32_t result, int32_t* pres) {
+void UDPSocket::Close(int32_t result) {
   FileSystem* sys = FileSystem::GetFileSystem();
+  Mutex::Lock lock(sys->mutex());
+  // Datagrams still queued are dropped, same as on a closed socket.
   delete socket_;
   socket_ = NULL;
-  *pres = PP_OK;
+  out_queue_.clear();
+  sys->RemovePendingClose(fd_);
   sys->cond().broadcast();
+  release();
 }
 
 void UDPSocket::Bind(int32_t result, const sockaddr* saddr, socklen_t addrlen,
@@ -245,6 +249,7 @@ void UDPSocket::OnRead(int32_t result) {
     return;
   }
 
+  int ready = readiness();
   PP_NetAddress_Private addr = {};
   if (result > 0 && socket_->GetRecvFromAddress(&addr)) {
     LOG("UDPSocket::OnRead: %d %s\n",
@@ -260,8 +265,7 @@ void UDPSocket::OnRead(int32_t result) {
     delete socket_;
     socket_ = NULL;
   }
-  sys->cond().broadcast();
-
+  sys->NotifyIfChanged(this, ready);
 }
 
 void UDPSocket::Write(int32_t result) {
@@ -296,6 +300,8 @@ void UDPSocket::OnWrite(int32_t result) {
     return;
   }
 
+  // Nobody waits for a datagram to be sent.
+  int ready = readiness();
   if (result < 0 || (size_t)result > write_buf_.size()) {
     // Write error.
     LOG("TCPSocket::OnWrite: close socket %d\n", fd_);
@@ -306,7 +312,7 @@ void UDPSocket::OnWrite(int32_t result) {
     assert(0);
   }
   write_buf_.clear();
-  sys->cond().broadcast();
+  sys->NotifyIfChanged(this, ready);
 
   if (!is_block()) {
     // For async sockets some more data could be written while Pepper sends
@@ -52,7 +52,7 @@ class UDPSocket : public FileStream {
  private:
   typedef std::deque<std::pair<sockaddr_in6, std::vector<char> > > MessageQueue;
 
-  void Close(int32_t result, int32_t* pres);
+  void Close(int32_t result);
 
   void Bind(int32_t result, const sockaddr* saddr, socklen_t addrlen,
             int32_t* pres);
@@ -88,6 +88,8 @@ class UDPSocket : public FileStream {
   PP_NetAddress_Private write_addr_;
   bool read_sent_;
   bool write_sent_;
+  // close() was called, the socket is deleted in the background.
+  bool closing_;
 
   DISALLOW_COPY_AND_ASSIGN(UDPSocket);
 };
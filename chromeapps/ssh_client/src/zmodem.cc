@@ -0,0 +1,836 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "zmodem.h"
+
+#include <algorithm>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "file_system.h"
+#include "pepper_file.h"
+
+const char Zmodem::kDownloadDirectory[] = "/zmodem";
+const size_t Zmodem::kWriteBlockSize;
+const size_t Zmodem::kReadBlockSize;
+const size_t Zmodem::kSubpacketSize;
+const size_t Zmodem::kMaxDataSize;
+
+// Framing characters.
+static const unsigned char kZpad = '*';
+static const unsigned char kZdle = 0x18;
+static const unsigned char kZbin = 'A';
+static const unsigned char kZhex = 'B';
+static const unsigned char kZbin32 = 'C';
+static const unsigned char kXon = 0x11;
+static const unsigned char kXoff = 0x13;
+
+// Header types.
+static const int kZrqinit = 0;
+static const int kZrinit = 1;
+static const int kZsinit = 2;
+static const int kZack = 3;
+static const int kZfile = 4;
+static const int kZskip = 5;
+static const int kZnak = 6;
+static const int kZabort = 7;
+static const int kZfin = 8;
+static const int kZrpos = 9;
+static const int kZdata = 10;
+static const int kZeof = 11;
+static const int kZferr = 12;
+static const int kZcan = 16;
+
+// Data subpacket ends.
+static const unsigned char kZcrce = 'h';
+static const unsigned char kZcrcg = 'i';
+static const unsigned char kZcrcq = 'j';
+static const unsigned char kZcrcw = 'k';
+static const unsigned char kZrub0 = 'l';
+static const unsigned char kZrub1 = 'm';
+
+// ZRINIT flags: full duplex, can receive while writing to disk and 32-bit
+// CRC. Zero buffer size lets sender stream the whole file without waiting.
+static const unsigned char kReceiverFlags = 0x01 | 0x02 | 0x20;
+static const unsigned char kCanFc32 = 0x20;
+// ZFILE conversion option for binary transfer.
+static const unsigned char kZcbin = 1;
+
+// ZPAD ZPAD ZDLE ZHEX '0' starts every hex header, the next digit tells
+// ZRQINIT from sz and ZRINIT from rz.
+static const char kStart[] = "**\x18" "B0";
+static const size_t kStartLength = sizeof(kStart) - 1;
+
+// What lrzsz sends to cancel: CANs followed by backspaces to erase them if
+// the other side isn't in a transfer anymore.
+static const char kAbort[] = "\x18\x18\x18\x18\x18\x18\x18\x18\x18\x18"
+                             "\b\b\b\b\b\b\b\b\b\b";
+
+static uint16_t UpdateCrc16(uint16_t crc, const unsigned char* buf,
+                            size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    crc ^= buf[i] << 8;
+    for (int bit = 0; bit < 8; bit++)
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc;
+}
+
+static void SetPosition(uint32_t pos, unsigned char* p) {
+  p[0] = pos;
+  p[1] = pos >> 8;
+  p[2] = pos >> 16;
+  p[3] = pos >> 24;
+}
+
+static uint32_t GetPosition(const unsigned char* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int GetHexDigit(unsigned char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+Zmodem::Zmodem()
+  : state_(IDLE), send_state_(SEND_WAIT_RINIT), cancel_(false), oo_left_(0),
+    match_(0), rx_state_(RX_SEARCH), rx_escape_(false), rx_can_count_(0),
+    rx_hex_(false), rx_crc32_(false), rx_header_type_(0), rx_need_(0),
+    rx_frame_end_(0), tx_crc32_(false), file_(NULL), file_offset_(0),
+    file_size_(0), file_start_() {
+}
+
+Zmodem::~Zmodem() {
+  if (file_)
+    file_->release();
+}
+
+bool Zmodem::FilterOutput(const char* buf, size_t count,
+                          std::string* terminal) {
+  if (cancel_)
+    Finish("zmodem: cancelled");
+
+  if (state_ == IDLE && held_.empty() && terminal_.empty() &&
+      !memchr(buf, kZdle, count)) {
+    // Common case, transfer can't start in this output. Only trailing ZPADs
+    // may be part of the start sequence.
+    match_ = 0;
+    while (match_ < 2 && match_ < count && buf[count - match_ - 1] == kZpad)
+      match_++;
+    return false;
+  }
+
+  terminal->clear();
+  terminal->swap(terminal_);
+  for (size_t i = 0; i < count; i++) {
+    unsigned char c = buf[i];
+    switch (state_) {
+      case IDLE:
+        DetectStart(c, terminal);
+        break;
+      case FINISHING:
+        if (c == 'O' && oo_left_ > 0) {
+          if (--oo_left_ == 0)
+            state_ = IDLE;
+        } else if (c != '\r' && c != '\n' && c != 0x8a && c != kXon) {
+          state_ = IDLE;
+          DetectStart(c, terminal);
+        }
+        break;
+      case RECEIVING:
+      case SENDING:
+        ProcessByte(c);
+        break;
+    }
+    if (!terminal_.empty()) {
+      terminal->append(terminal_);
+      terminal_.clear();
+    }
+  }
+  return true;
+}
+
+bool Zmodem::has_input() {
+  return !input_.empty() ||
+      (state_ == SENDING && send_state_ == SEND_DATA && !cancel_);
+}
+
+size_t Zmodem::ReadInput(char* buf, size_t count) {
+  if (cancel_)
+    Finish("zmodem: cancelled");
+  if (input_.empty() && state_ == SENDING && send_state_ == SEND_DATA)
+    EncodeNextBlock();
+
+  count = std::min(count, input_.size());
+  memcpy(buf, input_.data(), count);
+  input_.erase(0, count);
+  return count;
+}
+
+void Zmodem::OnUserInput(const char* buf, size_t count) {
+  if (cancel_ || !memchr(buf, 3, count))
+    return;
+  // Files are closed on the ssh thread.
+  input_ = kAbort;
+  cancel_ = true;
+}
+
+void Zmodem::QueueUpload(const std::vector<std::string>& paths) {
+  uploads_.insert(uploads_.end(), paths.begin(), paths.end());
+}
+
+void Zmodem::Reset() {
+  Finish("");
+  cancel_ = false;
+  match_ = 0;
+  held_.clear();
+  terminal_.clear();
+  input_.clear();
+  uploads_.clear();
+}
+
+void Zmodem::DetectStart(unsigned char c, std::string* terminal) {
+  // ZPADs go to the terminal right away so a prompt ending with '*' isn't
+  // delayed, if transfer starts the status line overwrites them.
+  if (match_ == kStartLength) {
+    if (c == '0' || c == '1') {
+      match_ = 0;
+      held_.clear();
+      Start(c == '1');
+      for (size_t i = 0; i < kStartLength && is_active(); i++)
+        ProcessByte(kStart[i]);
+      if (is_active())
+        ProcessByte(c);
+      return;
+    }
+  } else if (c == kStart[match_]) {
+    if (++match_ > 2)
+      held_.push_back(c);
+    else
+      terminal->push_back(c);
+    return;
+  } else if (match_ == 2 && c == kZpad) {
+    terminal->push_back(c);
+    return;
+  }
+
+  terminal->append(held_);
+  held_.clear();
+  match_ = c == kZpad ? 1 : 0;
+  terminal->push_back(c);
+}
+
+void Zmodem::Start(bool sending) {
+  LOG("Zmodem::Start: remote %s started\n", sending ? "rz" : "sz");
+  state_ = sending ? SENDING : RECEIVING;
+  send_state_ = SEND_WAIT_RINIT;
+  cancel_ = false;
+  oo_left_ = 0;
+  rx_state_ = RX_SEARCH;
+  rx_escape_ = false;
+  rx_can_count_ = 0;
+  tx_crc32_ = false;
+  input_.clear();
+  if (sending && uploads_.empty())
+    Cancel("zmodem: no files to send, queue them with zmodemSend()");
+}
+
+void Zmodem::Finish(const std::string& status) {
+  CloseFile(false);
+  if (state_ != IDLE)
+    LOG("Zmodem::Finish: %s\n", status.c_str());
+  state_ = IDLE;
+  cancel_ = false;
+  rx_state_ = RX_SEARCH;
+  rx_data_.clear();
+  if (!status.empty())
+    terminal_ += "\r\x1b[K" + status + "\r\n";
+}
+
+void Zmodem::Cancel(const std::string& status) {
+  input_ = kAbort;
+  Finish(status);
+}
+
+void Zmodem::ProcessByte(unsigned char c) {
+  // Five CANs in a row abort the session. ZDLE is the same byte, so count
+  // it in the raw stream.
+  if (c == kZdle) {
+    if (++rx_can_count_ == 5) {
+      Finish("zmodem: cancelled by remote side");
+      return;
+    }
+  } else {
+    rx_can_count_ = 0;
+  }
+
+  bool frame_end;
+  switch (rx_state_) {
+    case RX_SEARCH:
+      if (c == kZpad)
+        rx_state_ = RX_PAD;
+      break;
+
+    case RX_PAD:
+      if (c == kZdle)
+        rx_state_ = RX_PAD_ZDLE;
+      else if (c != kZpad)
+        rx_state_ = RX_SEARCH;
+      break;
+
+    case RX_PAD_ZDLE:
+      rx_state_ = RX_HEADER;
+      rx_escape_ = false;
+      rx_buf_.clear();
+      rx_hex_ = c == kZhex;
+      rx_crc32_ = c == kZbin32;
+      // Type, 4 bytes of position or flags and CRC, hex takes 2 digits for
+      // each byte.
+      if (c == kZhex)
+        rx_need_ = 14;
+      else if (c == kZbin)
+        rx_need_ = 7;
+      else if (c == kZbin32)
+        rx_need_ = 9;
+      else
+        rx_state_ = RX_SEARCH;
+      break;
+
+    case RX_HEADER:
+      if (!rx_hex_) {
+        if (!Unescape(&c, &frame_end))
+          break;
+        if (frame_end) {
+          rx_state_ = RX_SEARCH;
+          break;
+        }
+      }
+      rx_buf_.push_back(c);
+      if (rx_buf_.size() == rx_need_)
+        OnHeaderComplete();
+      break;
+
+    case RX_DATA:
+      if (!Unescape(&c, &frame_end))
+        break;
+      if (frame_end) {
+        rx_frame_end_ = c;
+        rx_state_ = RX_DATA_CRC;
+        rx_buf_.clear();
+        rx_need_ = rx_crc32_ ? 4 : 2;
+      } else if (rx_data_.size() < kMaxDataSize) {
+        rx_data_.push_back(c);
+      } else {
+        LOG("Zmodem: data subpacket is too long\n");
+        rx_state_ = RX_SEARCH;
+        OnReceiverData(-1);
+      }
+      break;
+
+    case RX_DATA_CRC:
+      if (!Unescape(&c, &frame_end))
+        break;
+      rx_buf_.push_back(c);
+      if (rx_buf_.size() == rx_need_)
+        OnDataComplete();
+      break;
+  }
+}
+
+bool Zmodem::Unescape(unsigned char* c, bool* frame_end) {
+  *frame_end = false;
+  if (rx_escape_) {
+    rx_escape_ = false;
+    if (*c >= kZcrce && *c <= kZcrcw)
+      *frame_end = true;
+    else if (*c == kZrub0)
+      *c = 0x7f;
+    else if (*c == kZrub1)
+      *c = 0xff;
+    else
+      *c ^= 0x40;
+    return true;
+  }
+
+  if (*c == kZdle) {
+    rx_escape_ = true;
+    return false;
+  }
+  // Flow control characters are always escaped by sender, bare ones come
+  // from the line and must be ignored.
+  return (*c & 0x7f) != kXon && (*c & 0x7f) != kXoff;
+}
+
+void Zmodem::OnHeaderComplete() {
+  unsigned char h[9];
+  if (rx_hex_) {
+    for (size_t i = 0; i < 7; i++) {
+      int hi = GetHexDigit(rx_buf_[2 * i]);
+      int lo = GetHexDigit(rx_buf_[2 * i + 1]);
+      if (hi < 0 || lo < 0) {
+        rx_state_ = RX_SEARCH;
+        return;
+      }
+      h[i] = (hi << 4) | lo;
+    }
+  } else {
+    std::copy(rx_buf_.begin(), rx_buf_.end(), h);
+  }
+
+  bool valid;
+  if (rx_crc32_) {
+    uint32_t crc = crc32(0, h, 5);
+    valid = crc == GetPosition(h + 5);
+  } else {
+    uint16_t crc = UpdateCrc16(0, h, 5);
+    valid = crc == ((h[5] << 8) | h[6]);
+  }
+  rx_state_ = RX_SEARCH;
+  if (!valid) {
+    // Sender repeats the header after timeout.
+    LOG("Zmodem: bad header CRC\n");
+    return;
+  }
+
+  rx_header_type_ = h[0];
+  if (state_ == RECEIVING)
+    OnReceiverHeader(h[0], GetPosition(h + 1));
+  else if (state_ == SENDING)
+    OnSenderHeader(h[0], h + 1);
+}
+
+void Zmodem::OnDataComplete() {
+  unsigned char frame_end = rx_frame_end_;
+  const unsigned char* data = rx_data_.empty() ? NULL : &rx_data_[0];
+  bool valid;
+  if (rx_crc32_) {
+    uint32_t crc = crc32(0, data, rx_data_.size());
+    crc = crc32(crc, &frame_end, 1);
+    valid = crc == GetPosition(&rx_buf_[0]);
+  } else {
+    uint16_t crc = UpdateCrc16(0, data, rx_data_.size());
+    crc = UpdateCrc16(crc, &frame_end, 1);
+    valid = crc == ((rx_buf_[0] << 8) | rx_buf_[1]);
+  }
+
+  if (!valid) {
+    LOG("Zmodem: bad data CRC\n");
+    rx_state_ = RX_SEARCH;
+    OnReceiverData(-1);
+    return;
+  }
+
+  rx_state_ = RX_SEARCH;
+  OnReceiverData(frame_end);
+  rx_data_.clear();
+  // After ZCRCG and ZCRCQ more data follows, otherwise a header.
+  if (state_ == RECEIVING && (frame_end == kZcrcg || frame_end == kZcrcq))
+    ExpectData();
+}
+
+void Zmodem::ExpectData() {
+  rx_state_ = RX_DATA;
+  rx_escape_ = false;
+  rx_data_.clear();
+}
+
+void Zmodem::OnReceiverHeader(int type, uint32_t pos) {
+  switch (type) {
+    case kZrqinit:
+      SendHexHeader(kZrinit, kReceiverFlags << 24);
+      break;
+
+    case kZsinit:
+    case kZfile:
+      ExpectData();
+      break;
+
+    case kZdata:
+      if (!file_) {
+        SendHexHeader(kZrinit, kReceiverFlags << 24);
+      } else if (pos != file_offset_) {
+        // Data we can't use, ask sender to go back.
+        SendHexHeader(kZrpos, file_offset_);
+      } else {
+        ExpectData();
+      }
+      break;
+
+    case kZeof:
+      // ZEOF with a different position came before data we asked to resend.
+      if (file_ && pos != file_offset_)
+        break;
+      CloseFile(true);
+      SendHexHeader(kZrinit, kReceiverFlags << 24);
+      break;
+
+    case kZfin:
+      CloseFile(false);
+      SendHexHeader(kZfin, 0);
+      LOG("Zmodem: receive finished\n");
+      state_ = FINISHING;
+      oo_left_ = 2;
+      break;
+
+    case kZcan:
+    case kZabort:
+      Finish("zmodem: cancelled by remote side");
+      break;
+  }
+}
+
+void Zmodem::OnReceiverData(int frame_end) {
+  if (state_ != RECEIVING)
+    return;
+
+  if (frame_end < 0) {
+    if (rx_header_type_ == kZdata && file_)
+      SendHexHeader(kZrpos, file_offset_);
+    else
+      SendHexHeader(kZnak, 0);
+    return;
+  }
+
+  switch (rx_header_type_) {
+    case kZsinit:
+      SendHexHeader(kZack, 0);
+      break;
+
+    case kZfile: {
+      std::string header(rx_data_.begin(), rx_data_.end());
+      if (OpenReceivedFile(header))
+        SendHexHeader(kZrpos, 0);
+      else
+        SendHexHeader(kZskip, 0);
+      break;
+    }
+
+    case kZdata:
+      if (!file_)
+        break;
+      file_buf_.insert(file_buf_.end(), rx_data_.begin(), rx_data_.end());
+      file_offset_ += rx_data_.size();
+      if (file_buf_.size() >= kWriteBlockSize && !FlushReceivedFile()) {
+        Cancel("zmodem: can't write " + file_name_);
+        break;
+      }
+      if (frame_end == kZcrcw || frame_end == kZcrcq)
+        SendHexHeader(kZack, file_offset_);
+      break;
+  }
+}
+
+void Zmodem::OnSenderHeader(int type, const unsigned char* p) {
+  switch (type) {
+    case kZrinit:
+      tx_crc32_ = (p[3] & kCanFc32) != 0;
+      if (send_state_ == SEND_WAIT_RINIT || send_state_ == SEND_WAIT_EOF_ACK) {
+        CloseFile(send_state_ == SEND_WAIT_EOF_ACK);
+        if (!SendNextFile()) {
+          SendHexHeader(kZfin, 0);
+          send_state_ = SEND_WAIT_FIN;
+        }
+      } else if (send_state_ == SEND_WAIT_RPOS) {
+        SendFileHeader();
+      }
+      break;
+
+    case kZnak:
+      if (send_state_ == SEND_WAIT_RPOS)
+        SendFileHeader();
+      break;
+
+    case kZrpos:
+      if (!file_ || send_state_ == SEND_WAIT_FIN)
+        break;
+      // Whatever is still queued was sent from a wrong position.
+      input_.clear();
+      if (!SeekFile(GetPosition(p))) {
+        Cancel("zmodem: can't read " + file_name_);
+        break;
+      }
+      SendBinaryHeader(kZdata, p);
+      send_state_ = SEND_DATA;
+      break;
+
+    case kZskip:
+      if (!file_)
+        break;
+      CloseFile(false);
+      input_.clear();
+      if (!SendNextFile()) {
+        SendHexHeader(kZfin, 0);
+        send_state_ = SEND_WAIT_FIN;
+      }
+      break;
+
+    case kZfin:
+      if (send_state_ == SEND_WAIT_FIN) {
+        input_ += "OO";
+        Finish("");
+        state_ = FINISHING;
+      }
+      break;
+
+    case kZcan:
+    case kZabort:
+    case kZferr:
+      Finish("zmodem: cancelled by remote side");
+      break;
+  }
+}
+
+void Zmodem::SendHexHeader(int type, uint32_t pos) {
+  if (cancel_)
+    return;
+
+  unsigned char h[5] = { (unsigned char)type };
+  SetPosition(pos, h + 1);
+  char buf[32];
+  snprintf(buf, sizeof(buf), "**\x18" "B%02x%02x%02x%02x%02x%04x\r\x8a",
+           h[0], h[1], h[2], h[3], h[4], UpdateCrc16(0, h, 5));
+  input_ += buf;
+  if (type != kZack && type != kZfin)
+    input_ += kXon;
+}
+
+void Zmodem::SendBinaryHeader(int type, const unsigned char* p) {
+  if (cancel_)
+    return;
+
+  unsigned char h[5] = { (unsigned char)type, p[0], p[1], p[2], p[3] };
+  input_ += kZpad;
+  input_ += kZdle;
+  input_ += tx_crc32_ ? kZbin32 : kZbin;
+  for (size_t i = 0; i < sizeof(h); i++)
+    AppendEscaped(h[i]);
+  if (tx_crc32_)
+    AppendCrc32(crc32(0, h, sizeof(h)));
+  else
+    AppendCrc16(UpdateCrc16(0, h, sizeof(h)));
+}
+
+void Zmodem::SendData(const char* buf, size_t count, int frame_end) {
+  if (cancel_)
+    return;
+
+  const unsigned char* data = reinterpret_cast<const unsigned char*>(buf);
+  for (size_t i = 0; i < count; i++)
+    AppendEscaped(data[i]);
+  input_ += kZdle;
+  input_ += (char)frame_end;
+
+  unsigned char end = frame_end;
+  if (tx_crc32_) {
+    AppendCrc32(crc32(crc32(0, data, count), &end, 1));
+  } else {
+    AppendCrc16(UpdateCrc16(UpdateCrc16(0, data, count), &end, 1));
+  }
+}
+
+void Zmodem::AppendEscaped(unsigned char c) {
+  // Besides what ZMODEM requires, CR and LF are escaped so openssh never
+  // sees '~' after a newline, which would start its escape sequence.
+  switch (c) {
+    case '\r':
+    case '\n':
+    case kZdle:
+    case 0x10:
+    case kXon:
+    case kXoff:
+    case 0x90:
+    case 0x91:
+    case 0x93:
+    case 0x98:
+      input_ += kZdle;
+      input_ += (char)(c ^ 0x40);
+      break;
+    default:
+      input_ += c;
+      break;
+  }
+}
+
+void Zmodem::AppendCrc16(uint16_t crc) {
+  AppendEscaped(crc >> 8);
+  AppendEscaped(crc & 0xff);
+}
+
+void Zmodem::AppendCrc32(uint32_t crc) {
+  for (int i = 0; i < 4; i++)
+    AppendEscaped((crc >> (8 * i)) & 0xff);
+}
+
+bool Zmodem::OpenReceivedFile(const std::string& header) {
+  CloseFile(false);
+
+  // Header is "name\0size mtime mode ...", only the name is used, directory
+  // part is dropped so nothing is written outside kDownloadDirectory.
+  std::string name = header.substr(0, header.find('\0'));
+  name = name.substr(name.find_last_of('/') + 1);
+  if (name.empty() || name == "." || name == "..") {
+    terminal_ += "\r\x1b[Kzmodem: skipped file with invalid name\r\n";
+    return false;
+  }
+
+  pp::FileSystem* ppfs = FileSystem::GetFileSystem()->GetPepperFileSystem();
+  std::string path = std::string(kDownloadDirectory) + "/" + name;
+  PepperFile* file = NULL;
+  if (ppfs) {
+    file = new PepperFile(-1, O_WRONLY | O_CREAT | O_TRUNC, ppfs);
+    if (!file->open(path.c_str())) {
+      file->release();
+      file = NULL;
+    }
+  }
+  if (!file) {
+    terminal_ += "\r\x1b[Kzmodem: can't create " + path + "\r\n";
+    return false;
+  }
+
+  file_ = file;
+  file_name_ = path;
+  file_offset_ = 0;
+  file_size_ = 0;
+  if (header.find('\0') != std::string::npos)
+    file_size_ = strtoul(header.c_str() + header.find('\0') + 1, NULL, 10);
+  gettimeofday(&file_start_, NULL);
+  return true;
+}
+
+bool Zmodem::FlushReceivedFile() {
+  if (file_buf_.empty())
+    return true;
+
+  // Blocking write, data from ssh waits in the channel window meanwhile.
+  size_t nwrote;
+  int result = file_->write(&file_buf_[0], file_buf_.size(), &nwrote);
+  file_buf_.clear();
+  return result == 0;
+}
+
+void Zmodem::CloseFile(bool done) {
+  if (!file_)
+    return;
+
+  bool written = state_ != RECEIVING || FlushReceivedFile();
+  file_->close();
+  file_->release();
+  file_ = NULL;
+  file_buf_.clear();
+
+  if (!written) {
+    terminal_ += "\r\x1b[Kzmodem: can't write " + file_name_ + "\r\n";
+  } else if (done) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%u bytes", file_offset_);
+    std::string status = std::string("zmodem: ") +
+        (state_ == SENDING ? "sent " : "received ") + file_name_ + ", " +
+        buf + GetRate();
+    LOG("Zmodem: %s\n", status.c_str());
+    terminal_ += "\r\x1b[K" + status + "\r\n";
+  }
+}
+
+bool Zmodem::SendNextFile() {
+  pp::FileSystem* ppfs = FileSystem::GetFileSystem()->GetPepperFileSystem();
+  while (!uploads_.empty()) {
+    std::string path = uploads_.front();
+    uploads_.pop_front();
+
+    PepperFile* file = NULL;
+    if (ppfs) {
+      file = new PepperFile(-1, O_RDONLY, ppfs);
+      if (!file->open(path.c_str())) {
+        file->release();
+        file = NULL;
+      }
+    }
+    if (!file) {
+      terminal_ += "\r\x1b[Kzmodem: can't open " + path + "\r\n";
+      continue;
+    }
+
+    nacl_abi_stat st;
+    file->fstat(&st);
+    file_ = file;
+    file_name_ = path;
+    file_offset_ = 0;
+    file_size_ = st.nacl_abi_st_size;
+    gettimeofday(&file_start_, NULL);
+    SendFileHeader();
+    send_state_ = SEND_WAIT_RPOS;
+    return true;
+  }
+  return false;
+}
+
+void Zmodem::SendFileHeader() {
+  unsigned char p[4] = { 0, 0, 0, kZcbin };
+  SendBinaryHeader(kZfile, p);
+
+  char info[32];
+  snprintf(info, sizeof(info), "%u 0 100644", file_size_);
+  std::string data = file_name_.substr(file_name_.find_last_of('/') + 1);
+  data.push_back('\0');
+  data += info;
+  data.push_back('\0');
+  SendData(data.data(), data.size(), kZcrcw);
+}
+
+void Zmodem::EncodeNextBlock() {
+  // Data is read only when ssh asks for input, so the file is never
+  // buffered ahead of the channel.
+  char buf[kReadBlockSize];
+  size_t nread;
+  int result = file_->read(buf, sizeof(buf), &nread);
+  if (cancel_)
+    return;
+  if (result) {
+    Cancel("zmodem: can't read " + file_name_);
+    return;
+  }
+
+  bool eof = nread == 0 || file_offset_ + nread >= file_size_;
+  for (size_t i = 0; i < nread; i += kSubpacketSize) {
+    size_t size = std::min(kSubpacketSize, nread - i);
+    SendData(buf + i, size, eof && i + size == nread ? kZcrce : kZcrcg);
+  }
+  file_offset_ += nread;
+
+  if (eof) {
+    if (nread == 0)
+      SendData(buf, 0, kZcrce);
+    unsigned char p[4];
+    SetPosition(file_offset_, p);
+    SendBinaryHeader(kZeof, p);
+    send_state_ = SEND_WAIT_EOF_ACK;
+  }
+}
+
+bool Zmodem::SeekFile(uint32_t pos) {
+  if (file_->seek(pos, SEEK_SET, NULL))
+    return false;
+  file_offset_ = pos;
+  return true;
+}
+
+std::string Zmodem::GetRate() {
+  timeval now;
+  gettimeofday(&now, NULL);
+  double seconds = (now.tv_sec - file_start_.tv_sec) +
+      (now.tv_usec - file_start_.tv_usec) / 1e6;
+  char buf[64];
+  snprintf(buf, sizeof(buf), " in %.1f s (%.0f KB/s)", seconds,
+           seconds > 0 ? file_offset_ / seconds / 1024 : 0);
+  return buf;
+}
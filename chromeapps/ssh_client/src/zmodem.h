@@ -0,0 +1,164 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef ZMODEM_H
+#define ZMODEM_H
+
+#include <stdint.h>
+#include <sys/time.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "pthread_helpers.h"
+
+class FileStream;
+
+// ZMODEM transfers started by sz or rz on the remote side. The start is
+// detected in the terminal output and from then on protocol bytes never
+// reach the terminal: files are written to or read from the HTML5 file
+// system and protocol replies go to the remote side as if typed.
+//
+// Received files are saved in kDownloadDirectory. Files to send must be
+// queued with QueueUpload() before rz is run, otherwise the transfer is
+// cancelled.
+//
+// All methods must be called with FileSystem mutex locked. FilterOutput()
+// and ReadInput() do blocking file I/O, so they must be called on the ssh
+// thread with the mutex locked exactly once.
+class Zmodem {
+ public:
+  static const char kDownloadDirectory[];
+
+  Zmodem();
+  ~Zmodem();
+
+  bool is_active() { return state_ != IDLE; }
+
+  // Terminal output from the remote side. Returns false if |buf| should go
+  // to the terminal unchanged, otherwise what's left for the terminal is
+  // returned in |terminal|.
+  bool FilterOutput(const char* buf, size_t count, std::string* terminal);
+
+  // Protocol bytes to send to the remote side, read as the terminal input.
+  bool has_input();
+  size_t ReadInput(char* buf, size_t count);
+
+  // Keys typed by user during transfer. Ctrl-C cancels the transfer, other
+  // keys are dropped.
+  void OnUserInput(const char* buf, size_t count);
+
+  // HTML5 file system paths of files to send when remote rz starts.
+  void QueueUpload(const std::vector<std::string>& paths);
+
+  // Abort current transfer without telling the remote side.
+  void Reset();
+
+ private:
+  enum State {
+    IDLE,
+    RECEIVING,
+    SENDING,
+    // Transfer is over. End of the last hex header and "OO" that sender
+    // sends after ZFIN are not shown.
+    FINISHING
+  };
+
+  enum SendState {
+    SEND_WAIT_RINIT,
+    SEND_WAIT_RPOS,
+    SEND_DATA,
+    SEND_WAIT_EOF_ACK,
+    SEND_WAIT_FIN
+  };
+
+  enum ReceiveState {
+    RX_SEARCH,
+    RX_PAD,
+    RX_PAD_ZDLE,
+    RX_HEADER,
+    RX_DATA,
+    RX_DATA_CRC
+  };
+
+  void DetectStart(unsigned char c, std::string* terminal);
+  void Start(bool sending);
+  void Finish(const std::string& status);
+  void Cancel(const std::string& status);
+
+  // Parser of the protocol bytes coming from the remote side.
+  void ProcessByte(unsigned char c);
+  bool Unescape(unsigned char* c, bool* frame_end);
+  void OnHeaderComplete();
+  void OnDataComplete();
+  void ExpectData();
+
+  void OnReceiverHeader(int type, uint32_t pos);
+  // |frame_end| is -1 if subpacket is damaged.
+  void OnReceiverData(int frame_end);
+  void OnSenderHeader(int type, const unsigned char* p);
+
+  void SendHexHeader(int type, uint32_t pos);
+  void SendBinaryHeader(int type, const unsigned char* p);
+  void SendData(const char* buf, size_t count, int frame_end);
+  void AppendEscaped(unsigned char c);
+  void AppendCrc16(uint16_t crc);
+  void AppendCrc32(uint32_t crc);
+
+  bool OpenReceivedFile(const std::string& header);
+  bool FlushReceivedFile();
+  void CloseFile(bool done);
+  bool SendNextFile();
+  void SendFileHeader();
+  void EncodeNextBlock();
+  bool SeekFile(uint32_t pos);
+
+  std::string GetRate();
+
+  static const size_t kWriteBlockSize = 256 * 1024;
+  static const size_t kReadBlockSize = 8 * 1024;
+  static const size_t kSubpacketSize = 1024;
+  static const size_t kMaxDataSize = 8 * 1024;
+
+  State state_;
+  SendState send_state_;
+  bool cancel_;
+  int oo_left_;
+
+  // Start sequence detection in terminal output.
+  size_t match_;
+  std::string held_;
+
+  // Parser state.
+  ReceiveState rx_state_;
+  bool rx_escape_;
+  int rx_can_count_;
+  bool rx_hex_;
+  bool rx_crc32_;
+  int rx_header_type_;
+  size_t rx_need_;
+  std::vector<unsigned char> rx_buf_;
+  int rx_frame_end_;
+  std::vector<unsigned char> rx_data_;
+  // Status messages for the terminal.
+  std::string terminal_;
+
+  // Bytes for the remote side.
+  std::string input_;
+  bool tx_crc32_;
+
+  // File being transferred.
+  FileStream* file_;
+  std::string file_name_;
+  uint32_t file_offset_;
+  uint32_t file_size_;
+  std::vector<char> file_buf_;
+  timeval file_start_;
+  std::deque<std::string> uploads_;
+
+  DISALLOW_COPY_AND_ASSIGN(Zmodem);
+};
+
+#endif  // ZMODEM_H